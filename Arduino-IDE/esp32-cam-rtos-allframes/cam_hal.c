@@ -22,6 +22,8 @@ static const char *TAG = "cam_hal";
 
 static cam_obj_t *cam_obj = NULL;
 
+static portMUX_TYPE cam_ref_lock = portMUX_INITIALIZER_UNLOCKED;
+
 static const uint32_t JPEG_SOI_MARKER = 0xFFD8FF;  // written in little-endian for esp32
 static const uint16_t JPEG_EOI_MARKER = 0xD9FF;  // written in little-endian for esp32
 
@@ -266,6 +268,7 @@ static esp_err_t cam_dma_config()
         cam_obj->frames[x].dma = NULL;
         cam_obj->frames[x].fb_offset = 0;
         cam_obj->frames[x].en = 0;
+        cam_obj->frames[x].ref = 0;
         cam_obj->frames[x].fb.buf = (uint8_t *)heap_caps_malloc(fb_size * sizeof(uint8_t) + dma_align, MALLOC_CAP_SPIRAM);
         CAM_CHECK(cam_obj->frames[x].fb.buf != NULL, "frame buffer malloc failed", ESP_FAIL);
         if (cam_obj->psram_mode) {
@@ -432,12 +435,28 @@ void cam_start(void)
     ll_cam_vsync_intr_enable(cam_obj, true);
 }
 
+static cam_frame_t *cam_frame(camera_fb_t *dma_buffer)
+{
+    for (int x = 0; x < cam_obj->frame_cnt; x++) {
+        if (&cam_obj->frames[x].fb == dma_buffer) {
+            return &cam_obj->frames[x];
+        }
+    }
+    return NULL;
+}
+
 camera_fb_t *cam_take(TickType_t timeout)
 {
     camera_fb_t *dma_buffer = NULL;
     TickType_t start = xTaskGetTickCount();
     xQueueReceive(cam_obj->frame_buffer_queue, (void *)&dma_buffer, timeout);
     if (dma_buffer) {
+        cam_frame_t *frame = cam_frame(dma_buffer);
+        if (frame) {
+            portENTER_CRITICAL(&cam_ref_lock);
+            frame->ref = 1;
+            portEXIT_CRITICAL(&cam_ref_lock);
+        }
         if(cam_obj->jpeg_mode){
             // find the end marker for JPEG. Data after that can be discarded
             int offset_e = cam_verify_jpeg_eoi(dma_buffer->buf, dma_buffer->len);
@@ -463,10 +482,41 @@ camera_fb_t *cam_take(TickType_t timeout)
 
 void cam_give(camera_fb_t *dma_buffer)
 {
-    for (int x = 0; x < cam_obj->frame_cnt; x++) {
-        if (&cam_obj->frames[x].fb == dma_buffer) {
-            cam_obj->frames[x].en = 1;
-            break;
-        }
+    cam_frame_t *frame = cam_frame(dma_buffer);
+    if (frame) {
+        portENTER_CRITICAL(&cam_ref_lock);
+        frame->ref = 0;
+        frame->en = 1;
+        portEXIT_CRITICAL(&cam_ref_lock);
+    }
+}
+
+camera_fb_t *cam_ref(camera_fb_t *dma_buffer)
+{
+    cam_frame_t *frame = cam_frame(dma_buffer);
+    if (frame == NULL) {
+        return NULL;
+    }
+    portENTER_CRITICAL(&cam_ref_lock);
+    if (frame->ref) {
+        frame->ref++;
+    } else {
+        //already back with the driver
+        dma_buffer = NULL;
+    }
+    portEXIT_CRITICAL(&cam_ref_lock);
+    return dma_buffer;
+}
+
+void cam_unref(camera_fb_t *dma_buffer)
+{
+    cam_frame_t *frame = cam_frame(dma_buffer);
+    if (frame == NULL) {
+        return;
+    }
+    portENTER_CRITICAL(&cam_ref_lock);
+    if (frame->ref && --frame->ref == 0) {
+        frame->en = 1;
     }
+    portEXIT_CRITICAL(&cam_ref_lock);
 }
@@ -105,6 +105,8 @@ void mjpegCB(void* pvParameters) {
   //  Registering webserver handling routines
   server.on("/mjpeg/1", HTTP_GET, handleJPGSstream);
   server.on("/jpg", HTTP_GET, handleJPG);
+  const char* snapshotHeaders[] = { "If-None-Match" };
+  server.collectHeaders(snapshotHeaders, 1);
   server.onNotFound(handleNotFound);
 
   //  Starting webserver
@@ -127,8 +129,7 @@ void mjpegCB(void* pvParameters) {
 
 // Current frame information
 volatile uint32_t frameNumber;
-volatile size_t   camSize;    // size of the current frame, byte
-volatile char*    camBuf;      // pointer to the current frame
+camera_fb_t*      camFb;       // the current frame: the driver's buffer, camCB holds a reference to it
 
 
 // ==== RTOS task to grab frames from the camera =========================
@@ -139,52 +140,42 @@ void camCB(void* pvParameters) {
   //  A running interval associated with currently desired frame rate
   const TickType_t xFrequency = pdMS_TO_TICKS(1000 / FPS);
 
-  //  Pointers to the 2 frames, their respective sizes and index of the current frame
-  char* fbs[2] = { NULL, NULL };
-  size_t fSize[2] = { 0, 0 };
-  int ifb = 0;
   frameNumber = 0;
+  camFb = NULL;
 
   //=== loop() section  ===================
   xLastWakeTime = xTaskGetTickCount();
 
   for (;;) {
 
-    //  Grab a frame from the camera and query its size
+    //  Grab a frame from the camera. It is not copied: the driver's buffer is published as it is,
+    //  and goes back to the driver once it is replaced and no reader holds a reference to it
     camera_fb_t* fb = NULL;
 
     fb = esp_camera_fb_get();
-    size_t s = fb->len;
-
-    //  If frame size is more that we have previously allocated - request  125% of the current frame space
-    if (s > fSize[ifb]) {
-      fSize[ifb] = s + s;
-      fbs[ifb] = allocateMemory(fbs[ifb], fSize[ifb]);
+    if ( fb == NULL ) {
+      Serial.println("camCB: error capturing a frame");
+      vTaskDelayUntil(&xLastWakeTime, xFrequency);
+      continue;
     }
 
-    //  Copy current frame into local buffer
-    char* b = (char *)fb->buf;
-    memcpy(fbs[ifb], b, s);
-    esp_camera_fb_return(fb);
+    //  Do not allow readers to take the current frame while switching it.
+    //  If a reader holds frameSync for the whole interval, the new frame is dropped
+    if ( xSemaphoreTake( frameSync, xFrequency ) == pdTRUE ) {
+      camera_fb_t* old = camFb;
+      camFb = fb;
+      frameNumber++;
+      //  Let anyone waiting for a frame know that the frame is ready
+      xSemaphoreGive( frameSync );
+      fb = old;
+    }
+    //  Drop camCB's reference to the frame that is no longer current
+    if ( fb ) esp_camera_fb_return(fb);
 
     //  Let other tasks run and wait until the end of the current frame rate interval (if any time left)
     taskYIELD();
     vTaskDelayUntil(&xLastWakeTime, xFrequency);
 
-    //  Only switch frames around if no frame is currently being streamed to a client
-    //  Wait on a semaphore until client operation completes
-    //    xSemaphoreTake( frameSync, portMAX_DELAY );
-
-    //  Do not allow frame copying while switching the current frame
-    xSemaphoreTake( frameSync, xFrequency );
-    camBuf = fbs[ifb];
-    camSize = s;
-    ifb++;
-    ifb &= 1;  // this should produce 1, 0, 1, 0, 1 ... sequence
-    frameNumber++;
-    //  Let anyone waiting for a frame know that the frame is ready
-    xSemaphoreGive( frameSync );
-
     //  Immediately let other (streaming) tasks run
     taskYIELD();
 
@@ -197,6 +188,12 @@ void camCB(void* pvParameters) {
       Serial.printf("mjpegCB: max alloc free heap : %d\n", ESP.getMaxAllocHeap());
       Serial.printf("mjpegCB: tCam stack wtrmark  : %d\n", uxTaskGetStackHighWaterMark(tCam));
       Serial.flush();
+      //  Do not keep a driver buffer while nobody is watching
+      xSemaphoreTake( frameSync, portMAX_DELAY );
+      camera_fb_t* old = camFb;
+      camFb = NULL;
+      xSemaphoreGive( frameSync );
+      if ( old ) esp_camera_fb_return(old);
       vTaskSuspend(NULL);  // passing NULL means "suspend yourself"
     }
   }
@@ -301,28 +298,31 @@ void streamCB(void * pvParameters) {
     if ( info->client.connected() ) {
 
       if ( info->frame != frameNumber) {
+        //  Hold on to the current frame with a reference of our own, so it is copied
+        //  without keeping camCB from publishing the next one
         xSemaphoreTake( frameSync, portMAX_DELAY );
-        if ( info->buffer == NULL ) {
-          info->buffer = allocateMemory (info->buffer, camSize);
-          info->len = camSize;
-        }
-        else {
-          if ( camSize > info->len ) {
-            info->buffer = allocateMemory (info->buffer, camSize);
-            info->len = camSize;
+        camera_fb_t* fb = camFb ? esp_camera_fb_ref(camFb) : NULL;
+        uint32_t fnm = frameNumber;
+        xSemaphoreGive( frameSync );
+
+        if ( fb ) {
+          size_t s = fb->len;
+          if ( s > info->len ) {
+            info->buffer = allocateMemory (info->buffer, s);
+            info->len = s;
           }
+          memcpy(info->buffer, fb->buf, s);
+          esp_camera_fb_unref(fb);
+          taskYIELD();
+
+          info->frame = fnm;
+          info->client.write(CTNTTYPE, cntLen);
+          sprintf(buf, "%d\r\n\r\n", (int) s);
+          info->client.write(buf, strlen(buf));
+          info->client.write((char*) info->buffer, s);
+          info->client.write(BOUNDARY, bdrLen);
+          info->client.flush();
         }
-        memcpy(info->buffer, (const void*) camBuf, info->len);
-        xSemaphoreGive( frameSync );
-        taskYIELD();
-
-        info->frame = frameNumber;
-        info->client.write(CTNTTYPE, cntLen);
-        sprintf(buf, "%d\r\n\r\n", info->len);
-        info->client.write(buf, strlen(buf));
-        info->client.write((char*) info->buffer, (size_t)info->len);
-        info->client.write(BOUNDARY, bdrLen);
-        info->client.flush();
       }
     }
     else {
@@ -354,12 +354,103 @@ const char JHEADER[] = "HTTP/1.1 200 OK\r\n" \
 const int jhdLen = strlen(JHEADER);
 
 // ==== Serve up one JPEG frame =============================================
+const char JSHEADER[] = "HTTP/1.1 200 OK\r\n" \
+                        "Content-disposition: inline; filename=capture.jpg\r\n" \
+                        "Content-type: image/jpeg\r\n" \
+                        "Cache-Control: no-cache\r\n" \
+                        "ETag: \"%u\"\r\n" \
+                        "Content-Length: %u\r\n\r\n";
+const char NOTMODIFIED[] = "HTTP/1.1 304 Not Modified\r\n" \
+                           "Cache-Control: no-cache\r\n" \
+                           "ETag: \"%u\"\r\n\r\n";
+const char NOFRAME[] = "HTTP/1.1 503 Service Unavailable\r\n" \
+                       "Retry-After: 1\r\n" \
+                       "Content-Length: 0\r\n\r\n";
+const int nofLen = strlen(NOFRAME);
+
+//  True if an If-None-Match value ("a", W/"b", ... or *) lists the ETag of frame aFrame
+bool etagMatch(const String& aList, uint32_t aFrame) {
+  char tag[12];
+  snprintf(tag, sizeof(tag), "%u", (unsigned) aFrame);
+  size_t n = strlen(tag);
+  const char* p = aList.c_str();
+  const char* end = p + aList.length();
+
+  while ( p < end ) {
+    while ( p < end && (*p == ' ' || *p == '\t' || *p == ',') ) p++;
+    if ( p < end && *p == '*' ) return true;
+    if ( p + 1 < end && p[0] == 'W' && p[1] == '/' ) p += 2;
+    if ( p >= end || *p != '"' ) return false;
+    const char* q = (const char*) memchr(p + 1, '"', end - p - 1);
+    if ( q == NULL ) return false;
+    if ( (size_t) (q - p - 1) == n && memcmp(p + 1, tag, n) == 0 ) return true;
+    p = q + 1;
+  }
+  return false;
+}
+
 void handleJPG(void)
 {
+  //  Only the web server task runs this handler, so one copy buffer is enough
+  static char*  jpgBuf = NULL;
+  static size_t jpgLen = 0;
+
   WiFiClient client = server.client();
 
   if (!client.connected()) return;
-  camera_fb_t* fb = esp_camera_fb_get();
+
+  //  While camCB is capturing for the streaming clients, send its current frame instead of
+  //  competing with it for the camera. The frame number is the ETag: a client polling with
+  //  If-None-Match gets 304 Not Modified until there is a new frame.
+  //  The frame is taken with a reference under frameSync, then copied and sent after
+  //  releasing it, so a slow client never holds up camCB or the camera driver
+  camera_fb_t* fb = NULL;
+  uint32_t fnm = 0;
+  if ( noActiveClients > 0 ) {
+    xSemaphoreTake( frameSync, portMAX_DELAY );
+    fb = camFb ? esp_camera_fb_ref(camFb) : NULL;
+    fnm = frameNumber;
+    xSemaphoreGive( frameSync );
+  }
+
+  if ( fb ) {
+    char buf[192];
+
+    if ( etagMatch(server.header("If-None-Match"), fnm) ) {
+      esp_camera_fb_unref(fb);
+      snprintf(buf, sizeof(buf), NOTMODIFIED, (unsigned) fnm);
+      client.write(buf, strlen(buf));
+      return;
+    }
+    //  Grow the copy buffer with some headroom, so it is not reallocated for every larger frame.
+    //  A snapshot is not worth restarting the board over: without memory it gets a 503
+    size_t len = fb->len;
+    if ( len > jpgLen ) {
+      free(jpgBuf);
+      jpgLen = len * 5 / 4;
+      jpgBuf = (char*) ps_malloc(jpgLen);
+      if ( jpgBuf == NULL ) {
+        jpgLen = 0;
+        esp_camera_fb_unref(fb);
+        Serial.println("handleJPG: out of memory for the snapshot");
+        client.write(NOFRAME, nofLen);
+        return;
+      }
+    }
+    memcpy(jpgBuf, fb->buf, len);
+    esp_camera_fb_unref(fb);
+
+    snprintf(buf, sizeof(buf), JSHEADER, (unsigned) fnm, (unsigned) len);
+    client.write(buf, strlen(buf));
+    client.write(jpgBuf, len);
+    return;
+  }
+
+  fb = esp_camera_fb_get();
+  if ( fb == NULL ) {
+    client.write(NOFRAME, nofLen);
+    return;
+  }
   client.write(JHEADER, jhdLen);
   client.write((char*)fb->buf, fb->len);
   esp_camera_fb_return(fb);
@@ -467,7 +558,9 @@ void setup()
     //    .frame_size     = FRAMESIZE_VGA,
     //    .frame_size     = FRAMESIZE_UXGA,
     .jpeg_quality   = 16,
-    .fb_count       = 2
+    //  camCB holds on to the current frame and readers take references to it while they copy it:
+    //  a third buffer keeps one free for the driver to capture into
+    .fb_count       = 3
   };
 
 #if defined(CAMERA_MODEL_ESP_EYE)
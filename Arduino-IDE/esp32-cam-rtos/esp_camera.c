@@ -330,7 +330,23 @@ void esp_camera_fb_return(camera_fb_t *fb)
     if (s_state == NULL) {
         return;
     }
-    cam_give(fb);
+    cam_unref(fb);
+}
+
+camera_fb_t *esp_camera_fb_ref(camera_fb_t *fb)
+{
+    if (s_state == NULL) {
+        return NULL;
+    }
+    return cam_ref(fb);
+}
+
+void esp_camera_fb_unref(camera_fb_t *fb)
+{
+    if (s_state == NULL) {
+        return;
+    }
+    cam_unref(fb);
 }
 
 sensor_t *esp_camera_sensor_get()
@@ -55,6 +55,18 @@ camera_fb_t *cam_take(TickType_t timeout);
 
 void cam_give(camera_fb_t *dma_buffer);
 
+/**
+ * @brief Take one more reference to a frame buffer obtained with cam_take()
+ *
+ * @return dma_buffer, or NULL if the buffer has already been given back
+ */
+camera_fb_t *cam_ref(camera_fb_t *dma_buffer);
+
+/**
+ * @brief Drop one reference. The buffer goes back to cam_task with the last one
+ */
+void cam_unref(camera_fb_t *dma_buffer);
+
 #ifdef __cplusplus
 }
 #endif
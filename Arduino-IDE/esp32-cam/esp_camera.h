@@ -172,10 +172,36 @@ camera_fb_t* esp_camera_fb_get();
 /**
  * @brief Return the frame buffer to be reused again.
  *
+ * Drops the caller's reference: the buffer is reused once no esp_camera_fb_ref() reference
+ * is left either.
+ *
  * @param fb    Pointer to the frame buffer
  */
 void esp_camera_fb_return(camera_fb_t * fb);
 
+/**
+ * @brief Take an additional reference to a frame buffer obtained with esp_camera_fb_get().
+ *
+ * A frame buffer handed out by esp_camera_fb_get() holds one reference. Every reader that
+ * keeps using the buffer takes its own reference, and releases it with esp_camera_fb_unref().
+ * The buffer is reused by the driver only after the last reference is dropped, so the
+ * DMA-filled buffer can be shared without copying. esp_camera_fb_return() drops one reference
+ * as well. Keep in mind that the driver can only capture while at least one of its fb_count
+ * buffers is not referenced.
+ *
+ * @param fb    Pointer to the frame buffer
+ *
+ * @return fb, or NULL if the frame buffer has already been returned
+ */
+camera_fb_t* esp_camera_fb_ref(camera_fb_t * fb);
+
+/**
+ * @brief Drop a reference taken with esp_camera_fb_get() or esp_camera_fb_ref().
+ *
+ * @param fb    Pointer to the frame buffer
+ */
+void esp_camera_fb_unref(camera_fb_t * fb);
+
 /**
  * @brief Get a pointer to the image sensor control structure
  *
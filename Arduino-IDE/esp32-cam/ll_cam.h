@@ -73,6 +73,7 @@ typedef enum {
 typedef struct {
     camera_fb_t fb;
     uint8_t en;
+    uint8_t ref;    //references held by the application, see cam_ref()/cam_unref()
     //for RGB/YUV modes
     lldesc_t *dma;
     size_t fb_offset;
@@ -0,0 +1,290 @@
+//  Benchmark of the all-frames mode frame storage: the frame arena (src/framearena.cpp) against
+//  a header and a data allocation per frame from the heap, as camCB did before.
+//
+//  usage: arena_bench [-n frames] [-r readers] [-a arena_kb] [-s frame_kb] [-z seed]
+//
+//  Both run the same sequence of frames: sizes vary around -s, with an occasional frame twice as
+//  large, and every reader reads 0 to 2 frames per captured frame, now and then stalling for a
+//  while. Frames are freed in capture order once every reader is past them. When the frames
+//  readers hold no longer fit in -a, the slowest reader is moved to the newest frame, as if it
+//  had been dropped. A run without any allocation gives the cost of the simulation itself, which
+//  is taken off the other two.
+//  Reported: time per frame for allocating and freeing it, and how fragmented the memory gets:
+//  the bytes the arena skips at its end when the tail wraps, and the free bytes held inside the
+//  heap (glibc mallinfo2, not the ESP32 heap, but it shows the trend).
+//  Every frame is stamped with its number, which readers and the free check. Exit code is
+//  non-zero if a stamp did not match or the arena is not empty at the end.
+
+#include "streaming.h"
+#include "framearena.h"
+
+#include <unistd.h>
+#include <malloc.h>
+#include <time.h>
+
+#include <vector>
+
+typedef enum { RUN_NONE, RUN_HEAP, RUN_ARENA } runMode_t;
+static const char* runNames[] = { "none", "heap", "arena" };
+
+typedef struct {
+  uint32_t  next;     // number of the next frame this reader reads
+  uint32_t  stall;    // frames this reader still does not read
+} reader_t;
+
+typedef struct {
+  double    seconds;
+  uint32_t  frames;     // frames stored
+  uint32_t  drops;      // readers moved to the newest frame
+  uint32_t  reads;
+  uint32_t  bad;        // stamps that did not match
+  size_t    maxLive;    // most bytes in frames, headers included
+  size_t    maxWaste;   // arena: most bytes skipped at the end of the buffer
+  uint32_t  fails;      // arena: frames that did not fit the first time
+  size_t    failFree;   // arena: most free bytes a frame did not fit into
+  size_t    maxHeld;    // heap: most bytes the heap held
+  size_t    maxFree;    // heap: most free bytes inside the heap
+} result_t;
+
+static uint32_t rng;
+static uint32_t random32() {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stamp(frameChunck_t* f, uint32_t aFnm) {
+  f->fnm = aFnm;
+  memcpy(f->dat, &aFnm, sizeof(aFnm));
+  memcpy(f->dat + f->siz - sizeof(aFnm), &aFnm, sizeof(aFnm));
+}
+
+static bool stamped(const frameChunck_t* f, uint32_t aFnm) {
+  uint32_t a, b;
+  memcpy(&a, f->dat, sizeof(a));
+  memcpy(&b, f->dat + f->siz - sizeof(b), sizeof(b));
+  return f->fnm == aFnm && a == aFnm && b == aFnm;
+}
+
+static void heapSample(result_t* r) {
+#if defined(__GLIBC__)
+  struct mallinfo2 mi = mallinfo2();
+  size_t held = mi.arena + mi.hblkhd;
+  if ( held > r->maxHeld ) r->maxHeld = held;
+  if ( mi.fordblks > r->maxFree ) r->maxFree = mi.fordblks;
+#endif
+}
+
+//  State of a run
+static runMode_t                    mode;
+static frameArena_t                 arena;
+static std::vector<frameChunck_t*>  frames;     // frames in memory by frame number
+static std::vector<size_t>          sizes;
+static frameChunck_t*               dummies;    // the frames of the run without allocations
+static std::vector<uint8_t>         dummyData;
+static std::vector<reader_t>        readers;
+static uint32_t                     oldest;     // oldest frame in memory
+static size_t                       live;       // bytes in frames, headers included
+
+static frameChunck_t* frameAlloc(uint32_t aFnm, size_t aSize) {
+  frameChunck_t* f = NULL;
+  if ( mode == RUN_ARENA ) {
+    f = arenaAlloc(&arena, aSize);
+  }
+  else if ( mode == RUN_HEAP ) {
+    f = (frameChunck_t*) malloc(sizeof(frameChunck_t));
+    if ( f ) {
+      f->dat = (uint8_t*) malloc(aSize);
+      f->siz = aSize;
+    }
+  }
+  else {
+    f = &dummies[aFnm % frames.size()];
+    f->dat = &dummyData[(aFnm % frames.size()) * sizeof(uint32_t) * 2];
+    f->siz = sizeof(uint32_t) * 2;
+  }
+  return f;
+}
+
+//  Free the frames before aFirst, the oldest first
+static void frameFree(uint32_t aFirst, result_t* r) {
+  for (; oldest < aFirst; oldest++) {
+    frameChunck_t* o = frames[oldest % frames.size()];
+    if ( !stamped(o, oldest) ) r->bad++;
+    live -= arenaEntry(sizes[oldest % frames.size()]);
+    if ( mode == RUN_ARENA ) arenaFree(&arena, o);
+    else if ( mode == RUN_HEAP ) {
+      free(o->dat);
+      free(o);
+    }
+  }
+}
+
+static uint32_t firstRead(uint32_t aFnm) {
+  uint32_t first = aFnm;
+  for (size_t i = 0; i < readers.size(); i++) if ( readers[i].next < first ) first = readers[i].next;
+  return first;
+}
+
+static result_t run(runMode_t aMode, uint32_t aFrames, int aReaders, size_t aBudget, size_t aFrameSize, uint32_t aSeed) {
+  result_t r;
+  memset(&r, 0, sizeof(r));
+  mode = aMode;
+
+  if ( mode == RUN_ARENA && !arenaInit(&arena, aBudget) ) {
+    fprintf(stderr, "cannot allocate an arena of %zu bytes\n", aBudget);
+    exit(2);
+  }
+
+  //  Every frame in memory takes at least its header out of the budget
+  size_t slots = aBudget / sizeof(frameChunck_t) + 1;
+  frames.assign(slots, (frameChunck_t*) NULL);
+  sizes.assign(slots, 0);
+  if ( mode == RUN_NONE ) {
+    dummies = new frameChunck_t[slots];
+    dummyData.resize(slots * sizeof(uint32_t) * 2);
+  }
+  readers.assign(aReaders, reader_t());
+  for (int i = 0; i < aReaders; i++) readers[i].next = readers[i].stall = 0;
+  oldest = 0;
+  live = 0;
+
+  rng = aSeed;
+  double start = now();
+
+  for (uint32_t fnm = 0; fnm < aFrames; fnm++) {
+    size_t siz = aFrameSize / 2 + random32() % aFrameSize;
+    if ( random32() % 50 == 0 ) siz *= 2;
+    size_t need = arenaEntry(siz);
+
+    frameChunck_t* f = NULL;
+    for (;;) {
+      if ( live + need <= aBudget ) {
+        f = frameAlloc(fnm, siz);
+        if ( f ) break;
+        if ( mode != RUN_ARENA ) {
+          fprintf(stderr, "out of memory at frame %u\n", fnm);
+          exit(2);
+        }
+        //  It would fit, but not in one piece
+        r.fails++;
+        if ( aBudget - live > r.failFree ) r.failFree = aBudget - live;
+      }
+
+      //  The frames readers hold take up the budget: drop the slowest reader
+      int slow = 0;
+      for (int i = 1; i < aReaders; i++) if ( readers[i].next < readers[slow].next ) slow = i;
+      if ( readers[slow].next == fnm ) {
+        fprintf(stderr, "frame %u of %zu bytes does not fit with no frames held\n", fnm, siz);
+        exit(2);
+      }
+      readers[slow].next = fnm;
+      r.drops++;
+      frameFree(firstRead(fnm), &r);
+    }
+
+    stamp(f, fnm);
+    frames[fnm % slots] = f;
+    sizes[fnm % slots] = siz;
+    live += need;
+    if ( live > r.maxLive ) r.maxLive = live;
+    r.frames++;
+    if ( mode == RUN_ARENA ) {
+      size_t waste = arena.end ? arena.size - arena.end : 0;
+      if ( waste > r.maxWaste ) r.maxWaste = waste;
+    }
+    if ( mode == RUN_HEAP && fnm % 4096 == 0 ) heapSample(&r);
+
+    //  Readers: 0 to 2 frames each, and a stall of up to 100 frames every thousand or so
+    for (int i = 0; i < aReaders; i++) {
+      reader_t* rd = &readers[i];
+      if ( rd->stall ) {
+        rd->stall--;
+        continue;
+      }
+      if ( random32() % 1000 == 0 ) rd->stall = random32() % 100;
+      for (uint32_t k = random32() % 3; k && rd->next <= fnm; k--, rd->next++) {
+        if ( !stamped(frames[rd->next % slots], rd->next) ) r.bad++;
+        r.reads++;
+      }
+    }
+    frameFree(firstRead(fnm + 1), &r);
+  }
+
+  //  Readers are gone: everything left is freed
+  frameFree(aFrames, &r);
+  r.seconds = now() - start;
+
+  if ( mode == RUN_ARENA ) {
+    if ( arena.count || arena.used || arena.head || arena.tail ) {
+      fprintf(stderr, "arena not empty at the end: %u frames, %zu bytes\n", arena.count, arena.used);
+      r.bad++;
+    }
+    if ( arena.highWater > arena.size ) r.bad++;
+    free(arena.buf);
+  }
+  if ( mode == RUN_HEAP ) heapSample(&r);
+  if ( mode == RUN_NONE ) delete[] dummies;
+  return r;
+}
+
+int main(int argc, char** argv) {
+  uint32_t frames = 2000000;
+  int      readers = 4;
+  size_t   arenaKb = FRAME_ARENA_SIZE / KILOBYTE;
+  size_t   frameKb = 30;
+  uint32_t seed = 2463534242u;
+
+  int opt;
+  while ( (opt = getopt(argc, argv, "n:r:a:s:z:")) != -1 ) {
+    switch ( opt ) {
+      case 'n': frames = strtoul(optarg, NULL, 10); break;
+      case 'r': readers = atoi(optarg); break;
+      case 'a': arenaKb = strtoul(optarg, NULL, 10); break;
+      case 's': frameKb = strtoul(optarg, NULL, 10); break;
+      case 'z': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames] [-r readers] [-a arena_kb] [-s frame_kb] [-z seed]\n", argv[0]);
+        return 2;
+    }
+  }
+  if ( readers < 1 || frameKb == 0 || seed == 0 ) {
+    fprintf(stderr, "at least one reader, a frame size and a non-zero seed are needed\n");
+    return 2;
+  }
+
+  size_t budget = arenaKb * KILOBYTE;
+  result_t res[3];
+  for (int m = RUN_NONE; m <= RUN_ARENA; m++) {
+    res[m] = run((runMode_t) m, frames, readers, budget, frameKb * KILOBYTE, seed);
+  }
+
+  printf("%u frames of %zu KB on average, %d readers, %zu KB of frame memory\n", frames, frameKb, readers, arenaKb);
+  int rc = 0;
+  for (int m = RUN_HEAP; m <= RUN_ARENA; m++) {
+    result_t* r = &res[m];
+    double ns = (r->seconds - res[RUN_NONE].seconds) * 1e9 / frames;
+    printf("%-5s: %7.1f ns per frame (%.2f s), %u readers dropped, %u reads, most held %zu KB",
+           runNames[m], ns < 0 ? 0 : ns, r->seconds, r->drops, r->reads, r->maxLive / KILOBYTE);
+    if ( m == RUN_ARENA ) {
+      printf(", %u did not fit in one piece (with up to %zu KB free), most skipped at the end %zu KB\n",
+             r->fails, r->failFree / KILOBYTE, r->maxWaste / KILOBYTE);
+    }
+    else {
+      printf(", heap held up to %zu KB with up to %zu KB free inside\n", r->maxHeld / KILOBYTE, r->maxFree / KILOBYTE);
+    }
+    if ( r->bad ) {
+      printf("%s: %u frames overwritten\n", runNames[m], r->bad);
+      rc = 1;
+    }
+    if ( r->frames != frames ) rc = 1;
+  }
+  return rc;
+}
@@ -0,0 +1,388 @@
+#include "host_platform.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <errno.h>
+
+#include <atomic>
+
+// ==== Time =========================================================================
+static uint64_t monotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static const uint64_t bootMicros = monotonicMicros();
+
+unsigned long micros(void) { return (unsigned long) (monotonicMicros() - bootMicros); }
+unsigned long millis(void) { return (unsigned long) ((monotonicMicros() - bootMicros) / 1000); }
+
+void delay(uint32_t aMillis) {
+  struct timespec ts = { (time_t) (aMillis / 1000), (long) (aMillis % 1000) * 1000000L };
+  while ( nanosleep(&ts, &ts) != 0 && errno == EINTR );
+}
+
+//  Absolute CLOCK_MONOTONIC deadline aTicks from now, for the condition variable waits
+static struct timespec deadlineIn(TickType_t aTicks) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  ts.tv_sec += aTicks / 1000;
+  ts.tv_nsec += (long) (aTicks % 1000) * 1000000L;
+  if ( ts.tv_nsec >= 1000000000L ) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  return ts;
+}
+
+static void initMonotonicCond(pthread_cond_t* aCond) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(aCond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+//  Wait on aCond until aReady() holds or aTicks expire. Mutex must be held. Returns aReady().
+template<typename P>
+static bool waitFor(pthread_cond_t* aCond, pthread_mutex_t* aMutex, TickType_t aTicks, P aReady) {
+  if ( aTicks == portMAX_DELAY ) {
+    while ( !aReady() ) pthread_cond_wait(aCond, aMutex);
+    return true;
+  }
+  struct timespec until = deadlineIn(aTicks);
+  while ( !aReady() ) {
+    if ( pthread_cond_timedwait(aCond, aMutex, &until) == ETIMEDOUT ) break;
+  }
+  return aReady();
+}
+
+
+// ==== Tasks ========================================================================
+struct hostTask_s {
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  TaskFunction_t  code;
+  void*           param;
+  const char*     name;
+  uint32_t        notify;
+  uint32_t        stack;
+  bool            suspended;
+  bool            deleted;
+};
+
+static thread_local TaskHandle_t currentTask = NULL;
+static std::atomic<uint32_t> taskStacks(0);     // stacks of live tasks, taken from the simulated heap
+
+static void* taskTrampoline(void* aTask) {
+  TaskHandle_t t = (TaskHandle_t) aTask;
+  currentTask = t;
+  //  Named after the task, so that per task figures (context switches) can be told apart in /proc
+  pthread_setname_np(pthread_self(), t->name);
+  t->code(t->param);
+  vTaskDelete(NULL);
+  return NULL;
+}
+
+//  Threads other than tasks (main, test harness) get a handle on first use so that
+//  notifications and self-suspension work from anywhere
+static TaskHandle_t selfTask() {
+  if ( currentTask == NULL ) {
+    TaskHandle_t t = new hostTask_s();
+    t->thread = pthread_self();
+    pthread_mutex_init(&t->lock, NULL);
+    initMonotonicCond(&t->cond);
+    t->name = "host";
+    currentTask = t;
+  }
+  return currentTask;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t aCode, const char* aName, uint32_t aStack, void* aParam,
+                                   UBaseType_t aPriority, TaskHandle_t* aHandle, BaseType_t aCore) {
+  TaskHandle_t t = new hostTask_s();
+  pthread_mutex_init(&t->lock, NULL);
+  initMonotonicCond(&t->cond);
+  t->code = aCode;
+  t->param = aParam;
+  t->name = aName;
+  t->stack = aStack;
+  taskStacks += aStack;
+
+  //  The handle must be visible before the task runs: tasks commonly refer to their own handle
+  if ( aHandle ) *aHandle = t;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int rc = pthread_create(&t->thread, &attr, taskTrampoline, t);
+  pthread_attr_destroy(&attr);
+  if ( rc != 0 ) {
+    if ( aHandle ) *aHandle = NULL;
+    taskStacks -= aStack;
+    delete t;
+    return pdFAIL;
+  }
+  return pdPASS;
+}
+
+//  Handles of deleted tasks are kept (marked deleted) so that eTaskGetState() on a stale
+//  handle stays well defined. The leak is one small struct per finished task.
+void vTaskDelete(TaskHandle_t aTask) {
+  TaskHandle_t t = aTask ? aTask : selfTask();
+  pthread_mutex_lock(&t->lock);
+  if ( !t->deleted ) taskStacks -= t->stack;
+  t->deleted = true;
+  pthread_mutex_unlock(&t->lock);
+  if ( t == currentTask ) pthread_exit(NULL);
+}
+
+//  Only self-suspension is supported: pthreads cannot be stopped asynchronously
+void vTaskSuspend(TaskHandle_t aTask) {
+  TaskHandle_t t = selfTask();
+  if ( aTask != NULL && aTask != t ) return;
+  pthread_mutex_lock(&t->lock);
+  t->suspended = true;
+  while ( t->suspended ) pthread_cond_wait(&t->cond, &t->lock);
+  pthread_mutex_unlock(&t->lock);
+}
+
+void vTaskResume(TaskHandle_t aTask) {
+  if ( aTask == NULL ) return;
+  pthread_mutex_lock(&aTask->lock);
+  aTask->suspended = false;
+  pthread_cond_broadcast(&aTask->cond);
+  pthread_mutex_unlock(&aTask->lock);
+}
+
+eTaskState eTaskGetState(TaskHandle_t aTask) {
+  if ( aTask == NULL ) return eInvalid;
+  pthread_mutex_lock(&aTask->lock);
+  eTaskState s = aTask->deleted ? eDeleted : (aTask->suspended ? eSuspended : eReady);
+  pthread_mutex_unlock(&aTask->lock);
+  return s;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) { return selfTask(); }
+
+void vTaskDelay(TickType_t aTicks) { delay(aTicks); }
+
+TickType_t xTaskGetTickCount(void) { return (TickType_t) millis(); }
+
+BaseType_t xTaskDelayUntil(TickType_t* aPrevWake, TickType_t aIncrement) {
+  TickType_t wake = *aPrevWake + aIncrement;
+  TickType_t now = xTaskGetTickCount();
+  *aPrevWake = wake;
+  //  Same semantics as FreeRTOS: no delay (and pdFALSE) if the wake time is already in the past
+  if ( (int32_t) (wake - now) <= 0 ) return pdFALSE;
+  delay(wake - now);
+  return pdTRUE;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t aTask) { return 0; }
+
+void taskYIELD(void) { sched_yield(); }
+
+void portENTER_CRITICAL(portMUX_TYPE* aMux) {
+  while ( __atomic_exchange_n(&aMux->locked, 1, __ATOMIC_ACQUIRE) ) {
+    while ( __atomic_load_n(&aMux->locked, __ATOMIC_RELAXED) ) {}
+  }
+}
+
+void portEXIT_CRITICAL(portMUX_TYPE* aMux) {
+  __atomic_store_n(&aMux->locked, 0, __ATOMIC_RELEASE);
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t aTask) {
+  pthread_mutex_lock(&aTask->lock);
+  aTask->notify++;
+  pthread_mutex_unlock(&aTask->lock);
+  //  Signalled after the unlock, so that the task does not wake up only to wait for the lock
+  pthread_cond_broadcast(&aTask->cond);
+  return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t aClearOnExit, TickType_t aTicks) {
+  TaskHandle_t t = selfTask();
+  pthread_mutex_lock(&t->lock);
+  waitFor(&t->cond, &t->lock, aTicks, [t]() { return t->notify != 0; });
+  uint32_t v = t->notify;
+  if ( v ) t->notify = aClearOnExit ? 0 : v - 1;
+  pthread_mutex_unlock(&t->lock);
+  return v;
+}
+
+
+// ==== Semaphores ===================================================================
+struct hostSemaphore_s {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  uint32_t        count;
+};
+
+static SemaphoreHandle_t createSemaphore(uint32_t aCount) {
+  SemaphoreHandle_t s = new hostSemaphore_s();
+  pthread_mutex_init(&s->lock, NULL);
+  initMonotonicCond(&s->cond);
+  s->count = aCount;
+  return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return createSemaphore(0); }
+SemaphoreHandle_t xSemaphoreCreateMutex(void) { return createSemaphore(1); }
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t aSem, TickType_t aTicks) {
+  pthread_mutex_lock(&aSem->lock);
+  bool ok = waitFor(&aSem->cond, &aSem->lock, aTicks, [aSem]() { return aSem->count != 0; });
+  if ( ok ) aSem->count = 0;
+  pthread_mutex_unlock(&aSem->lock);
+  return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t aSem) {
+  pthread_mutex_lock(&aSem->lock);
+  aSem->count = 1;
+  pthread_cond_signal(&aSem->cond);
+  pthread_mutex_unlock(&aSem->lock);
+  return pdTRUE;
+}
+
+
+// ==== Queues =======================================================================
+struct hostQueue_s {
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  uint8_t*        items;
+  UBaseType_t     length;
+  UBaseType_t     size;
+  UBaseType_t     head;
+  UBaseType_t     count;
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t aLength, UBaseType_t aItemSize) {
+  QueueHandle_t q = new hostQueue_s();
+  pthread_mutex_init(&q->lock, NULL);
+  initMonotonicCond(&q->cond);
+  q->items = (uint8_t*) malloc(aLength * aItemSize);
+  q->length = aLength;
+  q->size = aItemSize;
+  return q;
+}
+
+BaseType_t xQueueSend(QueueHandle_t aQueue, const void* aItem, TickType_t aTicks) {
+  pthread_mutex_lock(&aQueue->lock);
+  bool ok = waitFor(&aQueue->cond, &aQueue->lock, aTicks, [aQueue]() { return aQueue->count < aQueue->length; });
+  if ( ok ) {
+    UBaseType_t tail = (aQueue->head + aQueue->count) % aQueue->length;
+    memcpy(aQueue->items + tail * aQueue->size, aItem, aQueue->size);
+    aQueue->count++;
+    pthread_cond_broadcast(&aQueue->cond);
+  }
+  pthread_mutex_unlock(&aQueue->lock);
+  return ok ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t aQueue, void* aItem, TickType_t aTicks) {
+  pthread_mutex_lock(&aQueue->lock);
+  bool ok = waitFor(&aQueue->cond, &aQueue->lock, aTicks, [aQueue]() { return aQueue->count > 0; });
+  if ( ok ) {
+    memcpy(aItem, aQueue->items + aQueue->head * aQueue->size, aQueue->size);
+    aQueue->head = (aQueue->head + 1) % aQueue->length;
+    aQueue->count--;
+    pthread_cond_broadcast(&aQueue->cond);
+  }
+  pthread_mutex_unlock(&aQueue->lock);
+  return ok ? pdTRUE : pdFALSE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t aQueue) {
+  pthread_mutex_lock(&aQueue->lock);
+  UBaseType_t n = aQueue->count;
+  pthread_mutex_unlock(&aQueue->lock);
+  return n;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t aQueue) {
+  pthread_mutex_lock(&aQueue->lock);
+  UBaseType_t n = aQueue->length - aQueue->count;
+  pthread_mutex_unlock(&aQueue->lock);
+  return n;
+}
+
+
+// ==== Memory =======================================================================
+#define HOST_HEAP_SIZE    (320 * 1024)
+#define HOST_PSRAM_SIZE   (4 * 1024 * 1024)
+
+uint32_t  hostHeapSize = HOST_HEAP_SIZE;
+
+HostEsp ESP;
+
+bool      psramFound(void) { return true; }
+void*     ps_malloc(size_t aSize) { return malloc(aSize); }
+uint32_t  esp_random(void) { return (uint32_t) random() ^ (uint32_t) random() << 16; }
+
+uint32_t  HostEsp::getHeapSize() { return hostHeapSize; }
+//  Half the heap is taken by WiFi, lwIP and the rest of the system; task stacks come out of the other half
+uint32_t  HostEsp::getFreeHeap() { return hostHeapSize / 2 - taskStacks; }
+uint32_t  HostEsp::getMinFreeHeap() { return hostHeapSize / 2; }
+uint32_t  HostEsp::getMaxAllocHeap() { return getFreeHeap() / 2; }
+uint32_t  HostEsp::getPsramSize() { return HOST_PSRAM_SIZE; }
+uint32_t  HostEsp::getFreePsram() { return HOST_PSRAM_SIZE; }
+uint32_t  HostEsp::getMinFreePsram() { return HOST_PSRAM_SIZE; }
+uint32_t  HostEsp::getMaxAllocPsram() { return HOST_PSRAM_SIZE; }
+void      HostEsp::restart() { abort(); }
+
+
+// ==== Camera =======================================================================
+const resolution_info_t resolution[FRAMESIZE_INVALID] = {
+  {   96,   96 }, {  160,  120 }, {  176,  144 }, {  240,  176 }, {  240,  240 },
+  {  320,  240 }, {  400,  296 }, {  480,  320 }, {  640,  480 }, {  800,  600 }, { 1024,  768 },
+  { 1280,  720 }, { 1280, 1024 }, { 1600, 1200 },
+};
+
+
+// ==== Logging ======================================================================
+HostLog Log;
+
+void HostLog::print(int aLevel, const char* aFmt, va_list aArgs) {
+  static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+  static const char* levels = "?FEWNTV";
+  if ( aLevel > iLevel ) return;
+
+  pthread_mutex_lock(&logLock);
+  unsigned long mm = millis();
+  fprintf(stderr, "%6lu.%03lu %c ", mm / 1000, mm % 1000, levels[aLevel]);
+  for ( const char* p = aFmt; *p; p++ ) {
+    if ( *p != '%' || p[1] == '\0' ) {
+      fputc(*p, stderr);
+      continue;
+    }
+    switch ( *++p ) {
+      case 's': fputs(va_arg(aArgs, const char*), stderr); break;
+      case 'd': fprintf(stderr, "%d", va_arg(aArgs, int)); break;
+      case 'l': fprintf(stderr, "%ld", va_arg(aArgs, long)); break;
+      case 'x': fprintf(stderr, "%x", va_arg(aArgs, unsigned int)); break;
+      case 'X': fprintf(stderr, "0x%X", va_arg(aArgs, unsigned int)); break;
+      case 'c': fputc(va_arg(aArgs, int), stderr); break;
+      case 't': fputc(va_arg(aArgs, int) ? 'T' : 'F', stderr); break;
+      case 'T': fputs(va_arg(aArgs, int) ? "true" : "false", stderr); break;
+      default:  fputc(*p, stderr); break;
+    }
+  }
+  fflush(stderr);
+  pthread_mutex_unlock(&logLock);
+}
+
+#define HOST_LOG_METHOD(name, level) \
+  void HostLog::name(const char* aFmt, ...) { va_list a; va_start(a, aFmt); print(level, aFmt, a); va_end(a); }
+
+HOST_LOG_METHOD(fatal,   LOG_LEVEL_FATAL)
+HOST_LOG_METHOD(error,   LOG_LEVEL_ERROR)
+HOST_LOG_METHOD(warning, LOG_LEVEL_WARNING)
+HOST_LOG_METHOD(notice,  LOG_LEVEL_NOTICE)
+HOST_LOG_METHOD(trace,   LOG_LEVEL_TRACE)
+HOST_LOG_METHOD(verbose, LOG_LEVEL_VERBOSE)
@@ -0,0 +1,165 @@
+#pragma once
+//  Linux host port of the small FreeRTOS / Arduino / esp-camera subset used by the streaming code.
+//  Tasks are detached pthreads, semaphores and queues are mutex + condition variable pairs,
+//  and one tick is one millisecond. Only what the streaming modes actually call is provided.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <errno.h>
+
+// ==== FreeRTOS subset ===============================================================
+typedef int32_t   BaseType_t;
+typedef uint32_t  UBaseType_t;
+typedef uint32_t  TickType_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              1
+#define pdFAIL              0
+#define portMAX_DELAY       ((TickType_t) 0xffffffffUL)
+#define pdMS_TO_TICKS(x)    ((TickType_t) (x))
+#define tskIDLE_PRIORITY    0
+
+typedef enum { eRunning = 0, eReady, eBlocked, eSuspended, eDeleted, eInvalid } eTaskState;
+
+typedef struct hostTask_s*      TaskHandle_t;
+typedef struct hostSemaphore_s* SemaphoreHandle_t;
+typedef struct hostQueue_s*     QueueHandle_t;
+typedef void (*TaskFunction_t)(void*);
+
+BaseType_t  xTaskCreatePinnedToCore(TaskFunction_t aCode, const char* aName, uint32_t aStack, void* aParam,
+                                    UBaseType_t aPriority, TaskHandle_t* aHandle, BaseType_t aCore);
+void        vTaskDelete(TaskHandle_t aTask);
+void        vTaskSuspend(TaskHandle_t aTask);
+void        vTaskResume(TaskHandle_t aTask);
+eTaskState  eTaskGetState(TaskHandle_t aTask);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+void        vTaskDelay(TickType_t aTicks);
+BaseType_t  xTaskDelayUntil(TickType_t* aPrevWake, TickType_t aIncrement);
+TickType_t  xTaskGetTickCount(void);
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t aTask);
+void        taskYIELD(void);
+
+//  Critical sections are spinlocks, as on the dual core ESP32: waiting for one never blocks the task
+typedef struct {
+  uint32_t  locked;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED  { 0 }
+void        portENTER_CRITICAL(portMUX_TYPE* aMux);
+void        portEXIT_CRITICAL(portMUX_TYPE* aMux);
+
+BaseType_t  xTaskNotifyGive(TaskHandle_t aTask);
+uint32_t    ulTaskNotifyTake(BaseType_t aClearOnExit, TickType_t aTicks);
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+BaseType_t  xSemaphoreTake(SemaphoreHandle_t aSem, TickType_t aTicks);
+BaseType_t  xSemaphoreGive(SemaphoreHandle_t aSem);
+
+QueueHandle_t xQueueCreate(UBaseType_t aLength, UBaseType_t aItemSize);
+BaseType_t  xQueueSend(QueueHandle_t aQueue, const void* aItem, TickType_t aTicks);
+BaseType_t  xQueueReceive(QueueHandle_t aQueue, void* aItem, TickType_t aTicks);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t aQueue);
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t aQueue);
+
+
+// ==== Arduino subset ================================================================
+unsigned long millis(void);
+unsigned long micros(void);
+void          delay(uint32_t aMillis);
+
+#define F(s)  (s)
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+bool  psramFound(void);
+void* ps_malloc(size_t aSize);
+uint32_t esp_random(void);
+
+//  Stand-in for the Arduino EspClass. Heap figures are fixed so that allocateMemory()
+//  takes the same DRAM vs PSRAM decisions it would take on a 4MB PSRAM board.
+class HostEsp {
+  public:
+    uint32_t  getHeapSize();
+    uint32_t  getFreeHeap();
+    uint32_t  getMinFreeHeap();
+    uint32_t  getMaxAllocHeap();
+    uint32_t  getPsramSize();
+    uint32_t  getFreePsram();
+    uint32_t  getMinFreePsram();
+    uint32_t  getMaxAllocPsram();
+    void      restart();
+};
+extern HostEsp ESP;
+extern uint32_t hostHeapSize;   // simulated internal heap, bytes
+
+
+// ==== ArduinoLog subset ===============================================================
+#define LOG_LEVEL_SILENT  0
+#define LOG_LEVEL_FATAL   1
+#define LOG_LEVEL_ERROR   2
+#define LOG_LEVEL_WARNING 3
+#define LOG_LEVEL_NOTICE  4
+#define LOG_LEVEL_TRACE   5
+#define LOG_LEVEL_VERBOSE 6
+#define CR "\n"
+
+//  Understands the ArduinoLog wildcards used in this project (%s %d %l %x %X %c %t %T)
+class HostLog {
+  public:
+    void  begin(int aLevel)   { iLevel = aLevel; }
+    void  fatal(const char* aFmt, ...);
+    void  error(const char* aFmt, ...);
+    void  warning(const char* aFmt, ...);
+    void  notice(const char* aFmt, ...);
+    void  trace(const char* aFmt, ...);
+    void  verbose(const char* aFmt, ...);
+  private:
+    void  print(int aLevel, const char* aFmt, va_list aArgs);
+    int   iLevel = LOG_LEVEL_SILENT;
+};
+extern HostLog Log;
+
+
+// ==== esp-camera subset =============================================================
+typedef enum {
+  PIXFORMAT_RGB565, PIXFORMAT_YUV422, PIXFORMAT_YUV420, PIXFORMAT_GRAYSCALE,
+  PIXFORMAT_JPEG, PIXFORMAT_RGB888, PIXFORMAT_RAW, PIXFORMAT_RGB444, PIXFORMAT_RGB555,
+} pixformat_t;
+
+typedef struct {
+  uint8_t*        buf;
+  size_t          len;
+  size_t          width;
+  size_t          height;
+  pixformat_t     format;
+  struct timeval  timestamp;
+} camera_fb_t;
+
+//  Frame sizes in the order of esp32-camera, and their dimensions (sensor.h)
+typedef enum {
+  FRAMESIZE_96X96, FRAMESIZE_QQVGA, FRAMESIZE_QCIF, FRAMESIZE_HQVGA, FRAMESIZE_240X240,
+  FRAMESIZE_QVGA, FRAMESIZE_CIF, FRAMESIZE_HVGA, FRAMESIZE_VGA, FRAMESIZE_SVGA, FRAMESIZE_XGA,
+  FRAMESIZE_HD, FRAMESIZE_SXGA, FRAMESIZE_UXGA, FRAMESIZE_INVALID
+} framesize_t;
+
+typedef struct {
+  const uint16_t  width;
+  const uint16_t  height;
+} resolution_info_t;
+
+extern const resolution_info_t resolution[];
+
+//  The JPEG playback source serves VGA frames
+#ifndef FRAME_SIZE
+#define FRAME_SIZE  FRAMESIZE_VGA
+#endif
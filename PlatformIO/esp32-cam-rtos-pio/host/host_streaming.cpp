@@ -0,0 +1,414 @@
+#include "host_streaming.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <string>
+
+TaskHandle_t  tMjpeg;
+
+
+// ==== DirectorySource ===================================================================
+DirectorySource::DirectorySource(const char* aDir, uint32_t aSensorFps) {
+  pthread_mutex_init(&iLock, NULL);
+  pthread_cond_init(&iFree, NULL);
+
+  if ( aDir ) loadDirectory(aDir);
+  if ( iFrames.empty() ) synthesize();
+
+  iMaxSize = 0;
+  for (size_t i = 0; i < iFrames.size(); i++) iMaxSize = std::max(iMaxSize, iFrames[i].size());
+  iMaxSize += HOST_TAG_SIZE;
+
+  for (int i = 0; i < HOST_FB_COUNT; i++) {
+    memset(&iFbs[i], 0, sizeof(camera_fb_t));
+    iFbs[i].buf = (uint8_t*) malloc(iMaxSize);
+    iFbs[i].width = 640;
+    iFbs[i].height = 480;
+    iFbs[i].format = PIXFORMAT_JPEG;
+    iBusy[i] = false;
+  }
+  iNext = 0;
+  iSequence = 0;
+  iInterval = aSensorFps ? 1000000 / aSensorFps : 0;
+  iNextFrame = micros();
+  iStallEnd = iNextFrame;
+}
+
+DirectorySource::~DirectorySource() {
+  for (int i = 0; i < HOST_FB_COUNT; i++) free(iFbs[i].buf);
+}
+
+void DirectorySource::loadDirectory(const char* aDir) {
+  DIR* d = opendir(aDir);
+  if ( d == NULL ) {
+    Log.error("DirectorySource: cannot open %s\n", aDir);
+    return;
+  }
+  std::vector<std::string> names;
+  struct dirent* e;
+  while ( (e = readdir(d)) != NULL ) {
+    std::string n = e->d_name;
+    if ( n.size() > 4 && (n.compare(n.size() - 4, 4, ".jpg") == 0 || n.compare(n.size() - 4, 4, ".JPG") == 0) ) {
+      names.push_back(std::string(aDir) + "/" + n);
+    }
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());
+
+  for (size_t i = 0; i < names.size(); i++) {
+    FILE* f = fopen(names[i].c_str(), "rb");
+    if ( f == NULL ) continue;
+    std::vector<uint8_t> data;
+    uint8_t chunk[4096];
+    size_t n;
+    while ( (n = fread(chunk, 1, sizeof(chunk), f)) > 0 ) data.insert(data.end(), chunk, chunk + n);
+    fclose(f);
+    //  Only frames starting with SOI are usable - the timestamp tag goes right after it
+    if ( data.size() > 4 && data[0] == 0xFF && data[1] == 0xD8 ) iFrames.push_back(data);
+  }
+  Log.trace("DirectorySource: loaded %d frames from %s\n", (int) iFrames.size(), aDir);
+}
+
+// ==== Standard JPEG tables (ITU T.81 Annex K, RFC 2435 Appendix A and B) ====
+//  Quantization tables in zigzag order
+static const uint8_t lumQuant[64] = {
+  16, 11, 12, 14, 12, 10, 16, 14, 13, 14, 18, 17, 16, 19, 24, 40,
+  26, 24, 22, 22, 24, 49, 35, 37, 29, 40, 58, 51, 61, 60, 57, 51,
+  56, 55, 64, 72, 92, 78, 64, 68, 87, 69, 55, 56, 80, 109, 81, 87,
+  95, 98, 103, 104, 103, 62, 77, 113, 121, 112, 100, 120, 92, 101, 103, 99
+};
+static const uint8_t chmQuant[16] = {
+  17, 18, 18, 24, 21, 24, 47, 26, 26, 47, 99, 66, 56, 66, 99, 99      // then 99
+};
+
+//  Huffman tables: code counts per length, then the symbols. The AC symbols start with
+//  the frequent ones, the rest is every other run/size in order
+static const uint8_t dcLumBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t dcChmBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t acLumBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t acChmBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t acLumFirst[] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16
+};
+static const uint8_t acChmFirst[] = {
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1
+};
+
+typedef struct {
+  uint8_t   bits[16];
+  uint8_t   symbols[162];
+  int       count;
+} huffTable_t;
+
+static void huffTable(huffTable_t* aTable, const uint8_t* aBits, const uint8_t* aFirst, size_t aFirstLen, bool aAc) {
+  memcpy(aTable->bits, aBits, 16);
+  aTable->count = 0;
+  if ( !aAc ) {
+    for (int i = 0; i < 12; i++) aTable->symbols[aTable->count++] = i;
+    return;
+  }
+  bool used[256] = { false };
+  for (size_t i = 0; i < aFirstLen; i++) {
+    aTable->symbols[aTable->count++] = aFirst[i];
+    used[aFirst[i]] = true;
+  }
+  for (int r = 0; r < 16; r++) {
+    for (int s = 1; s <= 10; s++) {
+      if ( !used[r << 4 | s] ) aTable->symbols[aTable->count++] = r << 4 | s;
+    }
+  }
+}
+
+//  Tables in DHT order: DC luma, DC chroma, AC luma, AC chroma
+static void standardTables(huffTable_t aTables[4]) {
+  huffTable(&aTables[0], dcLumBits, NULL, 0, false);
+  huffTable(&aTables[1], dcChmBits, NULL, 0, false);
+  huffTable(&aTables[2], acLumBits, acLumFirst, sizeof(acLumFirst), true);
+  huffTable(&aTables[3], acChmBits, acChmFirst, sizeof(acChmFirst), true);
+}
+
+//  Code of aSymbol: canonical Huffman codes in order of length
+static bool huffCode(const huffTable_t* aTable, uint8_t aSymbol, uint16_t* aCode, int* aLen) {
+  uint16_t code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    for (int i = 0; i < aTable->bits[len - 1]; i++, k++) {
+      if ( aTable->symbols[k] == aSymbol ) {
+        *aCode = code;
+        *aLen = len;
+        return true;
+      }
+      code++;
+    }
+    code <<= 1;
+  }
+  return false;
+}
+
+class BitWriter {
+  public:
+    BitWriter(std::vector<uint8_t>& aOut) : iOut(aOut), iAcc(0), iBits(0) {}
+    void put(uint32_t aCode, int aLen) {
+      for (int i = aLen - 1; i >= 0; i--) {
+        iAcc = iAcc << 1 | ((aCode >> i) & 1);
+        if ( ++iBits == 8 ) byte();
+      }
+    }
+    //  Pad the last byte with 1 bits
+    void flush() {
+      while ( iBits ) put(1, 1);
+    }
+  private:
+    void byte() {
+      iOut.push_back(iAcc);
+      if ( iAcc == 0xFF ) iOut.push_back(0);
+      iAcc = 0;
+      iBits = 0;
+    }
+    std::vector<uint8_t>& iOut;
+    uint8_t iAcc;
+    int     iBits;
+};
+
+static void segment(std::vector<uint8_t>& aOut, uint8_t aMarker, const std::vector<uint8_t>& aData) {
+  aOut.push_back(0xFF);
+  aOut.push_back(aMarker);
+  aOut.push_back((uint8_t) ((aData.size() + 2) >> 8));
+  aOut.push_back((uint8_t) (aData.size() + 2));
+  aOut.insert(aOut.end(), aData.begin(), aData.end());
+}
+
+//  Baseline JPEGs sized like VGA frames at JPEG_QUALITY 16, with the sampling (4:2:2) and
+//  tables of the camera. Blocks are flat with a varying number of +-1 AC coefficients,
+//  as many as it takes to reach the size
+void DirectorySource::synthesize() {
+  static const size_t sizes[] = { 24000, 31000, 28500, 40000, 35500, 26000, 45000, 30500 };
+  const int mcus = (640 / 16) * (480 / 8);
+  huffTable_t tables[4];
+  standardTables(tables);
+
+  for (size_t k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> seg;
+    data.push_back(0xFF);
+    data.push_back(0xD8);
+
+    seg.push_back(0x00);
+    seg.insert(seg.end(), lumQuant, lumQuant + 64);
+    seg.push_back(0x01);
+    seg.insert(seg.end(), chmQuant, chmQuant + 16);
+    seg.insert(seg.end(), 48, 99);
+    segment(data, 0xDB, seg);
+
+    static const uint8_t sof[] = { 8, 480 >> 8, 480 & 0xFF, 640 >> 8, 640 & 0xFF, 3,
+                                   1, 0x21, 0, 2, 0x11, 1, 3, 0x11, 1 };
+    segment(data, 0xC0, std::vector<uint8_t>(sof, sof + sizeof(sof)));
+
+    seg.clear();
+    static const uint8_t classes[4] = { 0x00, 0x01, 0x10, 0x11 };
+    for (int t = 0; t < 4; t++) {
+      seg.push_back(classes[t]);
+      seg.insert(seg.end(), tables[t].bits, tables[t].bits + 16);
+      seg.insert(seg.end(), tables[t].symbols, tables[t].symbols + tables[t].count);
+    }
+    segment(data, 0xC4, seg);
+
+    static const uint8_t sos[] = { 3, 1, 0x00, 2, 0x11, 3, 0x11, 0, 63, 0 };
+    segment(data, 0xDA, std::vector<uint8_t>(sos, sos + sizeof(sos)));
+
+    //  Entropy coded data: every block has DC difference 0, n coefficients +-1, then EOB
+    uint16_t dc[2], ac1[2], eob[2];
+    int dcLen[2], ac1Len[2], eobLen[2];
+    for (int c = 0; c < 2; c++) {
+      huffCode(&tables[c], 0x00, &dc[c], &dcLen[c]);
+      huffCode(&tables[2 + c], 0x01, &ac1[c], &ac1Len[c]);
+      huffCode(&tables[2 + c], 0x00, &eob[c], &eobLen[c]);
+    }
+    size_t start = data.size();
+    uint64_t target = (uint64_t) (sizes[k] - start - 2) * 8;
+    uint64_t bits = 0;
+    uint32_t rnd = 0x12345 + k;
+    BitWriter out(data);
+    for (int b = 0; b < mcus * 4; b++) {
+      int c = (b & 3) < 2 ? 0 : 1;
+      int base = dcLen[c] + eobLen[c];
+      int64_t room = (int64_t) (target * (b + 1) / (mcus * 4)) - (int64_t) bits - base;
+      int n = room > 0 ? (int) (room / (ac1Len[c] + 1)) : 0;
+      if ( n > 63 ) n = 63;
+      out.put(dc[c], dcLen[c]);
+      for (int i = 0; i < n; i++) {
+        rnd = rnd * 1103515245 + 12345;
+        out.put(ac1[c], ac1Len[c]);
+        out.put((rnd >> 16) & 1, 1);
+      }
+      if ( n < 63 ) out.put(eob[c], eobLen[c]);
+      bits += base + n * (ac1Len[c] + 1);
+    }
+    out.flush();
+
+    data.push_back(0xFF);
+    data.push_back(0xD9);
+    iFrames.push_back(data);
+  }
+}
+
+camera_fb_t* DirectorySource::get() {
+  camera_fb_t* fb = NULL;
+
+  //  A stalled camera fails the capture, like esp_camera_fb_get() timing out
+  if ( (long) (iStallEnd - micros()) > 0 ) {
+    delay(10);
+    return NULL;
+  }
+
+  //  The driver owns HOST_FB_COUNT buffers; wait for one to be returned
+  pthread_mutex_lock(&iLock);
+  for (;;) {
+    for (int i = 0; i < HOST_FB_COUNT && fb == NULL; i++) {
+      if ( !iBusy[i] ) {
+        iBusy[i] = true;
+        fb = &iFbs[i];
+      }
+    }
+    if ( fb ) break;
+    pthread_cond_wait(&iFree, &iLock);
+  }
+  uint32_t seq = iSequence++;
+  const std::vector<uint8_t>& src = iFrames[iNext];
+  iNext = (iNext + 1) % iFrames.size();
+  pthread_mutex_unlock(&iLock);
+
+  //  Pace frames at the sensor rate
+  if ( iInterval ) {
+    long wait = (long) (iNextFrame - micros());
+    if ( wait > 0 ) delay(wait / 1000);
+    iNextFrame += iInterval;
+    if ( (long) (micros() - iNextFrame) > (long) iInterval ) iNextFrame = micros();
+  }
+
+  uint64_t ts = micros();
+  uint8_t* p = fb->buf;
+  *p++ = 0xFF;
+  *p++ = 0xD8;
+  *p++ = 0xFF;
+  *p++ = 0xFE;
+  *p++ = 0;
+  *p++ = HOST_TAG_SIZE - 2;
+  memcpy(p, HOST_TAG_MAGIC, 4);
+  p += 4;
+  for (int i = 0; i < 8; i++) *p++ = (uint8_t) (ts >> (8 * i));
+  for (int i = 0; i < 4; i++) *p++ = (uint8_t) (seq >> (8 * i));
+  memcpy(p, src.data() + 2, src.size() - 2);
+
+  fb->len = src.size() + HOST_TAG_SIZE;
+  fb->timestamp.tv_sec = ts / 1000000;
+  fb->timestamp.tv_usec = ts % 1000000;
+  return fb;
+}
+
+void DirectorySource::release(camera_fb_t* aFrame) {
+  pthread_mutex_lock(&iLock);
+  for (int i = 0; i < HOST_FB_COUNT; i++) {
+    if ( aFrame == &iFbs[i] ) iBusy[i] = false;
+  }
+  pthread_cond_signal(&iFree);
+  pthread_mutex_unlock(&iLock);
+}
+
+
+// ==== Scan check ====
+class BitReader {
+  public:
+    BitReader(const uint8_t* aBuf, size_t aLen) : iBuf(aBuf), iLen(aLen), iPos(0), iAcc(0), iBits(0), iOver(false) {}
+    int bit() {
+      if ( iBits == 0 ) {
+        //  Past the end, or at a marker: the scan is shorter than its MCUs
+        if ( iPos >= iLen || (iBuf[iPos] == 0xFF && (iPos + 1 >= iLen || iBuf[iPos + 1] != 0)) ) {
+          iOver = true;
+          return 1;
+        }
+        iAcc = iBuf[iPos];
+        iPos += iAcc == 0xFF ? 2 : 1;
+        iBits = 8;
+      }
+      return (iAcc >> --iBits) & 1;
+    }
+    uint32_t bits(int aLen) {
+      uint32_t v = 0;
+      while ( aLen-- ) v = v << 1 | bit();
+      return v;
+    }
+    //  Restart marker: drop the padding bits, then expect RSTn
+    bool restart(int aN) {
+      iBits = 0;
+      if ( iPos + 1 >= iLen || iBuf[iPos] != 0xFF || iBuf[iPos + 1] != 0xD0 + (aN & 7) ) return false;
+      iPos += 2;
+      return true;
+    }
+    size_t  pos() { return iPos; }
+    bool    over() { return iOver; }
+  private:
+    const uint8_t* iBuf;
+    size_t    iLen;
+    size_t    iPos;
+    uint8_t   iAcc;
+    int       iBits;
+    bool      iOver;
+};
+
+static int huffDecode(BitReader& aIn, const huffTable_t* aTable) {
+  int code = 0;
+  int first = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    code |= aIn.bit();
+    int n = aTable->bits[len - 1];
+    if ( code - first < n ) return aTable->symbols[k + code - first];
+    k += n;
+    first = (first + n) << 1;
+    code <<= 1;
+  }
+  return -1;
+}
+
+static bool skipBlock(BitReader& aIn, const huffTable_t* aDc, const huffTable_t* aAc) {
+  int s = huffDecode(aIn, aDc);
+  if ( s < 0 || s > 11 ) return false;
+  aIn.bits(s);
+  for (int k = 1; k < 64; k++) {
+    int rs = huffDecode(aIn, aAc);
+    if ( rs < 0 ) return false;
+    if ( (rs & 0x0F) == 0 ) {
+      if ( rs != 0xF0 ) break;
+      k += 15;
+      continue;
+    }
+    k += rs >> 4;
+    aIn.bits(rs & 0x0F);
+  }
+  return !aIn.over();
+}
+
+int jpegScanMcus(const jpegInfo_t* aInfo) {
+  huffTable_t tables[4];
+  standardTables(tables);
+  int type = aInfo->type & 63;
+  int lumBlocks = type == 1 ? 4 : 2;
+  int mcus = ((aInfo->width + 1) / 2) * (type == 1 ? (aInfo->height + 1) / 2 : aInfo->height);
+
+  BitReader in(aInfo->scan, aInfo->sln);
+  for (int m = 0; m < mcus; m++) {
+    if ( aInfo->dri && m && m % aInfo->dri == 0 && !in.restart(m / aInfo->dri - 1) ) return -1;
+    for (int b = 0; b < lumBlocks + 2; b++) {
+      int c = b < lumBlocks ? 0 : 1;
+      if ( !skipBlock(in, &tables[c], &tables[2 + c]) ) return -1;
+    }
+  }
+  //  Nothing but the padding of the last byte left
+  return in.pos() == aInfo->sln ? mcus : -1;
+}
@@ -0,0 +1,59 @@
+#pragma once
+#include "streaming.h"
+#include "socketsink.h"
+#include "rtpjpeg.h"
+
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+#ifndef HOST_FB_COUNT
+#define HOST_FB_COUNT     2     // same as camera_config.fb_count on the board
+#endif
+
+//  Every frame handed out by DirectorySource carries this JPEG comment segment right after SOI:
+//  FF FE <len:2> "MJTS" <capture micros:8, LE> <sequence:4, LE>
+#define HOST_TAG_MAGIC    "MJTS"
+#define HOST_TAG_SIZE     (2 + 2 + 4 + 8 + 4)
+
+// ==== Plays back a directory of JPEG files as if they came from the camera ===================
+//  With no directory, synthetic baseline JPEGs (640x480 4:2:2, standard tables) of typical VGA
+//  sizes are generated instead.
+//  Frames are released at the sensor rate, and a capture timestamp is stamped into each frame
+//  so that receivers can measure capture-to-client latency.
+class DirectorySource : public FrameSource {
+  public:
+    DirectorySource(const char* aDir, uint32_t aSensorFps);
+    ~DirectorySource();
+
+    camera_fb_t*  get();
+    void          release(camera_fb_t* aFrame);
+    int           buffers() { return HOST_FB_COUNT; }
+
+    size_t        frames() { return iFrames.size(); }
+    size_t        maxFrameSize() { return iMaxSize; }
+    void          stall(uint32_t aMs) { iStallEnd = micros() + aMs * 1000UL; }   // deliver no frames for aMs
+
+  private:
+    void          loadDirectory(const char* aDir);
+    void          synthesize();
+
+    std::vector< std::vector<uint8_t> > iFrames;
+    camera_fb_t     iFbs[HOST_FB_COUNT];
+    bool            iBusy[HOST_FB_COUNT];
+    pthread_mutex_t iLock;
+    pthread_cond_t  iFree;
+    size_t          iMaxSize;
+    uint32_t        iNext;
+    uint32_t        iSequence;
+    uint32_t        iInterval;   // microseconds between sensor frames
+    unsigned long   iNextFrame;
+    std::atomic<unsigned long> iStallEnd;
+};
+
+
+extern TaskHandle_t tMjpeg;
+
+//  Decodes the scan of a baseline JPEG with the standard Huffman tables (those of the camera
+//  and of RFC 2435) without dequantizing. Returns the number of MCUs, -1 if the scan is corrupt
+int jpegScanMcus(const jpegInfo_t* aInfo);
@@ -0,0 +1,496 @@
+//  Fuzz test and benchmark of the HTTP request parser and route table (src/httpparser.cpp).
+//
+//  usage: http_bench [-f fuzz_cases] [-b bench_seconds] [-s seed]
+//
+//  Fuzzing mutates a corpus of real requests (bit flips, inserted, deleted and duplicated bytes,
+//  splices, truncation) and checks every result: no access outside the input (run it under
+//  -fsanitize=address), everything the request points at lies inside the input, every prefix
+//  of a valid request head is reported incomplete, and no heap allocation is made.
+//  If-None-Match matching is checked on a few fixed cases and run on the mutated inputs as well,
+//  and so is the websocket frame parser (src/websocket.cpp), along with the handshake key.
+//  RTSP request lines (absolute URIs, "*") are checked on fixed cases, and the JPEG header parser
+//  and RTP/JPEG packetizer (src/rtpjpeg.cpp) on a built frame and mutations of it, with a packet of
+//  each frame rebuilt from the XOR parity.
+//  The benchmark parses and routes the corpus in a loop and reports requests per second and
+//  bytes allocated per request, next to a String based parser doing what WebServer does.
+//  Exit code is non-zero if any check failed.
+
+#include "streaming.h"
+#include "httpparser.h"
+#include "websocket.h"
+#include "rtpjpeg.h"
+
+#include <unistd.h>
+#include <malloc.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+// ==== Allocation counting: every malloc in the process goes through here =====================
+extern "C" void* __libc_malloc(size_t);
+extern "C" void* __libc_calloc(size_t, size_t);
+extern "C" void* __libc_realloc(void*, size_t);
+extern "C" void  __libc_free(void*);
+
+static bool     counting = false;
+static uint64_t allocCount = 0;
+static uint64_t allocBytes = 0;
+
+#if !defined(__SANITIZE_ADDRESS__)
+extern "C" void* malloc(size_t aSize) {
+  if ( counting ) {
+    allocCount++;
+    allocBytes += aSize;
+  }
+  return __libc_malloc(aSize);
+}
+
+extern "C" void* calloc(size_t aCount, size_t aSize) {
+  if ( counting ) {
+    allocCount++;
+    allocBytes += aCount * aSize;
+  }
+  return __libc_calloc(aCount, aSize);
+}
+
+extern "C" void* realloc(void* aPtr, size_t aSize) {
+  if ( counting ) {
+    allocCount++;
+    allocBytes += aSize;
+  }
+  return __libc_realloc(aPtr, aSize);
+}
+
+extern "C" void free(void* aPtr) { __libc_free(aPtr); }
+#endif
+
+static const char* corpus[] = {
+  "GET /mjpeg/1 HTTP/1.1\r\nHost: 192.168.1.50\r\nUser-Agent: curl/7.81.0\r\nAccept: */*\r\n\r\n",
+  "GET /mjpeg/1 HTTP/1.1\r\nHost: 192.168.1.50\r\nConnection: keep-alive\r\nCache-Control: max-age=0\r\n"
+  "Upgrade-Insecure-Requests: 1\r\nUser-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+  "Chrome/118.0.0.0 Safari/537.36\r\nAccept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,"
+  "image/webp,*/*;q=0.8\r\nAccept-Encoding: gzip, deflate\r\nAccept-Language: en-US,en;q=0.9\r\n\r\n",
+  "GET /mjpeg/1?fps=5&res=vga HTTP/1.1\r\nHost: cam\r\n\r\n",
+  "GET /favicon.ico HTTP/1.1\r\nHost: cam\r\nReferer: http://cam/mjpeg/1\r\n\r\n",
+  "HEAD / HTTP/1.0\r\n\r\n",
+  "POST /mjpeg/1 HTTP/1.1\r\nContent-Length: 0\r\n\r\n",
+  "GET /mjpeg/1 HTTP/1.1\nHost: cam\n\n",
+  "GET /jpg HTTP/1.1\r\nHost: cam\r\nIf-None-Match: W/\"11\", \"12\"\r\n\r\n",
+  "OPTIONS rtsp://192.168.1.50:554/mjpeg/1 RTSP/1.0\r\nCSeq: 1\r\nUser-Agent: Lavf60.16.100\r\n\r\n",
+  "SETUP rtsp://192.168.1.50:554/mjpeg/1/track1 RTSP/1.0\r\nCSeq: 3\r\n"
+  "Transport: RTP/AVP/UDP;unicast;client_port=5000-5001\r\n\r\n",
+};
+#define CORPUS_SIZE (sizeof(corpus) / sizeof(corpus[0]))
+
+static bool handled(int aFd, const httpRequest_t* aReq) { return true; }
+
+static const httpRoute_t routes[] = {
+  { HTTP_M_GET, "/", handled },
+  { HTTP_M_GET, "/jpg", handled },
+  { HTTP_M_GET, STREAMING_URL, handled },
+};
+#define ROUTES  (sizeof(routes) / sizeof(routes[0]))
+
+static uint32_t rnd = 1;
+static uint32_t random32() {
+  rnd ^= rnd << 13;
+  rnd ^= rnd >> 17;
+  rnd ^= rnd << 5;
+  return rnd;
+}
+
+// ==== WebServer-like parser: one String per request line part, argument and header ==========
+static int stringParse(const char* aBuf, size_t aLen) {
+  std::string req(aBuf, aLen);
+  size_t eol = req.find("\r\n");
+  if ( eol == std::string::npos ) return -1;
+  std::string line = req.substr(0, eol);
+  size_t sp1 = line.find(' ');
+  size_t sp2 = line.find(' ', sp1 + 1);
+  if ( sp1 == std::string::npos || sp2 == std::string::npos ) return -1;
+  std::string method = line.substr(0, sp1);
+  std::string url = line.substr(sp1 + 1, sp2 - sp1 - 1);
+  std::string search;
+  size_t q = url.find('?');
+  if ( q != std::string::npos ) {
+    search = url.substr(q + 1);
+    url = url.substr(0, q);
+  }
+  std::map<std::string, std::string> args;
+  size_t p = 0;
+  while ( !search.empty() && p <= search.size() ) {
+    size_t amp = search.find('&', p);
+    std::string arg = search.substr(p, amp == std::string::npos ? std::string::npos : amp - p);
+    size_t eq = arg.find('=');
+    args[arg.substr(0, eq)] = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+    if ( amp == std::string::npos ) break;
+    p = amp + 1;
+  }
+  std::map<std::string, std::string> headers;
+  size_t pos = eol + 2;
+  for (;;) {
+    eol = req.find("\r\n", pos);
+    if ( eol == std::string::npos ) return -1;
+    std::string h = req.substr(pos, eol - pos);
+    if ( h.empty() ) break;
+    size_t c = h.find(':');
+    if ( c == std::string::npos ) return -1;
+    std::string value = h.substr(c + 1);
+    value.erase(0, value.find_first_not_of(' '));
+    headers[h.substr(0, c)] = value;
+    pos = eol + 2;
+  }
+  return url == STREAMING_URL ? 1 : 0;
+}
+
+// ==== Fuzzing ===================================================================================
+static uint32_t failures = 0;
+
+static void fail(const char* aWhat, const std::string& aInput) {
+  if ( failures++ < 10 ) {
+    printf("FAIL: %s on input (%d bytes): ", aWhat, (int) aInput.size());
+    for (size_t i = 0; i < aInput.size() && i < 120; i++) {
+      uint8_t c = aInput[i];
+      if ( c >= ' ' && c < 0x7F ) putchar(c);
+      else printf("\\x%02x", c);
+    }
+    printf("\n");
+  }
+}
+
+static bool inside(const char* aPtr, size_t aLen, const char* aBuf, size_t aSize) {
+  return aPtr >= aBuf && aPtr + aLen <= aBuf + aSize;
+}
+
+static void mutate(std::string& aInput) {
+  int ops = 1 + random32() % 4;
+  for (int k = 0; k < ops; k++) {
+    size_t n = aInput.size();
+    size_t at = n ? random32() % n : 0;
+    switch ( random32() % 7 ) {
+      case 0: if ( n ) aInput[at] ^= 1 << (random32() % 8); break;
+      case 1: aInput.insert(at, 1, (char) (random32() % 256)); break;
+      case 2: if ( n ) aInput.erase(at, 1 + random32() % 8); break;
+      case 3: aInput.insert(at, "\r\n:? /&=\t"[random32() % 9], 1 + random32() % 3); break;
+      case 4: if ( n ) aInput.insert(at, aInput.substr(random32() % n, random32() % 64)); break;
+      case 5: aInput.resize(at); break;
+      case 6: {
+        std::string other = corpus[random32() % CORPUS_SIZE];
+        aInput = aInput.substr(0, at) + other.substr(random32() % other.size());
+        break;
+      }
+    }
+  }
+}
+
+static void check(const std::string& aInput, uint32_t* aValid) {
+  //  Exactly sized heap copy, so that the sanitizer catches any read past the end
+  size_t size = aInput.size();
+  char* buf = (char*) malloc(size ? size : 1);
+  memcpy(buf, aInput.data(), size);
+
+  //  The websocket parser unmasks in place: give it its own copy
+  uint8_t* ws = (uint8_t*) malloc(size ? size : 1);
+  memcpy(ws, aInput.data(), size);
+
+  httpRequest_t req;
+  counting = true;
+  uint64_t before = allocCount;
+  int parsed = httpParse(buf, size, &req);
+  const httpRoute_t* route = parsed > 0 ? httpRoute(routes, ROUTES, &req) : NULL;
+  const char* arg = parsed > 0 ? httpArg(&req, "fps", NULL) : NULL;
+  const char* host = parsed > 0 ? httpHeader(&req, "host", NULL) : NULL;
+  bool etag = httpEtagMatch(buf, size > 0xFFFF ? 0xFFFF : size, "12");
+  wsFrame_t frame;
+  int framed = wsParse(ws, size, 125, &frame);
+  bool allocated = allocCount != before;
+  counting = false;
+  (void) route;
+  (void) arg;
+  (void) host;
+  (void) etag;
+
+  if ( allocated ) fail("heap allocation", aInput);
+  if ( parsed > (int) size || parsed < HTTP_BAD_REQUEST ) fail("result out of range", aInput);
+  if ( framed > (int) size || framed < WS_BAD_FRAME ) fail("websocket result out of range", aInput);
+  if ( framed > 0 && (frame.pln > 125 || !inside((const char*) frame.payload, frame.pln, (const char*) ws, framed)) ) {
+    fail("websocket payload outside the frame", aInput);
+  }
+  free(ws);
+  if ( parsed > 0 ) {
+    (*aValid)++;
+    if ( !inside(req.path, req.pln, buf, parsed) ) fail("path outside the request", aInput);
+    if ( req.query && !inside(req.query, req.qln, buf, parsed) ) fail("query outside the request", aInput);
+    if ( req.headerCount > HTTP_HEADERS_MAX ) fail("header count", aInput);
+    for (int i = 0; i < req.headerCount; i++) {
+      if ( !inside(req.headers[i].nam, req.headers[i].nln, buf, parsed) ||
+           !inside(req.headers[i].val, req.headers[i].vln, buf, parsed) ) fail("header outside the request", aInput);
+    }
+    //  A request arriving in pieces: every prefix of a valid head is incomplete
+    for (int cut = 0; cut < parsed; cut += 1 + random32() % 16) {
+      httpRequest_t part;
+      if ( httpParse(buf, cut, &part) != HTTP_INCOMPLETE ) fail("prefix not incomplete", aInput);
+    }
+  }
+  free(buf);
+}
+
+// ==== If-None-Match ============================================================================
+static void etagCases() {
+  static const struct { const char* list; bool match; } cases[] = {
+    { "\"12\"", true },
+    { "\"1\", \"12\"", true },
+    { "W/\"12\"", true },
+    { "*", true },
+    { "\"123\"", false },
+    { "\"1\"", false },
+    { "12", false },
+    { "\"12", false },
+    { "", false },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    if ( httpEtagMatch(cases[i].list, strlen(cases[i].list), "12") != cases[i].match ) fail("ETag match", cases[i].list);
+  }
+}
+
+// ==== WebSocket handshake and frames (RFC 6455 1.3 and 5.7) =====================================
+static void wsCases() {
+  char accept[WS_ACCEPT_SIZE];
+  wsAcceptKey("dGhlIHNhbXBsZSBub25jZQ==", WS_KEY_LENGTH, accept);
+  if ( strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") != 0 ) fail("Sec-WebSocket-Accept", accept);
+
+  //  Masked "Hello", arriving in pieces
+  const uint8_t hello[] = { 0x81, 0x85, 0x37, 0xfa, 0x21, 0x3d, 0x7f, 0x9f, 0x4d, 0x51, 0x58 };
+  uint8_t buf[sizeof(hello)];
+  wsFrame_t f;
+  for (size_t cut = 0; cut < sizeof(hello); cut++) {
+    memcpy(buf, hello, sizeof(hello));
+    if ( wsParse(buf, cut, 125, &f) != WS_INCOMPLETE ) fail("websocket prefix not incomplete", "Hello");
+  }
+  memcpy(buf, hello, sizeof(hello));
+  if ( wsParse(buf, sizeof(hello), 125, &f) != (int) sizeof(hello) || f.opcode != WS_OP_TEXT || !f.fin ||
+       f.pln != 5 || memcmp(f.payload, "Hello", 5) != 0 ) fail("websocket masked frame", "Hello");
+  uint32_t fnm;
+  if ( wsAck(f.opcode, f.payload, f.pln, &fnm) ) fail("websocket ack", "Hello");
+
+  //  Unmasked client frames, reserved bits, long and fragmented control frames are refused
+  const uint8_t unmasked[] = { 0x81, 0x05, 'H', 'e', 'l', 'l', 'o' };
+  const uint8_t reserved[] = { 0xC1, 0x80, 0, 0, 0, 0 };
+  const uint8_t longPing[] = { 0x89, 0xFE, 0x00, 0x7E };
+  const uint8_t fragPing[] = { 0x09, 0x80, 0, 0, 0, 0 };
+  if ( wsParse((uint8_t*) unmasked, sizeof(unmasked), 125, &f) != WS_BAD_FRAME ) fail("websocket unmasked frame", "");
+  if ( wsParse((uint8_t*) reserved, sizeof(reserved), 125, &f) != WS_BAD_FRAME ) fail("websocket reserved bits", "");
+  if ( wsParse((uint8_t*) longPing, sizeof(longPing), 1024, &f) != WS_BAD_FRAME ) fail("websocket long ping", "");
+  if ( wsParse((uint8_t*) fragPing, sizeof(fragPing), 125, &f) != WS_BAD_FRAME ) fail("websocket fragmented ping", "");
+
+  //  Server frame headers for each length encoding
+  uint8_t h[10];
+  if ( wsHeader(h, WS_OP_BINARY, 125) != 2 || h[0] != 0x82 || h[1] != 125 ) fail("websocket header 7 bit", "");
+  if ( wsHeader(h, WS_OP_BINARY, 40000) != 4 || h[1] != 126 || h[2] != 0x9C || h[3] != 0x40 ) fail("websocket header 16 bit", "");
+  if ( wsHeader(h, WS_OP_BINARY, 70000) != 10 || h[1] != 127 || h[7] != 0x01 || h[8] != 0x11 || h[9] != 0x70 ) fail("websocket header 64 bit", "");
+
+  //  Acks: 4 bytes little-endian or decimal text
+  const uint8_t bin[] = { 0x39, 0x30, 0, 0 };
+  if ( !wsAck(WS_OP_BINARY, bin, 4, &fnm) || fnm != 12345 ) fail("websocket binary ack", "");
+  if ( !wsAck(WS_OP_TEXT, (const uint8_t*) "12345", 5, &fnm) || fnm != 12345 ) fail("websocket text ack", "");
+  if ( wsAck(WS_OP_TEXT, (const uint8_t*) "12a", 3, &fnm) || wsAck(WS_OP_BINARY, bin, 3, &fnm) ) fail("websocket bad ack", "");
+}
+
+// ==== RTSP request lines ==========================================================================
+static void rtspCases() {
+  static const struct { const char* req; int rtsp; const char* path; const char* query; } cases[] = {
+    { "DESCRIBE rtsp://10.0.0.5:554/mjpeg/1 RTSP/1.0\r\nCSeq: 2\r\n\r\n", 1, "/mjpeg/1", NULL },
+    { "PLAY rtsp://cam/mjpeg/1/ RTSP/1.0\r\nCSeq: 4\r\nSession: 0A1B2C3D\r\n\r\n", 1, "/mjpeg/1/", NULL },
+    { "OPTIONS * RTSP/1.0\r\nCSeq: 1\r\n\r\n", 1, "*", NULL },
+    { "OPTIONS rtsp://cam RTSP/1.0\r\n\r\n", 1, "", NULL },
+    { "GET http://cam:80/jpg?after=7 HTTP/1.1\r\n\r\n", 0, "/jpg", "after=7" },
+    { "DESCRIBE mjpeg/1 RTSP/1.0\r\n\r\n", -1, NULL, NULL },
+    { "DESCRIBE ://cam/mjpeg/1 RTSP/1.0\r\n\r\n", -1, NULL, NULL },
+    { "DESCRIBE rtsp://cam/mjpeg/1 RTSP/2.0\r\n\r\n", -1, NULL, NULL },
+  };
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    httpRequest_t req;
+    int parsed = httpParse(cases[i].req, strlen(cases[i].req), &req);
+    if ( cases[i].rtsp < 0 ) {
+      if ( parsed != HTTP_BAD_REQUEST ) fail("bad request line accepted", cases[i].req);
+      continue;
+    }
+    if ( parsed <= 0 || req.rtsp != (cases[i].rtsp == 1) ||
+         req.pln != strlen(cases[i].path) || memcmp(req.path, cases[i].path, req.pln) != 0 ||
+         (cases[i].query == NULL) != (req.query == NULL) ||
+         (req.query && (req.qln != strlen(cases[i].query) || memcmp(req.query, cases[i].query, req.qln) != 0)) ) {
+      fail("request line", cases[i].req);
+    }
+    if ( parsed > 0 && req.mln != strchr(cases[i].req, ' ') - cases[i].req ) fail("method", cases[i].req);
+  }
+}
+
+// ==== JPEG headers and RTP/JPEG packets ==========================================================
+//  Baseline 640x480 4:2:2 frame: DQT, SOF0, DRI, SOS, scan, EOI (no DHT, the packetizer does not need it)
+static std::string jpegFrame(uint16_t aDri, size_t aScan) {
+  std::string f("\xFF\xD8", 2);
+  f += std::string("\xFF\xDB\x00\x84\x00", 5) + std::string(64, '\x10') + '\x01' + std::string(64, '\x11');
+  f += std::string("\xFF\xC0\x00\x11\x08\x01\xE0\x02\x80\x03\x01\x21\x00\x02\x11\x01\x03\x11\x01", 19);
+  if ( aDri ) f += std::string("\xFF\xDD\x00\x04", 4) + (char) (aDri >> 8) + (char) aDri;
+  f += std::string("\xFF\xDA\x00\x0C\x03\x01\x00\x02\x11\x03\x11\x00\x3F\x00", 14);
+  for (size_t i = 0; i < aScan; i++) f += (char) (i % 255);
+  f += std::string("\xFF\xD9", 2);
+  return f;
+}
+
+//  Packets of a frame must carry its scan exactly once, in order, within RTP_PACKET_MAX
+static void rtpCheck(const jpegInfo_t* aJpg, const std::string& aInput) {
+  rtpStream_t stream;
+  memset(&stream, 0, sizeof(stream));
+  uint8_t hdr[RTP_HEADER_MAX];
+  size_t len = 0;
+  uint32_t off = 0;
+  static rtpFec_t fec;
+  std::vector<std::string> packets;
+  fec.count = 0;
+  for (int n = 0; off < aJpg->sln; n++, off += len) {
+    size_t h = rtpJpegPacket(hdr, aJpg, &stream, 1234, off, &len);
+    rtpFecAdd(&fec, hdr, h, aJpg->scan + off, len);
+    packets.push_back(std::string((const char*) hdr, h) + std::string((const char*) aJpg->scan + off, len));
+    uint32_t at = (uint32_t) hdr[13] << 16 | (uint32_t) hdr[14] << 8 | hdr[15];
+    bool last = off + len >= aJpg->sln;
+    if ( h > RTP_HEADER_MAX || h + len > RTP_PACKET_MAX || len == 0 || at != off || ((hdr[1] & 0x80) != 0) != last ||
+         hdr[3] != (uint8_t) n || hdr[16] != aJpg->type ) {
+      fail("RTP/JPEG packet", aInput);
+      return;
+    }
+    if ( off == 0 && (hdr[17] != 255 || memcmp(hdr + h - 128, aJpg->qt[0], 64) != 0) ) fail("RTP/JPEG tables", aInput);
+  }
+  if ( off != aJpg->sln || stream.frames != 1 ) fail("RTP/JPEG fragments", aInput);
+
+  //  Any one packet of the frame comes back from the parity and the others
+  uint8_t fhdr[RTP_FEC_HEADER];
+  size_t pln;
+  uint16_t count = fec.count;
+  if ( rtpFecPacket(fhdr, &fec, &stream, 1234, &pln) != RTP_FEC_HEADER || (fhdr[14] << 8 | fhdr[15]) != count ||
+       count != packets.size() ) {
+    fail("parity header", aInput);
+    return;
+  }
+  size_t lost = random32() % packets.size();
+  std::string rebuilt((const char*) fec.parity, pln);
+  uint16_t plen = (uint16_t) (fhdr[16] << 8 | fhdr[17]);
+  for (size_t i = 0; i < packets.size(); i++) {
+    if ( i == lost ) continue;
+    for (size_t k = 0; k < packets[i].size(); k++) rebuilt[k] ^= packets[i][k];
+    plen ^= (uint16_t) packets[i].size();
+  }
+  if ( plen > rebuilt.size() || rebuilt.substr(0, plen) != packets[lost] ) fail("parity rebuild", aInput);
+}
+
+static void jpegCases(uint32_t aCases) {
+  jpegInfo_t j;
+  std::string f = jpegFrame(0, 30000);
+  if ( !jpegParse((const uint8_t*) f.data(), f.size(), &j) || j.type != 0 || j.width != 80 || j.height != 60 ||
+       j.sln != 30000 || j.qt[0][0] != 0x10 || j.qt[1][0] != 0x11 ) fail("jpegParse", "baseline");
+  else rtpCheck(&j, "baseline");
+  f = jpegFrame(40, 5000);
+  if ( !jpegParse((const uint8_t*) f.data(), f.size(), &j) || j.type != 64 || j.dri != 40 ) fail("jpegParse", "restart interval");
+  else rtpCheck(&j, "restart interval");
+  f = jpegFrame(0, 100);
+  f[2 + 4 + 130 + 1] = '\xC2';    // SOF2
+  if ( jpegParse((const uint8_t*) f.data(), f.size(), &j) ) fail("jpegParse accepted", "progressive");
+
+  //  Mutated frames: rejected, or with everything inside the frame
+  for (uint32_t i = 0; i < aCases; i++) {
+    std::string input = jpegFrame(i & 1 ? 16 : 0, 200 + random32() % 4000);
+    mutate(input);
+    size_t size = input.size();
+    uint8_t* buf = (uint8_t*) malloc(size ? size : 1);
+    memcpy(buf, input.data(), size);
+    if ( jpegParse(buf, size, &j) ) {
+      if ( !inside((const char*) j.scan, j.sln, (const char*) buf, size) ||
+           !inside((const char*) j.qt[0], 64, (const char*) buf, size) ||
+           !inside((const char*) j.qt[1], 64, (const char*) buf, size) ) fail("jpegParse outside the frame", input);
+      else rtpCheck(&j, input);
+    }
+    free(buf);
+  }
+}
+
+static uint32_t fuzz(uint32_t aCases) {
+  uint32_t valid = 0;
+  for (size_t i = 0; i < CORPUS_SIZE; i++) {
+    uint32_t before = valid;
+    check(corpus[i], &valid);
+    if ( valid == before ) fail("corpus request rejected", corpus[i]);
+  }
+  for (uint32_t i = 0; i < aCases; i++) {
+    std::string input = corpus[random32() % CORPUS_SIZE];
+    mutate(input);
+    check(input, &valid);
+  }
+  return valid;
+}
+
+// ==== Benchmark =================================================================================
+static void bench(const char* aName, bool aStrings, double aSeconds) {
+  uint64_t requests = 0;
+  uint32_t matched = 0;
+  unsigned long start = micros();
+  unsigned long elapsed;
+
+  allocCount = 0;
+  allocBytes = 0;
+  counting = true;
+  do {
+    for (int k = 0; k < 1000; k++) {
+      const char* r = corpus[requests++ % CORPUS_SIZE];
+      size_t len = strlen(r);
+      if ( aStrings ) {
+        if ( stringParse(r, len) == 1 ) matched++;
+      }
+      else {
+        httpRequest_t req;
+        if ( httpParse(r, len, &req) > 0 ) {
+          const httpRoute_t* route = httpRoute(routes, ROUTES, &req);
+          if ( route && route->path == STREAMING_URL ) matched++;
+        }
+      }
+    }
+    elapsed = micros() - start;
+  } while ( elapsed < aSeconds * 1000000 );
+  counting = false;
+
+  printf("%-9s : %10.0f requests/s, %6.1f allocations and %7.1f bytes allocated per request (%u streaming)\n",
+         aName, requests * 1e6 / elapsed, (double) allocCount / requests, (double) allocBytes / requests, matched);
+}
+
+int main(int argc, char** argv) {
+  uint32_t cases = 100000;
+  double seconds = 1;
+  int opt;
+
+  while ( (opt = getopt(argc, argv, "f:b:s:")) != -1 ) {
+    switch ( opt ) {
+      case 'f': cases = atoi(optarg); break;
+      case 'b': seconds = atof(optarg); break;
+      case 's': rnd = atoi(optarg) | 1; break;
+      default:
+        fprintf(stderr, "usage: %s [-f fuzz_cases] [-b bench_seconds] [-s seed]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  etagCases();
+  wsCases();
+  rtspCases();
+  jpegCases(cases / 10);
+  uint32_t valid = fuzz(cases);
+  printf("fuzz      : %u cases, %u parsed as valid requests, %u failures\n", cases, valid, failures);
+#if defined(__SANITIZE_ADDRESS__)
+  printf("            (allocation counting is off under the address sanitizer)\n");
+#endif
+
+  if ( seconds > 0 ) {
+    bench("httpParse", false, seconds);
+    bench("String", true, seconds);
+  }
+  return failures ? 1 : 0;
+}
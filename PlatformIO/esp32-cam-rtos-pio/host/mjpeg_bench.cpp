@@ -0,0 +1,1532 @@
+//  Host streaming benchmark: runs camCB / streamCB / mjpegCB of the selected streaming mode
+//  on pthreads, plays back JPEG frames and connects N loopback clients to the MJPEG stream.
+//
+//  usage: mjpeg_bench_<mode> [-d jpeg_dir] [-c clients] [-t seconds] [-s sensor_fps]
+//                            [-p port] [-m min_frames_per_client] [-v log_level]
+//                            [-l slow_clients] [-r min_rejected] [-H heap_kb]
+//                            [-b bandwidth_KBps] [-f fps:count] [-w max_wakeups_per_s]
+//                            [-j snapshot_pollers] [-a pull_clients] [-W ws_viewers[:ack_ms]]
+//                            [-R rtsp_udp[:rtsp_tcp]] [-P rtsp_port] [-M receivers[:loss_percent]]
+//                            [-C churn_clients] [-B drop|pause|demote] [-L frame_memory_kb] [-S] [-E]
+//                            [-O outage_ms]
+//
+//  Per client it reports frames received, frame rate, throughput, time to first frame
+//  and capture-to-last-byte latency; overall, the send system calls and TCP segments per frame
+//  and the context switches of the streaming tasks per second.
+//  Clients turned away by admission control (503) are marked '-'. With -f, the last count clients
+//  ask for ?fps=fps (marked '/') and must get that rate within 30%, and if all clients do,
+//  the camera must run at no more than that rate. With -j, pollers fetch /jpg every SNAPSHOT_POLL_MS
+//  with If-None-Match and must get both new frames (200) and 304 Not Modified, and no errors.
+//  With -a, pull clients long poll /jpg?after=N on one keep-alive connection each and must get
+//  at least 70% of the FPS frame rate without reconnecting. With -W, websocket viewers watch /ws and
+//  ack every frame ack_ms after they got it: without a delay they must get 70% of FPS, with one they
+//  must be skipped frames instead of falling behind. With -R, RTSP clients play rtsp://.../mjpeg/1 over
+//  UDP and interleaved TCP, put the RTP/JPEG fragments back together and decode every frame's scan:
+//  they must get 70% of FPS, with no frame that does not decode. With -M, receivers join the RTSP
+//  multicast group and throw away loss_percent of the packets: the parity packets must make up for it
+//  (70% of FPS again), and the server must send each frame to the group only once. With -C, clients
+//  keep connecting to the stream, reading a few frames and hanging up: in all-frames mode the frames
+//  held in the frame arena must stay within a second of capture all the same. With -B and -L, all-frames
+//  mode keeps the frames under frame_memory_kb with the given backpressure policy: the policy must have
+//  kicked in for the slow clients, and the frames held must stay within the limit (pause), or within the
+//  limit and the frames captured while a slow client sends its last frame (drop, demote). With -S,
+//  /stats is fetched while the clients are connected: it must be valid JSON with a stream for every
+//  client and viewer, each with frames and bytes sent, no more frames than were captured or received, and
+//  every frame in the stream's capture-to-first-byte and capture-to-last-byte latency histograms.
+//  With -E, /metrics is fetched as well: every line must be a comment or a sample of a family declared
+//  before it, histogram buckets must add up to their count, and the counters and latency histograms must
+//  match what was sent. With -O, the camera is left to go idle first, and then delivers no frames for
+//  outage_ms while the clients connect: their tasks must wait for the camera instead of spinning, the
+//  process must stay under OUTAGE_CPU_PCT of a CPU during the outage.
+//  Exit code is non-zero if any admitted client got less than min_frames_per_client frames,
+//  or less than min_rejected clients were turned away, or the streaming tasks woke up more than
+//  max_wakeups_per_s times a second, so the benchmark doubles as a smoke test.
+
+#include "host_streaming.h"
+#include "admission.h"
+#include "websocket.h"
+#include "rtsp.h"
+#include "framearena.h"
+#include "framepool.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/tcp.h>
+#include <dirent.h>
+#include <sys/resource.h>
+
+#include <math.h>
+#include <stdarg.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#if defined(CAMERA_MULTICLIENT_QUEUE)
+#define MODE_NAME "CAMERA_MULTICLIENT_QUEUE"
+#elif defined(CAMERA_MULTICLIENT_TASK)
+#define MODE_NAME "CAMERA_MULTICLIENT_TASK"
+#elif defined(CAMERA_ALL_FRAMES)
+#define MODE_NAME "CAMERA_ALL_FRAMES"
+#endif
+
+#define SLOW_CLIENT_KBPS  64
+#define SNAPSHOT_POLL_MS  20
+#define OUTAGE_CPU_PCT    25
+
+typedef struct {
+  int                     id;
+  bool                    slow;
+  bool                    rejected;       // got 503 Service Unavailable
+  int                     fps;            // frame rate asked for with ?fps=, 0 for the full rate
+  uint32_t                frames;
+  uint64_t                bytes;
+  uint32_t                firstFrameUs;   // connect to end of first frame
+  uint32_t                sequenceGaps;   // frames skipped between two received frames
+  uint32_t                segments;       // TCP data segments received
+  std::vector<uint32_t>   latencyUs;      // capture to last byte
+  pthread_t               thread;
+} benchClient_t;
+
+typedef struct {
+  uint32_t                requests;
+  uint32_t                frames;         // 200 with a complete JPEG
+  uint32_t                notModified;    // 304
+  uint32_t                failed;         // anything else
+  uint32_t                firstFrameUs;   // start to the end of the first frame
+  uint64_t                requestUs;      // sum of connect to end of response
+  pthread_t               thread;
+} benchPoller_t;
+
+typedef struct {
+  uint32_t                frames;         // 200 with a complete JPEG
+  uint32_t                notModified;    // 304: no newer frame within LONGPOLL_MS
+  uint32_t                failed;         // anything else
+  uint32_t                connections;    // TCP connections used
+  uint32_t                sequenceGaps;   // frames skipped between two received frames
+  std::vector<uint32_t>   latencyUs;      // capture to last byte
+  pthread_t               thread;
+} benchPuller_t;
+
+typedef struct {
+  int                     ackMs;          // time the viewer takes for a frame before acking it
+  bool                    upgraded;       // got 101 with the right Sec-WebSocket-Accept
+  uint32_t                frames;
+  uint32_t                skipped;        // frame numbers missing between two frames received
+  uint32_t                failed;         // frames whose meta data does not match the JPEG
+  std::vector<uint32_t>   latencyUs;      // capture (meta data timestamp) to last byte
+  pthread_t               thread;
+} benchViewer_t;
+
+typedef struct {
+  bool                    tcp;            // interleaved, else UDP
+  bool                    mcast;          // joins the multicast group
+  int                     lossPermille;   // multicast packets it throws away, to exercise the parity
+  bool                    setup;          // OPTIONS, DESCRIBE, SETUP and PLAY answered as expected
+  bool                    teardown;       // TEARDOWN answered with 200
+  uint32_t                packets;
+  uint32_t                lost;           // RTP sequence numbers missing
+  uint32_t                frames;         // frames whose scan decodes
+  uint32_t                failed;         // malformed packets, frames that do not decode
+  uint32_t                thrown;         // packets thrown away (lossPermille)
+  uint32_t                parity;         // parity packets received
+  uint32_t                recovered;      // packets rebuilt from the parity
+  std::vector<std::string> pending;       // multicast packets waiting for the parity of their group
+  uint16_t                seq;
+  uint32_t                ts;
+  bool                    broken;         // frame being received is missing a fragment
+  jpegInfo_t              jpg;
+  std::vector<uint8_t>    frame;
+  std::vector<uint32_t>   latencyUs;      // capture (RTP timestamp) to last packet
+  pthread_t               thread;
+} benchRtsp_t;
+
+typedef struct {
+  uint32_t                connections;
+  uint32_t                rejected;       // got 503 Service Unavailable
+  uint64_t                bytes;
+  pthread_t               thread;
+} benchChurner_t;
+
+static std::atomic<bool> benchRunning(true);
+
+//  Timestamp and sequence number stamped by DirectorySource, false if the frame carries none
+static bool frameTag(const uint8_t* aBuf, size_t aLen, uint64_t* aStamp, uint32_t* aSeq) {
+  if ( aLen < HOST_TAG_SIZE + 2 || aBuf[2] != 0xFF || aBuf[3] != 0xFE ) return false;
+  if ( memcmp(aBuf + 6, HOST_TAG_MAGIC, 4) != 0 ) return false;
+  *aStamp = 0;
+  *aSeq = 0;
+  for (int i = 0; i < 8; i++) *aStamp |= (uint64_t) aBuf[10 + i] << (8 * i);
+  for (int i = 0; i < 4; i++) *aSeq |= (uint32_t) aBuf[18 + i] << (8 * i);
+  return true;
+}
+
+static void* clientThread(void* aParam) {
+  benchClient_t* c = (benchClient_t*) aParam;
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(serverPort);
+  struct timeval tv = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if ( c->slow ) {
+    //  Keep the kernel from buffering seconds worth of frames for a slow reader
+    int rcvbuf = 16 * 1024;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  }
+
+  unsigned long start = micros();
+  if ( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    close(fd);
+    return NULL;
+  }
+  char req[128];
+  if ( c->fps ) snprintf(req, sizeof(req), "GET /mjpeg/1?fps=%d HTTP/1.1\r\nHost: localhost\r\n\r\n", c->fps);
+  else snprintf(req, sizeof(req), "GET /mjpeg/1 HTTP/1.1\r\nHost: localhost\r\n\r\n");
+  send(fd, req, strlen(req), MSG_NOSIGNAL);
+
+  //  Minimal multipart parser: find Content-Length, skip to the end of the part headers,
+  //  collect the body, repeat
+  std::vector<uint8_t> buf;
+  size_t need = 0;          // body bytes expected, 0 while looking for the part header
+  size_t body = 0;          // offset of the body in buf
+  bool haveSeq = false;
+  uint32_t lastSeq = 0;
+  uint8_t chunk[16 * 1024];
+
+  while ( benchRunning ) {
+    ssize_t n = recv(fd, chunk, c->slow ? 4096 : sizeof(chunk), 0);
+    if ( n == 0 ) break;
+    if ( n < 0 ) {
+      if ( errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ) continue;
+      break;
+    }
+    c->bytes += n;
+    if ( c->slow ) delay(n * 1000 / (SLOW_CLIENT_KBPS * 1024));
+    buf.insert(buf.end(), chunk, chunk + n);
+    if ( c->frames == 0 && buf.size() >= 12 && memcmp(buf.data(), "HTTP/1.1 503", 12) == 0 ) {
+      c->rejected = true;
+      break;
+    }
+
+    for (;;) {
+      if ( need == 0 ) {
+        const char* key = "Content-Length: ";
+        std::vector<uint8_t>::iterator k = std::search(buf.begin(), buf.end(), key, key + strlen(key));
+        if ( k == buf.end() ) break;
+        const char* eoh = "\r\n\r\n";
+        std::vector<uint8_t>::iterator e = std::search(k, buf.end(), eoh, eoh + 4);
+        if ( e == buf.end() ) break;
+        need = strtoul(std::string(k + strlen(key), e).c_str(), NULL, 10);
+        body = (e - buf.begin()) + 4;
+        if ( need == 0 ) {
+          buf.erase(buf.begin(), buf.begin() + body);
+          continue;
+        }
+      }
+      if ( buf.size() < body + need ) break;
+
+      unsigned long now = micros();
+      uint64_t stamp;
+      uint32_t seq;
+      if ( frameTag(buf.data() + body, need, &stamp, &seq) ) {
+        c->latencyUs.push_back((uint32_t) (now - stamp));
+        if ( haveSeq && seq > lastSeq + 1 ) c->sequenceGaps += seq - lastSeq - 1;
+        lastSeq = seq;
+        haveSeq = true;
+      }
+      if ( c->frames == 0 ) c->firstFrameUs = now - start;
+      c->frames++;
+      buf.erase(buf.begin(), buf.begin() + body + need);
+      need = 0;
+    }
+  }
+  struct tcp_info ti;
+  socklen_t tlen = sizeof(ti);
+  if ( getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &tlen) == 0 ) c->segments = ti.tcpi_data_segs_in;
+  close(fd);
+  return NULL;
+}
+
+// ==== Context switches of the streaming tasks =================================================
+//  Task threads are named after their task; the benchmark's own threads keep the process name.
+//  Voluntary switches are the times a task blocked and was woken up again
+typedef struct {
+  uint64_t  voluntary;
+  uint64_t  preempted;
+} taskSwitches_t;
+
+static bool readLine(const char* aPath, char* aBuf, size_t aSize) {
+  FILE* f = fopen(aPath, "r");
+  if ( f == NULL ) return false;
+  bool ok = fgets(aBuf, aSize, f) != NULL;
+  fclose(f);
+  return ok;
+}
+
+//  CPU time the process has used, us
+static uint64_t cpuUs() {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static taskSwitches_t taskSwitches() {
+  taskSwitches_t s = { 0, 0 };
+  char self[32] = "";
+  char name[32];
+  char path[sizeof(((struct dirent*) 0)->d_name) + 32];
+  char line[128];
+  readLine("/proc/self/comm", self, sizeof(self));
+
+  DIR* d = opendir("/proc/self/task");
+  if ( d == NULL ) return s;
+  while ( struct dirent* e = readdir(d) ) {
+    if ( e->d_name[0] == '.' ) continue;
+    snprintf(path, sizeof(path), "/proc/self/task/%s/comm", e->d_name);
+    if ( !readLine(path, name, sizeof(name)) || strcmp(name, self) == 0 ) continue;
+    snprintf(path, sizeof(path), "/proc/self/task/%s/status", e->d_name);
+    FILE* f = fopen(path, "r");
+    if ( f == NULL ) continue;
+    unsigned long long n;
+    while ( fgets(line, sizeof(line), f) ) {
+      if ( sscanf(line, "voluntary_ctxt_switches: %llu", &n) == 1 ) s.voluntary += n;
+      else if ( sscanf(line, "nonvoluntary_ctxt_switches: %llu", &n) == 1 ) s.preempted += n;
+    }
+    fclose(f);
+  }
+  closedir(d);
+  return s;
+}
+
+// ==== Snapshot poller: GET /jpg with the ETag of the frame it has =============================
+static void* pollerThread(void* aParam) {
+  benchPoller_t* p = (benchPoller_t*) aParam;
+  char etag[32] = "";
+  unsigned long start = micros();
+
+  while ( benchRunning ) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(serverPort);
+    struct timeval tv = { 3, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    unsigned long t0 = micros();
+    std::string rsp;
+    if ( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 ) {
+      char req[128];
+      int n = snprintf(req, sizeof(req), "GET /jpg HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n%s%s%s\r\n",
+                       etag[0] ? "If-None-Match: " : "", etag, etag[0] ? "\r\n" : "");
+      send(fd, req, n, MSG_NOSIGNAL);
+      char chunk[16 * 1024];
+      ssize_t r;
+      while ( (r = recv(fd, chunk, sizeof(chunk), 0)) > 0 ) rsp.append(chunk, r);
+    }
+    close(fd);
+    p->requests++;
+    p->requestUs += micros() - t0;
+
+    //  Status, ETag and body
+    size_t eoh = rsp.find("\r\n\r\n");
+    size_t tag = rsp.find("ETag: ");
+    if ( rsp.compare(0, 12, "HTTP/1.1 304") == 0 && tag != std::string::npos ) {
+      p->notModified++;
+    }
+    else if ( rsp.compare(0, 12, "HTTP/1.1 200") == 0 && tag != std::string::npos && eoh != std::string::npos ) {
+      size_t cl = rsp.find("Content-Length: ");
+      size_t len = cl != std::string::npos ? strtoul(rsp.c_str() + cl + 16, NULL, 10) : 0;
+      const uint8_t* body = (const uint8_t*) rsp.data() + eoh + 4;
+      if ( len > 2 && rsp.size() == eoh + 4 + len && body[0] == 0xFF && body[1] == 0xD8 ) {
+        size_t end = rsp.find("\r\n", tag);
+        snprintf(etag, sizeof(etag), "%s", rsp.substr(tag + 6, end - tag - 6).c_str());
+        if ( p->frames++ == 0 ) p->firstFrameUs = micros() - start;
+      }
+      else {
+        p->failed++;
+      }
+    }
+    else {
+      p->failed++;
+    }
+    delay(SNAPSHOT_POLL_MS);
+  }
+  return NULL;
+}
+
+// ==== Pull client: GET /jpg?after=N for the next frame, on one keep-alive connection ============
+static int connectServer() {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(serverPort);
+  struct timeval tv = { 3, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if ( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// ==== Churn client: connects, reads a few frames worth of the stream, hangs up, again =========
+static void* churnerThread(void* aParam) {
+  benchChurner_t* c = (benchChurner_t*) aParam;
+  uint32_t rnd = (uint32_t) (uintptr_t) aParam;
+  uint8_t chunk[16 * 1024];
+
+  while ( benchRunning ) {
+    int fd = connectServer();
+    if ( fd < 0 ) {
+      delay(10);
+      continue;
+    }
+    c->connections++;
+    const char* req = "GET /mjpeg/1 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    send(fd, req, strlen(req), MSG_NOSIGNAL);
+
+    rnd = rnd * 1103515245 + 12345;
+    size_t want = 8 * 1024 + (rnd >> 8) % (160 * 1024);
+    size_t got = 0;
+    while ( benchRunning && got < want ) {
+      ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+      if ( n <= 0 ) break;
+      if ( got == 0 && n >= 12 && memcmp(chunk, "HTTP/1.1 503", 12) == 0 ) {
+        c->rejected++;
+        break;
+      }
+      got += n;
+    }
+    c->bytes += got;
+    close(fd);
+    delay((rnd >> 4) % 50);
+  }
+  return NULL;
+}
+
+#if defined(CAMERA_ALL_FRAMES)
+// ==== Most frames held in the frame arena ===================================================
+static uint32_t arenaMaxFrames = 0;
+static size_t   arenaMaxUsed = 0;
+
+static void* arenaThread(void* aParam) {
+  while ( benchRunning ) {
+    uint32_t n = frameArena.count;
+    size_t used = frameArena.used;
+    if ( n > arenaMaxFrames ) arenaMaxFrames = n;
+    if ( used > arenaMaxUsed ) arenaMaxUsed = used;
+    delay(1);
+  }
+  return NULL;
+}
+#endif
+
+static void* pullerThread(void* aParam) {
+  benchPuller_t* p = (benchPuller_t*) aParam;
+  std::string buf;
+  uint32_t after = 0;
+  bool haveSeq = false;
+  uint32_t lastSeq = 0;
+  int fd = -1;
+
+  while ( benchRunning ) {
+    if ( fd < 0 ) {
+      fd = connectServer();
+      if ( fd < 0 ) break;
+      p->connections++;
+      buf.clear();
+    }
+    char req[128];
+    int n = snprintf(req, sizeof(req), "GET /jpg?after=%u HTTP/1.1\r\nHost: localhost\r\n\r\n", (unsigned) after);
+    send(fd, req, n, MSG_NOSIGNAL);
+
+    //  Response head, then Content-Length bytes of body (none for 304)
+    size_t eoh;
+    char chunk[16 * 1024];
+    ssize_t r = 1;
+    while ( (eoh = buf.find("\r\n\r\n")) == std::string::npos && (r = recv(fd, chunk, sizeof(chunk), 0)) > 0 ) buf.append(chunk, r);
+    size_t cl = buf.find("Content-Length: ");
+    size_t len = eoh != std::string::npos && cl < eoh ? strtoul(buf.c_str() + cl + 16, NULL, 10) : 0;
+    while ( eoh != std::string::npos && buf.size() < eoh + 4 + len && (r = recv(fd, chunk, sizeof(chunk), 0)) > 0 ) buf.append(chunk, r);
+    if ( r <= 0 || eoh == std::string::npos ) {
+      if ( benchRunning ) p->failed++;
+      close(fd);
+      fd = -1;
+      continue;
+    }
+
+    size_t tag = buf.find("ETag: \"");
+    bool keep = buf.find("Connection: keep-alive") < eoh;
+    if ( buf.compare(0, 12, "HTTP/1.1 304") == 0 ) {
+      p->notModified++;
+    }
+    else if ( buf.compare(0, 12, "HTTP/1.1 200") == 0 && tag < eoh && len > 2 ) {
+      const uint8_t* body = (const uint8_t*) buf.data() + eoh + 4;
+      uint64_t stamp;
+      uint32_t seq;
+      if ( frameTag(body, len, &stamp, &seq) ) {
+        p->latencyUs.push_back((uint32_t) (micros() - stamp));
+        if ( haveSeq && seq > lastSeq + 1 ) p->sequenceGaps += seq - lastSeq - 1;
+        lastSeq = seq;
+        haveSeq = true;
+      }
+      after = strtoul(buf.c_str() + tag + 7, NULL, 10);
+      p->frames++;
+    }
+    else {
+      p->failed++;
+    }
+    buf.erase(0, eoh + 4 + len);
+    if ( !keep ) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if ( fd >= 0 ) close(fd);
+  return NULL;
+}
+
+// ==== Websocket viewer: /ws, acking every frame after ackMs ====================================
+static void* viewerThread(void* aParam) {
+  benchViewer_t* v = (benchViewer_t*) aParam;
+  int fd = connectServer();
+  if ( fd < 0 ) return NULL;
+  //  Key and accept value of the example in RFC 6455 1.3
+  const char* req = "GET /ws HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                    "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n";
+  send(fd, req, strlen(req), MSG_NOSIGNAL);
+
+  std::string buf;
+  char chunk[16 * 1024];
+  ssize_t r;
+  size_t eoh;
+  while ( (eoh = buf.find("\r\n\r\n")) == std::string::npos && (r = recv(fd, chunk, sizeof(chunk), 0)) > 0 ) buf.append(chunk, r);
+  v->upgraded = eoh != std::string::npos && buf.compare(0, 12, "HTTP/1.1 101") == 0 &&
+                buf.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=") < eoh;
+  if ( !v->upgraded ) {
+    close(fd);
+    return NULL;
+  }
+  buf.erase(0, eoh + 4);
+
+  uint32_t last = 0;
+  while ( benchRunning ) {
+    //  Server frames are not masked: header, then the payload
+    const uint8_t* h = (const uint8_t*) buf.data();
+    size_t hl = 2, pl = 0;
+    if ( buf.size() >= 2 ) {
+      pl = h[1] & 0x7F;
+      if ( pl == 126 ) hl = 4;
+      if ( pl == 127 ) hl = 10;
+    }
+    if ( buf.size() >= hl && hl > 2 ) {
+      pl = 0;
+      for (size_t i = 2; i < hl; i++) pl = pl << 8 | h[i];
+    }
+    if ( buf.size() < hl || buf.size() < hl + pl ) {
+      r = recv(fd, chunk, sizeof(chunk), 0);
+      if ( r == 0 || (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) break;
+      if ( r > 0 ) buf.append(chunk, r);
+      continue;
+    }
+    unsigned long now = micros();
+    const uint8_t* p = h + hl;
+    if ( (h[0] & 0x0F) == WS_OP_BINARY && pl > WS_META_SIZE ) {
+      uint32_t fnm = 0;
+      uint64_t us = 0, stamp;
+      uint32_t seq;
+      for (int i = 0; i < 4; i++) fnm |= (uint32_t) p[i] << (8 * i);
+      for (int i = 0; i < 8; i++) us |= (uint64_t) p[4 + i] << (8 * i);
+      if ( frameTag(p + WS_META_SIZE, pl - WS_META_SIZE, &stamp, &seq) && stamp != us ) v->failed++;
+      if ( v->frames && fnm != last + 1 ) v->skipped += fnm - last - 1;
+      v->latencyUs.push_back((uint32_t) (now - us));
+      v->frames++;
+      last = fnm;
+      buf.erase(0, hl + pl);
+
+      //  "Render" the frame, then ack it: masked binary message with the frame number
+      if ( v->ackMs ) delay(v->ackMs);
+      uint8_t ack[10] = { 0x80 | WS_OP_BINARY, 0x80 | 4, 0x12, 0x34, 0x56, 0x78 };
+      for (int i = 0; i < 4; i++) ack[6 + i] = (uint8_t) (fnm >> (8 * i)) ^ ack[2 + i];
+      send(fd, ack, sizeof(ack), MSG_NOSIGNAL);
+    }
+    else {
+      buf.erase(0, hl + pl);
+    }
+  }
+  close(fd);
+  return NULL;
+}
+
+// ==== RTSP client: DESCRIBE, SETUP, PLAY, then RTP/JPEG over UDP or interleaved TCP ============
+//  Frames are put back together from their fragments and their scan is decoded
+static void rtpPacket(benchRtsp_t* aR, const uint8_t* aBuf, size_t aLen) {
+  if ( aLen < 12 + 8 || (aBuf[0] & 0xC0) != 0x80 || (aBuf[1] & 0x7F) != RTP_PT_JPEG ) {
+    aR->failed++;
+    return;
+  }
+  bool marker = aBuf[1] & 0x80;
+  uint16_t seq = (uint16_t) (aBuf[2] << 8 | aBuf[3]);
+  uint32_t ts = (uint32_t) aBuf[4] << 24 | (uint32_t) aBuf[5] << 16 | (uint32_t) aBuf[6] << 8 | aBuf[7];
+  if ( aR->packets && seq != (uint16_t) (aR->seq + 1) ) {
+    aR->lost += (uint16_t) (seq - aR->seq - 1);
+    aR->broken = true;
+  }
+  aR->seq = seq;
+  aR->packets++;
+
+  const uint8_t* p = aBuf + 12;
+  uint32_t off = (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+  jpegInfo_t& j = aR->jpg;
+  j.type = p[4];
+  j.width = p[6];
+  j.height = p[7];
+  uint8_t q = p[5];
+  p += 8;
+  if ( j.type >= 64 ) {
+    j.dri = (uint16_t) (p[0] << 8 | p[1]);
+    p += 4;
+  }
+  if ( off == 0 ) {
+    aR->frame.clear();
+    aR->broken = false;
+    aR->ts = ts;
+    if ( q >= 128 ) {
+      size_t qln = (size_t) (p[2] << 8 | p[3]);
+      if ( qln != 128 ) aR->failed++;
+      p += 4 + qln;
+    }
+  }
+  if ( p > aBuf + aLen ) {
+    aR->failed++;
+    return;
+  }
+  if ( off != aR->frame.size() || ts != aR->ts ) aR->broken = true;
+  aR->frame.insert(aR->frame.end(), p, aBuf + aLen);
+  if ( !marker || aR->broken ) return;
+
+  //  Capture to last packet, on the 90 kHz clock
+  struct timeval now;
+  unsigned long us = micros();
+  now.tv_sec = us / 1000000;
+  now.tv_usec = us % 1000000;
+  aR->latencyUs.push_back((uint32_t) ((uint64_t) (rtpTimestamp(&now) - ts) * 1000000 / RTP_CLOCK));
+  j.scan = aR->frame.data();
+  j.sln = aR->frame.size();
+  if ( jpegScanMcus(&j) > 0 ) aR->frames++;
+  else aR->failed++;
+  aR->frame.clear();
+}
+
+//  Interleaved packets in aBuf, then the response to the last request: its status, -1 on error
+static int rtspResponse(benchRtsp_t* aR, int aFd, std::string& aBuf, std::string& aRsp) {
+  char chunk[16 * 1024];
+  for (;;) {
+    if ( aBuf.size() >= 4 && aBuf[0] == '$' ) {
+      size_t len = (uint8_t) aBuf[2] << 8 | (uint8_t) aBuf[3];
+      if ( aBuf.size() >= 4 + len ) {
+        rtpPacket(aR, (const uint8_t*) aBuf.data() + 4, len);
+        aBuf.erase(0, 4 + len);
+        continue;
+      }
+    }
+    else if ( aBuf.size() >= 4 ) {
+      size_t eoh = aBuf.find("\r\n\r\n");
+      if ( eoh != std::string::npos ) {
+        size_t cl = aBuf.find("Content-Length: ");
+        size_t len = cl < eoh ? strtoul(aBuf.c_str() + cl + 16, NULL, 10) : 0;
+        if ( aBuf.size() >= eoh + 4 + len ) {
+          aRsp = aBuf.substr(0, eoh + 4 + len);
+          aBuf.erase(0, eoh + 4 + len);
+          return aRsp.compare(0, 9, "RTSP/1.0 ") == 0 ? atoi(aRsp.c_str() + 9) : -1;
+        }
+      }
+    }
+    ssize_t r = recv(aFd, chunk, sizeof(chunk), 0);
+    if ( r <= 0 ) return -1;
+    aBuf.append(chunk, r);
+  }
+}
+
+static int rtspRequest(benchRtsp_t* aR, int aFd, std::string& aBuf, std::string& aRsp, const char* aFmt, ...) {
+  char req[512];
+  va_list ap;
+  va_start(ap, aFmt);
+  int n = vsnprintf(req, sizeof(req), aFmt, ap);
+  va_end(ap);
+  send(aFd, req, n, MSG_NOSIGNAL);
+  return rtspResponse(aR, aFd, aBuf, aRsp);
+}
+
+//  Socket receiving a multicast group port (several receivers on one host all get the packets)
+static int groupSocket(const char* aGroup, int aPort) {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = inet_addr(aGroup);
+  addr.sin_port = htons(aPort);
+  bind(fd, (struct sockaddr*) &addr, sizeof(addr));
+  struct ip_mreq mreq;
+  mreq.imr_multiaddr.s_addr = inet_addr(aGroup);
+  mreq.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+  int rcvbuf = 1024 * 1024;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  return fd;
+}
+
+//  Packets of the group the parity packet covers: rebuilds a single missing one, then hands
+//  them, and any older ones still waiting, to rtpPacket in order
+static void parityPacket(benchRtsp_t* aR, const uint8_t* aBuf, size_t aLen) {
+  uint16_t base = (uint16_t) (aBuf[12] << 8 | aBuf[13]);
+  uint16_t count = (uint16_t) (aBuf[14] << 8 | aBuf[15]);
+  uint16_t lengths = (uint16_t) (aBuf[16] << 8 | aBuf[17]);
+  std::vector<std::string> group;
+  std::vector<std::string> later;
+  for (size_t i = 0; i < aR->pending.size(); i++) {
+    const std::string& p = aR->pending[i];
+    int16_t d = (int16_t) ((uint16_t) ((uint8_t) p[2] << 8 | (uint8_t) p[3]) - base);
+    if ( d < count ) group.push_back(p);
+    else later.push_back(p);
+  }
+  aR->pending.swap(later);
+
+  std::vector<bool> have(count, false);
+  size_t got = 0;
+  for (size_t i = 0; i < group.size(); i++) {
+    int16_t d = (int16_t) ((uint16_t) ((uint8_t) group[i][2] << 8 | (uint8_t) group[i][3]) - base);
+    if ( d >= 0 && !have[d] ) {
+      have[d] = true;
+      got++;
+    }
+  }
+  if ( got + 1 == count ) {
+    std::string rebuilt((const char*) aBuf + RTP_FEC_HEADER, aLen - RTP_FEC_HEADER);
+    uint16_t len = lengths;
+    for (size_t i = 0; i < group.size(); i++) {
+      const std::string& p = group[i];
+      if ( (int16_t) ((uint16_t) ((uint8_t) p[2] << 8 | (uint8_t) p[3]) - base) < 0 ) continue;
+      if ( p.size() > rebuilt.size() ) {
+        aR->failed++;
+        return;
+      }
+      for (size_t k = 0; k < p.size(); k++) rebuilt[k] ^= p[k];
+      len ^= (uint16_t) p.size();
+    }
+    if ( len <= rebuilt.size() ) {
+      rebuilt.resize(len);
+      group.push_back(rebuilt);
+      aR->recovered++;
+    }
+  }
+
+  //  In sequence order
+  std::vector<std::pair<int, size_t> > order;
+  for (size_t i = 0; i < group.size(); i++) {
+    order.push_back(std::make_pair((int) (int16_t) ((uint16_t) ((uint8_t) group[i][2] << 8 | (uint8_t) group[i][3]) - base), i));
+  }
+  std::sort(order.begin(), order.end());
+  for (size_t i = 0; i < order.size(); i++) {
+    const std::string& p = group[order[i].second];
+    rtpPacket(aR, (const uint8_t*) p.data(), p.size());
+  }
+}
+
+static void groupReceive(benchRtsp_t* aR, const char* aGroup, int aPort) {
+  int rtp = groupSocket(aGroup, aPort);
+  int par = groupSocket(aGroup, aPort + 2);
+  unsigned int seed = (unsigned int) (uintptr_t) aR;
+  uint8_t pkt[RTP_PACKET_MAX + 64];
+
+  while ( benchRunning ) {
+    fd_set rfds;
+    FD_ZERO(&rfds);
+    FD_SET(rtp, &rfds);
+    FD_SET(par, &rfds);
+    struct timeval tv = { 0, 200000 };
+    if ( select(std::max(rtp, par) + 1, &rfds, NULL, NULL, &tv) <= 0 ) continue;
+    for (;;) {
+      //  The packets of a group are sent before its parity: once the parity is in, so are they
+      ssize_t f = recv(par, pkt, sizeof(pkt), MSG_DONTWAIT);
+      uint8_t data[RTP_PACKET_MAX + 64];
+      ssize_t n;
+      while ( (n = recv(rtp, data, sizeof(data), MSG_DONTWAIT)) > 0 ) {
+        if ( (int) (rand_r(&seed) % 1000) < aR->lossPermille ) {
+          aR->thrown++;
+          continue;
+        }
+#if RTP_FEC_GROUP > 0
+        aR->pending.push_back(std::string((const char*) data, n));
+#else
+        rtpPacket(aR, data, n);
+#endif
+      }
+      if ( f <= 0 ) break;
+      if ( f < RTP_FEC_HEADER || (pkt[1] & 0x7F) != RTP_PT_FEC ) {
+        aR->failed++;
+        continue;
+      }
+      aR->parity++;
+      parityPacket(aR, pkt, f);
+    }
+  }
+  close(rtp);
+  close(par);
+}
+
+static void* rtspThread(void* aParam) {
+  benchRtsp_t* r = (benchRtsp_t*) aParam;
+  while ( rtspPort == 0 ) delay(1);
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(rtspPort);
+  struct timeval tv = { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  if ( connect(fd, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    close(fd);
+    return NULL;
+  }
+
+  //  RTP port pair of a UDP client
+  int udp = -1;
+  int port = 0;
+  if ( !r->tcp && !r->mcast ) {
+    udp = socket(AF_INET, SOCK_DGRAM, 0);
+    addr.sin_port = 0;
+    bind(udp, (struct sockaddr*) &addr, sizeof(addr));
+    socklen_t alen = sizeof(addr);
+    getsockname(udp, (struct sockaddr*) &addr, &alen);
+    port = ntohs(addr.sin_port);
+    int rcvbuf = 1024 * 1024;
+    setsockopt(udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    setsockopt(udp, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  }
+
+  std::string buf, rsp;
+  char url[64];
+  snprintf(url, sizeof(url), "rtsp://127.0.0.1:%d/mjpeg/1", (int) rtspPort);
+  bool ok = rtspRequest(r, fd, buf, rsp, "OPTIONS %s RTSP/1.0\r\nCSeq: 1\r\n\r\n", url) == 200 &&
+            rsp.find("DESCRIBE") != std::string::npos;
+  ok = ok && rtspRequest(r, fd, buf, rsp, "DESCRIBE %s RTSP/1.0\r\nCSeq: 2\r\nAccept: application/sdp\r\n\r\n", url) == 200 &&
+       rsp.find("m=video 0 RTP/AVP 26\r\n") != std::string::npos && rsp.find("a=control:track1") != std::string::npos &&
+       rsp.find("CSeq: 2\r\n") != std::string::npos;
+  char group[32] = "";
+  if ( ok && r->mcast ) {
+    //  The server picks the group and its ports
+    ok = rtspRequest(r, fd, buf, rsp, "SETUP %s/track1 RTSP/1.0\r\nCSeq: 3\r\nTransport: RTP/AVP;multicast\r\n\r\n", url) == 200 &&
+         rsp.find("destination=") != std::string::npos &&
+         sscanf(rsp.c_str() + rsp.find("destination="), "destination=%31[0-9.];port=%d", group, &port) == 2;
+  }
+  else if ( ok && r->tcp ) {
+    ok = rtspRequest(r, fd, buf, rsp, "SETUP %s/track1 RTSP/1.0\r\nCSeq: 3\r\nTransport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n\r\n", url) == 200 &&
+         rsp.find("interleaved=0-1") != std::string::npos;
+  }
+  else if ( ok ) {
+    ok = rtspRequest(r, fd, buf, rsp, "SETUP %s/track1 RTSP/1.0\r\nCSeq: 3\r\nTransport: RTP/AVP;unicast;client_port=%d-%d\r\n\r\n",
+                     url, port, port + 1) == 200 && rsp.find("server_port=") != std::string::npos;
+  }
+  size_t s = rsp.find("Session: ");
+  std::string session = ok && s != std::string::npos ? rsp.substr(s + 9, 8) : "";
+  ok = ok && rtspRequest(r, fd, buf, rsp, "PLAY %s RTSP/1.0\r\nCSeq: 4\r\nSession: %s\r\nRange: npt=0.000-\r\n\r\n",
+                         url, session.c_str()) == 200 && rsp.find("RTP-Info: ") != std::string::npos;
+  r->setup = ok;
+
+  char chunk[16 * 1024];
+  if ( ok && r->mcast ) groupReceive(r, group, port);
+  while ( ok && !r->mcast && benchRunning ) {
+    ssize_t n = recv(r->tcp ? fd : udp, chunk, sizeof(chunk), 0);
+    if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) break;
+    if ( n < 0 ) continue;
+    if ( !r->tcp ) {
+      rtpPacket(r, (const uint8_t*) chunk, n);
+      continue;
+    }
+    buf.append(chunk, n);
+    while ( buf.size() >= 4 && buf[0] == '$' ) {
+      size_t len = (uint8_t) buf[2] << 8 | (uint8_t) buf[3];
+      if ( buf.size() < 4 + len ) break;
+      rtpPacket(r, (const uint8_t*) buf.data() + 4, len);
+      buf.erase(0, 4 + len);
+    }
+  }
+  if ( ok ) {
+    r->teardown = rtspRequest(r, fd, buf, rsp, "TEARDOWN %s RTSP/1.0\r\nCSeq: 5\r\nSession: %s\r\n\r\n", url, session.c_str()) == 200;
+  }
+  if ( udp >= 0 ) close(udp);
+  close(fd);
+  return NULL;
+}
+
+// ==== /stats: fetched while the clients are connected, and checked ==========================
+//  Just enough JSON to check the response: numbers as double, objects as key / value lists
+typedef struct jsonValue {
+  char                    type;     // 'o'bject, 'a'rray, 's'tring, 'n'umber, 'b'oolean, 'z' null
+  double                  num;
+  std::string             str;
+  std::vector<std::pair<std::string, jsonValue> > members;
+  std::vector<jsonValue>  items;
+} jsonValue_t;
+
+static bool jsonParse(const char*& p, jsonValue_t& v, int aDepth = 0);
+
+static void jsonSpace(const char*& p) {
+  while ( *p == ' ' || *p == '\n' || *p == '\r' || *p == '\t' ) p++;
+}
+
+static bool jsonString(const char*& p, std::string& aStr) {
+  if ( *p++ != '"' ) return false;
+  while ( *p && *p != '"' ) {
+    if ( (unsigned char) *p < 0x20 ) return false;
+    if ( *p == '\\' ) {
+      p++;
+      if ( !strchr("\"\\/bfnrtu", *p) || *p == 0 ) return false;
+    }
+    aStr += *p++;
+  }
+  return *p++ == '"';
+}
+
+static bool jsonParse(const char*& p, jsonValue_t& v, int aDepth) {
+  if ( aDepth > 16 ) return false;
+  jsonSpace(p);
+  v.type = 0;
+  if ( *p == '{' || *p == '[' ) {
+    bool obj = *p++ == '{';
+    v.type = obj ? 'o' : 'a';
+    jsonSpace(p);
+    if ( *p == (obj ? '}' : ']') ) {
+      p++;
+      return true;
+    }
+    for (;;) {
+      jsonValue_t item;
+      std::string key;
+      if ( obj ) {
+        jsonSpace(p);
+        if ( !jsonString(p, key) ) return false;
+        jsonSpace(p);
+        if ( *p++ != ':' ) return false;
+      }
+      if ( !jsonParse(p, item, aDepth + 1) ) return false;
+      if ( obj ) v.members.push_back(std::make_pair(key, item));
+      else v.items.push_back(item);
+      jsonSpace(p);
+      if ( *p == ',' ) {
+        p++;
+        continue;
+      }
+      return *p++ == (obj ? '}' : ']');
+    }
+  }
+  if ( *p == '"' ) {
+    v.type = 's';
+    return jsonString(p, v.str);
+  }
+  if ( strncmp(p, "true", 4) == 0 || strncmp(p, "null", 4) == 0 ) {
+    v.type = *p == 't' ? 'b' : 'z';
+    p += 4;
+    return true;
+  }
+  if ( strncmp(p, "false", 5) == 0 ) {
+    v.type = 'b';
+    p += 5;
+    return true;
+  }
+  char* end;
+  v.num = strtod(p, &end);
+  if ( end == p || !(*p == '-' || (*p >= '0' && *p <= '9')) ) return false;
+  v.type = 'n';
+  p = end;
+  return true;
+}
+
+static const jsonValue_t* jsonGet(const jsonValue_t* aObj, const char* aKey) {
+  if ( aObj == NULL || aObj->type != 'o' ) return NULL;
+  for (size_t i = 0; i < aObj->members.size(); i++) {
+    if ( aObj->members[i].first == aKey ) return &aObj->members[i].second;
+  }
+  return NULL;
+}
+
+static double jsonNumber(const jsonValue_t* aObj, const char* aKey) {
+  const jsonValue_t* v = jsonGet(aObj, aKey);
+  return v && v->type == 'n' ? v->num : -1;
+}
+
+static bool fetchStats(const char* aPath, const char* aType, std::string& aBody) {
+  int fd = connectServer();
+  if ( fd < 0 ) return false;
+  char req[96];
+  int len = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", aPath);
+  send(fd, req, len, MSG_NOSIGNAL);
+  std::string rsp;
+  char chunk[4096];
+  ssize_t n;
+  while ( (n = recv(fd, chunk, sizeof(chunk), 0)) > 0 ) rsp.append(chunk, n);
+  close(fd);
+  size_t eoh = rsp.find("\r\n\r\n");
+  if ( rsp.compare(0, 12, "HTTP/1.1 200") != 0 || eoh == std::string::npos ||
+       rsp.find(std::string("Content-Type: ") + aType) == std::string::npos ) return false;
+  aBody = rsp.substr(eoh + 4);
+  return true;
+}
+
+//  /metrics, Prometheus text format: samples by name and labels, with their family's type
+typedef struct {
+  std::string             name;     // metric name, with _bucket, _sum, _count
+  std::string             labels;   // as sent, without the braces
+  double                  value;
+} promSample_t;
+
+static bool promName(const std::string& aName) {
+  if ( aName.empty() || !(isalpha((unsigned char) aName[0]) || aName[0] == '_' || aName[0] == ':') ) return false;
+  for (size_t i = 1; i < aName.size(); i++) {
+    if ( !(isalnum((unsigned char) aName[i]) || aName[i] == '_' || aName[i] == ':') ) return false;
+  }
+  return true;
+}
+
+//  Returns the number of lines that break the format, after checking every histogram
+static int promParse(const std::string& aBody, std::vector<promSample_t>& aSamples) {
+  std::vector<std::pair<std::string, std::string> > families;   // name, type
+  int bad = 0;
+  size_t pos = 0;
+  while ( pos < aBody.size() ) {
+    size_t eol = aBody.find('\n', pos);
+    if ( eol == std::string::npos ) {
+      bad++;    // the last line has to end too
+      break;
+    }
+    std::string line = aBody.substr(pos, eol - pos);
+    pos = eol + 1;
+    if ( line.empty() ) continue;
+    if ( line[0] == '#' ) {
+      char kw[8], name[96], type[16];
+      if ( sscanf(line.c_str(), "# %7s %95s %15s", kw, name, type) == 3 && strcmp(kw, "TYPE") == 0 ) {
+        for (size_t i = 0; i < families.size(); i++) if ( families[i].first == name ) bad++;
+        if ( strcmp(type, "counter") && strcmp(type, "gauge") && strcmp(type, "histogram") ) bad++;
+        families.push_back(std::make_pair(std::string(name), std::string(type)));
+      }
+      continue;
+    }
+    promSample_t smp;
+    size_t sp = line.find_first_of("{ ");
+    if ( sp == std::string::npos ) {
+      bad++;
+      continue;
+    }
+    smp.name = line.substr(0, sp);
+    size_t rest = sp;
+    if ( line[sp] == '{' ) {
+      size_t close = line.find("} ", sp);
+      if ( close == std::string::npos ) {
+        bad++;
+        continue;
+      }
+      smp.labels = line.substr(sp + 1, close - sp - 1);
+      rest = close + 1;
+    }
+    char* end;
+    smp.value = strtod(line.c_str() + rest + 1, &end);
+    if ( !promName(smp.name) || *end != 0 || end == line.c_str() + rest + 1 ) bad++;
+    //  The family, declared before its samples
+    std::string family;
+    for (size_t i = 0; i < families.size(); i++) {
+      const std::string& f = families[i].first;
+      if ( smp.name == f ) family = families[i].second;
+      if ( families[i].second == "histogram" && smp.name.compare(0, f.size(), f) == 0 ) {
+        std::string suffix = smp.name.substr(f.size());
+        if ( suffix == "_bucket" || suffix == "_sum" || suffix == "_count" ) family = "histogram";
+      }
+    }
+    if ( family.empty() || (family == "counter" && smp.value < 0) ) bad++;
+    aSamples.push_back(smp);
+  }
+
+  //  Histograms: buckets do not go down, and the +Inf one is the count
+  for (size_t i = 0; i < aSamples.size(); i++) {
+    const promSample_t& c = aSamples[i];
+    if ( c.name.size() < 6 || c.name.compare(c.name.size() - 6, 6, "_count") != 0 ) continue;
+    std::string base = c.name.substr(0, c.name.size() - 6);
+    double last = 0;
+    int buckets = 0;
+    bool inf = false;
+    for (size_t j = 0; j < aSamples.size(); j++) {
+      const promSample_t& b = aSamples[j];
+      if ( b.name != base + "_bucket" ) continue;
+      size_t le = b.labels.find("le=\"");
+      std::string others = le != std::string::npos ? b.labels.substr(0, le) : b.labels;
+      if ( !others.empty() && others[others.size() - 1] == ',' ) others.erase(others.size() - 1);
+      if ( others != c.labels ) continue;
+      if ( b.value < last ) bad++;
+      last = b.value;
+      buckets++;
+      inf = b.labels.find("le=\"+Inf\"") != std::string::npos;
+    }
+    if ( buckets < 2 || !inf || last != c.value ) bad++;
+  }
+  return bad;
+}
+
+static double promValue(const std::vector<promSample_t>& aSamples, const char* aName, const char* aLabels = "") {
+  for (size_t i = 0; i < aSamples.size(); i++) {
+    if ( aSamples[i].name == aName && aSamples[i].labels == aLabels ) return aSamples[i].value;
+  }
+  return -1;
+}
+
+static uint32_t percentile(std::vector<uint32_t>& aValues, int aPercent) {
+  if ( aValues.empty() ) return 0;
+  std::sort(aValues.begin(), aValues.end());
+  size_t i = (aValues.size() - 1) * aPercent / 100;
+  return aValues[i];
+}
+
+int main(int argc, char** argv) {
+  const char* dir = NULL;
+  int clients = 4;
+  int seconds = 5;
+  int sensorFps = 25;
+  int port = 0;
+  int minFrames = 0;
+  int logLevel = LOG_LEVEL_ERROR;
+  int slowClients = 0;
+  int minRejected = 0;
+  int lowFps = 0;
+  int lowFpsClients = 0;
+  int maxWakeups = 0;
+  int pollers = 0;
+  int pullers = 0;
+  int viewers = 0;
+  int ackMs = 0;
+  int rtspUdp = 0;
+  int rtspTcp = 0;
+  int rtspListen = -1;
+  int receivers = 0;
+  float lossPercent = 0;
+  int churners = 0;
+  int outageMs = 0;
+  const char* policy = NULL;
+  int limitKb = 0;
+  bool stats = false;
+  bool prom = false;
+
+  int opt;
+  while ( (opt = getopt(argc, argv, "d:c:t:s:p:m:v:l:r:H:b:f:w:j:a:W:R:P:M:C:B:L:O:SE")) != -1 ) {
+    switch ( opt ) {
+      case 'd': dir = optarg; break;
+      case 'c': clients = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 's': sensorFps = atoi(optarg); break;
+      case 'p': port = atoi(optarg); break;
+      case 'm': minFrames = atoi(optarg); break;
+      case 'v': logLevel = atoi(optarg); break;
+      case 'l': slowClients = atoi(optarg); break;
+      case 'r': minRejected = atoi(optarg); break;
+      case 'H': hostHeapSize = atoi(optarg) * 1024; break;
+      case 'b': admitBandwidth = atoi(optarg) * 1024; break;
+      case 'f': if ( sscanf(optarg, "%d:%d", &lowFps, &lowFpsClients) != 2 ) lowFpsClients = 0; break;
+      case 'w': maxWakeups = atoi(optarg); break;
+      case 'j': pollers = atoi(optarg); break;
+      case 'a': pullers = atoi(optarg); break;
+      case 'W': if ( sscanf(optarg, "%d:%d", &viewers, &ackMs) < 1 ) viewers = 0; break;
+      case 'R': if ( sscanf(optarg, "%d:%d", &rtspUdp, &rtspTcp) < 1 ) rtspUdp = 0; break;
+      case 'P': rtspListen = atoi(optarg); break;
+      case 'M': if ( sscanf(optarg, "%d:%f", &receivers, &lossPercent) < 1 ) receivers = 0; break;
+      case 'C': churners = atoi(optarg); break;
+      case 'O': outageMs = atoi(optarg); break;
+      case 'B': policy = optarg; break;
+      case 'L': limitKb = atoi(optarg); break;
+      case 'S': stats = true; break;
+      case 'E': prom = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-d jpeg_dir] [-c clients] [-t seconds] [-s sensor_fps] [-p port] [-m min_frames] [-v log_level] [-l slow_clients] [-r min_rejected] [-H heap_kb] [-b bandwidth_KBps] [-f fps:count] [-w max_wakeups_per_s] [-j snapshot_pollers] [-a pull_clients] [-W ws_viewers[:ack_ms]] [-R rtsp_udp[:rtsp_tcp]] [-P rtsp_port] [-M receivers[:loss_percent]] [-C churn_clients] [-B drop|pause|demote] [-L frame_memory_kb] [-S] [-E] [-O outage_ms]\n", argv[0]);
+        return 2;
+    }
+  }
+
+#if defined(CAMERA_ALL_FRAMES)
+  if ( policy ) {
+    if ( strcmp(policy, "pause") == 0 ) frameBackpressure = BACKPRESSURE_PAUSE;
+    else if ( strcmp(policy, "demote") == 0 ) frameBackpressure = BACKPRESSURE_DEMOTE;
+    else frameBackpressure = BACKPRESSURE_DROP_OLDEST;
+  }
+  if ( limitKb ) frameMemoryLimit = limitKb * KILOBYTE;
+#else
+  if ( policy || limitKb ) fprintf(stderr, "-B and -L only apply to the all-frames mode\n");
+#endif
+
+  Log.begin(logLevel);
+  DirectorySource source(dir, sensorFps);
+  frameSource = &source;
+
+  xTaskCreatePinnedToCore(mjpegCB, "mjpeg", 3 * KILOBYTE, (void*) (intptr_t) port, tskIDLE_PRIORITY + 2, &tMjpeg, PRO_CPU);
+  while ( serverPort == 0 ) delay(1);
+  if ( rtspUdp || rtspTcp || receivers || rtspListen >= 0 ) {
+    //  Benchmarks running side by side must not receive each other's group
+    rtspGroupPort = 20000 + (getpid() % 10000) * 4;
+    xTaskCreatePinnedToCore(rtspCB, "rtsp", 4 * KILOBYTE, (void*) (intptr_t) (rtspListen > 0 ? rtspListen : 0),
+                            tskIDLE_PRIORITY + 2, &tRtsp, PRO_CPU);
+    while ( rtspPort == 0 ) delay(1);
+    printf("rtsp      : rtsp://127.0.0.1:%d%s\n", (int) rtspPort, STREAMING_URL);
+  }
+
+  printf("mode      : %s, FPS=%d, sensor=%d fps, %d frames (max %d bytes), %d clients, %d s\n",
+         MODE_NAME, FPS, sensorFps, (int) source.frames(), (int) source.maxFrameSize(), clients, seconds);
+
+  //  The camera goes idle without clients, and fails once they come
+  uint64_t outageCpu = 0;
+  unsigned long outageStart = 0;
+  if ( outageMs ) {
+    for (int i = 0; i < 2000 && eTaskGetState(tCam) != eSuspended; i++) delay(1);
+    source.stall(outageMs);
+    outageCpu = cpuUs();
+    outageStart = micros();
+  }
+
+  std::vector<benchClient_t> c(clients);
+  for (int i = 0; i < clients; i++) {
+    c[i].id = i;
+    c[i].slow = i < slowClients;
+    c[i].rejected = false;
+    c[i].fps = i >= clients - lowFpsClients ? lowFps : 0;
+    c[i].frames = 0;
+    c[i].bytes = 0;
+    c[i].firstFrameUs = 0;
+    c[i].sequenceGaps = 0;
+    c[i].segments = 0;
+    pthread_create(&c[i].thread, NULL, clientThread, &c[i]);
+  }
+  //  Without streaming clients the pollers find the camera idle: their first request starts it
+  for (int i = 0; clients == 0 && i < 1000 && eTaskGetState(tCam) != eSuspended; i++) delay(1);
+  std::vector<benchPoller_t> sp(pollers);
+  for (int i = 0; i < pollers; i++) {
+    memset(&sp[i], 0, sizeof(benchPoller_t));
+    pthread_create(&sp[i].thread, NULL, pollerThread, &sp[i]);
+  }
+  std::vector<benchPuller_t> pc(pullers);
+  for (int i = 0; i < pullers; i++) pthread_create(&pc[i].thread, NULL, pullerThread, &pc[i]);
+  std::vector<benchViewer_t> wv(viewers);
+  for (int i = 0; i < viewers; i++) {
+    wv[i].ackMs = ackMs;
+    pthread_create(&wv[i].thread, NULL, viewerThread, &wv[i]);
+  }
+  int rtspClients = rtspUdp + rtspTcp + receivers;
+  std::vector<benchRtsp_t> rs(rtspClients);
+  for (int i = 0; i < rtspClients; i++) {
+    rs[i].tcp = i >= rtspUdp && i < rtspUdp + rtspTcp;
+    rs[i].mcast = i >= rtspUdp + rtspTcp;
+    rs[i].lossPermille = rs[i].mcast ? (int) (lossPercent * 10) : 0;
+    pthread_create(&rs[i].thread, NULL, rtspThread, &rs[i]);
+  }
+  std::vector<benchChurner_t> ch(churners);
+  for (int i = 0; i < churners; i++) {
+    memset(&ch[i], 0, sizeof(benchChurner_t));
+    pthread_create(&ch[i].thread, NULL, churnerThread, &ch[i]);
+  }
+#if defined(CAMERA_ALL_FRAMES)
+  pthread_t arenaSampler;
+  pthread_create(&arenaSampler, NULL, arenaThread, NULL);
+#endif
+  double outagePct = 0;
+  if ( outageMs ) {
+    delay(outageMs * 9 / 10);
+    outagePct = (cpuUs() - outageCpu) * 100.0 / (micros() - outageStart);
+  }
+  //  Context switches are counted once the clients are being served, and before they leave
+  delay(seconds * 100);
+  taskSwitches_t switchStart = taskSwitches();
+  unsigned long switchTime = micros();
+  delay(seconds * 800);
+  taskSwitches_t switchEnd = taskSwitches();
+  double switchSeconds = (micros() - switchTime) / 1e6;
+  std::string statsBody;
+  bool statsFetched = stats && fetchStats("/stats", "application/json", statsBody);
+  //  Stands in for the driver logging a JPEG that did not fit, which the host never does
+  if ( prom ) metricsDriverEvent(DRIVER_FB_OVF);
+  std::string promBody;
+  bool promFetched = prom && fetchStats("/metrics", METRICS_CONTENT_TYPE, promBody);
+  uint32_t statsCaptured = captureStats.count;
+  delay(seconds * 100);
+  benchRunning = false;
+  for (int i = 0; i < clients; i++) pthread_join(c[i].thread, NULL);
+  for (int i = 0; i < pollers; i++) pthread_join(sp[i].thread, NULL);
+  for (int i = 0; i < pullers; i++) pthread_join(pc[i].thread, NULL);
+  for (int i = 0; i < viewers; i++) pthread_join(wv[i].thread, NULL);
+  for (int i = 0; i < rtspClients; i++) pthread_join(rs[i].thread, NULL);
+  for (int i = 0; i < churners; i++) pthread_join(ch[i].thread, NULL);
+#if defined(CAMERA_ALL_FRAMES)
+  pthread_join(arenaSampler, NULL);
+#endif
+
+  int rc = 0;
+  int rejected = 0;
+  uint64_t totalBytes = 0;
+  uint32_t totalFrames = 0;
+  uint32_t totalSegments = 0;
+  std::vector<uint32_t> all;
+  printf("client  frames    fps    KB/s  first(ms)  skipped  lat50(ms)  lat99(ms)  latmax(ms)\n");
+  for (int i = 0; i < clients; i++) {
+    std::vector<uint32_t>& l = c[i].latencyUs;
+    all.insert(all.end(), l.begin(), l.end());
+    totalBytes += c[i].bytes;
+    totalFrames += c[i].frames;
+    totalSegments += c[i].segments;
+    printf("%5d%c  %6u  %5.1f  %6.0f  %9.1f  %7u  %9.2f  %9.2f  %10.2f\n", i, c[i].rejected ? '-' : c[i].slow ? '*' : c[i].fps ? '/' : ' ', c[i].frames,
+           (float) c[i].frames / seconds, (float) c[i].bytes / 1024 / seconds, c[i].firstFrameUs / 1000.0,
+           c[i].sequenceGaps, percentile(l, 50) / 1000.0, percentile(l, 99) / 1000.0, percentile(l, 100) / 1000.0);
+    if ( c[i].rejected ) rejected++;
+    else if ( c[i].fps ) {
+      if ( c[i].frames < 0.7 * c[i].fps * seconds || c[i].frames > 1.3 * c[i].fps * seconds + 2 ) rc = 1;
+    }
+    else if ( !c[i].slow && (int) c[i].frames < minFrames ) rc = 1;
+  }
+  printf("total   %6u  %5.1f  %6.0f  %9s  %7s  %9.2f  %9.2f  %10.2f\n", totalFrames, (float) totalFrames / seconds,
+         (float) totalBytes / 1024 / seconds, "", "", percentile(all, 50) / 1000.0, percentile(all, 99) / 1000.0,
+         percentile(all, 100) / 1000.0);
+  if ( captureStats.count > 1 ) {
+    double n = captureStats.count - 1;
+    double avg = captureStats.sum / n;
+    double var = captureStats.sumSq / n - avg * avg;
+    printf("capture   : %u frames, interval avg %.2f ms, stddev %.2f ms, max %.2f ms, %u ring misses (%d slots)\n",
+           (unsigned) captureStats.count, avg / 1000, sqrt(var > 0 ? var : 0) / 1000, captureStats.maxGap / 1000.0,
+           (unsigned) frameRingMisses, CAPTURE_SLOTS);
+    printf("            %u frames sent from the camera buffer, %u copied (%d camera buffers)\n",
+           (unsigned) frameLends, (unsigned) frameCopies, source.buffers());
+  }
+#if !defined(CAMERA_ALL_FRAMES)
+  printf("pool      : %u KB set aside, up to %u KB in use, %u%% of it not asked for, %u from the heap (%u failed)\n",
+         (unsigned) (framePool.size / 1024), (unsigned) (framePool.highWater / 1024), poolWaste(),
+         (unsigned) framePool.fallbacks, (unsigned) framePool.failures);
+  for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+    poolClass_t* pc = &framePool.classes[i];
+    printf("            %6u bytes x %2u in %-5s: up to %2u in use, %6u handed out, %u times taken\n", (unsigned) pc->size,
+           pc->count, pc->psram ? "PSRAM" : "DRAM", pc->highWater, (unsigned) pc->allocs, (unsigned) pc->misses);
+  }
+  //  The pool is sized for the frames of the JPEG source: only readers holding on to frames
+  //  (slow clients, or clients hanging up) may need more buffers than it has
+  if ( framePool.failures ) rc = 1;
+  if ( slowClients == 0 && churners == 0 && framePool.fallbacks ) rc = 1;
+#endif
+  //  Nobody wants the full rate: the camera has to slow down as well
+  if ( lowFpsClients && lowFpsClients >= clients && captureStats.count > 1.3 * lowFps * seconds + 3 ) rc = 1;
+  printf("admission : %u accepted, %d rejected (clients %u, heap %u, psram %u, bandwidth %u), %u KB/s measured\n",
+         (unsigned) admitStats.accepted, rejected, (unsigned) admitStats.rejected[ADMIT_CLIENTS],
+         (unsigned) admitStats.rejected[ADMIT_HEAP], (unsigned) admitStats.rejected[ADMIT_PSRAM],
+         (unsigned) admitStats.rejected[ADMIT_BANDWIDTH_LIMIT], (unsigned) admitStats.bandwidth / 1024);
+  if ( rejected < minRejected ) rc = 1;
+  if ( pollers ) {
+    benchPoller_t t;
+    memset(&t, 0, sizeof(t));
+    for (int i = 0; i < pollers; i++) {
+      t.requests += sp[i].requests;
+      t.frames += sp[i].frames;
+      t.notModified += sp[i].notModified;
+      t.failed += sp[i].failed;
+      t.requestUs += sp[i].requestUs;
+      if ( sp[i].firstFrameUs > t.firstFrameUs ) t.firstFrameUs = sp[i].firstFrameUs;
+      if ( sp[i].frames == 0 || sp[i].notModified == 0 ) rc = 1;
+    }
+    printf("snapshot  : %u requests, %u frames (200), %u not modified (304), %u failed, first frame %.1f ms, %.2f ms per request\n",
+           t.requests, t.frames, t.notModified, t.failed, t.firstFrameUs / 1000.0,
+           t.requests ? t.requestUs / 1000.0 / t.requests : 0);
+    if ( t.failed ) rc = 1;
+  }
+  for (int i = 0; i < pullers; i++) {
+    std::vector<uint32_t>& l = pc[i].latencyUs;
+    printf("pull %3d  : %u frames (%.1f fps), %u skipped, %u not modified (304), %u failed, %u connections, latency p50 %.2f ms, p99 %.2f ms\n",
+           i, pc[i].frames, (float) pc[i].frames / seconds, pc[i].sequenceGaps, pc[i].notModified, pc[i].failed,
+           pc[i].connections, percentile(l, 50) / 1000.0, percentile(l, 99) / 1000.0);
+    if ( pc[i].frames < 0.7 * FPS * seconds || pc[i].failed || pc[i].connections != 1 ) rc = 1;
+  }
+  for (int i = 0; i < viewers; i++) {
+    std::vector<uint32_t>& l = wv[i].latencyUs;
+    printf("ws   %3d  : %u frames (%.1f fps), %u skipped, %u failed, ack after %d ms, latency p50 %.2f ms, p99 %.2f ms%s\n",
+           i, wv[i].frames, (float) wv[i].frames / seconds, wv[i].skipped, wv[i].failed, wv[i].ackMs,
+           percentile(l, 50) / 1000.0, percentile(l, 99) / 1000.0, wv[i].upgraded ? "" : ", upgrade failed");
+    if ( !wv[i].upgraded || wv[i].failed ) rc = 1;
+    //  A viewer that keeps up gets (nearly) every frame. One that does not is skipped frames,
+    //  and what it gets is never older than the frames it still has to ack
+    if ( ackMs == 0 && wv[i].frames < 0.7 * FPS * seconds ) rc = 1;
+    if ( ackMs && (wv[i].skipped == 0 || percentile(l, 99) > (uint32_t) (WS_WINDOW + 1) * ackMs * 1000) ) rc = 1;
+  }
+  if ( viewers ) {
+    printf("websocket : %u frames sent, %u skipped for viewers behind, %u acks\n",
+           (unsigned) wsStats.frames, (unsigned) wsStats.skipped, (unsigned) wsStats.acks);
+  }
+  for (int i = 0; i < rtspClients; i++) {
+    std::vector<uint32_t>& l = rs[i].latencyUs;
+    printf("rtsp %3d  : %s, %u frames (%.1f fps), %u packets, %u lost, %u failed, latency p50 %.2f ms, p99 %.2f ms%s%s\n",
+           i, rs[i].mcast ? "multicast" : rs[i].tcp ? "tcp" : "udp", rs[i].frames, (float) rs[i].frames / seconds, rs[i].packets, rs[i].lost,
+           rs[i].failed, percentile(l, 50) / 1000.0, percentile(l, 99) / 1000.0, rs[i].setup ? "" : ", setup failed",
+           rs[i].teardown ? "" : ", teardown failed");
+    if ( !rs[i].setup || !rs[i].teardown || rs[i].failed || rs[i].frames < 0.7 * FPS * seconds ) rc = 1;
+    if ( rs[i].mcast ) {
+      printf("            %u packets thrown away, %u rebuilt from %u parity packets\n",
+             rs[i].thrown, rs[i].recovered, rs[i].parity);
+      if ( rs[i].thrown && !rs[i].recovered ) rc = 1;
+    }
+  }
+  if ( rtspClients ) {
+    printf("rtsp      : %u sessions, %u frames, %u packets sent, %u skipped, %u dropped\n",
+           (unsigned) rtspStats.sessions, (unsigned) rtspStats.frames, (unsigned) rtspStats.packets,
+           (unsigned) rtspStats.skipped, (unsigned) rtspStats.dropped);
+  }
+  if ( receivers ) {
+    //  However many receivers: every frame once
+    printf("multicast : %u frames, %u packets and %u parity packets sent to the group (%d receivers)\n",
+           (unsigned) rtspStats.groupFrames, (unsigned) rtspStats.groupPackets, (unsigned) rtspStats.fecPackets, receivers);
+    if ( rtspStats.groupFrames > captureStats.count ) rc = 1;
+  }
+  if ( churners ) {
+    benchChurner_t t;
+    memset(&t, 0, sizeof(t));
+    for (int i = 0; i < churners; i++) {
+      t.connections += ch[i].connections;
+      t.rejected += ch[i].rejected;
+      t.bytes += ch[i].bytes;
+    }
+    printf("churn     : %u connections (%.1f/s), %u rejected, %.0f KB/s\n", t.connections,
+           (float) t.connections / seconds, t.rejected, (float) t.bytes / 1024 / seconds);
+    if ( t.connections <= t.rejected ) rc = 1;
+  }
+#if defined(CAMERA_ALL_FRAMES)
+  printf("arena     : %u frames held at most, high water %u of %u KB, %u wraps, %u frames did not fit\n",
+         arenaMaxFrames, (unsigned) (frameArena.highWater / KILOBYTE), (unsigned) (frameArena.size / KILOBYTE),
+         frameArena.wraps, frameArena.fails);
+  //  Clients coming and going must not leave frames behind: without slow clients nobody holds
+  //  on to more than a second of frames
+  if ( churners && slowClients == 0 && arenaMaxFrames > FPS ) rc = 1;
+  printf("backpress : %s, %u KB for frames, at most %u KB held; %u laggards, %u demoted, %u frames skipped, %u not captured, %u lost\n",
+         backpressureName(frameBackpressure), (unsigned) (frameMemoryLimit / KILOBYTE), (unsigned) (arenaMaxUsed / KILOBYTE),
+         backpressureStats.laggards, backpressureStats.demoted, (unsigned) backpressureStats.skipped,
+         backpressureStats.paused, backpressureStats.full);
+  if ( policy || limitKb ) {
+    //  The policy has to have kicked in for the slow clients, and memory stays bounded: pausing never
+    //  goes over the limit; skipping and demoting only by the frames captured while a slow client
+    //  sends the frame it is at, which takes it about a second at SLOW_CLIENT_KBPS
+    size_t bound = frameMemoryLimit;
+    if ( frameBackpressure != BACKPRESSURE_PAUSE ) {
+      size_t frame = source.maxFrameSize() + sizeof(frameChunck_t);
+      bound += (source.maxFrameSize() / (SLOW_CLIENT_KBPS * 1024) + 1) * FPS * frame;
+    }
+    if ( arenaMaxUsed > bound ) rc = 1;
+    uint32_t kicked = frameBackpressure == BACKPRESSURE_PAUSE ? backpressureStats.paused :
+                      frameBackpressure == BACKPRESSURE_DEMOTE ? backpressureStats.demoted : backpressureStats.laggards;
+    if ( slowClients && kicked == 0 ) rc = 1;
+  }
+#endif
+  if ( stats ) {
+    //  A stream per client and viewer still connected, that has sent frames, not more than were captured
+    //  by then nor more than its client received (all of them, the slow ones aside: give them a frame in flight)
+    jsonValue_t root;
+    const char* p = statsBody.c_str();
+    bool valid = statsFetched && jsonParse(p, root) && root.type == 'o';
+    jsonSpace(p);
+    valid = valid && *p == 0;
+    const jsonValue_t* streams = jsonGet(&root, "streams");
+    const jsonValue_t* capture = jsonGet(&root, "capture");
+    const jsonValue_t* memory = jsonGet(&root, "memory");
+    const jsonValue_t* bounds = jsonGet(&root, "latency_bounds_us");
+    size_t latencyBuckets = bounds && bounds->type == 'a' ? bounds->items.size() + 1 : 0;
+    int mjpeg = 0, ws = 0, bad = 0;
+    double sent = 0, latency = 0;
+    for (size_t i = 0; valid && streams && i < streams->items.size(); i++) {
+      const jsonValue_t* st = &streams->items[i];
+      const jsonValue_t* type = jsonGet(st, "type");
+      double frames = jsonNumber(st, "frames");
+      if ( type && type->str == "mjpeg" ) {
+        mjpeg++;
+        sent += frames;
+      }
+      else if ( type && type->str == "websocket" ) ws++;
+      if ( frames <= 0 || jsonNumber(st, "bytes") < frames || frames > statsCaptured || jsonNumber(st, "send_avg_us") < 0 ) bad++;
+      //  Every frame played back is stamped: all of them are in the latency histograms, the first
+      //  byte goes out before the last, and the percentiles are in order
+      const jsonValue_t* fb = jsonGet(st, "first_byte_us");
+      const jsonValue_t* lb = jsonGet(st, "last_byte_us");
+      const jsonValue_t* buckets = jsonGet(lb, "buckets");
+      double counted = 0;
+      for (size_t b = 0; buckets && b < buckets->items.size(); b++) counted += buckets->items[b].num;
+      double timed = jsonNumber(st, "timed");
+      if ( timed != frames || counted != timed || buckets == NULL || buckets->items.size() != latencyBuckets ) bad++;
+      if ( jsonNumber(fb, "avg") > jsonNumber(lb, "avg") || jsonNumber(lb, "p50") <= 0 ||
+           jsonNumber(lb, "p50") > jsonNumber(lb, "p99") || jsonNumber(lb, "p99") > jsonNumber(st, "latency_max_us") ) bad++;
+      if ( type && type->str == "mjpeg" ) latency += jsonNumber(lb, "avg") * frames;
+    }
+    double captured = jsonNumber(capture, "frames");
+    printf("stats     : %zu bytes%s, %d MJPEG streams sent %.0f frames (capture to last byte %.2f ms avg), %d websocket viewers, "
+           "capture %.0f frames, %.0f us avg, heap %.0f KB free\n",
+           statsBody.size(), valid ? "" : " NOT VALID JSON", mjpeg, sent, sent ? latency / sent / 1000 : 0, ws, captured,
+           jsonNumber(capture, "time_avg_us"), jsonNumber(memory, "heap_free") / 1024);
+    if ( !valid || streams == NULL || streams->type != 'a' || latencyBuckets == 0 || bad ) rc = 1;
+    if ( mjpeg != clients - rejected || ws != viewers ) rc = 1;
+    if ( captured <= 0 || captured > statsCaptured || jsonNumber(capture, "time_avg_us") <= 0 || jsonNumber(memory, "heap_free") <= 0 ) rc = 1;
+    if ( sent > totalFrames + clients ) rc = 1;
+  }
+  if ( prom ) {
+    //  Well formed, and the counters agree with the clients: the stream frames sent by then are
+    //  no more than the clients received, the capture histograms count every frame captured
+    std::vector<promSample_t> smp;
+    int bad = promFetched ? promParse(promBody, smp) : 1;
+    double captured = promValue(smp, "esp32cam_capture_frames_total");
+    double timed = promValue(smp, "esp32cam_capture_duration_seconds_count");
+    double sizes = promValue(smp, "esp32cam_frame_size_bytes_count");
+    double sent = promValue(smp, "esp32cam_sent_frames_total", "type=\"mjpeg\"");
+    double timedSends = promValue(smp, "esp32cam_send_duration_seconds_count", "type=\"mjpeg\"");
+    double streams = promValue(smp, "esp32cam_clients", "type=\"mjpeg\"");
+    double wsSent = promValue(smp, "esp32cam_sent_frames_total", "type=\"websocket\"");
+    double events = promValue(smp, "esp32cam_driver_events_total", "event=\"FB-OVF\"");
+    double noEoi = promValue(smp, "esp32cam_driver_events_total", "event=\"NO-EOI\"");
+    double firstBytes = promValue(smp, "esp32cam_capture_to_first_byte_seconds_count", "type=\"mjpeg\"");
+    double lastBytes = promValue(smp, "esp32cam_capture_to_last_byte_seconds_count", "type=\"mjpeg\"");
+    double lastSum = promValue(smp, "esp32cam_capture_to_last_byte_seconds_sum", "type=\"mjpeg\"");
+    printf("metrics   : %zu bytes, %zu samples, %d malformed; %.0f frames captured, %.0f sent to %.0f MJPEG streams "
+           "(capture to last byte %.2f ms avg), %.0f to viewers\n",
+           promBody.size(), smp.size(), bad, captured, sent, streams, lastBytes > 0 ? lastSum / lastBytes * 1000 : 0, wsSent);
+    if ( bad || smp.empty() ) rc = 1;
+    //  Capture goes on while /metrics is rendered: a frame may come in between two of its lines
+    if ( captured <= 0 || captured > statsCaptured || fabs(timed - captured) > 1 || fabs(sizes - captured) > 1 ) rc = 1;
+    if ( sent <= 0 || sent > totalFrames + clients || timedSends < sent || timedSends > sent + clients ) rc = 1;
+    //  Every frame sent was stamped at capture
+    if ( lastBytes < sent || lastBytes > sent + clients || fabs(firstBytes - lastBytes) > clients || lastSum <= 0 ) rc = 1;
+    if ( streams != clients - rejected || (viewers && wsSent <= 0) || events != 1 || noEoi != 0 ) rc = 1;
+  }
+  if ( totalFrames ) {
+    printf("per frame : %.2f send calls, %.2f TCP segments\n", (float) sinkSendCalls / totalFrames,
+           (float) totalSegments / totalFrames);
+  }
+  double wakeups = (switchEnd.voluntary - switchStart.voluntary) / switchSeconds;
+  printf("tasks     : %.0f context switches/s, %.0f wakeups/s (voluntary), %.0f preempted/s\n",
+         (switchEnd.voluntary + switchEnd.preempted - switchStart.voluntary - switchStart.preempted) / switchSeconds,
+         wakeups, (switchEnd.preempted - switchStart.preempted) / switchSeconds);
+  if ( maxWakeups && wakeups > maxWakeups ) rc = 1;
+  if ( outageMs ) {
+    printf("outage    : %d ms without frames, %.0f%% CPU\n", outageMs, outagePct);
+    if ( outagePct > OUTAGE_CPU_PCT ) rc = 1;
+  }
+  fflush(stdout);
+
+  //  Streaming tasks never terminate - leave without running static destructors under them
+  _exit(rc);
+}
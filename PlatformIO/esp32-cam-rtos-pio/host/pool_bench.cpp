@@ -0,0 +1,226 @@
+//  Benchmark of the frame memory of the queue and task modes: frameAlloc() and frameUnref()
+//  (src/frame.cpp) with the frame pool (src/framepool.cpp) against the same code taking every
+//  buffer from the heap, as it did before.
+//
+//  usage: pool_bench [-n frames] [-r readers] [-w width] [-h height] [-s frame_kb] [-z seed]
+//
+//  Both run the same sequence of frames: sizes vary around -s, with an occasional frame twice as
+//  large. Every reader holds on to the frame it is sending for 0 to 3 frames and now and then
+//  stalls for a while, so that the capture ring runs out of slots and frames need buffers of
+//  their own, as with slow clients.
+//  Reported: time per frame, buffers that had to come from the heap, and how fragmented memory
+//  gets: the bytes of pool buffers not asked for, and the free bytes held inside the heap
+//  (glibc mallinfo2, not the ESP32 heap, but it shows the trend).
+//  Every frame is stamped with its number, which readers and the last reference check. Exit code
+//  is non-zero if a stamp did not match, a frame was left over, or the pool took from the heap
+//  for a frame one of its classes is there for with no reader stalling.
+
+#include "streaming.h"
+#include "framepool.h"
+
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <time.h>
+
+#include <vector>
+
+typedef struct {
+  frame_t*  frame;    // frame being sent, NULL if none
+  uint32_t  hold;     // frames to go until it is sent
+  uint32_t  stall;    // frames this reader still does not take a new frame
+} reader_t;
+
+typedef struct {
+  double    seconds;
+  uint32_t  reads;
+  uint32_t  bad;        // stamps that did not match
+  uint32_t  misses;     // frames that found no free capture slot
+  uint32_t  heap;       // pool: buffers that had to come from the heap
+  uint32_t  heapSteady; // pool: of those, with no reader stalling, for frames a class is there for
+  uint32_t  stalled;    // frames captured with a reader stalling
+  size_t    maxHeld;    // most bytes the heap held
+  size_t    maxFree;    // most free bytes inside the heap
+} result_t;
+
+static uint32_t rng;
+static uint32_t random32() {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void stamp(frame_t* f, uint32_t aFnm) {
+  f->fnm = aFnm;
+  memcpy(f->dat, &aFnm, sizeof(aFnm));
+  memcpy(f->dat + f->siz - sizeof(aFnm), &aFnm, sizeof(aFnm));
+}
+
+static bool stamped(const frame_t* f) {
+  uint32_t a, b;
+  memcpy(&a, f->dat, sizeof(a));
+  memcpy(&b, f->dat + f->siz - sizeof(b), sizeof(b));
+  return a == f->fnm && b == f->fnm;
+}
+
+static void heapSample(result_t* r) {
+#if defined(__GLIBC__)
+  struct mallinfo2 mi = mallinfo2();
+  size_t held = mi.arena + mi.hblkhd;
+  if ( held > r->maxHeld ) r->maxHeld = held;
+  if ( mi.fordblks > r->maxFree ) r->maxFree = mi.fordblks;
+#endif
+}
+
+static void release(reader_t* aReader, result_t* r) {
+  if ( aReader->frame == NULL ) return;
+  if ( !stamped(aReader->frame) ) r->bad++;
+  frameUnref( aReader->frame );
+  aReader->frame = NULL;
+}
+
+static result_t run(uint32_t aFrames, int aReaders, size_t aFrameSize, uint32_t aSeed) {
+  result_t r;
+  memset(&r, 0, sizeof(r));
+  std::vector<reader_t> readers(aReaders);
+  for (int i = 0; i < aReaders; i++) memset(&readers[i], 0, sizeof(reader_t));
+  uint32_t misses = frameRingMisses;
+  uint32_t fallbacks = framePool.fallbacks;
+
+  rng = aSeed;
+  double start = now();
+  frame_t* cur = NULL;
+  bool stalling = false;
+
+  for (uint32_t fnm = 0; fnm < aFrames; fnm++) {
+    size_t siz = aFrameSize / 2 + random32() % aFrameSize;
+    if ( random32() % 50 == 0 ) siz *= 2;
+
+    uint32_t before = framePool.fallbacks;
+    frame_t* f = frameAlloc(siz);
+    if ( f == NULL ) {
+      fprintf(stderr, "out of memory at frame %u\n", fnm);
+      exit(2);
+    }
+    size_t largest = framePool.classes[FRAME_POOL_CLASSES - 1].size;
+    if ( framePool.fallbacks != before && !stalling && sizeof(frame_t) + siz <= largest ) r.heapSteady++;
+    stamp(f, fnm);
+    frameUnref( cur );
+    cur = f;
+
+    //  Readers: done with their frame after 0 to 3 frames, and a stall of up to 100 frames every thousand or so
+    for (int i = 0; i < aReaders; i++) {
+      reader_t* rd = &readers[i];
+      if ( rd->stall ) {
+        rd->stall--;
+        continue;
+      }
+      if ( rd->frame && rd->hold-- > 0 ) continue;
+      release(rd, &r);
+      if ( random32() % 1000 == 0 ) rd->stall = random32() % 100;
+      rd->frame = frameRef(cur);
+      rd->hold = random32() % 4;
+      r.reads++;
+    }
+    //  A stalling reader holds on to a frame longer than the others ever do
+    stalling = false;
+    for (int i = 0; i < aReaders; i++) {
+      if ( readers[i].frame && fnm - readers[i].frame->fnm > 4 ) stalling = true;
+    }
+    if ( stalling ) r.stalled++;
+    if ( fnm % 4096 == 0 ) heapSample(&r);
+  }
+
+  for (int i = 0; i < aReaders; i++) release(&readers[i], &r);
+  frameUnref( cur );
+  r.seconds = now() - start;
+  heapSample(&r);
+  r.misses = frameRingMisses - misses;
+  r.heap = framePool.fallbacks - fallbacks;
+  if ( framesAllocated.load() != 0 ) {
+    fprintf(stderr, "%u frames left over\n", (unsigned) framesAllocated.load());
+    r.bad++;
+  }
+  return r;
+}
+
+int main(int argc, char** argv) {
+  uint32_t frames = 1000000;
+  int      readers = 4;
+  int      width = 640;
+  int      height = 480;
+  size_t   frameKb = 30;
+  uint32_t seed = 2463534242u;
+
+  int opt;
+  while ( (opt = getopt(argc, argv, "n:r:w:h:s:z:")) != -1 ) {
+    switch ( opt ) {
+      case 'n': frames = strtoul(optarg, NULL, 10); break;
+      case 'r': readers = atoi(optarg); break;
+      case 'w': width = atoi(optarg); break;
+      case 'h': height = atoi(optarg); break;
+      case 's': frameKb = strtoul(optarg, NULL, 10); break;
+      case 'z': seed = strtoul(optarg, NULL, 10); break;
+      default:
+        fprintf(stderr, "usage: %s [-n frames] [-r readers] [-w width] [-h height] [-s frame_kb] [-z seed]\n", argv[0]);
+        return 2;
+    }
+  }
+  if ( readers < 1 || frameKb == 0 || seed == 0 || width <= 0 || height <= 0 ) {
+    fprintf(stderr, "at least one reader, frame dimensions, a frame size and a non-zero seed are needed\n");
+    return 2;
+  }
+
+  //  Each run in a process of its own, so that neither finds the heap as the other left it
+  result_t heap;
+  int fds[2];
+  if ( pipe(fds) != 0 ) return 2;
+  pid_t child = fork();
+  if ( child == 0 ) {
+    heap = run(frames, readers, frameKb * KILOBYTE, seed);
+    _exit(write(fds[1], &heap, sizeof(heap)) == sizeof(heap) ? 0 : 2);
+  }
+  if ( child < 0 || read(fds[0], &heap, sizeof(heap)) != sizeof(heap) ) {
+    fprintf(stderr, "the run without the pool failed\n");
+    return 2;
+  }
+  waitpid(child, NULL, 0);
+
+  if ( !poolInit(width, height) ) {
+    fprintf(stderr, "cannot set aside the frame pool\n");
+    return 2;
+  }
+  result_t pool = run(frames, readers, frameKb * KILOBYTE, seed);
+
+  printf("%u frames of %zu KB on average, %d readers, %u frames with a reader stalling, %d capture slots\n",
+         frames, frameKb, readers, pool.stalled, CAPTURE_SLOTS);
+  printf("heap : %6.1f ns per frame (%.2f s), %u ring misses, all from the heap, heap held up to %zu KB with up to %zu KB free inside\n",
+         heap.seconds * 1e9 / frames, heap.seconds, heap.misses, heap.maxHeld / KILOBYTE, heap.maxFree / KILOBYTE);
+  printf("pool : %6.1f ns per frame (%.2f s), %u ring misses, %u from the heap (%u that fit a class with no reader stalling), heap held up to %zu KB besides the pool with up to %zu KB free inside\n",
+         pool.seconds * 1e9 / frames, pool.seconds, pool.misses, pool.heap, pool.heapSteady,
+         (pool.maxHeld > framePool.size ? pool.maxHeld - framePool.size : 0) / KILOBYTE, pool.maxFree / KILOBYTE);
+  printf("       %zu KB set aside for %dx%d, up to %zu KB in use, %u%% of it not asked for\n",
+         framePool.size / KILOBYTE, width, height, framePool.highWater / KILOBYTE, poolWaste());
+  for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+    poolClass_t* c = &framePool.classes[i];
+    printf("       %6zu bytes x %2u: up to %2u in use, %8u handed out, %6u times taken\n",
+           c->size, c->count, c->highWater, (unsigned) c->allocs, (unsigned) c->misses);
+  }
+
+  int rc = 0;
+  if ( heap.bad || pool.bad ) {
+    printf("%u frames overwritten or left over\n", heap.bad + pool.bad);
+    rc = 1;
+  }
+  //  Frames the readers keep fit in the pool as long as none of them stalls
+  if ( pool.heapSteady ) rc = 1;
+  if ( framePool.failures ) rc = 1;
+  return rc;
+}
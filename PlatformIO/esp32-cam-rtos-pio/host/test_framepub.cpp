@@ -0,0 +1,124 @@
+//  Stress test for the lock-free frame publication in frame.cpp: one producer publishes
+//  frames as fast as it can while several readers acquire and check them.
+//
+//  usage: test_framepub [-r readers] [-t seconds]
+//
+//  Every frame is filled with a pattern derived from its frame number and size, so a reader
+//  holding a frame that was recycled or freed under it sees a torn frame. Readers also check
+//  that frame numbers never go backwards. At the end the frame is unpublished and every
+//  frame must have been freed. Best run under -fsanitize=address or thread as well.
+
+#include "streaming.h"
+#include "frame.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+static framePub_t             pub;
+static std::atomic<bool>      running(true);
+static std::atomic<uint32_t>  published(0);
+
+typedef struct {
+  uint32_t    acquired;
+  uint32_t    empty;      // frameAcquire() found no frame
+  uint32_t    torn;       // frame content did not match its frame number
+  uint32_t    backwards;  // frame number lower than the previous one
+  pthread_t   thread;
+} reader_t;
+
+static uint8_t pattern(uint32_t aFnm, size_t aIndex) {
+  return (uint8_t) (aFnm * 131 + aIndex * 7);
+}
+
+static size_t frameSize(uint32_t aFnm) {
+  return 512 + (aFnm * 977) % 8192;
+}
+
+static void* producer(void* aParam) {
+  uint32_t fnm = 0;
+  while ( running ) {
+    fnm++;
+    size_t len = frameSize(fnm);
+    frame_t* f = frameAlloc(len);
+    if ( f == NULL ) continue;
+    f->fnm = fnm;
+    for (size_t i = 0; i < len; i++) f->dat[i] = pattern(fnm, i);
+    framePublish(&pub, f);
+    published++;
+  }
+  return NULL;
+}
+
+static void* reader(void* aParam) {
+  reader_t* r = (reader_t*) aParam;
+  uint32_t last = 0;
+  while ( running ) {
+    frame_t* f = frameAcquire(&pub);
+    if ( f == NULL ) {
+      r->empty++;
+      continue;
+    }
+    r->acquired++;
+    if ( f->fnm < last ) r->backwards++;
+    last = f->fnm;
+
+    bool ok = f->siz == frameSize(f->fnm);
+    for (size_t i = 0; ok && i < f->siz; i++) ok = f->dat[i] == pattern(f->fnm, i);
+    //  Hold on to the frame for a while, so that the producer runs a few frames ahead
+    if ( r->acquired % 16 == 0 ) usleep(100);
+    for (size_t i = 0; ok && i < f->siz; i++) ok = f->dat[i] == pattern(f->fnm, i);
+    if ( !ok ) r->torn++;
+    frameUnref(f);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  int readers = 4;
+  int seconds = 2;
+
+  int opt;
+  while ( (opt = getopt(argc, argv, "r:t:")) != -1 ) {
+    switch ( opt ) {
+      case 'r': readers = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      default:
+        fprintf(stderr, "usage: %s [-r readers] [-t seconds]\n", argv[0]);
+        return 2;
+    }
+  }
+
+  std::vector<reader_t> r(readers);
+  pthread_t p;
+  pthread_create(&p, NULL, producer, NULL);
+  for (int i = 0; i < readers; i++) {
+    memset(&r[i], 0, sizeof(reader_t));
+    pthread_create(&r[i].thread, NULL, reader, &r[i]);
+  }
+  delay(seconds * 1000);
+  running = false;
+  pthread_join(p, NULL);
+  for (int i = 0; i < readers; i++) pthread_join(r[i].thread, NULL);
+
+  uint32_t acquired = 0, torn = 0, backwards = 0;
+  for (int i = 0; i < readers; i++) {
+    acquired += r[i].acquired;
+    torn += r[i].torn;
+    backwards += r[i].backwards;
+  }
+  uint32_t generation = frameGeneration(&pub);
+  framePublish(&pub, NULL);
+
+  printf("published %u frames, %d readers acquired %u frames, torn %u, backwards %u, leaked %u\n",
+         (unsigned) published, readers, acquired, torn, backwards, (unsigned) framesAllocated);
+
+  int rc = 0;
+  if ( torn || backwards ) rc = 1;
+  if ( framesAllocated != 0 ) rc = 1;
+  if ( generation != published ) rc = 1;
+  if ( published == 0 || acquired == 0 ) rc = 1;
+  return rc;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include "platform.h"
+
+//  Client admission: a new viewer is only accepted if the board can afford it.
+//  The cost of a client is estimated per streaming mode (socket and send buffer, task stack,
+//  the frame it may hold on to) and checked against free internal heap, free PSRAM, the
+//  sockets lwIP has left and the measured outgoing bandwidth. MAX_CLIENTS stays the upper bound.
+//  Rejected clients get "503 Service Unavailable" with a Retry-After of ADMIT_RETRY_AFTER seconds.
+
+#ifndef ADMIT_HEAP_RESERVE
+#define ADMIT_HEAP_RESERVE    (48 * 1024)     // internal heap kept free for WiFi / lwIP / camera
+#endif
+#ifndef ADMIT_PSRAM_RESERVE
+#define ADMIT_PSRAM_RESERVE   (256 * 1024)    // PSRAM kept free for capture slots
+#endif
+#ifndef ADMIT_SOCKET_COST
+#define ADMIT_SOCKET_COST     (6 * 1024)      // lwIP pcb, netconn and a full TCP_SND_BUF
+#endif
+#ifndef ADMIT_BANDWIDTH
+#define ADMIT_BANDWIDTH       (1536 * 1024)   // bytes/s the link sustains, 0: do not check
+#endif
+#ifndef ADMIT_FRAME_SIZE
+#define ADMIT_FRAME_SIZE      (32 * 1024)     // frame size assumed until frames have been captured
+#endif
+#ifndef ADMIT_RETRY_AFTER
+#define ADMIT_RETRY_AFTER     5               // seconds
+#endif
+
+#define ADMIT_WINDOW_MS       1000            // bandwidth measurement interval
+
+typedef enum {
+  ADMIT_OK = 0,
+  ADMIT_CLIENTS,      // MAX_CLIENTS or the socket limit reached
+  ADMIT_HEAP,
+  ADMIT_PSRAM,
+  ADMIT_BANDWIDTH_LIMIT,
+  ADMIT_REASONS
+} admitReason_t;
+
+typedef struct {
+  uint32_t  accepted;
+  uint32_t  rejected[ADMIT_REASONS];    // per reason, [ADMIT_OK] unused
+  uint32_t  bandwidth;                  // measured outgoing bytes/s
+} admitStats_t;
+
+//  Decide on a new streaming client asking for aFps frames per second.
+//  Returns ADMIT_OK or the reason for turning it away
+admitReason_t admitClient(uint8_t aFps);
+
+//  Called regularly (by camCB) to measure the outgoing bandwidth
+void          admitSample(void);
+
+const char*   admitReasonName(admitReason_t aReason);
+
+extern admitStats_t admitStats;
+extern uint32_t     admitBandwidth;     // bytes/s, ADMIT_BANDWIDTH unless changed at run time
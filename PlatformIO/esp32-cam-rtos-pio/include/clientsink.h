@@ -0,0 +1,51 @@
+#pragma once
+#include "platform.h"
+
+#define CLIENT_IOV_MAX  8   // most segments handed to a single gather write
+
+//  A connected streaming client (SocketSink on the board and on the host).
+//  Deleting the sink closes the connection.
+class ClientSink {
+  public:
+    virtual ~ClientSink() {}
+    virtual size_t  write(const void* aBuf, size_t aSize) = 0;
+    virtual bool    connected() = 0;
+    virtual void    flush() {}
+    virtual void    setTimeout(uint32_t aSeconds) {}
+    virtual void    stop() = 0;
+
+    //  Event-driven senders: the socket to select() on
+    virtual int     fd() = 0;
+
+    //  One gather write (sendmsg) of up to CLIENT_IOV_MAX segments. Returns the number of bytes
+    //  taken, 0 if the socket buffer is full (aWait false) or the send timed out (aWait true),
+    //  -1 if the connection is gone
+    virtual int     sendv(const struct iovec* aIov, int aCount, bool aWait) = 0;
+
+    //  All segments of a multipart part (part header, frame, boundary) in as few calls as the
+    //  socket allows. Returns the bytes sent, less than the total on timeout or error
+    size_t writev(const struct iovec* aIov, int aCount) {
+      struct iovec iov[CLIENT_IOV_MAX];
+      size_t sent = 0;
+      memcpy(iov, aIov, aCount * sizeof(struct iovec));
+      while ( aCount > 0 ) {
+        int n = sendv(iov, aCount, true);
+        if ( n <= 0 ) break;
+        sent += n;
+        iovConsume(iov, aCount, n);
+      }
+      return sent;
+    }
+
+    //  Drop aBytes already sent from the front of an iovec array
+    static void iovConsume(struct iovec* aIov, int& aCount, size_t aBytes) {
+      int skip = 0;
+      while ( skip < aCount && aBytes >= aIov[skip].iov_len ) aBytes -= aIov[skip++].iov_len;
+      if ( skip ) memmove(aIov, aIov + skip, (aCount - skip) * sizeof(struct iovec));
+      aCount -= skip;
+      if ( aCount > 0 ) {
+        aIov[0].iov_base = (char*) aIov[0].iov_base + aBytes;
+        aIov[0].iov_len -= aBytes;
+      }
+    }
+};
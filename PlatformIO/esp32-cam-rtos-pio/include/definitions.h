@@ -7,3 +7,10 @@
 #define KILOBYTE    1024
 
 #define SERIAL_RATE 115200
+
+#define WEBSERVER_PORT  80
+
+// Camera frame buffers. With more than 2, frames can be streamed straight from the camera buffers
+#ifndef CAMERA_FB_COUNT
+#define CAMERA_FB_COUNT 2
+#endif
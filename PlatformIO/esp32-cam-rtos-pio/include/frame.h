@@ -0,0 +1,73 @@
+#pragma once
+#include "platform.h"
+#include <atomic>
+
+#define PART_HEADER_MAX   128   // room for the multipart part header of a frame
+
+//  A captured frame shared by any number of streaming tasks without copying.
+//  The frame is immutable once published. Every holder owns one reference:
+//  camCB owns the first one, streaming tasks take theirs with frameRef() while they send,
+//  and the memory is released by whoever drops the last reference with frameUnref().
+typedef struct {
+  std::atomic<uint32_t> refs;   // number of holders
+  int8_t                slot;   // capture ring slot, -1 if allocated on its own
+  camera_fb_t*          fb;     // camera buffer lent to this frame, NULL if the data was copied
+  uint32_t              fnm;    // frame number
+  size_t                siz;    // frame size
+  uint8_t*              dat;    // frame data, allocated together with the header
+  struct timeval        tms;    // capture timestamp
+  uint16_t              hln;    // part header length
+  char                  hdr[PART_HEADER_MAX];   // part header, built once by camCB
+} frame_t;
+
+//  Capture ring: frames live in CAPTURE_SLOTS buffers that are reused from frame to frame,
+//  instead of a heap allocation per capture. A slot is free again as soon as the last reference
+//  to its frame is dropped. With one slot holding the current frame and one being sent, a third
+//  slot is always there for the next capture; only when readers hold on to more frames than that
+//  does frameAlloc() fall back to a buffer of its own, so the producer never waits. Slot and
+//  separate buffers come from the frame pool (framepool.h) once it is set aside.
+//  frameAlloc() must only be called from one task (camCB).
+#ifndef CAPTURE_SLOTS
+#define CAPTURE_SLOTS 3
+#endif
+
+frame_t*  frameAlloc(size_t aSize);
+frame_t*  frameRef(frame_t* aFrame);
+void      frameUnref(frame_t* aFrame);
+
+//  Zero-copy capture: frameCapture() turns a camera frame buffer into a frame. While the source
+//  keeps at least one buffer for the next capture, the frame points at the camera buffer itself,
+//  and the buffer goes back to the source with the last frameUnref(). Otherwise the data is copied
+//  into the capture ring and the buffer is released right away.
+frame_t*  frameCapture(camera_fb_t* aFb);
+
+extern uint32_t frameRingMisses;    // frames that did not find a free capture slot
+extern uint32_t frameCopies;        // frames copied out of the camera buffer
+extern uint32_t frameLends;         // frames sent straight from the camera buffer
+
+
+//  Lock-free publication of the current frame: one producer (camCB), any number of readers.
+//  The producer never waits for readers and readers never wait for the producer or each other.
+//  A reader pins the slot holding the current frame, checks that the slot is still current,
+//  and takes a frame reference before unpinning. The producer only recycles slots that
+//  are neither current nor pinned, so a reader can never reference a released frame.
+#ifndef FRAME_PUB_SLOTS
+#define FRAME_PUB_SLOTS 3
+#endif
+
+typedef struct {
+  std::atomic<uint32_t>   pins;     // readers between pin and frameRef()
+  frame_t*                frame;    // published frame, owns one reference
+} framePubSlot_t;
+
+typedef struct {
+  framePubSlot_t                slots[FRAME_PUB_SLOTS];
+  std::atomic<framePubSlot_t*>  current;
+  std::atomic<uint32_t>         generation;   // incremented on every publication
+} framePub_t;
+
+void      framePublish(framePub_t* aPub, frame_t* aFrame);
+frame_t*  frameAcquire(framePub_t* aPub);
+uint32_t  frameGeneration(framePub_t* aPub);
+
+extern std::atomic<uint32_t> framesAllocated;   // frames currently in memory
@@ -0,0 +1,73 @@
+#pragma once
+#include "streaming.h"
+
+//  Frame arena of the all-frames mode: one contiguous buffer, allocated once in PSRAM, in which
+//  the frames are stored back to back, each behind its frameChunck_t header, instead of two heap
+//  allocations per captured frame. Frames are taken at the tail and given back at the head in
+//  the order they were captured, so the free space is always one or two contiguous pieces and
+//  the arena never fragments. A frame that does not fit between the tail and the end of the
+//  buffer goes to the start, and the rest of the buffer is skipped until the head gets there.
+//  Every streaming client reads the frames in between with its own cursor (streamCB).
+//  The arena does not lock: callers serialize (frameSync).
+#ifndef FRAME_ARENA_SIZE
+#define FRAME_ARENA_SIZE  (2048 * KILOBYTE)
+#endif
+#define FRAME_ARENA_MIN   (64 * KILOBYTE)   // smallest arena arenaInit() settles for
+#define FRAME_ARENA_ALIGN 8
+
+typedef struct {
+  uint8_t*  buf;
+  size_t    size;
+  size_t    head;       // offset of the oldest frame
+  size_t    tail;       // offset the next frame goes to
+  size_t    end;        // end of the frames at the top of the buffer once the tail has wrapped, 0 otherwise
+  size_t    used;       // bytes taken by frames, headers included
+  uint32_t  count;      // frames in the arena
+  //  statistics
+  uint32_t  allocs;     // frames allocated
+  uint32_t  fails;      // frames that did not fit
+  uint32_t  wraps;      // times the tail went back to the start
+  size_t    highWater;  // most bytes ever taken, skipped ends included
+} frameArena_t;
+
+bool            arenaInit(frameArena_t* aArena, size_t aSize);
+frameChunck_t*  arenaAlloc(frameArena_t* aArena, size_t aSize);
+void            arenaFree(frameArena_t* aArena, frameChunck_t* aFrame);
+size_t          arenaLargest(const frameArena_t* aArena);
+size_t          arenaEntry(size_t aSize);   // bytes a frame of aSize bytes takes, header included
+
+extern frameArena_t frameArena;
+
+
+//  Backpressure: frames the clients still have to read are kept under frameMemoryLimit bytes.
+//  When a slow client holds so many that the next frame does not fit, frameBackpressure decides.
+//  A client only lets go of a frame once it has sent it, so under DROP_OLDEST and DEMOTE camCB
+//  keeps storing frames in the rest of the arena until the slow client has moved on; only when
+//  the arena is full as well is a frame lost for everyone (full)
+typedef enum {
+  BACKPRESSURE_DROP_OLDEST = 0, // the clients holding the oldest frames skip ahead as far as needed
+  BACKPRESSURE_PAUSE,           // capture waits for the slowest client: nobody misses a frame, everyone gets them late
+  BACKPRESSURE_DEMOTE,          // the clients holding the oldest frames only get the latest frame from then on
+  BACKPRESSURE_POLICIES
+} backpressure_t;
+
+#ifndef FRAME_BACKPRESSURE
+#define FRAME_BACKPRESSURE  BACKPRESSURE_DROP_OLDEST
+#endif
+#ifndef FRAME_MEMORY_LIMIT
+#define FRAME_MEMORY_LIMIT  (FRAME_ARENA_SIZE / 4 * 3)
+#endif
+
+typedef struct {
+  uint32_t              laggards;   // DROP_OLDEST: times a client was told to skip the oldest frames
+  uint32_t              demoted;    // DEMOTE: clients switched to the latest frame
+  std::atomic<uint32_t> skipped;    // DROP_OLDEST, DEMOTE: frames clients skipped because of it
+  uint32_t              paused;     // PAUSE: frames not captured while waiting for the slowest client
+  uint32_t              full;       // frames lost because the arena was full
+} backpressureStats_t;
+
+const char* backpressureName(uint8_t aPolicy);
+
+extern uint8_t              frameBackpressure;    // backpressure_t
+extern size_t               frameMemoryLimit;     // bytes, at most the arena size
+extern backpressureStats_t  backpressureStats;
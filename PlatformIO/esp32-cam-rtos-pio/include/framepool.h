@@ -0,0 +1,64 @@
+#pragma once
+#include "streaming.h"
+
+//  Frame pool of the queue and task modes: the memory for frames (capture ring slots, frames
+//  the ring has no free slot for, headers of frames lent from a camera buffer) is taken once at
+//  startup, in a few size classes fitted to the JPEG frames of FRAME_SIZE, and recycled from
+//  frame to frame, instead of a free and a malloc every time a frame outgrows its buffer.
+//  Frame buffers go to PSRAM if the board has it, to the internal heap otherwise; headers stay
+//  in the internal heap. A request no class has a free buffer for falls back to allocateMemory()
+//  and is counted, so that the class sizes and counts can be tuned from the statistics.
+//  Buffers can be given back from any task.
+
+//  Pixels per JPEG byte at the JPEG_QUALITY used in platformio.ini: a VGA frame is about 38 KB
+#ifndef FRAME_POOL_RATIO
+#define FRAME_POOL_RATIO    8
+#endif
+//  Buffers per class: headers, then frames of half, one, one and a half and two typical sizes.
+//  The capture ring keeps CAPTURE_SLOTS of them, the rest is for frames readers hold on to
+#ifndef FRAME_POOL_HEADERS
+#define FRAME_POOL_HEADERS  4
+#endif
+#ifndef FRAME_POOL_FRAMES
+#define FRAME_POOL_FRAMES   (CAPTURE_SLOTS + 3)
+#endif
+//  Internal heap the frame buffers may take on a board without PSRAM
+#ifndef FRAME_POOL_DRAM
+#define FRAME_POOL_DRAM     (96 * KILOBYTE)
+#endif
+
+#define FRAME_POOL_CLASSES  5
+#define FRAME_POOL_GRANULE  (4 * KILOBYTE)  // frame classes are multiples of this
+
+typedef struct {
+  size_t    size;       // bytes per buffer
+  uint16_t  count;      // buffers in the class
+  uint16_t  used;       // buffers handed out
+  uint16_t  highWater;  // most buffers handed out at once
+  bool      psram;      // buffers are in PSRAM
+  uint8_t*  base;       // the buffers, back to back
+  void*     free;       // free buffers, linked through their first word
+  //  statistics
+  uint32_t  allocs;     // buffers handed out
+  uint32_t  misses;     // requests this class fitted best but had no free buffer for
+} poolClass_t;
+
+typedef struct {
+  poolClass_t classes[FRAME_POOL_CLASSES];
+  size_t    size;         // bytes preallocated
+  size_t    used;         // bytes in buffers handed out
+  size_t    highWater;    // most bytes in buffers handed out at once
+  uint64_t  requested;    // bytes asked for, over all buffers handed out
+  uint64_t  granted;      // bytes of the buffers handed out for them
+  uint32_t  fallbacks;    // requests served by allocateMemory()
+  uint32_t  failures;     // requests nothing could serve
+} framePool_t;
+
+bool    poolInit(uint16_t aWidth, uint16_t aHeight);
+void*   poolAlloc(size_t aSize);
+void    poolFree(void* aPtr);
+size_t  poolSize(const void* aPtr);           // bytes of a pool buffer, 0 if aPtr is not from the pool
+size_t  poolFit(size_t aSize);                // bytes of the buffers best fitting aSize, 0 if no class does
+uint8_t poolWaste(void);                      // % of the bytes handed out that were not asked for
+
+extern framePool_t framePool;
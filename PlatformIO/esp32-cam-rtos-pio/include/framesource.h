@@ -0,0 +1,18 @@
+#pragma once
+#include "platform.h"
+
+//  Where camCB gets its frames from: the camera driver on the board,
+//  a directory of JPEG files (or synthetic frames) on the host.
+//  get() may block until the next frame is ready and returns NULL on failure.
+//  Every frame obtained with get() has to be handed back with release().
+//  buffers() is the number of frames the source can have out at once (camera fb_count),
+//  so that a frame can be held on to while the next one is being captured.
+class FrameSource {
+  public:
+    virtual ~FrameSource() {}
+    virtual camera_fb_t*  get() = 0;
+    virtual void          release(camera_fb_t* aFrame) = 0;
+    virtual int           buffers() { return 1; }
+};
+
+extern FrameSource* frameSource;
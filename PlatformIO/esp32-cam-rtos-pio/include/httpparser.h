@@ -0,0 +1,73 @@
+#pragma once
+#include "platform.h"
+
+#define HTTP_HEADERS_MAX  12    // headers kept per request, the rest are skipped
+
+//  HTTP/1.x request head parser working in place on the receive buffer: the request
+//  only points into the buffer, nothing is copied or allocated. Strings are not
+//  zero-terminated, use the lengths. RTSP/1.0 requests (same syntax) are parsed as well.
+typedef enum {
+  HTTP_M_OTHER = 0,
+  HTTP_M_GET,
+  HTTP_M_HEAD,
+  HTTP_M_POST,
+} httpMethod_t;
+
+typedef struct {
+  const char* nam;
+  uint16_t    nln;
+  const char* val;
+  uint16_t    vln;
+} httpHeader_t;
+
+typedef struct {
+  httpMethod_t  method;
+  const char*   mth;            // method as sent (RTSP methods are HTTP_M_OTHER)
+  uint8_t       mln;
+  bool          rtsp;           // RTSP/1.0 request
+  const char*   path;           // target up to '?', the path of an absolute URI
+  uint16_t      pln;
+  const char*   query;          // after '?', NULL if there is none
+  uint16_t      qln;
+  uint8_t       minor;          // HTTP/1.<minor>
+  uint8_t       headerCount;
+  httpHeader_t  headers[HTTP_HEADERS_MAX];
+} httpRequest_t;
+
+#define HTTP_INCOMPLETE   0     // the end of the request head has not arrived yet
+#define HTTP_BAD_REQUEST  (-1)
+
+//  Parses the request head at the start of aBuf. Returns the length of the head (request line,
+//  headers and the empty line) once it is complete, HTTP_INCOMPLETE if more data is needed,
+//  HTTP_BAD_REQUEST if it is not a valid HTTP/1.x request.
+int           httpParse(const char* aBuf, size_t aLen, httpRequest_t* aReq);
+
+//  Value of a header (case-insensitive name), NULL if absent
+const char*   httpHeader(const httpRequest_t* aReq, const char* aName, uint16_t* aLen);
+
+//  Value of a query argument (?name=value&...), NULL if absent. No %-decoding
+const char*   httpArg(const httpRequest_t* aReq, const char* aName, uint16_t* aLen);
+
+//  True if aLen bytes at aStr equal the C string aLit
+bool          httpEquals(const char* aStr, uint16_t aLen, const char* aLit);
+
+const char*   httpMethodName(httpMethod_t aMethod);
+
+//  True if the If-None-Match value aList (a comma separated list of entity tags, or "*")
+//  matches aTag, the entity tag without quotes. Weak tags (W/"...") match as well (RFC 7232 3.2)
+bool          httpEtagMatch(const char* aList, uint16_t aLen, const char* aTag);
+
+
+// ==== Route table ============================================================================
+//  A handler returns true if it took over the connection (e.g. a streaming client),
+//  false if the server should close it.
+typedef bool (*httpHandler_t)(int aFd, const httpRequest_t* aReq);
+
+typedef struct {
+  httpMethod_t  method;         // HTTP_M_OTHER matches any method
+  const char*   path;
+  httpHandler_t handler;
+} httpRoute_t;
+
+//  First route matching method and path, NULL if none does
+const httpRoute_t*  httpRoute(const httpRoute_t* aRoutes, int aCount, const httpRequest_t* aReq);
@@ -0,0 +1,103 @@
+#pragma once
+#include "streaming.h"
+
+//  Metrics registry: what the streaming code measures all the time, in release builds as well.
+//  It costs a few additions per frame sent. /stats serves it as JSON and /metrics in the
+//  Prometheus text format, so a fleet of boards can be watched over WiFi. Every streaming client
+//  (MJPEG stream, websocket viewer) has a slot that only the task serving it writes. Readers take
+//  a copy under the slot's sequence counter and try again if it changed in between: neither side
+//  ever waits for the other. Totals and histograms over all clients are kept per kind of client,
+//  as they have to keep counting after a client leaves.
+#define METRICS_CLIENTS   (MAX_CLIENTS + 8)   // MJPEG streams and websocket viewers
+#define METRICS_CHUNK     2048                // a response buffer grows by this many bytes
+#define METRICS_MAX       (64 * 1024)         // longest response
+
+typedef enum {
+  METRICS_MJPEG = 0,
+  METRICS_WEBSOCKET,
+  METRICS_KINDS
+} metricsKind_t;
+
+//  Histograms for /metrics: METRICS_BUCKETS upper bounds, ascending, and a bucket for the rest.
+//  Adding a value is an increment and an addition, from any task
+#define METRICS_BUCKETS   12
+
+typedef struct {
+  const uint32_t*       bounds;
+  std::atomic<uint32_t> counts[METRICS_BUCKETS + 1];
+  std::atomic<uint64_t> sum;
+} histogram_t;
+
+void      histogramAdd(histogram_t* aHist, uint32_t aValue);
+
+//  Camera driver events that cost a frame, as the driver (cam_hal.c) logs them. EV-OVF (cam_task
+//  not keeping up with the DMA interrupts) is logged from the interrupt and is not counted
+typedef enum {
+  DRIVER_FB_OVF = 0,      // the JPEG did not fit the frame buffer
+  DRIVER_NO_EOI,          // a frame without the JPEG end marker
+  DRIVER_EVENTS
+} driverEvent_t;
+
+void      metricsDriverEvent(uint8_t aEvent);
+void      metricsDriverHook(void);    // on the board: count the events from the driver's log
+
+typedef struct {
+  uint8_t   kind;         // metricsKind_t
+  uint8_t   fps;          // frame rate asked for
+  uint32_t  since;        // millis() when the client connected
+  uint32_t  frames;       // frames sent
+  uint64_t  bytes;        // bytes sent with them
+  uint32_t  skipped;      // frames due to the client that it did not get
+  uint32_t  fnm;          // number of the last frame sent
+  uint32_t  last;         // micros() when it was sent
+  uint32_t  intervalAvg;  // running average of the time between frames, us
+  uint32_t  sendAvg;      // running average of the time to send a frame, us
+  uint32_t  sendMax;      // longest time to send a frame, us
+  uint64_t  sendSum;      // time spent sending frames, us
+  //  Latency from the capture (camera_fb_t.timestamp) to the first and the last byte of a frame
+  //  handed to the socket, us: counts per bucket of latencyBounds, sums and the longest
+  uint32_t  firstByte[METRICS_BUCKETS + 1];
+  uint32_t  lastByte[METRICS_BUCKETS + 1];
+  uint64_t  firstByteSum;
+  uint64_t  lastByteSum;
+  uint32_t  lastByteMax;
+  uint32_t  timed;        // frames sent with a capture timestamp, the ones counted above
+} clientMetrics_t;
+
+extern const uint32_t latencyBounds[METRICS_BUCKETS];
+
+int8_t    metricsJoin(uint8_t aKind, uint8_t aFps);     // slot of a new client, -1 if all are taken
+void      metricsLeave(int8_t aSlot);
+//  aSendUs: time to send the frame, aTms: when it was captured
+void      metricsSent(int8_t aSlot, uint32_t aFnm, size_t aBytes, uint32_t aSendUs, const struct timeval* aTms);
+bool      metricsClient(int aSlot, clientMetrics_t* aCopy);  // a consistent copy, false if the slot is free
+uint32_t  metricsFps10(const clientMetrics_t* aClient);      // frames per second, in tenths
+uint32_t  metricsPercentile(const uint32_t* aCounts, uint32_t aMax, uint8_t aPct);  // us, bucket bound it falls in
+const char* metricsKindName(uint8_t aKind);
+void      metricsLogClient(int8_t aSlot);                // BENCHMARK builds: a line on the log for a client
+void      metricsLog(void);                              // and for all of them
+
+//  A response is rendered in one go into a buffer of its own (in PSRAM if there is any), so it is
+//  a consistent copy of the registry. The webserver sends it without blocking, like a snapshot,
+//  and frees it with metricsFree() once it is out or the client is gone
+typedef struct {
+  char*     buf;
+  size_t    len;
+  size_t    size;
+  bool      failed;           // out of memory, or longer than METRICS_MAX
+} metricsOut_t;
+
+void      metricsBegin(metricsOut_t* aOut);
+void      metricsPrint(metricsOut_t* aOut, const char* aFmt, ...);
+bool      metricsEnd(metricsOut_t* aOut);     // false if the response is not complete
+void      metricsFree(metricsOut_t* aOut);
+
+//  Called by captureDone() for every frame published
+void      metricsCapture(uint32_t aCaptureUs, uint32_t aIntervalUs, size_t aSize);
+
+//  GET /stats: everything above as JSON
+void      statsJson(metricsOut_t* aOut);
+//  GET /metrics: counters and histograms in the Prometheus text format
+void      metricsText(metricsOut_t* aOut);
+
+#define METRICS_CONTENT_TYPE  "text/plain; version=0.0.4; charset=utf-8"
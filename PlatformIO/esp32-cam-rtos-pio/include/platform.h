@@ -0,0 +1,14 @@
+#pragma once
+//  On the board the streaming core runs on FreeRTOS and the Arduino core.
+//  On a Linux host the same API subset is provided on top of pthreads (see host/host_platform.h)
+#if defined(ARDUINO_ARCH_ESP32)
+#include <Arduino.h>
+#include <ArduinoLog.h>
+#include "esp_camera.h"
+#include <lwip/sockets.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include "esp_vfs_eventfd.h"
+#else
+#include "host_platform.h"
+#endif
@@ -0,0 +1,72 @@
+#pragma once
+#include "platform.h"
+
+//  RTP payload format for JPEG (RFC 2435). The sensor's baseline JPEG frames are sent as they are:
+//  the headers are dropped and only the entropy coded scan goes out, in fragments of up to
+//  RTP_PACKET_MAX bytes, each behind a small RTP/JPEG header. The receiver rebuilds the headers
+//  from the type, size and the quantization tables, which are taken out of the frame's DQT
+//  and sent in-band with the first fragment of every frame (Q = 255). Nothing is re-encoded,
+//  and the scan is sent from where the frame is stored.
+
+#ifndef RTP_PACKET_MAX
+#define RTP_PACKET_MAX    1400    // RTP packet (headers and payload), below the WiFi MTU
+#endif
+#define RTP_HEADER_MAX    (12 + 8 + 4 + 4 + 128)  // RTP, JPEG, restart marker and quantization table headers
+#define RTP_PT_JPEG       26      // static payload type of JPEG (RFC 3551)
+#define RTP_CLOCK         90000   // video clock rate
+#define RTP_PT_FEC        127     // dynamic payload type of the parity packets
+#define RTP_FEC_HEADER    (12 + 6)  // RTP and FEC headers of a parity packet
+
+//  What RFC 2435 needs to know about a frame
+typedef struct {
+  uint8_t         type;       // 0: 4:2:2, 1: 4:2:0; +64 with restart markers
+  uint8_t         width;      // in 8 pixel units
+  uint8_t         height;
+  uint16_t        dri;        // restart interval, 0 if none
+  const uint8_t*  qt[2];      // luma and chroma quantization tables, 64 bytes in zigzag order
+  const uint8_t*  scan;       // entropy coded data, up to EOI
+  size_t          sln;
+} jpegInfo_t;
+
+//  One RTP stream: a receiver or a multicast group
+typedef struct {
+  uint16_t  seq;
+  uint32_t  ssrc;
+  uint32_t  packets;          // packets sent
+  uint32_t  frames;           // frames sent
+} rtpStream_t;
+
+//  XOR parity over a group of consecutive RTP packets (a frame is split in groups of up to
+//  RTP_FEC_GROUP packets). A receiver that lost one packet of the group rebuilds it, RTP header
+//  included, by XORing the parity with the packets it got. The parity packet is an RTP packet of
+//  its own stream (RTP_PT_FEC, same SSRC and timestamp) with a 6 byte header: sequence number of the
+//  first packet of the group, number of packets and XOR of their lengths, then the parity of the
+//  packets, as long as the longest of them. It goes to its own port, so plain RTP receivers never see it
+typedef struct {
+  uint16_t  base;             // sequence number of the first packet of the group
+  uint16_t  count;            // packets in the group so far
+  uint16_t  lengths;          // XOR of their lengths
+  uint16_t  max;              // longest packet
+  uint8_t   parity[RTP_PACKET_MAX];
+} rtpFec_t;
+
+//  Finds the quantization tables, frame size, sampling and scan of a baseline JPEG.
+//  False if it is not one RFC 2435 can carry (progressive, 12 bit, grayscale, odd sampling)
+bool      jpegParse(const uint8_t* aBuf, size_t aLen, jpegInfo_t* aInfo);
+
+//  RTP timestamp of a capture time
+uint32_t  rtpTimestamp(const struct timeval* aTms);
+
+//  Headers of the packet carrying the scan from aOffset on. Sets *aLen to the scan bytes that fit
+//  behind them, and returns the header length (at most RTP_HEADER_MAX). The packet is the
+//  header followed by aInfo->scan + aOffset, *aLen bytes. The last packet of a frame has the
+//  marker bit set. Send a frame as: for (off = 0; off < sln; off += len) rtpJpegPacket(...)
+size_t    rtpJpegPacket(uint8_t* aBuf, const jpegInfo_t* aInfo, rtpStream_t* aStream,
+                        uint32_t aTimestamp, uint32_t aOffset, size_t* aLen);
+
+//  Adds a packet built by rtpJpegPacket (its headers, then aLen scan bytes) to the parity
+void      rtpFecAdd(rtpFec_t* aFec, const uint8_t* aHdr, size_t aHln, const uint8_t* aData, size_t aLen);
+
+//  Headers of the parity packet of the group (RTP_FEC_HEADER bytes) into aBuf, and starts a new group.
+//  The packet is the headers followed by aFec->parity, *aLen bytes. 0 if the group is empty
+size_t    rtpFecPacket(uint8_t* aBuf, rtpFec_t* aFec, rtpStream_t* aStream, uint32_t aTimestamp, size_t* aLen);
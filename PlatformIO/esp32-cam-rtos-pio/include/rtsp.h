@@ -0,0 +1,57 @@
+#pragma once
+#include "streaming.h"
+#include "rtpjpeg.h"
+
+//  RTSP server (RFC 2326) for NVRs and players that do not take multipart MJPEG:
+//  rtsp://<ip>:RTSP_PORT/mjpeg/1 with OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN
+//  and GET_PARAMETER / SET_PARAMETER as keep-alive. Frames go out as RTP/JPEG (rtpjpeg.h),
+//  over UDP to the client's ports (RTP/AVP) or interleaved on the RTSP connection (RTP/AVP/TCP).
+//  One task serves all sessions from the published frames (snapshotAcquire), like the
+//  websocket viewers: a session that is still sending a frame when the next one is published
+//  skips it. A session without requests (or RTCP on TCP) for RTSP_TIMEOUT_S is closed.
+//
+//  Multicast (SETUP with RTP/AVP;multicast) puts the session in the group instead: while any
+//  member plays, every frame is sent once to RTSP_MULTICAST_GROUP, however many receivers
+//  joined it. With RTP_FEC_GROUP, a parity packet (rtpjpeg.h) follows every RTP_FEC_GROUP packets
+//  of a frame on the next port pair, so that a single lost packet does not cost the frame.
+
+#ifndef RTSP_PORT
+#define RTSP_PORT         554
+#endif
+#ifndef RTSP_SESSIONS
+#define RTSP_SESSIONS     4       // RTSP connections, each with one session
+#endif
+#define RTSP_TIMEOUT_S    60      // session timeout announced in SETUP
+#ifndef RTSP_MULTICAST_GROUP
+#define RTSP_MULTICAST_GROUP  "239.255.0.42"
+#endif
+#ifndef RTSP_MULTICAST_PORT
+#define RTSP_MULTICAST_PORT   5004  // RTP port of the group (RTCP + 1, parity + 2)
+#endif
+#ifndef RTSP_MULTICAST_TTL
+#define RTSP_MULTICAST_TTL    1     // do not leave the local network
+#endif
+#ifndef RTP_FEC_GROUP
+#define RTP_FEC_GROUP     10      // packets per parity packet on the multicast group, 0 for none
+#endif
+
+typedef struct {
+  uint32_t  sessions;     // sessions set up
+  uint32_t  playing;      // sessions playing now
+  uint32_t  frames;       // frames sent, all sessions
+  uint32_t  packets;      // RTP packets sent
+  uint32_t  skipped;      // frames sessions did not get because they were still sending
+  uint32_t  dropped;      // frames not sent completely (UDP send failed, frame not baseline JPEG)
+  uint32_t  members;      // multicast sessions playing now
+  uint32_t  groupFrames;  // frames sent to the multicast group
+  uint32_t  groupPackets; // RTP packets sent to it
+  uint32_t  fecPackets;   // parity packets sent to it
+} rtspStats_t;
+
+extern rtspStats_t  rtspStats;
+extern volatile int rtspPort;       // port the RTSP server listens on, 0 until it is up
+extern TaskHandle_t tRtsp;
+extern uint16_t     rtspGroupPort;  // RTP port of the multicast group, RTSP_MULTICAST_PORT unless changed at run time
+
+//  The RTSP server task. pvParameters is the port to listen on (0: any free port)
+void rtspCB(void* pvParameters);
@@ -0,0 +1,36 @@
+#pragma once
+#include "streaming.h"
+
+//  Streaming task scheduler (CAMERA_MULTICLIENT_TASK and CAMERA_ALL_FRAMES).
+//  Instead of every client task polling frameNumber at its own rate, client tasks sleep on their
+//  task notification and camCB wakes exactly the ones a newly published frame is due for
+//  (streamInfo_t.due). Sleeping tasks are kept in a timer wheel of SCHED_WHEEL slots indexed by
+//  the frame number they are due at, so that publishing a frame only looks at the tasks due then.
+//  A client task that is not woken for SCHED_IDLE_MS (camera stalled or suspended) wakes up on its
+//  own to check that its client is still connected.
+
+#ifndef SCHED_IDLE_MS
+#define SCHED_IDLE_MS   1000    // longest a client task sleeps without a frame
+#endif
+#ifndef SCHED_WHEEL
+#define SCHED_WHEEL     16      // timer wheel slots, frames
+#endif
+
+//  Called by a client task for itself before it waits for frames, and before it exits
+void  schedJoin(streamInfo_t* aInfo);
+void  schedLeave(streamInfo_t* aInfo);
+
+//  Called by camCB once frame aFnm is published: notifies the tasks of all clients it is due for
+void  schedPublish(uint32_t aFnm);
+
+//  camCB's frame pacing, like xTaskDelayUntil() at captureFps. A client asking for a higher
+//  rate than captureFps (fpsJoin) wakes camCB, so it does not finish a long interval first
+void  schedCaptureDelay(TickType_t* aLastWake);
+void  schedRateUp(void);
+
+//  Sleep until the frame aInfo->due is published or SCHED_IDLE_MS pass. True if it is out.
+//  aNoFrame: the caller found no frame to send (none captured yet, or camCB was suspended), so a
+//  frame published before does not count, whatever its due: it sleeps until the next one
+bool  schedWait(streamInfo_t* aInfo, bool aNoFrame);
+
+extern uint32_t schedWakeups;   // client tasks notified by schedPublish()
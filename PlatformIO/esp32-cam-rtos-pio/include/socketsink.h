@@ -0,0 +1,25 @@
+#pragma once
+#include "clientsink.h"
+#include <atomic>
+
+// ==== A connected TCP socket as a streaming client ===========================================
+//  Plain BSD socket calls, so the same code runs on lwIP on the board and on a Linux host.
+class SocketSink : public ClientSink {
+  public:
+    SocketSink(int aFd);
+    ~SocketSink();
+
+    size_t  write(const void* aBuf, size_t aSize);
+    bool    connected();
+    void    flush();
+    void    setTimeout(uint32_t aSeconds);
+    void    stop();
+    int     fd() { return iFd; }
+    int     sendv(const struct iovec* aIov, int aCount, bool aWait);
+
+  private:
+    int     iFd;
+};
+
+extern std::atomic<uint32_t> sinkSendCalls;   // send / sendmsg calls made by all SocketSinks
+extern std::atomic<uint64_t> sinkSendBytes;   // bytes sent by all SocketSinks
@@ -1,29 +1,85 @@
 #pragma once
 #include "definitions.h"
-#include "references.h"
+#include "platform.h"
+#include "framesource.h"
+#include "clientsink.h"
+#include "frame.h"
 
-typedef struct {
+typedef struct streamInfo {
   uint32_t        frame;
-  WiFiClient      *client;
+  ClientSink      *client;
   TaskHandle_t    task;
-  char*           buffer;
-  size_t          len;
+  uint8_t         fps;    // frame rate the client asked for (?fps=), 1..FPS
+  uint32_t        due;    // number of the next frame this client is due to get
+  int8_t          cursor; // all-frames mode: slot of the client's read cursor
+  struct streamInfo* next;  // scheduler: next task waiting in the same timer wheel slot
+  bool            armed;  // scheduler: waiting in the timer wheel
 } streamInfo_t;
 
 typedef struct {
-  uint8_t   cnt;  // served to clients counter. when equal to number of active clients, could be deleted
-  void*     nxt;  // next chunck
+  uint8_t   pin;  // snapshot requests sending this frame, it is not freed while they do
+  std::atomic<void*> nxt;  // next chunck, linked by camCB once it is complete
   uint32_t  fnm;  // frame number
   uint32_t  siz;  // frame size
-  uint8_t*  dat;  // frame pointer
+  uint32_t  len;  // bytes the frame takes in the frame arena, this header included
+  uint8_t*  dat;  // frame pointer, right behind this header
+  struct timeval tms;  // capture timestamp
+  uint16_t  hln;  // part header length
+  char      hdr[PART_HEADER_MAX]; // part header
 } frameChunck_t;
 
 
+//  Intervals between frames published by camCB, to see capture jitter, and how long capturing took
+typedef struct {
+  uint32_t  count;    // frames published
+  uint32_t  last;     // micros() of the last one
+  uint32_t  maxGap;   // longest interval, us
+  uint64_t  sum;      // sum of intervals, us
+  uint64_t  sumSq;    // sum of squared intervals, us^2
+  uint32_t  sizeAvg;  // running average of the frame size, bytes
+  uint32_t  timeAvg;  // running average of the time from asking the camera for a frame to having it stored, us
+  uint32_t  timeMax;  // longest such time, us
+  uint32_t  errors;   // frames the camera did not deliver or there was no memory for
+} captureStats_t;
+
+#define CLIENT_TASK_STACK (3 * KILOBYTE)  // stack of a per-client streaming task
+
+
+//  The latest published frame, for a still image (/jpg). It is sent from where the frame is
+//  stored, so whatever holds the frame (frame reference, pinned chain frame) is kept in ref
+//  until snapshotRelease()
+typedef struct {
+  const char*     hdr;    // part header of the frame: Content-Type, Content-Length, empty line
+  uint16_t        hln;
+  const uint8_t*  dat;
+  size_t          siz;
+  uint32_t        fnm;
+  struct timeval  tms;    // capture timestamp
+  void*           ref;
+} snapshot_t;
+
+#define SNAPSHOT_IDLE_MS  5000    // the camera keeps running this long after the last snapshot request
+
+
+void startStreaming(void);
+void captureDone(size_t aSize, uint32_t aCaptureUs);
 void camCB(void* pvParameters);
-void handleJPGSstream(void);
-void handleNotFound(void);
+bool handleJPGSstream(ClientSink* aClient, uint8_t aFps);
+int  clientCount(void);
 void streamCB(void * pvParameters);
 void mjpegCB(void * pvParameters);
+void streamSignal(void);
+void streamClear(void);
+bool snapshotAcquire(snapshot_t* aSnap);
+void snapshotRelease(snapshot_t* aSnap);
+void snapshotWanted(void);
+bool snapshotActive(void);
+uint8_t  clientFps(int aFps);
+void     fpsJoin(uint8_t aFps);
+void     fpsLeave(uint8_t aFps);
+uint32_t frameStep(uint8_t aFps);
+size_t partHeader(char* aBuf, size_t aSize, uint32_t aFnm, const struct timeval* aTms);
+size_t streamPart(ClientSink* aClient, const char* aHeader, size_t aHeaderLen, const uint8_t* aData, size_t aSize);
 
 #define FAIL_IF_OOM true
 #define OK_IF_OOM   false
@@ -40,4 +96,20 @@ extern const int cntLen;
 extern volatile uint32_t frameNumber;
 
 extern frameChunck_t* fstFrame;
-extern frameChunck_t* curFrame; 
+extern frameChunck_t* curFrame;
+
+extern SemaphoreHandle_t frameSync;
+extern TaskHandle_t tCam;     // handles getting picture frames from the camera and storing them locally
+extern TaskHandle_t tStream;
+extern uint8_t      noActiveClients;       // number of active clients
+extern captureStats_t captureStats;
+extern int          streamEvent;           // eventfd signalled on new frames and clients
+extern int          frameEvent;            // eventfd signalled on new frames while frameWaiters > 0
+extern std::atomic<uint32_t> frameWaiters;  // requests waiting for the next frame
+extern int          rtpEvent;              // eventfd signalled on new frames while rtpWaiters > 0
+extern std::atomic<uint32_t> rtpWaiters;    // RTSP sessions playing
+extern volatile uint8_t  captureFps;        // rate camCB captures at: the highest fps a client asked for
+extern volatile uint32_t fpsDemand;         // sum of the frame rates of all clients
+
+extern const char   STREAMING_URL[];
+extern volatile int serverPort;            // port mjpegCB listens on, 0 until the server is up
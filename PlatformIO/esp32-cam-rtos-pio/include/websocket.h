@@ -0,0 +1,68 @@
+#pragma once
+#include "platform.h"
+
+//  WebSocket (RFC 6455) framing for the /ws frame stream. Every published frame goes to the
+//  viewer as one binary message: a WS_META_SIZE byte header followed by the JPEG.
+//
+//    offset  size  little-endian
+//         0     4  frame number
+//         4     8  capture timestamp, microseconds (camera_fb_t.timestamp)
+//
+//  A viewer acks a frame by sending its frame number back, as a 4 byte binary message or
+//  as decimal text. Acks are cumulative. Once a viewer acks, it never has more than WS_WINDOW
+//  frames unacked: while the window is full it is skipped, and it gets the latest frame
+//  when an ack opens the window again. Viewers that never ack are paced by their socket.
+//  Like the rest of the parser code, nothing here allocates.
+
+#ifndef WS_WINDOW
+#define WS_WINDOW       2       // frames a viewer that acks may have unacked
+#endif
+#define WS_META_SIZE    12      // frame number and capture timestamp
+#define WS_HEADER_MAX   (10 + WS_META_SIZE)   // longest frame header, with the frame meta data
+#define WS_KEY_LENGTH   24      // Sec-WebSocket-Key: 16 bytes, base64
+#define WS_ACCEPT_SIZE  29      // Sec-WebSocket-Accept: 20 bytes, base64, and the terminator
+
+typedef enum {
+  WS_OP_CONTINUATION = 0x0,
+  WS_OP_TEXT         = 0x1,
+  WS_OP_BINARY       = 0x2,
+  WS_OP_CLOSE        = 0x8,
+  WS_OP_PING         = 0x9,
+  WS_OP_PONG         = 0xA,
+} wsOpcode_t;
+
+typedef struct {
+  uint8_t   opcode;
+  bool      fin;
+  size_t    length;     // frame length: header and payload
+  size_t    pln;        // payload length
+  uint8_t*  payload;    // in the receive buffer, unmasked in place
+} wsFrame_t;
+
+#define WS_INCOMPLETE   0     // the frame has not arrived completely yet
+#define WS_BAD_FRAME    (-1)  // not a frame a client may send (unmasked, reserved bits, too long)
+
+typedef struct {
+  uint32_t  clients;    // viewers connected now
+  uint32_t  frames;     // frames sent
+  uint32_t  skipped;    // frames viewers did not get because they were behind
+  uint32_t  acks;       // acks received
+} wsStats_t;
+
+extern wsStats_t wsStats;
+
+//  Sec-WebSocket-Accept for the client's Sec-WebSocket-Key: base64(SHA-1(key + GUID))
+void  wsAcceptKey(const char* aKey, uint16_t aLen, char aAccept[WS_ACCEPT_SIZE]);
+
+//  Parses the client frame at the start of aBuf (at most aMax bytes of payload). Returns the
+//  frame length once the frame is complete, WS_INCOMPLETE or WS_BAD_FRAME
+int   wsParse(uint8_t* aBuf, size_t aLen, size_t aMax, wsFrame_t* aFrame);
+
+//  Header of a server frame (not masked) with a payload of aLen bytes. Returns its length
+size_t wsHeader(uint8_t* aBuf, uint8_t aOpcode, uint64_t aLen);
+
+//  Frame meta data following the header of a binary frame message
+void  wsMeta(uint8_t* aBuf, uint32_t aFnm, const struct timeval* aTms);
+
+//  Frame number of an ack message, false if the payload is not one
+bool  wsAck(uint8_t aOpcode, const uint8_t* aPayload, size_t aLen, uint32_t* aFnm);
@@ -0,0 +1,105 @@
+#include "admission.h"
+#include "streaming.h"
+#include "socketsink.h"
+#include "rtsp.h"
+#include "websocket.h"
+
+#define ADMIT_TASK_COST   512     // TCB and bookkeeping of a FreeRTOS task, on top of its stack
+
+//  Sockets lwIP has: the host runs with what the sdkconfig files set, 16, the most IDF 4.4 takes
+#if defined(CONFIG_LWIP_MAX_SOCKETS)
+#define ADMIT_LWIP_SOCKETS  CONFIG_LWIP_MAX_SOCKETS
+#else
+#define ADMIT_LWIP_SOCKETS  16
+#endif
+//  The RTSP server keeps its listening socket, the RTP socket and one per session
+#if defined(RTSP_SERVER)
+#define ADMIT_RTSP_SOCKETS  (2 + RTSP_SESSIONS)
+#else
+#define ADMIT_RTSP_SOCKETS  0
+#endif
+//  Streaming sockets lwIP can still open: one is the web server's listening socket, and one is
+//  kept for the next request so that it can at least be told to come back later
+#define ADMIT_SOCKETS     (ADMIT_LWIP_SOCKETS - 2 - ADMIT_RTSP_SOCKETS)
+
+admitStats_t admitStats;
+uint32_t     admitBandwidth = ADMIT_BANDWIDTH;
+
+static uint32_t sampleTime = 0;
+static uint64_t sampleBytes = 0;
+
+static const char* reasons[ADMIT_REASONS] = { "ok", "clients", "heap", "psram", "bandwidth" };
+
+const char* admitReasonName(admitReason_t aReason) {
+  return aReason < ADMIT_REASONS ? reasons[aReason] : "?";
+}
+
+// ==== Outgoing bandwidth, measured over ADMIT_WINDOW_MS ================================
+void admitSample() {
+  static bool started = false;
+  uint32_t now = millis();
+  uint32_t elapsed = now - sampleTime;
+  if ( started && elapsed < ADMIT_WINDOW_MS ) return;
+
+  uint64_t bytes = sinkSendBytes;
+  if ( started ) admitStats.bandwidth = (uint32_t) ((bytes - sampleBytes) * 1000 / elapsed);
+  started = true;
+  sampleTime = now;
+  sampleBytes = bytes;
+}
+
+//  Frame size the next client will be streamed: the running average once frames are captured
+static size_t frameSize() {
+  return captureStats.count ? captureStats.sizeAvg : ADMIT_FRAME_SIZE;
+}
+
+// ==== What one more client costs, and whether there is room for it ======================
+static admitReason_t admitCheck(uint8_t aFps) {
+  //  Websocket viewers are served by the web server task, but hold a socket and take
+  //  every frame just the same
+  int clients = clientCount() + wsStats.clients;
+  if ( clients >= MAX_CLIENTS || clients >= ADMIT_SOCKETS ) return ADMIT_CLIENTS;
+
+  //  Every client has a socket and its send buffer in internal RAM
+  size_t heap = ADMIT_SOCKET_COST + sizeof(SocketSink);
+#if defined(CAMERA_MULTICLIENT_TASK) || defined(CAMERA_ALL_FRAMES)
+  //  ... and a streaming task of its own
+  heap += CLIENT_TASK_STACK + ADMIT_TASK_COST + sizeof(streamInfo_t);
+  if ( ESP.getMaxAllocHeap() < CLIENT_TASK_STACK ) return ADMIT_HEAP;
+#endif
+
+  //  A client that falls behind holds on to one more frame (a capture slot, or the
+  //  frame chain in all-frames mode). Frames go to PSRAM if there is any
+  size_t frame = frameSize();
+  if ( psramFound() ) {
+    if ( ESP.getFreePsram() < frame + ADMIT_PSRAM_RESERVE ) return ADMIT_PSRAM;
+  }
+  else {
+    heap += frame;
+  }
+  if ( ESP.getFreeHeap() < heap + ADMIT_HEAP_RESERVE ) return ADMIT_HEAP;
+
+  if ( admitBandwidth ) {
+    //  Clients that just connected do not show up in the measurement yet, so the load is
+    //  at least what the current clients need at the frame rates they asked for
+    uint32_t demand = frame * aFps;
+    uint32_t load = frame * (fpsDemand + FPS * wsStats.clients);
+    if ( clients && admitStats.bandwidth > load ) load = admitStats.bandwidth;
+    if ( load + demand > admitBandwidth ) return ADMIT_BANDWIDTH_LIMIT;
+  }
+
+  return ADMIT_OK;
+}
+
+admitReason_t admitClient(uint8_t aFps) {
+  admitReason_t r = admitCheck(aFps);
+  if ( r == ADMIT_OK ) {
+    admitStats.accepted++;
+  }
+  else {
+    admitStats.rejected[r]++;
+    Log.warning("admitClient: client rejected (%s): %d clients, free heap %d, free psram %d, %d bytes/s\n",
+                admitReasonName(r), clientCount(), ESP.getFreeHeap(), ESP.getFreePsram(), admitStats.bandwidth);
+  }
+  return r;
+}
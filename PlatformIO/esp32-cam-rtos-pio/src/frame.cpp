@@ -0,0 +1,193 @@
+#include "frame.h"
+#include "streaming.h"
+#include "framepool.h"
+
+#include <new>
+
+std::atomic<uint32_t> framesAllocated(0);
+
+// ==== Capture ring =========================================================================
+typedef struct {
+  frame_t*            frame;    // NULL until first used
+  size_t              cap;      // data bytes the slot can hold
+  std::atomic<bool>   busy;     // a frame in this slot is referenced
+} frameSlot_t;
+
+static frameSlot_t  ring[CAPTURE_SLOTS];
+uint32_t            frameRingMisses = 0;
+uint32_t            frameCopies = 0;
+uint32_t            frameLends = 0;
+
+static std::atomic<int> fbLent(0);    // camera buffers currently held by frames
+
+static frame_t* frameInit(char* aMem, size_t aSize, int8_t aSlot) {
+  frame_t* f = new (aMem) frame_t;
+  f->refs.store(1);
+  f->slot = aSlot;
+  f->fb = NULL;
+  f->fnm = 0;
+  f->siz = aSize;
+  f->dat = (uint8_t*) (aMem + sizeof(frame_t));
+  f->hln = 0;
+  framesAllocated.fetch_add(1);
+  return f;
+}
+
+//  A free ring slot for aSize bytes of data, with another pool buffer if its buffer does not fit.
+//  A buffer larger than the best fitting one goes back as well, so that the ring does not end up
+//  holding the large buffers the pool keeps for large frames. -1 if all slots are in use
+static int frameSlot(size_t aSize) {
+  for (int i = 0; i < CAPTURE_SLOTS; i++) {
+    frameSlot_t* s = &ring[i];
+    if ( s->busy.load() ) continue;
+    //  In steps, so that a slightly larger frame does not cost another buffer if it came from the heap
+    size_t cap = (aSize + FRAME_POOL_GRANULE - 1) / FRAME_POOL_GRANULE * FRAME_POOL_GRANULE;
+    size_t fit = poolFit(sizeof(frame_t) + cap);
+    if ( s->cap < aSize || (fit && poolSize(s->frame) > fit) ) {
+      poolFree( s->frame );
+      s->frame = (frame_t*) poolAlloc(sizeof(frame_t) + cap);
+      size_t siz = poolSize( s->frame );
+      s->cap = s->frame ? (siz ? siz - sizeof(frame_t) : cap) : 0;
+      if ( s->frame == NULL ) return -1;
+    }
+    return i;
+  }
+  return -1;
+}
+
+
+// ==== Allocate a frame for aSize bytes of data with a single reference =============
+//  Takes a free capture slot, or a separate pool buffer with header and data together
+//  if readers hold all slots. Returns NULL if out of memory.
+frame_t* frameAlloc(size_t aSize) {
+  int i = frameSlot(aSize);
+  if ( i >= 0 ) {
+    ring[i].busy.store(true);
+    return frameInit((char*) ring[i].frame, aSize, i);
+  }
+
+  frameRingMisses++;
+  char* m = (char*) poolAlloc(sizeof(frame_t) + aSize);
+  if ( m == NULL ) return NULL;
+  return frameInit(m, aSize, -1);
+}
+
+frame_t* frameRef(frame_t* aFrame) {
+  if ( aFrame ) aFrame->refs.fetch_add(1);
+  return aFrame;
+}
+
+//  The last reference returns the frame to its capture slot or the camera buffer to the source,
+//  or gives its buffer back to the pool
+void frameUnref(frame_t* aFrame) {
+  if ( aFrame && aFrame->refs.fetch_sub(1) == 1 ) {
+    int8_t slot = aFrame->slot;
+    camera_fb_t* fb = aFrame->fb;
+    aFrame->~frame_t();
+    framesAllocated.fetch_sub(1);
+    if ( fb ) {
+      frameSource->release(fb);
+      fbLent.fetch_sub(1);
+    }
+    if ( slot >= 0 ) ring[slot].busy.store(false);
+    else poolFree( aFrame );
+  }
+}
+
+
+// ==== Frame from a camera frame buffer, without copying if possible ======================
+frame_t* frameCapture(camera_fb_t* aFb) {
+  frame_t* f = NULL;
+
+  //  Lend the buffer only if the source keeps one to capture the next frame into
+  if ( fbLent.load() + 1 < frameSource->buffers() ) {
+    char* m = (char*) poolAlloc(sizeof(frame_t));
+    if ( m ) {
+      f = frameInit(m, aFb->len, -1);
+      f->dat = aFb->buf;
+      f->fb = aFb;
+      f->tms = aFb->timestamp;
+      fbLent.fetch_add(1);
+      frameLends++;
+      return f;
+    }
+  }
+
+  f = frameAlloc(aFb->len);
+  if ( f ) {
+    memcpy(f->dat, aFb->buf, aFb->len);
+    f->tms = aFb->timestamp;
+    frameCopies++;
+  }
+  frameSource->release(aFb);
+  return f;
+}
+
+
+// ==== Lock-free frame publication ====================================================
+//  All atomics use sequentially consistent ordering: a reader increments pins before
+//  re-reading current, the producer stores current before reading pins. Either the
+//  producer sees the pin, or the reader sees the new current and backs off.
+
+//  Drop the frames held by slots that are no longer current and not pinned (producer only)
+static void frameReclaim(framePub_t* aPub) {
+  framePubSlot_t* cur = aPub->current.load();
+  for (int i = 0; i < FRAME_PUB_SLOTS; i++) {
+    framePubSlot_t* s = &aPub->slots[i];
+    if ( s != cur && s->frame && s->pins.load() == 0 ) {
+      frame_t* f = s->frame;
+      s->frame = NULL;
+      frameUnref( f );
+    }
+  }
+}
+
+//  Make aFrame the current frame, taking over the caller's reference. NULL unpublishes.
+//  Must only be called from a single task.
+void framePublish(framePub_t* aPub, frame_t* aFrame) {
+  framePubSlot_t* slot = NULL;
+
+  frameReclaim( aPub );
+  if ( aFrame ) {
+    //  With FRAME_PUB_SLOTS >= 3 a free slot is always there unless readers were preempted
+    //  while pinned - they only hold a pin for a few instructions
+    while ( slot == NULL ) {
+      framePubSlot_t* cur = aPub->current.load();
+      for (int i = 0; i < FRAME_PUB_SLOTS && slot == NULL; i++) {
+        framePubSlot_t* s = &aPub->slots[i];
+        if ( s != cur && s->frame == NULL && s->pins.load() == 0 ) slot = s;
+      }
+      if ( slot == NULL ) {
+        taskYIELD();
+        frameReclaim( aPub );
+      }
+    }
+    slot->frame = aFrame;
+  }
+  aPub->current.store( slot );
+  aPub->generation.fetch_add(1);
+
+  //  Usually nobody is pinning the previous slot, so its frame can go right away
+  frameReclaim( aPub );
+}
+
+//  Reference to the current frame (to be released with frameUnref), or NULL if there is none
+frame_t* frameAcquire(framePub_t* aPub) {
+  for (;;) {
+    framePubSlot_t* s = aPub->current.load();
+    if ( s == NULL ) return NULL;
+
+    s->pins.fetch_add(1);
+    if ( aPub->current.load() == s ) {
+      frame_t* f = frameRef( s->frame );
+      s->pins.fetch_sub(1);
+      return f;
+    }
+    //  A newer frame was published in the meantime - try again with that one
+    s->pins.fetch_sub(1);
+  }
+}
+
+uint32_t frameGeneration(framePub_t* aPub) {
+  return aPub->generation.load();
+}
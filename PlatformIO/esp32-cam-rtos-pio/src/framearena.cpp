@@ -0,0 +1,116 @@
+#include "framearena.h"
+
+frameArena_t frameArena;
+
+uint8_t             frameBackpressure = FRAME_BACKPRESSURE;
+size_t              frameMemoryLimit = FRAME_MEMORY_LIMIT;
+backpressureStats_t backpressureStats;
+
+static const char* policies[BACKPRESSURE_POLICIES] = { "drop-oldest", "pause", "demote" };
+
+const char* backpressureName(uint8_t aPolicy) {
+  return aPolicy < BACKPRESSURE_POLICIES ? policies[aPolicy] : "?";
+}
+
+size_t arenaEntry(size_t aSize) {
+  return (sizeof(frameChunck_t) + aSize + FRAME_ARENA_ALIGN - 1) & ~(size_t) (FRAME_ARENA_ALIGN - 1);
+}
+
+// ==== Allocate the arena buffer: aSize bytes in PSRAM, or less if there is not that much ====
+bool arenaInit(frameArena_t* aArena, size_t aSize) {
+  memset(aArena, 0, sizeof(frameArena_t));
+  aSize &= ~(size_t) (FRAME_ARENA_ALIGN - 1);
+  while ( aSize >= FRAME_ARENA_MIN ) {
+    aArena->buf = (uint8_t*) allocateMemory(NULL, aSize, OK_IF_OOM, PSRAM_ONLY);
+    if ( aArena->buf ) {
+      aArena->size = aSize;
+      return true;
+    }
+    aSize /= 2;
+  }
+  return false;
+}
+
+//  Bytes between the head and the tail, with the end of the buffer skipped by a wrap
+static size_t arenaTaken(const frameArena_t* aArena) {
+  if ( aArena->count == 0 ) return 0;
+  if ( aArena->end ) return aArena->end - aArena->head + aArena->tail;
+  return aArena->tail - aArena->head;
+}
+
+
+// ==== A frame for aSize bytes of data at the tail, NULL if there is no room ===============
+//  Only dat, siz and len are set
+frameChunck_t* arenaAlloc(frameArena_t* aArena, size_t aSize) {
+  size_t len = arenaEntry(aSize);
+  size_t at;
+
+  if ( aArena->end ) {
+    //  Wrapped: the only room is between the tail and the head
+    if ( aArena->tail + len > aArena->head ) {
+      aArena->fails++;
+      return NULL;
+    }
+    at = aArena->tail;
+  }
+  else if ( aArena->tail + len <= aArena->size ) {
+    at = aArena->tail;
+  }
+  else if ( len <= aArena->head ) {
+    //  Not enough room up to the end of the buffer: go back to the start.
+    //  With frames in the arena the head is above 0, so end is never 0 here
+    aArena->end = aArena->tail;
+    aArena->wraps++;
+    at = 0;
+  }
+  else {
+    aArena->fails++;
+    return NULL;
+  }
+
+  frameChunck_t* f = (frameChunck_t*) (aArena->buf + at);
+  f->dat = (uint8_t*) f + sizeof(frameChunck_t);
+  f->siz = aSize;
+  f->len = len;
+  aArena->tail = at + len;
+  aArena->used += len;
+  aArena->count++;
+  aArena->allocs++;
+
+  size_t taken = arenaTaken(aArena);
+  if ( taken > aArena->highWater ) aArena->highWater = taken;
+  return f;
+}
+
+
+// ==== Give back the oldest frame ==========================================================
+void arenaFree(frameArena_t* aArena, frameChunck_t* aFrame) {
+  if ( aArena->count == 0 || (uint8_t*) aFrame != aArena->buf + aArena->head ) {
+    Log.error("arenaFree: frame %d is not the oldest one\n", aFrame->fnm);
+    return;
+  }
+  aArena->head += aFrame->len;
+  aArena->used -= aFrame->len;
+  aArena->count--;
+
+  if ( aArena->count == 0 ) {
+    //  Empty: start over at the bottom, which leaves the most room for the next frames
+    aArena->head = aArena->tail = aArena->end = 0;
+  }
+  else if ( aArena->end && aArena->head == aArena->end ) {
+    //  The head has reached the skipped end of the buffer: the frames continue at the start
+    aArena->head = 0;
+    aArena->end = 0;
+  }
+}
+
+
+// ==== Data bytes of the largest frame that fits right now =================================
+size_t arenaLargest(const frameArena_t* aArena) {
+  size_t room;
+  if ( aArena->count == 0 ) room = aArena->size;
+  else if ( aArena->end ) room = aArena->head - aArena->tail;
+  else if ( aArena->size - aArena->tail > aArena->head ) room = aArena->size - aArena->tail;
+  else room = aArena->head;
+  return room > sizeof(frameChunck_t) ? room - sizeof(frameChunck_t) : 0;
+}
@@ -0,0 +1,144 @@
+#include "framepool.h"
+
+framePool_t framePool;
+
+static SemaphoreHandle_t  poolSync = NULL;    // NULL until poolInit(): everything comes from the heap
+
+//  Frame classes in typical frame sizes / 2, and the buffers wanted of each
+static const uint8_t  classHalves[FRAME_POOL_CLASSES] = { 0, 1, 2, 3, 4 };
+static const uint16_t classCounts[FRAME_POOL_CLASSES] = { FRAME_POOL_HEADERS, 3, FRAME_POOL_FRAMES, 3, 2 };
+//  The typical frames are set aside first, so that a small board has them at least
+static const uint8_t  classOrder[FRAME_POOL_CLASSES] = { 0, 2, 1, 3, 4 };
+
+static size_t headerSize() {
+  return (sizeof(frame_t) + 7) & ~(size_t) 7;
+}
+
+//  Class of a buffer handed out by the pool, NULL for anything else
+static poolClass_t* poolClass(const void* aPtr) {
+  const uint8_t* p = (const uint8_t*) aPtr;
+  for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+    poolClass_t* c = &framePool.classes[i];
+    if ( c->base && p >= c->base && p < c->base + c->size * c->count ) return c;
+  }
+  return NULL;
+}
+
+
+// ==== Set aside the buffers for frames of aWidth x aHeight pixels ========================
+//  Returns false if not even the buffers of typical frames could be had
+bool poolInit(uint16_t aWidth, uint16_t aHeight) {
+  memset(&framePool, 0, sizeof(framePool));
+
+  size_t typical = (size_t) aWidth * aHeight / FRAME_POOL_RATIO;
+  typical = (typical / 2 + FRAME_POOL_GRANULE - 1) / FRAME_POOL_GRANULE * FRAME_POOL_GRANULE * 2;
+  bool psram = psramFound();
+  size_t budget = FRAME_POOL_DRAM;
+
+  for (int k = 0; k < FRAME_POOL_CLASSES; k++) {
+    int i = classOrder[k];
+    poolClass_t* c = &framePool.classes[i];
+    c->size = headerSize() + typical / 2 * classHalves[i];
+    c->psram = psram && i > 0;
+    size_t count = classCounts[i];
+    if ( i > 0 && !psram && count > budget / c->size ) count = budget / c->size;
+
+    //  Fewer buffers if there is not enough memory for all of them
+    for (; count > 0; count--) {
+      c->base = (uint8_t*) allocateMemory(NULL, c->size * count, OK_IF_OOM, c->psram ? PSRAM_ONLY : ANY_MEMORY);
+      if ( c->base ) break;
+    }
+    c->count = count;
+    if ( i > 0 && !psram ) budget -= c->size * count;
+    framePool.size += c->size * count;
+
+    for (size_t n = count; n > 0; n--) {
+      void* b = c->base + c->size * (n - 1);
+      *(void**) b = c->free;
+      c->free = b;
+    }
+    Log.trace("poolInit: %d buffers of %d bytes in %s\n", (int) c->count, (int) c->size, c->psram ? "PSRAM" : "DRAM");
+  }
+
+  poolSync = xSemaphoreCreateMutex();
+  return framePool.classes[2].count > 0;
+}
+
+
+// ==== A buffer of at least aSize bytes: the smallest free one, or from the heap ==========
+//  A frame header only takes a header buffer, never a frame buffer
+void* poolAlloc(size_t aSize) {
+  if ( poolSync == NULL ) return allocateMemory(NULL, aSize, OK_IF_OOM, ANY_MEMORY);
+
+  xSemaphoreTake( poolSync, portMAX_DELAY );
+  bool fitted = false;
+  void* b = NULL;
+  for (int i = 0; i < FRAME_POOL_CLASSES && b == NULL; i++) {
+    poolClass_t* c = &framePool.classes[i];
+    if ( c->size < aSize ) continue;
+    if ( i > 0 && aSize <= framePool.classes[0].size ) break;
+    if ( c->free == NULL ) {
+      //  The best fit is taken: a larger buffer then
+      if ( !fitted ) c->misses++;
+      fitted = true;
+      continue;
+    }
+    fitted = true;
+    b = c->free;
+    c->free = *(void**) b;
+    if ( ++c->used > c->highWater ) c->highWater = c->used;
+    c->allocs++;
+    framePool.used += c->size;
+    if ( framePool.used > framePool.highWater ) framePool.highWater = framePool.used;
+    framePool.requested += aSize;
+    framePool.granted += c->size;
+  }
+  if ( b == NULL ) framePool.fallbacks++;
+  xSemaphoreGive( poolSync );
+
+  if ( b == NULL ) {
+    b = allocateMemory(NULL, aSize, OK_IF_OOM, ANY_MEMORY);
+    if ( b == NULL ) {
+      xSemaphoreTake( poolSync, portMAX_DELAY );
+      framePool.failures++;
+      xSemaphoreGive( poolSync );
+    }
+  }
+  return b;
+}
+
+
+// ==== Give a buffer back to its class, or to the heap if it came from there ===============
+void poolFree(void* aPtr) {
+  if ( aPtr == NULL ) return;
+  poolClass_t* c = poolClass(aPtr);
+  if ( c == NULL ) {
+    free(aPtr);
+    return;
+  }
+  xSemaphoreTake( poolSync, portMAX_DELAY );
+  *(void**) aPtr = c->free;
+  c->free = aPtr;
+  c->used--;
+  framePool.used -= c->size;
+  xSemaphoreGive( poolSync );
+}
+
+
+size_t poolFit(size_t aSize) {
+  for (int i = 0; i < FRAME_POOL_CLASSES; i++) {
+    poolClass_t* c = &framePool.classes[i];
+    if ( c->count && c->size >= aSize ) return c->size;
+  }
+  return 0;
+}
+
+size_t poolSize(const void* aPtr) {
+  poolClass_t* c = poolClass(aPtr);
+  return c ? c->size : 0;
+}
+
+uint8_t poolWaste() {
+  if ( framePool.granted == 0 ) return 0;
+  return (uint8_t) ((framePool.granted - framePool.requested) * 100 / framePool.granted);
+}
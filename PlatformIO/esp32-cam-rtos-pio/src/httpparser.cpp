@@ -0,0 +1,202 @@
+#include "httpparser.h"
+#include <ctype.h>
+
+static bool isToken(char c) {
+  if ( c <= ' ' || c >= 0x7F ) return false;
+  return strchr("()<>@,;:\\\"/[]?={}", c) == NULL;
+}
+
+//  End of the line starting at aPos (position of '\n'), -1 if it has not arrived yet
+static int lineEnd(const char* aBuf, size_t aLen, size_t aPos) {
+  const char* p = (const char*) memchr(aBuf + aPos, '\n', aLen - aPos);
+  return p ? (int) (p - aBuf) : -1;
+}
+
+//  Line length without the '\r' before '\n'
+static size_t lineLength(const char* aBuf, size_t aStart, size_t aEnd) {
+  return ( aEnd > aStart && aBuf[aEnd - 1] == '\r' ) ? aEnd - 1 - aStart : aEnd - aStart;
+}
+
+static httpMethod_t method(const char* aStr, size_t aLen) {
+  if ( aLen == 3 && memcmp(aStr, "GET", 3) == 0 ) return HTTP_M_GET;
+  if ( aLen == 4 && memcmp(aStr, "HEAD", 4) == 0 ) return HTTP_M_HEAD;
+  if ( aLen == 4 && memcmp(aStr, "POST", 4) == 0 ) return HTTP_M_POST;
+  return HTTP_M_OTHER;
+}
+
+// ==== Request line: METHOD SP target SP HTTP/1.x (or RTSP/1.0) ====
+//  The target is a path (origin-form), an absolute URI (rtsp://host:554/mjpeg/1, absolute-form)
+//  whose path is used, or "*" (OPTIONS)
+static bool parseRequestLine(const char* aLine, size_t aLen, httpRequest_t* aReq) {
+  size_t i = 0;
+  while ( i < aLen && isToken(aLine[i]) ) i++;
+  if ( i == 0 || i >= aLen || aLine[i] != ' ' || i > 0xFF ) return false;
+  aReq->method = method(aLine, i);
+  aReq->mth = aLine;
+  aReq->mln = i;
+
+  size_t t = ++i;
+  while ( i < aLen && aLine[i] > ' ' && aLine[i] < 0x7F ) i++;
+  if ( i == t || i >= aLen || aLine[i] != ' ' ) return false;
+  if ( i - t > 0xFFFF ) return false;
+  const char* target = aLine + t;
+  const char* end = aLine + i;
+  if ( *target != '/' ) {
+    if ( i - t == 1 && *target == '*' ) {
+      aReq->path = target;
+      aReq->pln = 1;
+      target = end;
+    }
+    else {
+      //  scheme "://" authority, then the path (which may be empty)
+      const char* s = target;
+      while ( s < end && (isalnum((uint8_t) *s) || *s == '+' || *s == '-' || *s == '.') ) s++;
+      if ( s == target || end - s < 3 || memcmp(s, "://", 3) != 0 ) return false;
+      const char* slash = (const char*) memchr(s + 3, '/', end - (s + 3));
+      target = slash ? slash : end;
+    }
+  }
+  if ( aReq->path == NULL ) {
+    const char* q = (const char*) memchr(target, '?', end - target);
+    aReq->path = target;
+    if ( q ) {
+      aReq->pln = q - target;
+      aReq->query = q + 1;
+      aReq->qln = end - (q + 1);
+    }
+    else {
+      aReq->pln = end - target;
+    }
+  }
+
+  i++;
+  if ( aLen - i == 8 && memcmp(aLine + i, "RTSP/1.0", 8) == 0 ) {
+    aReq->rtsp = true;
+    return true;
+  }
+  if ( aLen - i != 8 || memcmp(aLine + i, "HTTP/1.", 7) != 0 ) return false;
+  char m = aLine[i + 7];
+  if ( m < '0' || m > '9' ) return false;
+  aReq->minor = m - '0';
+  return true;
+}
+
+// ==== Header line: name ":" OWS value OWS ====
+static bool parseHeaderLine(const char* aLine, size_t aLen, httpRequest_t* aReq) {
+  size_t i = 0;
+  while ( i < aLen && isToken(aLine[i]) ) i++;
+  if ( i == 0 || i >= aLen || aLine[i] != ':' ) return false;
+  size_t nln = i++;
+
+  while ( i < aLen && (aLine[i] == ' ' || aLine[i] == '\t') ) i++;
+  size_t v = i;
+  size_t e = aLen;
+  while ( e > v && (aLine[e - 1] == ' ' || aLine[e - 1] == '\t') ) e--;
+  for (size_t k = v; k < e; k++) {
+    if ( (uint8_t) aLine[k] < ' ' && aLine[k] != '\t' ) return false;
+  }
+  if ( nln > 0xFFFF || e - v > 0xFFFF ) return false;
+
+  if ( aReq->headerCount < HTTP_HEADERS_MAX ) {
+    httpHeader_t* h = &aReq->headers[aReq->headerCount++];
+    h->nam = aLine;
+    h->nln = nln;
+    h->val = aLine + v;
+    h->vln = e - v;
+  }
+  return true;
+}
+
+int httpParse(const char* aBuf, size_t aLen, httpRequest_t* aReq) {
+  size_t pos = 0;
+
+  memset(aReq, 0, sizeof(httpRequest_t));
+
+  //  Tolerate empty lines ahead of the request line (RFC 7230 3.5)
+  while ( pos < aLen && (aBuf[pos] == '\r' || aBuf[pos] == '\n') ) pos++;
+
+  int end = lineEnd(aBuf, aLen, pos);
+  if ( end < 0 ) return HTTP_INCOMPLETE;
+  if ( !parseRequestLine(aBuf + pos, lineLength(aBuf, pos, end), aReq) ) return HTTP_BAD_REQUEST;
+  pos = end + 1;
+
+  for (;;) {
+    end = lineEnd(aBuf, aLen, pos);
+    if ( end < 0 ) return HTTP_INCOMPLETE;
+    size_t len = lineLength(aBuf, pos, end);
+    if ( len == 0 ) return end + 1;
+    if ( !parseHeaderLine(aBuf + pos, len, aReq) ) return HTTP_BAD_REQUEST;
+    pos = end + 1;
+  }
+}
+
+bool httpEquals(const char* aStr, uint16_t aLen, const char* aLit) {
+  return strlen(aLit) == aLen && memcmp(aStr, aLit, aLen) == 0;
+}
+
+const char* httpMethodName(httpMethod_t aMethod) {
+  switch ( aMethod ) {
+    case HTTP_M_GET:  return "GET";
+    case HTTP_M_HEAD: return "HEAD";
+    case HTTP_M_POST: return "POST";
+    default:          return "OTHER";
+  }
+}
+
+bool httpEtagMatch(const char* aList, uint16_t aLen, const char* aTag) {
+  size_t n = strlen(aTag);
+  uint16_t i = 0;
+
+  while ( i < aLen ) {
+    while ( i < aLen && (aList[i] == ' ' || aList[i] == '\t' || aList[i] == ',') ) i++;
+    if ( i < aLen && aList[i] == '*' ) return true;
+    if ( i + 1 < aLen && aList[i] == 'W' && aList[i + 1] == '/' ) i += 2;
+    if ( i >= aLen || aList[i] != '"' ) return false;
+    const char* q = (const char*) memchr(aList + i + 1, '"', aLen - i - 1);
+    if ( q == NULL ) return false;
+    if ( (size_t) (q - (aList + i + 1)) == n && memcmp(aList + i + 1, aTag, n) == 0 ) return true;
+    i = q - aList + 1;
+  }
+  return false;
+}
+
+const char* httpHeader(const httpRequest_t* aReq, const char* aName, uint16_t* aLen) {
+  size_t n = strlen(aName);
+  for (int i = 0; i < aReq->headerCount; i++) {
+    const httpHeader_t* h = &aReq->headers[i];
+    if ( h->nln == n && strncasecmp(h->nam, aName, n) == 0 ) {
+      if ( aLen ) *aLen = h->vln;
+      return h->val;
+    }
+  }
+  return NULL;
+}
+
+const char* httpArg(const httpRequest_t* aReq, const char* aName, uint16_t* aLen) {
+  size_t n = strlen(aName);
+  const char* p = aReq->query;
+  const char* end = p + aReq->qln;
+
+  while ( p && p < end ) {
+    const char* amp = (const char*) memchr(p, '&', end - p);
+    const char* e = amp ? amp : end;
+    const char* eq = (const char*) memchr(p, '=', e - p);
+    const char* ne = eq ? eq : e;
+    if ( (size_t) (ne - p) == n && memcmp(p, aName, n) == 0 ) {
+      const char* v = eq ? eq + 1 : e;
+      if ( aLen ) *aLen = e - v;
+      return v;
+    }
+    p = amp ? amp + 1 : NULL;
+  }
+  return NULL;
+}
+
+const httpRoute_t* httpRoute(const httpRoute_t* aRoutes, int aCount, const httpRequest_t* aReq) {
+  for (int i = 0; i < aCount; i++) {
+    const httpRoute_t* r = &aRoutes[i];
+    if ( r->method != HTTP_M_OTHER && r->method != aReq->method ) continue;
+    if ( httpEquals(aReq->path, aReq->pln, r->path) ) return r;
+  }
+  return NULL;
+}
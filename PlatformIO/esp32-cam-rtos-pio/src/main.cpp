@@ -17,6 +17,10 @@
 
 #include "credentials.h"
 #include "streaming.h"
+#include "metrics.h"
+#if defined(RTSP_SERVER)
+#include "rtsp.h"
+#endif
 
 const char *c_ssid = AP_SSID;
 const char *c_pwd = AP_PWD;
@@ -27,18 +31,20 @@ const char *c_pwd = AP_PWD;
 
 #include "camera_pins.h"
 
-WebServer server(80);
-
 // ===== rtos task handles =========================
 // Streaming is implemented with tasks:
 TaskHandle_t tMjpeg;            // handles client connections to the webserver
-TaskHandle_t tCam;              // handles getting picture frames from the camera and storing them locally
-TaskHandle_t tStream;
 
-uint8_t      noActiveClients;   // number of active clients
 
-// frameSync semaphore is used to prevent streaming buffer as it is replaced with the next frame
-SemaphoreHandle_t frameSync = NULL;
+// ===== Camera driver as the source of frames for camCB ==========================
+class EspCameraSource : public FrameSource {
+  public:
+    camera_fb_t*  get() { return esp_camera_fb_get(); }
+    void          release(camera_fb_t* aFrame) { esp_camera_fb_return(aFrame); }
+    int           buffers() { return CAMERA_FB_COUNT; }
+};
+
+EspCameraSource cameraSource;
 
 
 // ==== SETUP method ==================================================================
@@ -80,7 +86,7 @@ void setup() {
     .pixel_format   = PIXFORMAT_JPEG,
     .frame_size     = FRAME_SIZE,
     .jpeg_quality   = JPEG_QUALITY,
-    .fb_count       = 2,
+    .fb_count       = CAMERA_FB_COUNT,
     .fb_location = CAMERA_FB_IN_DRAM,
     .grab_mode = CAMERA_GRAB_LATEST,
     // .sccb_i2c_port = -1
@@ -102,6 +108,10 @@ void setup() {
   s->set_vflip(s, true);
 #endif
 
+  //  Count the frames the driver drops (FB-OVF, NO-EOI) for /metrics
+  metricsDriverHook();
+  frameSource = &cameraSource;
+
   //  Configure and connect to WiFi
   char apname[65];
   char passwd[65];
@@ -136,11 +146,24 @@ void setup() {
     mjpegCB,
     "mjpeg",
     3 * KILOBYTE,
-    NULL,
+    (void*) WEBSERVER_PORT,
     tskIDLE_PRIORITY + 2,
     &tMjpeg,
     PRO_CPU);
 
+#if defined(RTSP_SERVER)
+  // RTSP server for NVRs and players that need RTP: rtsp://<ip>:RTSP_PORT/mjpeg/1
+  Serial.printf("RTSP Link: rtsp://%s:%d%s\n\n", ip.toString().c_str(), RTSP_PORT, STREAMING_URL);
+  xTaskCreatePinnedToCore(
+    rtspCB,
+    "rtsp",
+    4 * KILOBYTE,
+    (void*) RTSP_PORT,
+    tskIDLE_PRIORITY + 2,
+    &tRtsp,
+    PRO_CPU);
+#endif
+
   Log.trace("setup complete: free heap  : %d\n", ESP.getFreeHeap());
 }
 
@@ -0,0 +1,527 @@
+#include "metrics.h"
+#include "admission.h"
+#include "framepool.h"
+#include "framearena.h"
+#include "websocket.h"
+#include "rtsp.h"
+#include "socketsink.h"
+
+#include <stdarg.h>
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include "esp_log.h"
+#endif
+
+typedef struct {
+  std::atomic<bool>     used;
+  std::atomic<uint32_t> seq;    // odd while the owner updates the slot
+  clientMetrics_t       m;
+} metricsSlot_t;
+
+static metricsSlot_t slots[METRICS_CLIENTS];
+
+static const char* kindNames[METRICS_KINDS] = { "mjpeg", "websocket" };
+
+//  Bucket bounds: times in us, sizes in bytes
+static const uint32_t CAPTURE_US[METRICS_BUCKETS]  = { 1000, 2000, 5000, 10000, 20000, 30000, 50000, 75000, 100000, 150000, 250000, 500000 };
+static const uint32_t INTERVAL_US[METRICS_BUCKETS] = { 25000, 40000, 50000, 66667, 100000, 125000, 150000, 200000, 250000, 500000, 1000000, 2000000 };
+static const uint32_t SIZE_BYTES[METRICS_BUCKETS]  = { 4096, 8192, 16384, 24576, 32768, 40960, 49152, 65536, 81920, 98304, 131072, 196608 };
+static const uint32_t SEND_US[METRICS_BUCKETS]     = { 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000 };
+const uint32_t latencyBounds[METRICS_BUCKETS]      = { 10000, 20000, 35000, 50000, 75000, 100000, 150000, 200000, 300000, 500000, 1000000, 2000000 };
+
+static histogram_t captureTime = { CAPTURE_US };
+static histogram_t captureInterval = { INTERVAL_US };
+static histogram_t frameSize = { SIZE_BYTES };
+static histogram_t sendTime[METRICS_KINDS] = { { SEND_US }, { SEND_US } };
+static histogram_t firstByte[METRICS_KINDS] = { { latencyBounds }, { latencyBounds } };
+static histogram_t lastByte[METRICS_KINDS] = { { latencyBounds }, { latencyBounds } };
+
+//  Latencies longer than this are not a frame sent late but a timestamp from another clock:
+//  the driver stamps frames with esp_timer_get_time(), which micros() reads as well
+#define METRICS_LATENCY_MAX   60000000
+
+//  Totals per kind of client, past clients included
+typedef struct {
+  std::atomic<uint32_t> frames;
+  std::atomic<uint64_t> bytes;
+  std::atomic<uint32_t> skipped;
+  std::atomic<uint32_t> joined;
+} kindTotals_t;
+
+static kindTotals_t totals[METRICS_KINDS];
+static std::atomic<uint32_t> driverEvents[DRIVER_EVENTS];
+static const char* driverEventNames[DRIVER_EVENTS] = { "FB-OVF", "NO-EOI" };
+
+const char* metricsKindName(uint8_t aKind) {
+  return aKind < METRICS_KINDS ? kindNames[aKind] : "?";
+}
+
+
+// ==== Client slots ======================================================================
+int8_t metricsJoin(uint8_t aKind, uint8_t aFps) {
+  for (int i = 0; i < METRICS_CLIENTS; i++) {
+    metricsSlot_t* s = &slots[i];
+    if ( s->used.exchange(true) ) continue;
+    uint32_t seq = s->seq.load(std::memory_order_relaxed);
+    s->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    memset(&s->m, 0, sizeof(clientMetrics_t));
+    s->m.kind = aKind;
+    s->m.fps = aFps;
+    s->m.since = millis();
+    s->seq.store(seq + 2, std::memory_order_release);
+    if ( aKind < METRICS_KINDS ) totals[aKind].joined++;
+    return i;
+  }
+  return -1;
+}
+
+void metricsLeave(int8_t aSlot) {
+  if ( aSlot < 0 ) return;
+  slots[aSlot].used.store(false);
+}
+
+static uint8_t bucketOf(const uint32_t* aBounds, uint32_t aValue) {
+  uint8_t i = 0;
+  while ( i < METRICS_BUCKETS && aValue > aBounds[i] ) i++;
+  return i;
+}
+
+//  A frame is out: aSendUs from the first byte handed to the socket to the last.
+//  The capture timestamp is in us since boot, as micros() is: the difference is right
+//  across micros() wrapping around
+void metricsSent(int8_t aSlot, uint32_t aFnm, size_t aBytes, uint32_t aSendUs, const struct timeval* aTms) {
+  if ( aSlot < 0 ) return;
+  metricsSlot_t* s = &slots[aSlot];
+  clientMetrics_t* m = &s->m;
+  uint32_t now = micros();
+
+  uint32_t last = 0;
+  bool timed = aTms && (aTms->tv_sec || aTms->tv_usec);
+  if ( timed ) {
+    last = now - (uint32_t) (aTms->tv_sec * 1000000ULL + aTms->tv_usec);
+    timed = last <= METRICS_LATENCY_MAX;
+  }
+  uint32_t first = timed && last > aSendUs ? last - aSendUs : 0;
+
+  uint32_t skipped = 0;
+
+  uint32_t seq = s->seq.load(std::memory_order_relaxed);
+  s->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  if ( m->frames ) {
+    //  Frames the client passed over at its own frame rate were not due to it
+    uint32_t step = frameStep(m->fps);
+    if ( aFnm - m->fnm > step ) skipped = aFnm - m->fnm - step;
+    m->skipped += skipped;
+    //  Averages over about the last 8 frames, seeded with the first one
+    int32_t interval = now - m->last;
+    if ( m->frames > 1 ) m->intervalAvg += (interval - (int32_t) m->intervalAvg) / 8;
+    else m->intervalAvg = interval;
+    m->sendAvg += ((int32_t) aSendUs - (int32_t) m->sendAvg) / 8;
+  }
+  else {
+    m->sendAvg = aSendUs;
+  }
+  if ( aSendUs > m->sendMax ) m->sendMax = aSendUs;
+  m->sendSum += aSendUs;
+  m->frames++;
+  m->bytes += aBytes;
+  m->fnm = aFnm;
+  m->last = now;
+  if ( timed ) {
+    m->firstByte[bucketOf(latencyBounds, first)]++;
+    m->lastByte[bucketOf(latencyBounds, last)]++;
+    m->firstByteSum += first;
+    m->lastByteSum += last;
+    if ( last > m->lastByteMax ) m->lastByteMax = last;
+    m->timed++;
+  }
+  s->seq.store(seq + 2, std::memory_order_release);
+
+  kindTotals_t* t = &totals[m->kind];
+  t->frames.fetch_add(1, std::memory_order_relaxed);
+  t->bytes.fetch_add(aBytes, std::memory_order_relaxed);
+  if ( skipped ) t->skipped.fetch_add(skipped, std::memory_order_relaxed);
+  histogramAdd(&sendTime[m->kind], aSendUs);
+  if ( timed ) {
+    histogramAdd(&firstByte[m->kind], first);
+    histogramAdd(&lastByte[m->kind], last);
+  }
+}
+
+bool metricsClient(int aSlot, clientMetrics_t* aCopy) {
+  metricsSlot_t* s = &slots[aSlot];
+  for (;;) {
+    if ( !s->used.load() ) return false;
+    uint32_t seq = s->seq.load(std::memory_order_acquire);
+    if ( seq & 1 ) {
+      taskYIELD();
+      continue;
+    }
+    memcpy(aCopy, &s->m, sizeof(clientMetrics_t));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if ( s->seq.load(std::memory_order_relaxed) == seq ) return true;
+  }
+}
+
+//  Upper bound of the bucket the aPct percentile falls in; aMax for the bucket above the bounds
+uint32_t metricsPercentile(const uint32_t* aCounts, uint32_t aMax, uint8_t aPct) {
+  uint64_t count = 0;
+  for (int i = 0; i <= METRICS_BUCKETS; i++) count += aCounts[i];
+  if ( count == 0 ) return 0;
+  uint64_t rank = (count * aPct + 99) / 100;
+  uint64_t seen = 0;
+  for (int i = 0; i < METRICS_BUCKETS; i++) {
+    seen += aCounts[i];
+    if ( seen >= rank ) return latencyBounds[i] < aMax ? latencyBounds[i] : aMax;
+  }
+  return aMax;
+}
+
+uint32_t metricsFps10(const clientMetrics_t* aClient) {
+  if ( aClient->frames < 2 || aClient->intervalAvg == 0 ) return 0;
+  //  Nothing sent for a while: the average no longer tells
+  if ( micros() - aClient->last > 2 * aClient->intervalAvg + 1000000 ) return 0;
+  return (10000000 + aClient->intervalAvg / 2) / aClient->intervalAvg;
+}
+
+void metricsLogClient(int8_t aSlot) {
+  clientMetrics_t m;
+  if ( aSlot < 0 || !metricsClient(aSlot, &m) ) return;
+  uint32_t fps = metricsFps10(&m);
+  Log.verbose("metrics: %s client %d: fps=%d.%d of %d, frames=%d, skipped=%d, send avg=%d us, max=%d us, "
+              "capture to last byte p50=%d us, p99=%d us, max=%d us\n",
+              metricsKindName(m.kind), aSlot, fps / 10, fps % 10, m.fps, m.frames, m.skipped, m.sendAvg, m.sendMax,
+              (int) metricsPercentile(m.lastByte, m.lastByteMax, 50), (int) metricsPercentile(m.lastByte, m.lastByteMax, 99),
+              (int) m.lastByteMax);
+}
+
+void metricsLog() {
+  for (int i = 0; i < METRICS_CLIENTS; i++) metricsLogClient(i);
+}
+
+
+
+// ==== Histograms and counters for /metrics ===============================================
+void histogramAdd(histogram_t* aHist, uint32_t aValue) {
+  aHist->counts[bucketOf(aHist->bounds, aValue)].fetch_add(1, std::memory_order_relaxed);
+  aHist->sum.fetch_add(aValue, std::memory_order_relaxed);
+}
+
+void metricsCapture(uint32_t aCaptureUs, uint32_t aIntervalUs, size_t aSize) {
+  histogramAdd(&captureTime, aCaptureUs);
+  if ( aIntervalUs ) histogramAdd(&captureInterval, aIntervalUs);
+  histogramAdd(&frameSize, aSize);
+}
+
+void metricsDriverEvent(uint8_t aEvent) {
+  if ( aEvent < DRIVER_EVENTS ) driverEvents[aEvent].fetch_add(1, std::memory_order_relaxed);
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+//  The camera driver is a framework component that only tells about these events in its log:
+//  every log line goes through here first. They are warnings, so they only come by when the
+//  cam_hal log level lets warnings through; it is left as the application set it. EV-OVF is
+//  logged from the interrupt with the early logger, which does not come by here
+static vprintf_like_t driverLogNext = NULL;
+
+static int driverLog(const char* aFmt, va_list aArgs) {
+  for (int i = 0; i < DRIVER_EVENTS; i++) {
+    if ( strstr(aFmt, driverEventNames[i]) ) metricsDriverEvent(i);
+  }
+  return driverLogNext ? driverLogNext(aFmt, aArgs) : vprintf(aFmt, aArgs);
+}
+
+void metricsDriverHook() {
+  driverLogNext = esp_log_set_vprintf(driverLog);
+}
+#else
+void metricsDriverHook() {}
+#endif
+
+
+// ==== Responses rendered into a buffer ===================================================
+//  Makes room for aMore bytes after what is rendered so far
+static bool metricsGrow(metricsOut_t* aOut, size_t aMore) {
+  if ( aOut->len + aMore <= aOut->size ) return true;
+  size_t size = aOut->size;
+  while ( size < aOut->len + aMore ) size += METRICS_CHUNK;
+  if ( size > METRICS_MAX ) return false;
+  char* buf = (char*) ps_malloc(size);
+  if ( buf == NULL ) return false;
+  if ( aOut->buf ) {
+    memcpy(buf, aOut->buf, aOut->len);
+    free(aOut->buf);
+  }
+  aOut->buf = buf;
+  aOut->size = size;
+  return true;
+}
+
+void metricsBegin(metricsOut_t* aOut) {
+  aOut->buf = NULL;
+  aOut->len = 0;
+  aOut->size = 0;
+  aOut->failed = !metricsGrow(aOut, METRICS_CHUNK);
+}
+
+void metricsPrint(metricsOut_t* aOut, const char* aFmt, ...) {
+  for (int tries = 0; tries < 2 && !aOut->failed; tries++) {
+    va_list args;
+    va_start(args, aFmt);
+    int n = vsnprintf(aOut->buf + aOut->len, aOut->size - aOut->len, aFmt, args);
+    va_end(args);
+    if ( n < 0 ) return;
+    if ( aOut->len + n < aOut->size ) {
+      aOut->len += n;
+      return;
+    }
+    //  Does not fit behind what is there: grow the buffer and render it again
+    if ( !metricsGrow(aOut, n + 1) ) aOut->failed = true;
+  }
+}
+
+bool metricsEnd(metricsOut_t* aOut) {
+  return !aOut->failed;
+}
+
+void metricsFree(metricsOut_t* aOut) {
+  free(aOut->buf);
+  aOut->buf = NULL;
+  aOut->len = 0;
+  aOut->size = 0;
+}
+
+
+// ==== GET /stats ==========================================================================
+#if defined(CAMERA_MULTICLIENT_QUEUE)
+#define STATS_MODE  "queue"
+#elif defined(CAMERA_MULTICLIENT_TASK)
+#define STATS_MODE  "task"
+#else
+#define STATS_MODE  "allframes"
+#endif
+
+//  Capture to send latency of a client: average, percentiles (bucket bounds) and the counts per
+//  bucket of latency_bounds_us, the last one for anything longer
+static void statsLatency(metricsOut_t* aOut, const char* aName, const uint32_t* aCounts, uint64_t aSum, uint32_t aMax, uint32_t aTimed) {
+  metricsPrint(aOut, ",\"%s_us\":{\"avg\":%u,\"p50\":%u,\"p90\":%u,\"p99\":%u,\"buckets\":[", aName,
+               (unsigned) (aTimed ? aSum / aTimed : 0), (unsigned) metricsPercentile(aCounts, aMax, 50),
+               (unsigned) metricsPercentile(aCounts, aMax, 90), (unsigned) metricsPercentile(aCounts, aMax, 99));
+  for (int i = 0; i <= METRICS_BUCKETS; i++) metricsPrint(aOut, "%s%u", i ? "," : "", (unsigned) aCounts[i]);
+  metricsPrint(aOut, "]}");
+}
+
+void statsJson(metricsOut_t* aOut) {
+  uint32_t intervalAvg = captureStats.count > 1 ? captureStats.sum / (captureStats.count - 1) : 0;
+  uint32_t fps10 = intervalAvg ? (10000000 + intervalAvg / 2) / intervalAvg : 0;
+
+  metricsPrint(aOut, "{\"mode\":\"" STATS_MODE "\",\"uptime_ms\":%u,\"fps_max\":%u,\"capture_fps\":%u,\"clients\":%u,",
+               (unsigned) millis(), (unsigned) FPS, (unsigned) captureFps, (unsigned) clientCount());
+  metricsPrint(aOut, "\"capture\":{\"frames\":%u,\"errors\":%u,\"fps\":%u.%u,\"interval_avg_us\":%u,\"interval_max_us\":%u,"
+               "\"time_avg_us\":%u,\"time_max_us\":%u,\"size_avg\":%u},",
+               (unsigned) captureStats.count, (unsigned) captureStats.errors, (unsigned) (fps10 / 10), (unsigned) (fps10 % 10),
+               (unsigned) intervalAvg, (unsigned) captureStats.maxGap, (unsigned) captureStats.timeAvg,
+               (unsigned) captureStats.timeMax, (unsigned) captureStats.sizeAvg);
+  metricsPrint(aOut, "\"memory\":{\"heap_free\":%u,\"heap_min_free\":%u,\"heap_largest\":%u,"
+               "\"psram_free\":%u,\"psram_min_free\":%u,\"psram_largest\":%u},",
+               (unsigned) ESP.getFreeHeap(), (unsigned) ESP.getMinFreeHeap(), (unsigned) ESP.getMaxAllocHeap(),
+               (unsigned) ESP.getFreePsram(), (unsigned) ESP.getMinFreePsram(), (unsigned) ESP.getMaxAllocPsram());
+#if defined(CAMERA_ALL_FRAMES)
+  metricsPrint(aOut, "\"arena\":{\"size\":%u,\"used\":%u,\"frames\":%u,\"high_water\":%u,\"limit\":%u,\"policy\":\"%s\","
+               "\"laggards\":%u,\"demoted\":%u,\"skipped\":%u,\"paused\":%u,\"full\":%u},",
+               (unsigned) frameArena.size, (unsigned) frameArena.used, (unsigned) frameArena.count, (unsigned) frameArena.highWater,
+               (unsigned) frameMemoryLimit, backpressureName(frameBackpressure), (unsigned) backpressureStats.laggards,
+               (unsigned) backpressureStats.demoted, (unsigned) backpressureStats.skipped.load(),
+               (unsigned) backpressureStats.paused, (unsigned) backpressureStats.full);
+#else
+  metricsPrint(aOut, "\"pool\":{\"size\":%u,\"used\":%u,\"high_water\":%u,\"waste_pct\":%u,\"fallbacks\":%u,\"failures\":%u,"
+               "\"ring_misses\":%u,\"lends\":%u,\"copies\":%u},",
+               (unsigned) framePool.size, (unsigned) framePool.used, (unsigned) framePool.highWater, (unsigned) poolWaste(),
+               (unsigned) framePool.fallbacks, (unsigned) framePool.failures, (unsigned) frameRingMisses,
+               (unsigned) frameLends, (unsigned) frameCopies);
+#endif
+  metricsPrint(aOut, "\"admission\":{\"accepted\":%u,\"rejected\":%u,\"bandwidth\":%u},",
+               (unsigned) admitStats.accepted,
+               (unsigned) (admitStats.rejected[ADMIT_CLIENTS] + admitStats.rejected[ADMIT_HEAP] +
+                           admitStats.rejected[ADMIT_PSRAM] + admitStats.rejected[ADMIT_BANDWIDTH_LIMIT]),
+               (unsigned) admitStats.bandwidth);
+  metricsPrint(aOut, "\"send\":{\"calls\":%u,\"bytes\":%llu},", (unsigned) sinkSendCalls.load(),
+               (unsigned long long) sinkSendBytes.load());
+  metricsPrint(aOut, "\"websocket\":{\"viewers\":%u,\"frames\":%u,\"skipped\":%u,\"acks\":%u},",
+               (unsigned) wsStats.clients, (unsigned) wsStats.frames, (unsigned) wsStats.skipped, (unsigned) wsStats.acks);
+  metricsPrint(aOut, "\"rtsp\":{\"playing\":%u,\"members\":%u,\"frames\":%u,\"packets\":%u,\"skipped\":%u,\"dropped\":%u},",
+               (unsigned) rtspStats.playing, (unsigned) rtspStats.members, (unsigned) rtspStats.frames,
+               (unsigned) rtspStats.packets, (unsigned) rtspStats.skipped, (unsigned) rtspStats.dropped);
+
+  metricsPrint(aOut, "\"latency_bounds_us\":[");
+  for (int i = 0; i < METRICS_BUCKETS; i++) metricsPrint(aOut, "%s%u", i ? "," : "", (unsigned) latencyBounds[i]);
+  metricsPrint(aOut, "],");
+
+  metricsPrint(aOut, "\"streams\":[");
+  bool first = true;
+  uint32_t now = millis();
+  for (int i = 0; i < METRICS_CLIENTS; i++) {
+    clientMetrics_t m;
+    if ( !metricsClient(i, &m) ) continue;
+    uint32_t fps = metricsFps10(&m);
+    metricsPrint(aOut, "%s{\"id\":%d,\"type\":\"%s\",\"fps_asked\":%u,\"fps\":%u.%u,\"connected_s\":%u,\"frames\":%u,"
+                 "\"bytes\":%llu,\"skipped\":%u,\"send_avg_us\":%u,\"send_max_us\":%u,\"send_ms\":%u",
+                 first ? "" : ",", i, metricsKindName(m.kind), (unsigned) m.fps, (unsigned) (fps / 10), (unsigned) (fps % 10),
+                 (unsigned) ((now - m.since) / 1000), (unsigned) m.frames, (unsigned long long) m.bytes,
+                 (unsigned) m.skipped, (unsigned) m.sendAvg, (unsigned) m.sendMax, (unsigned) (m.sendSum / 1000));
+    metricsPrint(aOut, ",\"timed\":%u,\"latency_max_us\":%u", (unsigned) m.timed, (unsigned) m.lastByteMax);
+    statsLatency(aOut, "first_byte", m.firstByte, m.firstByteSum, m.lastByteMax, m.timed);
+    statsLatency(aOut, "last_byte", m.lastByte, m.lastByteSum, m.lastByteMax, m.timed);
+    metricsPrint(aOut, "}");
+    first = false;
+  }
+  metricsPrint(aOut, "]}\n");
+}
+
+
+// ==== GET /metrics ========================================================================
+//  Prometheus text exposition format 0.0.4. Times are in seconds: values kept in us are
+//  printed with six decimals
+#define PROM_PREFIX "esp32cam_"
+
+static void promFamily(metricsOut_t* aOut, const char* aName, const char* aType, const char* aHelp) {
+  metricsPrint(aOut, "# HELP " PROM_PREFIX "%s %s\n# TYPE " PROM_PREFIX "%s %s\n", aName, aHelp, aName, aType);
+}
+
+static void promValue(metricsOut_t* aOut, const char* aName, const char* aLabels, uint64_t aValue) {
+  metricsPrint(aOut, PROM_PREFIX "%s%s %llu\n", aName, aLabels, (unsigned long long) aValue);
+}
+
+static void promMetric(metricsOut_t* aOut, const char* aName, const char* aType, const char* aHelp, uint64_t aValue) {
+  promFamily(aOut, aName, aType, aHelp);
+  promValue(aOut, aName, "", aValue);
+}
+
+static void promNumber(char* aBuf, size_t aSize, uint64_t aValue, bool aMicros) {
+  if ( aMicros ) snprintf(aBuf, aSize, "%llu.%06u", (unsigned long long) (aValue / 1000000), (unsigned) (aValue % 1000000));
+  else snprintf(aBuf, aSize, "%llu", (unsigned long long) aValue);
+}
+
+//  Cumulative buckets, then sum and count. The count is the one of the buckets printed,
+//  so that it matches the +Inf bucket while the histogram is being added to
+static void promHistogram(metricsOut_t* aOut, const char* aName, const char* aLabel, const histogram_t* aHist, bool aMicros) {
+  char num[24];
+  uint64_t count = 0;
+  uint64_t sum = aHist->sum.load(std::memory_order_relaxed);
+  for (int i = 0; i <= METRICS_BUCKETS; i++) {
+    count += aHist->counts[i].load(std::memory_order_relaxed);
+    if ( i < METRICS_BUCKETS ) promNumber(num, sizeof(num), aHist->bounds[i], aMicros);
+    else strcpy(num, "+Inf");
+    metricsPrint(aOut, PROM_PREFIX "%s_bucket{%s%sle=\"%s\"} %llu\n", aName, aLabel, *aLabel ? "," : "", num, (unsigned long long) count);
+  }
+  promNumber(num, sizeof(num), sum, aMicros);
+  metricsPrint(aOut, PROM_PREFIX "%s_sum%s%s%s %s\n", aName, *aLabel ? "{" : "", aLabel, *aLabel ? "}" : "", num);
+  metricsPrint(aOut, PROM_PREFIX "%s_count%s%s%s %llu\n", aName, *aLabel ? "{" : "", aLabel, *aLabel ? "}" : "", (unsigned long long) count);
+}
+
+void metricsText(metricsOut_t* aOut) {
+  char label[48];
+
+  promFamily(aOut, "info", "gauge", "Streaming mode and frame rate limit");
+  metricsPrint(aOut, PROM_PREFIX "info{mode=\"" STATS_MODE "\",fps_max=\"%u\",max_clients=\"%u\"} 1\n",
+               (unsigned) FPS, (unsigned) MAX_CLIENTS);
+  promMetric(aOut, "uptime_seconds", "gauge", "Time since boot", millis() / 1000);
+
+  //  Capture loop (camCB)
+  promMetric(aOut, "capture_frames_total", "counter", "Frames captured and published", captureStats.count);
+  promMetric(aOut, "capture_errors_total", "counter", "Frames the camera did not deliver or there was no memory for", captureStats.errors);
+  promMetric(aOut, "capture_fps", "gauge", "Frame rate capture runs at: the highest a client asked for", captureFps);
+  promFamily(aOut, "capture_duration_seconds", "histogram", "Time from asking the camera for a frame to having it stored");
+  promHistogram(aOut, "capture_duration_seconds", "", &captureTime, true);
+  promFamily(aOut, "capture_interval_seconds", "histogram", "Time between two frames published");
+  promHistogram(aOut, "capture_interval_seconds", "", &captureInterval, true);
+  promFamily(aOut, "frame_size_bytes", "histogram", "Size of the frames published");
+  promHistogram(aOut, "frame_size_bytes", "", &frameSize, false);
+
+  promFamily(aOut, "driver_events_total", "counter", "Camera driver events that cost a frame (cam_hal.c log, EV-OVF not counted)");
+  for (int i = 0; i < DRIVER_EVENTS; i++) {
+    snprintf(label, sizeof(label), "{event=\"%s\"}", driverEventNames[i]);
+    promValue(aOut, "driver_events_total", label, driverEvents[i].load(std::memory_order_relaxed));
+  }
+
+  //  Send path (streamCB, websocket viewers)
+  uint32_t connected[METRICS_KINDS] = { 0 };
+  for (int i = 0; i < METRICS_CLIENTS; i++) {
+    if ( slots[i].used.load() && slots[i].m.kind < METRICS_KINDS ) connected[slots[i].m.kind]++;
+  }
+  const char* names[] = { "clients", "clients_total", "sent_frames_total", "sent_bytes_total", "skipped_frames_total" };
+  const char* types[] = { "gauge", "counter", "counter", "counter", "counter" };
+  const char* helps[] = { "Streaming clients connected", "Streaming clients connected since boot", "Frames sent to streaming clients",
+                          "Bytes sent with them", "Frames due to streaming clients that they did not get" };
+  for (int f = 0; f < 5; f++) {
+    promFamily(aOut, names[f], types[f], helps[f]);
+    for (int k = 0; k < METRICS_KINDS; k++) {
+      kindTotals_t* t = &totals[k];
+      uint64_t v = f == 0 ? connected[k] : f == 1 ? t->joined.load() : f == 2 ? t->frames.load() :
+                   f == 3 ? t->bytes.load() : t->skipped.load();
+      snprintf(label, sizeof(label), "{type=\"%s\"}", kindNames[k]);
+      promValue(aOut, names[f], label, v);
+    }
+  }
+  promFamily(aOut, "send_duration_seconds", "histogram", "Time to send a frame to a streaming client");
+  for (int k = 0; k < METRICS_KINDS; k++) {
+    snprintf(label, sizeof(label), "type=\"%s\"", kindNames[k]);
+    promHistogram(aOut, "send_duration_seconds", label, &sendTime[k], true);
+  }
+  promFamily(aOut, "capture_to_first_byte_seconds", "histogram",
+             "Time from the capture of a frame to its first byte handed to a streaming client's socket");
+  for (int k = 0; k < METRICS_KINDS; k++) {
+    snprintf(label, sizeof(label), "type=\"%s\"", kindNames[k]);
+    promHistogram(aOut, "capture_to_first_byte_seconds", label, &firstByte[k], true);
+  }
+  promFamily(aOut, "capture_to_last_byte_seconds", "histogram",
+             "Time from the capture of a frame to its last byte handed to a streaming client's socket");
+  for (int k = 0; k < METRICS_KINDS; k++) {
+    snprintf(label, sizeof(label), "type=\"%s\"", kindNames[k]);
+    promHistogram(aOut, "capture_to_last_byte_seconds", label, &lastByte[k], true);
+  }
+  promMetric(aOut, "send_calls_total", "counter", "send and sendmsg calls of the streaming sockets", sinkSendCalls.load());
+  promMetric(aOut, "rtsp_frames_total", "counter", "Frames sent to RTSP sessions", rtspStats.frames);
+  promMetric(aOut, "rtsp_packets_total", "counter", "RTP packets sent to RTSP sessions", rtspStats.packets);
+  promMetric(aOut, "rtsp_sessions", "gauge", "RTSP sessions playing", rtspStats.playing);
+
+  promFamily(aOut, "admission_rejected_total", "counter", "Streaming clients turned away, by reason");
+  for (int r = ADMIT_CLIENTS; r < ADMIT_REASONS; r++) {
+    snprintf(label, sizeof(label), "{reason=\"%s\"}", admitReasonName((admitReason_t) r));
+    promValue(aOut, "admission_rejected_total", label, admitStats.rejected[r]);
+  }
+  promMetric(aOut, "bandwidth_bytes_per_second", "gauge", "Outgoing bandwidth measured", admitStats.bandwidth);
+
+  //  Memory
+  const char* mem[] = { "heap", "psram" };
+  uint32_t values[3][2] = {
+    { ESP.getFreeHeap(), ESP.getFreePsram() },
+    { ESP.getMinFreeHeap(), ESP.getMinFreePsram() },
+    { ESP.getMaxAllocHeap(), ESP.getMaxAllocPsram() },
+  };
+  const char* memNames[] = { "memory_free_bytes", "memory_min_free_bytes", "memory_largest_free_block_bytes" };
+  const char* memHelps[] = { "Free memory", "Least free memory since boot", "Largest block that can be allocated" };
+  for (int f = 0; f < 3; f++) {
+    promFamily(aOut, memNames[f], "gauge", memHelps[f]);
+    for (int m = 0; m < 2; m++) {
+      snprintf(label, sizeof(label), "{memory=\"%s\"}", mem[m]);
+      promValue(aOut, memNames[f], label, values[f][m]);
+    }
+  }
+#if defined(CAMERA_ALL_FRAMES)
+  promMetric(aOut, "frame_arena_bytes", "gauge", "Size of the frame arena", frameArena.size);
+  promMetric(aOut, "frame_arena_used_bytes", "gauge", "Bytes the frames in the arena take", frameArena.used);
+  promMetric(aOut, "frame_arena_frames", "gauge", "Frames in the arena", frameArena.count);
+  promMetric(aOut, "frame_arena_full_total", "counter", "Frames lost because the arena was full", backpressureStats.full);
+  promMetric(aOut, "backpressure_skipped_frames_total", "counter", "Frames slow clients were made to skip", backpressureStats.skipped.load());
+  promMetric(aOut, "backpressure_paused_frames_total", "counter", "Frames not captured while waiting for the slowest client", backpressureStats.paused);
+#else
+  promMetric(aOut, "frame_pool_bytes", "gauge", "Memory set aside for frames", framePool.size);
+  promMetric(aOut, "frame_pool_used_bytes", "gauge", "Bytes in frame buffers handed out", framePool.used);
+  promMetric(aOut, "frame_pool_fallbacks_total", "counter", "Frame buffers the pool had to take from the heap", framePool.fallbacks);
+  promMetric(aOut, "frame_copies_total", "counter", "Frames copied out of the camera buffer", frameCopies);
+  promMetric(aOut, "frame_lends_total", "counter", "Frames sent straight from the camera buffer", frameLends);
+#endif
+}
@@ -0,0 +1,205 @@
+#include "rtpjpeg.h"
+
+static uint16_t be16(const uint8_t* aBuf) {
+  return (uint16_t) aBuf[0] << 8 | aBuf[1];
+}
+
+// ==== JPEG headers ====
+bool jpegParse(const uint8_t* aBuf, size_t aLen, jpegInfo_t* aInfo) {
+  const uint8_t* tables[4] = { NULL, NULL, NULL, NULL };
+  uint8_t sel[3] = { 0, 0, 0 };   // quantization table of each component
+  bool frame = false;
+
+  memset(aInfo, 0, sizeof(jpegInfo_t));
+  if ( aLen < 4 || aBuf[0] != 0xFF || aBuf[1] != 0xD8 ) return false;
+
+  size_t pos = 2;
+  while ( pos + 4 <= aLen ) {
+    if ( aBuf[pos] != 0xFF ) return false;
+    uint8_t marker = aBuf[pos + 1];
+    if ( marker == 0xFF ) {
+      //  Fill byte
+      pos++;
+      continue;
+    }
+    if ( marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8) ) {
+      pos += 2;
+      continue;
+    }
+    size_t len = be16(aBuf + pos + 2);
+    const uint8_t* seg = aBuf + pos + 4;
+    if ( len < 2 || pos + 2 + len > aLen ) return false;
+    len -= 2;
+
+    switch ( marker ) {
+      case 0xDB:    // DQT, one or more tables
+        for (size_t i = 0; i < len; i += 65) {
+          //  Only 8 bit tables, the only ones RTP/JPEG carries
+          if ( i + 65 > len || (seg[i] >> 4) != 0 ) return false;
+          tables[seg[i] & 0x03] = seg + i + 1;
+        }
+        break;
+
+      case 0xC0:    // SOF0 baseline
+      case 0xC1:    // SOF1 extended sequential, Huffman
+        if ( len < 15 || seg[0] != 8 || seg[5] != 3 ) return false;
+        {
+          uint16_t height = be16(seg + 1);
+          uint16_t width = be16(seg + 3);
+          if ( width == 0 || height == 0 || width > 2040 || height > 2040 ) return false;
+          aInfo->width = (width + 7) / 8;
+          aInfo->height = (height + 7) / 8;
+          //  Y 2x1 or 2x2, Cb and Cr 1x1
+          uint8_t y = seg[7];
+          if ( y == 0x21 ) aInfo->type = 0;
+          else if ( y == 0x22 ) aInfo->type = 1;
+          else return false;
+          if ( seg[10] != 0x11 || seg[13] != 0x11 ) return false;
+          sel[0] = seg[8] & 0x03;
+          sel[1] = seg[11] & 0x03;
+          sel[2] = seg[14] & 0x03;
+          if ( sel[1] != sel[2] ) return false;
+          frame = true;
+        }
+        break;
+
+      case 0xDD:    // DRI
+        if ( len < 2 ) return false;
+        aInfo->dri = be16(seg);
+        break;
+
+      case 0xDA:    // SOS: the scan follows the segment, up to EOI
+        if ( !frame || len < 1 || seg[0] != 3 ) return false;
+        aInfo->qt[0] = tables[sel[0]];
+        aInfo->qt[1] = tables[sel[1]];
+        if ( aInfo->qt[0] == NULL || aInfo->qt[1] == NULL ) return false;
+        if ( aInfo->dri ) aInfo->type += 64;
+        {
+          size_t start = pos + 2 + 2 + len;
+          size_t end = aLen;
+          //  The camera may leave a few bytes after EOI
+          for (size_t i = aLen; i >= start + 2 && i + 64 > aLen; i--) {
+            if ( aBuf[i - 2] == 0xFF && aBuf[i - 1] == 0xD9 ) {
+              end = i - 2;
+              break;
+            }
+          }
+          aInfo->scan = aBuf + start;
+          aInfo->sln = end - start;
+        }
+        return aInfo->sln > 0;
+
+      case 0xC2: case 0xC3: case 0xC5: case 0xC6: case 0xC7:
+      case 0xC9: case 0xCA: case 0xCB: case 0xCD: case 0xCE: case 0xCF:
+        //  Progressive, lossless, hierarchical, arithmetic
+        return false;
+
+      default:      // APPn, COM, DHT (RTP/JPEG always uses the standard Huffman tables)
+        break;
+    }
+    pos += 2 + 2 + len;
+  }
+  return false;
+}
+
+
+// ==== RTP packets ====
+uint32_t rtpTimestamp(const struct timeval* aTms) {
+  return (uint32_t) ((uint64_t) aTms->tv_sec * RTP_CLOCK + (uint64_t) aTms->tv_usec * RTP_CLOCK / 1000000);
+}
+
+size_t rtpJpegPacket(uint8_t* aBuf, const jpegInfo_t* aInfo, rtpStream_t* aStream,
+                     uint32_t aTimestamp, uint32_t aOffset, size_t* aLen) {
+  //  JPEG header, then the restart marker header and, in the first fragment, the tables
+  size_t hln = 12 + 8;
+  if ( aInfo->type >= 64 ) hln += 4;
+  if ( aOffset == 0 ) hln += 4 + 128;
+
+  size_t len = aInfo->sln - aOffset;
+  if ( len > RTP_PACKET_MAX - hln ) len = RTP_PACKET_MAX - hln;
+  bool last = aOffset + len >= aInfo->sln;
+
+  uint8_t* p = aBuf;
+  *p++ = 0x80;                                  // version 2
+  *p++ = (last ? 0x80 : 0) | RTP_PT_JPEG;       // marker on the last fragment
+  *p++ = (uint8_t) (aStream->seq >> 8);
+  *p++ = (uint8_t) aStream->seq;
+  for (int i = 3; i >= 0; i--) *p++ = (uint8_t) (aTimestamp >> (8 * i));
+  for (int i = 3; i >= 0; i--) *p++ = (uint8_t) (aStream->ssrc >> (8 * i));
+
+  *p++ = 0;                                     // type-specific
+  *p++ = (uint8_t) (aOffset >> 16);
+  *p++ = (uint8_t) (aOffset >> 8);
+  *p++ = (uint8_t) aOffset;
+  *p++ = aInfo->type;
+  *p++ = 255;                                   // Q: tables in-band
+  *p++ = aInfo->width;
+  *p++ = aInfo->height;
+
+  if ( aInfo->type >= 64 ) {
+    *p++ = (uint8_t) (aInfo->dri >> 8);
+    *p++ = (uint8_t) aInfo->dri;
+    *p++ = 0xFF;                                // F = L = 1, count 0x3FFF: fragments are
+    *p++ = 0xFF;                                // not aligned to restart intervals
+  }
+  if ( aOffset == 0 ) {
+    *p++ = 0;                                   // MBZ
+    *p++ = 0;                                   // 8 bit tables
+    *p++ = 0;
+    *p++ = 128;
+    memcpy(p, aInfo->qt[0], 64);
+    memcpy(p + 64, aInfo->qt[1], 64);
+    p += 128;
+  }
+
+  aStream->seq++;
+  aStream->packets++;
+  if ( last ) aStream->frames++;
+  *aLen = len;
+  return p - aBuf;
+}
+
+
+// ==== XOR parity ====
+void rtpFecAdd(rtpFec_t* aFec, const uint8_t* aHdr, size_t aHln, const uint8_t* aData, size_t aLen) {
+  size_t len = aHln + aLen;
+  if ( aFec->count == 0 ) {
+    aFec->base = (uint16_t) (aHdr[2] << 8 | aHdr[3]);
+    aFec->lengths = 0;
+    aFec->max = 0;
+  }
+  //  The parity is as long as the longest packet: what lies beyond the shorter ones counts as zeros
+  if ( len > aFec->max ) {
+    memset(aFec->parity + aFec->max, 0, len - aFec->max);
+    aFec->max = len;
+  }
+  for (size_t i = 0; i < aHln; i++) aFec->parity[i] ^= aHdr[i];
+  uint8_t* p = aFec->parity + aHln;
+  for (size_t i = 0; i < aLen; i++) p[i] ^= aData[i];
+  aFec->lengths ^= (uint16_t) len;
+  aFec->count++;
+}
+
+size_t rtpFecPacket(uint8_t* aBuf, rtpFec_t* aFec, rtpStream_t* aStream, uint32_t aTimestamp, size_t* aLen) {
+  if ( aFec->count == 0 ) return 0;
+  uint8_t* p = aBuf;
+  *p++ = 0x80;
+  *p++ = 0x80 | RTP_PT_FEC;
+  *p++ = (uint8_t) (aStream->seq >> 8);
+  *p++ = (uint8_t) aStream->seq;
+  for (int i = 3; i >= 0; i--) *p++ = (uint8_t) (aTimestamp >> (8 * i));
+  for (int i = 3; i >= 0; i--) *p++ = (uint8_t) (aStream->ssrc >> (8 * i));
+
+  *p++ = (uint8_t) (aFec->base >> 8);
+  *p++ = (uint8_t) aFec->base;
+  *p++ = (uint8_t) (aFec->count >> 8);
+  *p++ = (uint8_t) aFec->count;
+  *p++ = (uint8_t) (aFec->lengths >> 8);
+  *p++ = (uint8_t) aFec->lengths;
+
+  aStream->seq++;
+  aStream->packets++;
+  *aLen = aFec->max;
+  aFec->count = 0;
+  return p - aBuf;
+}
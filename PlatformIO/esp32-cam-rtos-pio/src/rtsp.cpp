@@ -0,0 +1,693 @@
+#include "rtsp.h"
+#include "httpparser.h"
+#include "socketsink.h"
+
+#if !defined(ARDUINO_ARCH_ESP32)
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+#define RTSP_REQUEST_MAX    768     // longest request head (SETUP lines get long)
+#define RTSP_RESPONSE_MAX   512     // longest response, with the SDP of DESCRIBE
+
+volatile int rtspPort = 0;
+TaskHandle_t tRtsp = NULL;
+rtspStats_t  rtspStats;
+uint16_t     rtspGroupPort = RTSP_MULTICAST_PORT;
+
+typedef enum {
+  RTSP_INIT = 0,                    // connected, no session yet
+  RTSP_READY,                       // SETUP done (or PAUSE)
+  RTSP_PLAYING,
+} rtspState_t;
+
+//  An RTSP connection and its session. Interleaved frames are sent packet by packet without
+//  blocking the task: a response to a request that comes in meanwhile goes out between two packets
+typedef struct {
+  int                 fd;           // RTSP connection, -1 if the slot is free
+  uint8_t             state;
+  bool                tcp;          // RTP interleaved on the RTSP connection
+  bool                mcast;        // member of the multicast group
+  bool                closing;      // close once the response is out (TEARDOWN)
+  uint8_t             channel;      // interleaved RTP channel
+  struct sockaddr_in  peer;         // UDP: the client's RTP port
+  uint32_t            id;           // Session:, 0 until SETUP
+  uint32_t            since;        // millis() of the last data from the client
+  size_t              skip;         // request body or interleaved RTCP bytes still to be skipped
+  size_t              len;
+  char                buf[RTSP_REQUEST_MAX];
+  uint16_t            rln;          // response waiting to be sent
+  uint16_t            rsent;
+  char                rsp[RTSP_RESPONSE_MAX];
+  rtpStream_t         rtp;
+  uint32_t            last;         // number of the last frame sent
+  bool                busy;         // interleaved: a frame is being sent
+  snapshot_t          snap;
+  jpegInfo_t          jpg;
+  uint32_t            ts;
+  uint32_t            offset;       // scan offset of the packet being sent
+  size_t              pln;          // its '$' header and RTP/JPEG headers
+  size_t              dln;          // its scan bytes
+  size_t              sent;         // bytes of it sent
+  uint8_t             pkt[4 + RTP_HEADER_MAX];
+} rtspSession_t;
+
+static rtspSession_t  sessions[RTSP_SESSIONS];
+static int            rtpSock = -1;     // UDP socket all sessions send RTP from
+static uint16_t       rtpPort = 0;      // its port, server_port of UDP sessions
+
+//  The multicast group: one stream, sent while any member plays
+static rtpStream_t        group;
+static rtpStream_t        groupFec;
+static rtpFec_t           fec;
+static uint32_t           groupLast;    // number of the last frame sent to the group
+
+static const char* PUBLIC = "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n\r\n";
+
+
+// ==== Helpers ====
+static bool retry(int aErr) {
+  return aErr == EAGAIN || aErr == EWOULDBLOCK || aErr == EINTR;
+}
+
+static bool isMethod(const httpRequest_t* aReq, const char* aName) {
+  return strlen(aName) == aReq->mln && memcmp(aReq->mth, aName, aReq->mln) == 0;
+}
+
+//  The stream is at STREAMING_URL, its only track at STREAMING_URL/track1
+static bool streamPath(const httpRequest_t* aReq) {
+  size_t n = strlen(STREAMING_URL);
+  return aReq->pln >= n && memcmp(aReq->path, STREAMING_URL, n) == 0 && (aReq->pln == n || aReq->path[n] == '/');
+}
+
+//  Value of name=value in a header like Transport, NULL if absent
+static const char* param(const char* aVal, uint16_t aLen, const char* aName) {
+  size_t n = strlen(aName);
+  for (uint16_t i = 0; i + n <= aLen; i++) {
+    if ( (i == 0 || aVal[i - 1] == ';') && strncasecmp(aVal + i, aName, n) == 0 ) return aVal + i + n;
+  }
+  return NULL;
+}
+
+static bool contains(const char* aVal, uint16_t aLen, const char* aWord) {
+  size_t n = strlen(aWord);
+  for (uint16_t i = 0; i + n <= aLen; i++) {
+    if ( strncasecmp(aVal + i, aWord, n) == 0 ) return true;
+  }
+  return false;
+}
+
+static uint32_t number(const char* aStr, const char* aEnd, int aBase) {
+  uint32_t v = 0;
+  for (; aStr < aEnd; aStr++) {
+    int d;
+    if ( *aStr >= '0' && *aStr <= '9' ) d = *aStr - '0';
+    else if ( aBase == 16 && *aStr >= 'a' && *aStr <= 'f' ) d = *aStr - 'a' + 10;
+    else if ( aBase == 16 && *aStr >= 'A' && *aStr <= 'F' ) d = *aStr - 'A' + 10;
+    else break;
+    v = v * aBase + d;
+  }
+  return v;
+}
+
+//  Address the client connected to, for the SDP and the URLs
+static void localAddress(int aFd, char aIp[16]) {
+  struct sockaddr_in a;
+  socklen_t alen = sizeof(a);
+  memset(&a, 0, sizeof(a));
+  getsockname(aFd, (struct sockaddr*) &a, &alen);
+  const uint8_t* b = (const uint8_t*) &a.sin_addr.s_addr;
+  snprintf(aIp, 16, "%u.%u.%u.%u", b[0], b[1], b[2], b[3]);
+}
+
+
+// ==== Sessions ====
+static void closeSession(rtspSession_t* aSes) {
+  if ( aSes->state == RTSP_PLAYING ) {
+    rtpWaiters--;
+    rtspStats.playing--;
+    if ( aSes->mcast ) rtspStats.members--;
+  }
+  if ( aSes->snap.ref ) snapshotRelease(&aSes->snap);
+  close(aSes->fd);
+  aSes->fd = -1;
+}
+
+static void rtspProcess(rtspSession_t* aSes);
+
+//  Interleaved packet at aSes->offset: '$', channel, length, then the RTP packet
+static void tcpPacket(rtspSession_t* aSes) {
+  size_t len;
+  size_t h = rtpJpegPacket(aSes->pkt + 4, &aSes->jpg, &aSes->rtp, aSes->ts, aSes->offset, &len);
+  aSes->pkt[0] = '$';
+  aSes->pkt[1] = aSes->channel;
+  aSes->pkt[2] = (uint8_t) ((h + len) >> 8);
+  aSes->pkt[3] = (uint8_t) (h + len);
+  aSes->pln = 4 + h;
+  aSes->dln = len;
+  aSes->sent = 0;
+  rtspStats.packets++;
+}
+
+//  Send what the connection takes: the pending response (only between packets), then the frame
+static void rtspWrite(rtspSession_t* aSes) {
+  for (;;) {
+    if ( aSes->rln && aSes->sent == 0 ) {
+      ssize_t n = send(aSes->fd, aSes->rsp + aSes->rsent, aSes->rln - aSes->rsent, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if ( n < 0 ) {
+        if ( !retry(errno) ) closeSession(aSes);
+        return;
+      }
+      aSes->rsent += n;
+      if ( aSes->rsent < aSes->rln ) return;
+      aSes->rln = 0;
+      aSes->rsent = 0;
+      if ( aSes->closing ) {
+        closeSession(aSes);
+        return;
+      }
+      //  Requests that came in behind this one
+      rtspProcess(aSes);
+      if ( aSes->fd < 0 ) return;
+      continue;
+    }
+    if ( !aSes->busy ) return;
+
+    struct iovec iov[2];
+    int count = 2;
+    iov[0].iov_base = aSes->pkt;
+    iov[0].iov_len = aSes->pln;
+    iov[1].iov_base = (void*) (aSes->jpg.scan + aSes->offset);
+    iov[1].iov_len = aSes->dln;
+    ClientSink::iovConsume(iov, count, aSes->sent);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    sinkSendCalls++;
+    ssize_t n = sendmsg(aSes->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if ( n < 0 ) {
+      if ( !retry(errno) ) closeSession(aSes);
+      return;
+    }
+    sinkSendBytes += n;
+    aSes->sent += n;
+    if ( aSes->sent < aSes->pln + aSes->dln ) return;
+
+    aSes->offset += aSes->dln;
+    aSes->sent = 0;
+    if ( aSes->offset < aSes->jpg.sln ) {
+      tcpPacket(aSes);
+    }
+    else {
+      snapshotRelease(&aSes->snap);
+      aSes->busy = false;
+      rtspStats.frames++;
+    }
+  }
+}
+
+//  RTSP/1.0 response with the request's CSeq. aExtra holds the headers, the empty line and the body
+static void reply(rtspSession_t* aSes, const httpRequest_t* aReq, const char* aStatus, const char* aExtra) {
+  uint16_t cln = 1;
+  const char* cseq = httpHeader(aReq, "cseq", &cln);
+  int n = snprintf(aSes->rsp, RTSP_RESPONSE_MAX, "RTSP/1.0 %s\r\nCSeq: %.*s\r\n%s",
+                   aStatus, cseq ? (int) cln : 1, cseq ? cseq : "0", aExtra);
+  aSes->rln = n < RTSP_RESPONSE_MAX ? n : RTSP_RESPONSE_MAX - 1;
+  aSes->rsent = 0;
+}
+
+
+// ==== Requests ====
+static void describe(rtspSession_t* aSes, const httpRequest_t* aReq) {
+  char ip[16];
+  char sdp[256];
+  char extra[RTSP_RESPONSE_MAX - 64];
+  localAddress(aSes->fd, ip);
+  int sln = snprintf(sdp, sizeof(sdp),
+                     "v=0\r\n"
+                     "o=- %u 1 IN IP4 %s\r\n"
+                     "s=ESP32-CAM\r\n"
+                     "c=IN IP4 0.0.0.0\r\n"
+                     "t=0 0\r\n"
+                     "a=control:*\r\n"
+                     "m=video 0 RTP/AVP %d\r\n"
+                     "a=control:track1\r\n"
+                     "a=framerate:%d\r\n",
+                     (unsigned) millis(), ip, RTP_PT_JPEG, FPS);
+  snprintf(extra, sizeof(extra), "Content-Base: rtsp://%s:%d%s/\r\n"
+                                 "Content-Type: application/sdp\r\n"
+                                 "Content-Length: %d\r\n\r\n%s",
+           ip, rtspPort, STREAMING_URL, sln, sdp);
+  reply(aSes, aReq, "200 OK", extra);
+}
+
+static void setup(rtspSession_t* aSes, const httpRequest_t* aReq) {
+  char extra[192];
+  uint16_t tln = 0;
+  const char* t = httpHeader(aReq, "transport", &tln);
+  const char* e = t + tln;
+
+  if ( aSes->state == RTSP_PLAYING ) {
+    reply(aSes, aReq, "455 Method Not Valid in This State", "\r\n");
+    return;
+  }
+  if ( t == NULL ) {
+    reply(aSes, aReq, "461 Unsupported Transport", "\r\n");
+    return;
+  }
+  if ( aSes->id == 0 ) {
+    aSes->id = esp_random() | 1;
+    aSes->rtp.ssrc = esp_random();
+    aSes->rtp.seq = (uint16_t) esp_random();
+    rtspStats.sessions++;
+  }
+
+  aSes->mcast = false;
+  if ( contains(t, tln, "multicast") ) {
+    //  The group's address and ports are the server's choice
+    aSes->mcast = true;
+    aSes->tcp = false;
+    snprintf(extra, sizeof(extra), "Transport: RTP/AVP;multicast;destination=%s;port=%u-%u;ttl=%d;ssrc=%08X\r\n"
+                                   "Session: %08X;timeout=%d\r\n\r\n",
+             RTSP_MULTICAST_GROUP, rtspGroupPort, rtspGroupPort + 1, RTSP_MULTICAST_TTL, (unsigned) group.ssrc,
+             (unsigned) aSes->id, RTSP_TIMEOUT_S);
+  }
+  else if ( contains(t, tln, "RTP/AVP/TCP") ) {
+    const char* il = param(t, tln, "interleaved=");
+    aSes->tcp = true;
+    aSes->channel = il ? number(il, e, 10) : 0;
+    snprintf(extra, sizeof(extra), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d;ssrc=%08X\r\n"
+                                   "Session: %08X;timeout=%d\r\n\r\n",
+             aSes->channel, aSes->channel + 1, (unsigned) aSes->rtp.ssrc, (unsigned) aSes->id, RTSP_TIMEOUT_S);
+  }
+  else {
+    const char* cp = param(t, tln, "client_port=");
+    uint32_t port = cp ? number(cp, e, 10) : 0;
+    if ( port == 0 || port > 0xFFFF ) {
+      reply(aSes, aReq, "461 Unsupported Transport", "\r\n");
+      return;
+    }
+    //  RTP goes to the address the request came from
+    socklen_t plen = sizeof(aSes->peer);
+    getpeername(aSes->fd, (struct sockaddr*) &aSes->peer, &plen);
+    aSes->peer.sin_port = htons((uint16_t) port);
+    aSes->tcp = false;
+    snprintf(extra, sizeof(extra), "Transport: RTP/AVP;unicast;client_port=%u-%u;server_port=%u-%u;ssrc=%08X\r\n"
+                                   "Session: %08X;timeout=%d\r\n\r\n",
+             (unsigned) port, (unsigned) port + 1, rtpPort, rtpPort + 1, (unsigned) aSes->rtp.ssrc,
+             (unsigned) aSes->id, RTSP_TIMEOUT_S);
+  }
+  aSes->state = RTSP_READY;
+  reply(aSes, aReq, "200 OK", extra);
+}
+
+static void rtspRequest(rtspSession_t* aSes, const httpRequest_t* aReq) {
+  char extra[192];
+
+  if ( isMethod(aReq, "OPTIONS") ) {
+    reply(aSes, aReq, "200 OK", PUBLIC);
+    return;
+  }
+  if ( isMethod(aReq, "GET_PARAMETER") || isMethod(aReq, "SET_PARAMETER") ) {
+    //  Keep-alive
+    reply(aSes, aReq, "200 OK", "\r\n");
+    return;
+  }
+  if ( !streamPath(aReq) ) {
+    reply(aSes, aReq, "404 Not Found", "\r\n");
+    return;
+  }
+  if ( isMethod(aReq, "DESCRIBE") ) {
+    describe(aSes, aReq);
+    return;
+  }
+  if ( isMethod(aReq, "SETUP") ) {
+    setup(aSes, aReq);
+    return;
+  }
+
+  bool play = isMethod(aReq, "PLAY");
+  bool pause = isMethod(aReq, "PAUSE");
+  bool teardown = isMethod(aReq, "TEARDOWN");
+  if ( !play && !pause && !teardown ) {
+    reply(aSes, aReq, "501 Not Implemented", "\r\n");
+    return;
+  }
+  uint16_t sln = 0;
+  const char* sid = httpHeader(aReq, "session", &sln);
+  if ( aSes->state == RTSP_INIT || sid == NULL || number(sid, sid + sln, 16) != aSes->id ) {
+    reply(aSes, aReq, "454 Session Not Found", "\r\n");
+    return;
+  }
+
+  if ( play ) {
+    if ( aSes->state != RTSP_PLAYING ) {
+      aSes->state = RTSP_PLAYING;
+      rtpWaiters++;
+      rtspStats.playing++;
+      if ( aSes->mcast ) rtspStats.members++;
+      snapshotWanted();
+    }
+    char ip[16];
+    localAddress(aSes->fd, ip);
+    snprintf(extra, sizeof(extra), "Session: %08X\r\nRange: npt=0.000-\r\nRTP-Info: url=rtsp://%s:%d%s/track1;seq=%u\r\n\r\n",
+             (unsigned) aSes->id, ip, rtspPort, STREAMING_URL, (unsigned) (aSes->mcast ? group.seq : aSes->rtp.seq));
+  }
+  else {
+    if ( aSes->state == RTSP_PLAYING ) {
+      aSes->state = RTSP_READY;
+      rtpWaiters--;
+      rtspStats.playing--;
+      if ( aSes->mcast ) rtspStats.members--;
+    }
+    aSes->closing = teardown;
+    snprintf(extra, sizeof(extra), "Session: %08X\r\n\r\n", (unsigned) aSes->id);
+  }
+  reply(aSes, aReq, "200 OK", extra);
+}
+
+//  Handle the requests in the buffer, one at a time: the next waits until the response is out
+static void rtspProcess(rtspSession_t* aSes) {
+  while ( aSes->len && aSes->rln == 0 && !aSes->closing ) {
+    if ( aSes->skip ) {
+      size_t k = aSes->skip < aSes->len ? aSes->skip : aSes->len;
+      memmove(aSes->buf, aSes->buf + k, aSes->len - k);
+      aSes->len -= k;
+      aSes->skip -= k;
+      continue;
+    }
+    //  RTCP from an interleaved client
+    if ( aSes->buf[0] == '$' ) {
+      if ( aSes->len < 4 ) return;
+      aSes->skip = 4 + ((uint8_t) aSes->buf[2] << 8 | (uint8_t) aSes->buf[3]);
+      continue;
+    }
+
+    httpRequest_t req;
+    int parsed = httpParse(aSes->buf, aSes->len, &req);
+    if ( parsed == HTTP_INCOMPLETE && aSes->len < RTSP_REQUEST_MAX ) return;
+    if ( parsed <= 0 || !req.rtsp ) {
+      const char* bad = "RTSP/1.0 400 Bad Request\r\n\r\n";
+      send(aSes->fd, bad, strlen(bad), MSG_NOSIGNAL | MSG_DONTWAIT);
+      closeSession(aSes);
+      return;
+    }
+    rtspRequest(aSes, &req);
+
+    uint16_t cln = 0;
+    const char* cl = httpHeader(&req, "content-length", &cln);
+    memmove(aSes->buf, aSes->buf + parsed, aSes->len - parsed);
+    aSes->len -= parsed;
+    if ( cl ) aSes->skip = number(cl, cl + cln, 10);
+  }
+}
+
+static void rtspRead(rtspSession_t* aSes) {
+  ssize_t n = recv(aSes->fd, aSes->buf + aSes->len, RTSP_REQUEST_MAX - aSes->len, MSG_DONTWAIT);
+  if ( n == 0 || (n < 0 && !retry(errno)) ) {
+    closeSession(aSes);
+    return;
+  }
+  if ( n < 0 ) return;
+  aSes->len += n;
+  aSes->since = millis();
+  rtspProcess(aSes);
+  if ( aSes->fd >= 0 ) rtspWrite(aSes);
+}
+
+
+// ==== Frames ====
+//  True if the frame is one to send to the session: newer than the last one it got
+static bool frameWanted(rtspSession_t* aSes, uint32_t aFnm) {
+  if ( aSes->rtp.frames && (int32_t) (aFnm - aSes->last) <= 0 ) return false;
+  if ( aSes->rtp.frames && aFnm - aSes->last > 1 ) rtspStats.skipped += aFnm - aSes->last - 1;
+  aSes->last = aFnm;
+  return true;
+}
+
+//  All packets of the frame at once: UDP does not wait for the receiver
+static void udpFrame(rtspSession_t* aSes, const jpegInfo_t* aJpg, uint32_t aTs) {
+  uint8_t hdr[RTP_HEADER_MAX];
+  size_t len;
+  for (uint32_t off = 0; off < aJpg->sln; off += len) {
+    size_t h = rtpJpegPacket(hdr, aJpg, &aSes->rtp, aTs, off, &len);
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = h;
+    iov[1].iov_base = (void*) (aJpg->scan + off);
+    iov[1].iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &aSes->peer;
+    msg.msg_namelen = sizeof(aSes->peer);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sinkSendCalls++;
+    ssize_t n = sendmsg(rtpSock, &msg, MSG_DONTWAIT);
+    if ( n < 0 ) {
+      //  Out of buffers: the rest of the frame would be of no use to the receiver
+      rtspStats.dropped++;
+      return;
+    }
+    sinkSendBytes += n;
+    rtspStats.packets++;
+  }
+  rtspStats.frames++;
+}
+
+//  The frame once to the group, with a parity packet after every RTP_FEC_GROUP packets.
+//  A packet that cannot be sent is left to the parity: the rest of the frame still goes out
+static void groupFrame(const jpegInfo_t* aJpg, uint32_t aTs) {
+  uint8_t hdr[RTP_HEADER_MAX];
+  struct sockaddr_in to;
+  memset(&to, 0, sizeof(to));
+  to.sin_family = AF_INET;
+  to.sin_addr.s_addr = inet_addr(RTSP_MULTICAST_GROUP);
+  bool failed = false;
+  size_t len;
+  for (uint32_t off = 0; off < aJpg->sln; off += len) {
+    size_t h = rtpJpegPacket(hdr, aJpg, &group, aTs, off, &len);
+    struct iovec iov[2];
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = h;
+    iov[1].iov_base = (void*) (aJpg->scan + off);
+    iov[1].iov_len = len;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &to;
+    msg.msg_namelen = sizeof(to);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    to.sin_port = htons(rtspGroupPort);
+    sinkSendCalls++;
+    ssize_t n = sendmsg(rtpSock, &msg, MSG_DONTWAIT);
+    if ( n < 0 ) failed = true;
+    else sinkSendBytes += n;
+    rtspStats.groupPackets++;
+
+#if RTP_FEC_GROUP > 0
+    rtpFecAdd(&fec, hdr, h, aJpg->scan + off, len);
+    if ( fec.count < RTP_FEC_GROUP && off + len < aJpg->sln ) continue;
+    size_t pln;
+    iov[0].iov_len = rtpFecPacket(hdr, &fec, &groupFec, aTs, &pln);
+    iov[1].iov_base = fec.parity;
+    iov[1].iov_len = pln;
+    to.sin_port = htons(rtspGroupPort + 2);
+    sinkSendCalls++;
+    n = sendmsg(rtpSock, &msg, MSG_DONTWAIT);
+    if ( n >= 0 ) sinkSendBytes += n;
+    rtspStats.fecPackets++;
+#endif
+  }
+  if ( failed ) rtspStats.dropped++;
+  rtspStats.groupFrames++;
+}
+
+//  A frame has been published: UDP sessions get it right away, interleaved ones as fast as
+//  their connection takes it. A session still sending its last frame skips this one
+static void frameArrived() {
+  uint64_t cnt;
+  read(rtpEvent, &cnt, sizeof(cnt));
+
+  snapshot_t snap;
+  jpegInfo_t jpg;
+  bool have = false;
+  bool usable = false;
+  for (int i = 0; i < RTSP_SESSIONS; i++) {
+    rtspSession_t* s = &sessions[i];
+    if ( s->fd < 0 || s->state != RTSP_PLAYING || s->mcast ) continue;
+
+    if ( !s->tcp ) {
+      if ( !have ) {
+        have = snapshotAcquire(&snap);
+        if ( !have ) return;
+        usable = jpegParse(snap.dat, snap.siz, &jpg);
+      }
+      if ( !frameWanted(s, snap.fnm) ) continue;
+      if ( usable ) udpFrame(s, &jpg, rtpTimestamp(&snap.tms));
+      else rtspStats.dropped++;
+      continue;
+    }
+
+    if ( s->busy || !snapshotAcquire(&s->snap) ) continue;
+    if ( !frameWanted(s, s->snap.fnm) ) {
+      snapshotRelease(&s->snap);
+      continue;
+    }
+    if ( !jpegParse(s->snap.dat, s->snap.siz, &s->jpg) ) {
+      rtspStats.dropped++;
+      snapshotRelease(&s->snap);
+      continue;
+    }
+    s->ts = rtpTimestamp(&s->snap.tms);
+    s->offset = 0;
+    s->busy = true;
+    tcpPacket(s);
+    rtspWrite(s);
+  }
+
+  if ( rtspStats.members ) {
+    if ( !have ) {
+      have = snapshotAcquire(&snap);
+      if ( !have ) return;
+      usable = jpegParse(snap.dat, snap.siz, &jpg);
+    }
+    if ( group.frames == 0 || (int32_t) (snap.fnm - groupLast) > 0 ) {
+      if ( group.frames && snap.fnm - groupLast > 1 ) rtspStats.skipped += snap.fnm - groupLast - 1;
+      groupLast = snap.fnm;
+      if ( usable ) groupFrame(&jpg, rtpTimestamp(&snap.tms));
+      else rtspStats.dropped++;
+    }
+  }
+  if ( have ) snapshotRelease(&snap);
+}
+
+
+// ==== RTSP server task ===========================================================
+void rtspCB(void* pvParameters) {
+  int port = (int) (intptr_t) pvParameters;
+
+  for (int i = 0; i < RTSP_SESSIONS; i++) {
+    sessions[i].fd = -1;
+    sessions[i].snap.ref = NULL;
+  }
+  //  The frame event is created by startStreaming() in the webserver task
+  while ( rtpEvent < 0 ) delay(100);
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+#if defined(SERVER_LOOPBACK)
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#else
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+#endif
+  socklen_t alen = sizeof(addr);
+
+  rtpSock = socket(AF_INET, SOCK_DGRAM, 0);
+  addr.sin_port = 0;
+  if ( rtpSock < 0 || bind(rtpSock, (struct sockaddr*) &addr, sizeof(addr)) != 0 ) {
+    Log.error("rtspCB: cannot open the RTP socket\n");
+    vTaskDelete(NULL);
+    return;
+  }
+  getsockname(rtpSock, (struct sockaddr*) &addr, &alen);
+  rtpPort = ntohs(addr.sin_port);
+  //  The group is sent to with the RTP socket as well (on loopback when the server is)
+  uint8_t ttl = RTSP_MULTICAST_TTL;
+  setsockopt(rtpSock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+#if defined(SERVER_LOOPBACK)
+  struct in_addr ifaddr;
+  ifaddr.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(rtpSock, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr));
+#endif
+  group.ssrc = esp_random();
+  group.seq = (uint16_t) esp_random();
+  groupFec.ssrc = group.ssrc;
+  groupFec.seq = (uint16_t) esp_random();
+
+  int srv = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#if defined(SERVER_MSS)
+  int mss = SERVER_MSS;
+  setsockopt(srv, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+#endif
+#if defined(SERVER_SNDBUF)
+  int sndbuf = SERVER_SNDBUF;
+  setsockopt(srv, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+#endif
+  addr.sin_port = htons((uint16_t) port);
+  if ( bind(srv, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(srv, RTSP_SESSIONS) != 0 ) {
+    Log.error("rtspCB: cannot listen on port %d\n", port);
+    vTaskDelete(NULL);
+    return;
+  }
+  alen = sizeof(addr);
+  getsockname(srv, (struct sockaddr*) &addr, &alen);
+  fcntl(srv, F_SETFL, fcntl(srv, F_GETFL, 0) | O_NONBLOCK);
+  rtspPort = ntohs(addr.sin_port);
+  Log.trace("rtspCB: RTSP server on port %d, RTP from port %d\n", rtspPort, rtpPort);
+
+  for (;;) {
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    int maxFd = -1;
+    int freeSlot = -1;
+    uint32_t now = millis();
+
+    for (int i = 0; i < RTSP_SESSIONS; i++) {
+      rtspSession_t* s = &sessions[i];
+      if ( s->fd >= 0 && now - s->since > (RTSP_TIMEOUT_S + 10) * 1000UL ) {
+        Log.verbose("rtspCB: session %X timed out\n", s->id);
+        closeSession(s);
+      }
+      if ( s->fd < 0 ) {
+        freeSlot = i;
+        continue;
+      }
+      //  Keep the camera running while a session plays
+      if ( s->state == RTSP_PLAYING ) snapshotWanted();
+      FD_SET(s->fd, &rfds);
+      if ( s->busy || s->rln ) FD_SET(s->fd, &wfds);
+      if ( s->fd > maxFd ) maxFd = s->fd;
+    }
+    if ( rtpWaiters ) {
+      FD_SET(rtpEvent, &rfds);
+      if ( rtpEvent > maxFd ) maxFd = rtpEvent;
+    }
+    if ( freeSlot >= 0 ) {
+      FD_SET(srv, &rfds);
+      if ( srv > maxFd ) maxFd = srv;
+    }
+
+    //  The timeout only drives session expiry and the camera keep-alive
+    struct timeval tv = { 1, 0 };
+    int n = select(maxFd + 1, &rfds, &wfds, NULL, &tv);
+    if ( n <= 0 ) continue;
+
+    for (int i = 0; i < RTSP_SESSIONS; i++) {
+      rtspSession_t* s = &sessions[i];
+      if ( s->fd >= 0 && FD_ISSET(s->fd, &rfds) ) rtspRead(s);
+      if ( s->fd >= 0 && FD_ISSET(s->fd, &wfds) ) rtspWrite(s);
+    }
+    if ( FD_ISSET(rtpEvent, &rfds) ) frameArrived();
+
+    if ( freeSlot >= 0 && FD_ISSET(srv, &rfds) ) {
+      int fd = accept(srv, NULL, NULL);
+      if ( fd >= 0 ) {
+        rtspSession_t* s = &sessions[freeSlot];
+        memset(s, 0, sizeof(rtspSession_t));
+        s->fd = fd;
+        s->since = millis();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        //  Interleaved packets go out as they are written, not after the client's delayed ACK
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      }
+    }
+  }
+}
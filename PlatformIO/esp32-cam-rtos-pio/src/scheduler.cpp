@@ -0,0 +1,122 @@
+#include "scheduler.h"
+
+#if defined(CAMERA_MULTICLIENT_TASK) || defined(CAMERA_ALL_FRAMES)
+
+//  Timer wheel keyed by frame number: a client task that goes to sleep is put in the slot of
+//  the frame it is due for next, and camCB only looks at the slot of the frame it publishes.
+//  Entries are one-shot: camCB takes a task out when it notifies it, so a task is woken once
+//  per frame due to it, never for frames it passes over, and camCB's work per frame does not
+//  grow with the clients that are not due. A slot holds the tasks due at frames SCHED_WHEEL
+//  apart; those not due yet stay in it. The wheel is changed in short critical sections, so
+//  neither camCB nor a client task ever blocks on it
+static streamInfo_t*  wheel[SCHED_WHEEL];
+static uint32_t       published = 0;      // number of the last frame published
+static bool           anyPublished = false;
+static portMUX_TYPE   schedLock = portMUX_INITIALIZER_UNLOCKED;
+
+uint32_t schedWakeups = 0;
+
+void schedJoin(streamInfo_t* aInfo) {
+  aInfo->task = xTaskGetCurrentTaskHandle();
+  aInfo->next = NULL;
+  aInfo->armed = false;
+}
+
+//  In schedLock
+static void wheelRemove(streamInfo_t* aInfo) {
+  streamInfo_t** p = &wheel[aInfo->due % SCHED_WHEEL];
+  while ( *p && *p != aInfo ) p = &(*p)->next;
+  if ( *p ) *p = aInfo->next;
+  aInfo->next = NULL;
+  aInfo->armed = false;
+}
+
+void schedLeave(streamInfo_t* aInfo) {
+  portENTER_CRITICAL(&schedLock);
+  if ( aInfo->armed ) wheelRemove(aInfo);
+  portEXIT_CRITICAL(&schedLock);
+}
+
+//  The slots of every frame number since the last one published are looked at: frame numbers
+//  go up by one, but no task is left behind if they do not. The tasks taken out are notified
+//  after the critical section; each of them waits for its notification before it can leave
+void schedPublish(uint32_t aFnm) {
+  TaskHandle_t due[MAX_CLIENTS];
+  int n = 0;
+
+  portENTER_CRITICAL(&schedLock);
+  uint32_t slots = anyPublished && aFnm - published < SCHED_WHEEL ? aFnm - published : SCHED_WHEEL;
+  for (uint32_t fnm = aFnm - slots + 1; fnm != aFnm + 1; fnm++) {
+    streamInfo_t** p = &wheel[fnm % SCHED_WHEEL];
+    while ( *p && n < MAX_CLIENTS ) {
+      streamInfo_t* w = *p;
+      if ( (int32_t) (aFnm - w->due) < 0 ) {
+        p = &w->next;
+        continue;
+      }
+      *p = w->next;
+      w->next = NULL;
+      w->armed = false;
+      due[n++] = w->task;
+    }
+  }
+  published = aFnm;
+  anyPublished = true;
+  portEXIT_CRITICAL(&schedLock);
+
+  for (int i = 0; i < n; i++) xTaskNotifyGive( due[i] );
+  schedWakeups += n;
+}
+
+// ==== camCB pacing ================================================================
+void schedCaptureDelay(TickType_t* aLastWake) {
+  TickType_t wake = *aLastWake + pdMS_TO_TICKS(1000 / captureFps);
+  for (;;) {
+    int32_t left = (int32_t) (wake - xTaskGetTickCount());
+    if ( left <= 0 ) {
+      //  Running late: no delay, as with xTaskDelayUntil()
+      taskYIELD();
+      break;
+    }
+    if ( ulTaskNotifyTake( pdTRUE, (TickType_t) left ) == 0 ) break;
+
+    //  The rate went up: the next capture may be due sooner
+    TickType_t sooner = *aLastWake + pdMS_TO_TICKS(1000 / captureFps);
+    if ( (int32_t) (sooner - wake) < 0 ) wake = sooner;
+  }
+  *aLastWake = wake;
+}
+
+void schedRateUp() {
+  if ( tCam ) xTaskNotifyGive( tCam );
+}
+
+//  due is only written by the client task, and not while it is in the wheel. A frame due to it
+//  that was published before it got here is not waited for, unless the client had no frame
+//  to send: then it would only find no frame again
+bool schedWait(streamInfo_t* aInfo, bool aNoFrame) {
+  portENTER_CRITICAL(&schedLock);
+  if ( aNoFrame && anyPublished && (int32_t) (published - aInfo->due) >= 0 ) aInfo->due = published + 1;
+  if ( anyPublished && (int32_t) (published - aInfo->due) >= 0 ) {
+    portEXIT_CRITICAL(&schedLock);
+    return true;
+  }
+  streamInfo_t** slot = &wheel[aInfo->due % SCHED_WHEEL];
+  aInfo->next = *slot;
+  *slot = aInfo;
+  aInfo->armed = true;
+  portEXIT_CRITICAL(&schedLock);
+
+  if ( ulTaskNotifyTake( pdTRUE, pdMS_TO_TICKS(SCHED_IDLE_MS) ) != 0 ) return true;
+
+  //  Timed out: still in the wheel, unless camCB took it out in the meantime. Then the
+  //  notification is on its way, and the task must not leave before it arrives
+  portENTER_CRITICAL(&schedLock);
+  bool woken = !aInfo->armed;
+  if ( !woken ) wheelRemove(aInfo);
+  portEXIT_CRITICAL(&schedLock);
+  if ( woken ) ulTaskNotifyTake( pdTRUE, portMAX_DELAY );
+  return woken;
+}
+
+#endif
@@ -0,0 +1,85 @@
+#include "socketsink.h"
+
+#if !defined(ARDUINO_ARCH_ESP32)
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+std::atomic<uint32_t> sinkSendCalls(0);
+std::atomic<uint64_t> sinkSendBytes(0);
+
+// ==== SocketSink ========================================================================
+SocketSink::SocketSink(int aFd) : iFd(aFd) {
+  int one = 1;
+  setsockopt(iFd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  setTimeout(5);
+}
+
+SocketSink::~SocketSink() { stop(); }
+
+size_t SocketSink::write(const void* aBuf, size_t aSize) {
+  const uint8_t* p = (const uint8_t*) aBuf;
+  size_t sent = 0;
+  while ( iFd >= 0 && sent < aSize ) {
+    sinkSendCalls++;
+    ssize_t n = send(iFd, p + sent, aSize - sent, MSG_NOSIGNAL);
+    if ( n > 0 ) {
+      sent += n;
+      sinkSendBytes += n;
+    }
+    else if ( n < 0 && errno == EINTR ) {
+      continue;
+    }
+    else {
+      //  Timeout or error: give up on this write like WiFiClient does
+      if ( errno != EAGAIN && errno != EWOULDBLOCK ) stop();
+      break;
+    }
+  }
+  return sent;
+}
+
+int SocketSink::sendv(const struct iovec* aIov, int aCount, bool aWait) {
+  if ( iFd < 0 ) return -1;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = (struct iovec*) aIov;
+  msg.msg_iovlen = aCount;
+  for (;;) {
+    sinkSendCalls++;
+    ssize_t n = sendmsg(iFd, &msg, MSG_NOSIGNAL | (aWait ? 0 : MSG_DONTWAIT));
+    if ( n >= 0 ) {
+      sinkSendBytes += n;
+      return (int) n;
+    }
+    if ( errno == EINTR ) continue;
+    return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? 0 : -1;
+  }
+}
+
+bool SocketSink::connected() {
+  if ( iFd < 0 ) return false;
+  char c;
+  ssize_t n = recv(iFd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if ( n == 0 ) return false;
+  if ( n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) return false;
+  return true;
+}
+
+//  Same as WiFiClient::flush(): discard whatever the client sent us
+void SocketSink::flush() {
+  char buf[256];
+  while ( iFd >= 0 && recv(iFd, buf, sizeof(buf), MSG_DONTWAIT) > 0 );
+}
+
+void SocketSink::setTimeout(uint32_t aSeconds) {
+  struct timeval tv = { (time_t) aSeconds, 0 };
+  setsockopt(iFd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+void SocketSink::stop() {
+  if ( iFd >= 0 ) {
+    close(iFd);
+    iFd = -1;
+  }
+}
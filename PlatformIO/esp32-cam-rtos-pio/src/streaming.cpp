@@ -1,4 +1,8 @@
 #include "streaming.h"
+#include "admission.h"
+#include "scheduler.h"
+#include "framepool.h"
+#include "metrics.h"
 
 const char* HEADER = "HTTP/1.1 200 OK\r\n" \
                       "Access-Control-Allow-Origin: *\r\n" \
@@ -13,16 +17,60 @@ volatile uint32_t frameNumber;
 frameChunck_t* fstFrame = NULL;  // first frame
 frameChunck_t* curFrame = NULL;  // current frame being captured by the camera
 
-const char*  STREAMING_URL = "/mjpeg/1";
+const char   STREAMING_URL[] = "/mjpeg/1";
 
-void mjpegCB(void* pvParameters) {
-  TickType_t xLastWakeTime;
-  const TickType_t xFrequency = pdMS_TO_TICKS(WSINTERVAL);
+// ==== Streaming state shared by all modes =========================================
+FrameSource*      frameSource = NULL;  // where camCB gets the frames from
 
+TaskHandle_t      tCam;                 // handles getting picture frames from the camera and storing them locally
+TaskHandle_t      tStream;
+
+uint8_t           noActiveClients;      // number of active clients
+
+captureStats_t    captureStats;         // camCB publication intervals
+int               streamEvent = -1;     // eventfd a select() based streaming task waits on
+int               frameEvent = -1;      // eventfd the webserver waits on for requests that need a new frame
+std::atomic<uint32_t> frameWaiters(0);  // such requests
+int               rtpEvent = -1;        // eventfd the RTSP server waits on while sessions are playing
+std::atomic<uint32_t> rtpWaiters(0);    // such sessions
+static uint32_t   snapshotTime = 0;     // millis() of the last snapshot request
+static bool       snapshotSeen = false;
+
+volatile uint8_t  captureFps = FPS;     // highest frame rate any client asked for, FPS with no clients
+volatile uint32_t fpsDemand = 0;        // sum of the client frame rates
+static uint16_t   fpsClients[FPS + 1];  // clients per requested frame rate, changed under fpsLock
+static portMUX_TYPE fpsLock = portMUX_INITIALIZER_UNLOCKED;
+
+// frameSync semaphore protects the frame chain of the all-frames mode. The other modes
+// publish frames lock-free (see frame.h)
+SemaphoreHandle_t frameSync = NULL;
+
+
+// ==== Start frame capture. Clients are handed over with handleJPGSstream() =========
+void startStreaming() {
   // Creating frame synchronization semaphore and initializing it
   frameSync = xSemaphoreCreateBinary();
   xSemaphoreGive( frameSync );
 
+#if defined(CAMERA_MULTICLIENT_QUEUE) || defined(CAMERA_MULTICLIENT_TASK)
+  //  Frame buffers for the size of the frames, set aside before the first capture.
+  //  All-frames mode keeps its frames in the frame arena instead
+  if ( !poolInit(resolution[FRAME_SIZE].width, resolution[FRAME_SIZE].height) ) {
+    Log.error("startStreaming: cannot set aside frame buffers, frames come from the heap\n");
+  }
+#endif
+
+  //  Event counter signalled on new frames and new clients. It is a file descriptor,
+  //  so a streaming task can wait for it and its sockets in the same select()
+#if defined(ARDUINO_ARCH_ESP32)
+  esp_vfs_eventfd_config_t config = ESP_VFS_EVENTD_CONFIG_DEFAULT();
+  esp_vfs_eventfd_register(&config);
+#endif
+  streamEvent = eventfd(0, 0);
+  frameEvent = eventfd(0, 0);
+  rtpEvent = eventfd(0, 0);
+  if ( streamEvent < 0 || frameEvent < 0 || rtpEvent < 0 ) Log.error("startStreaming: cannot create stream event\n");
+
 
   //  Creating RTOS task for grabbing frames from the camera
   xTaskCreatePinnedToCore(
@@ -33,25 +81,151 @@ void mjpegCB(void* pvParameters) {
       tskIDLE_PRIORITY + 2, // priority
       &tCam,        // RTOS task handle
       APP_CPU);     // core
+}
 
-  //  Registering webserver handling routines
-  server.on(STREAMING_URL, HTTP_GET, handleJPGSstream);
-  server.onNotFound(handleNotFound);
 
-  //  Starting webserver
-  server.begin();
+// ==== Called by camCB every time a frame is published ===============================
+void captureDone(size_t aSize, uint32_t aCaptureUs) {
+  uint32_t now = micros();
+  //  Averages over about the last 8 frames, seeded with the first one
+  if ( captureStats.count ) {
+    captureStats.sizeAvg += ((int32_t) aSize - (int32_t) captureStats.sizeAvg) / 8;
+    captureStats.timeAvg += ((int32_t) aCaptureUs - (int32_t) captureStats.timeAvg) / 8;
+  }
+  else {
+    captureStats.sizeAvg = aSize;
+    captureStats.timeAvg = aCaptureUs;
+  }
+  if ( aCaptureUs > captureStats.timeMax ) captureStats.timeMax = aCaptureUs;
+  uint32_t gap = 0;
+  if ( captureStats.count++ ) {
+    gap = now - captureStats.last;
+    captureStats.sum += gap;
+    captureStats.sumSq += (uint64_t) gap * gap;
+    if ( gap > captureStats.maxGap ) captureStats.maxGap = gap;
+  }
+  metricsCapture(aCaptureUs, gap, aSize);
+  captureStats.last = now;
+  admitSample();
+
+  //  Wake up the webserver if a request is waiting for this frame, and the RTSP server
+  uint64_t one = 1;
+  if ( frameWaiters && frameEvent >= 0 ) write(frameEvent, &one, sizeof(one));
+  if ( rtpWaiters && rtpEvent >= 0 ) write(rtpEvent, &one, sizeof(one));
+}
+
 
-  Log.trace("mjpegCB: Starting streaming service\n");
-  Log.verbose ("mjpegCB: free heap (start)  : %d\n", ESP.getFreeHeap());
+// ==== Snapshots (/jpg) ===============================================================
+//  Snapshots are served from the frames camCB captures for the streaming clients, never from
+//  the camera driver directly. Without streaming clients camCB keeps running for SNAPSHOT_IDLE_MS
+//  after a snapshot request, so that a client polling for stills finds a recent frame
+void snapshotWanted() {
+  snapshotTime = millis();
+  snapshotSeen = true;
+  if ( tCam && eTaskGetState( tCam ) == eSuspended ) vTaskResume( tCam );
+}
 
-  //=== loop() section  ===================
-  xLastWakeTime = xTaskGetTickCount();
-  for (;;) {
-    server.handleClient();
+bool snapshotActive() {
+  return snapshotSeen && millis() - snapshotTime < SNAPSHOT_IDLE_MS;
+}
+
+
+// ==== Client frame rates ==============================================================
+//  Clients may ask for fewer frames per second than FPS (?fps=2). The camera is only run
+//  as fast as the most demanding client, and every client gets every k-th captured frame
+
+//  The rate a client gets: what it asked for, within 1..FPS. 0 (not asked) means FPS
+uint8_t clientFps(int aFps) {
+  if ( aFps <= 0 || aFps > FPS ) return FPS;
+  return aFps;
+}
 
-    //  After every server client handling request, we let other tasks run and then pause
-    if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
+//  Must be called holding fpsLock: clients join on the webserver task and leave on their own
+//  tasks, and the rates have to be worked out from the counts as they are after the change
+static void fpsUpdate() {
+  uint8_t  top = 0;
+  uint32_t sum = 0;
+  for (int i = 1; i <= FPS; i++) {
+    uint16_t n = fpsClients[i];
+    if ( n ) top = i;
+    sum += n * i;
   }
+  captureFps = top ? top : FPS;
+  fpsDemand = sum;
+}
+
+void fpsJoin(uint8_t aFps) {
+  portENTER_CRITICAL(&fpsLock);
+  uint8_t before = captureFps;
+  fpsClients[aFps]++;
+  fpsUpdate();
+  bool faster = captureFps > before;
+  portEXIT_CRITICAL(&fpsLock);
+#if defined(CAMERA_MULTICLIENT_TASK) || defined(CAMERA_ALL_FRAMES)
+  //  camCB may be in the middle of a long interval at the old rate
+  if ( faster ) schedRateUp();
+#else
+  (void) faster;
+#endif
+}
+
+void fpsLeave(uint8_t aFps) {
+  portENTER_CRITICAL(&fpsLock);
+  fpsClients[aFps]--;
+  fpsUpdate();
+  portEXIT_CRITICAL(&fpsLock);
+}
+
+//  A client at aFps gets every frameStep()-th captured frame
+uint32_t frameStep(uint8_t aFps) {
+  uint8_t c = captureFps;
+  if ( aFps >= c ) return 1;
+  return (c + aFps / 2) / aFps;
+}
+
+
+// ==== Stream event: wake up / clear =================================================
+void streamSignal() {
+  uint64_t one = 1;
+  if ( streamEvent >= 0 ) write(streamEvent, &one, sizeof(one));
+}
+
+//  Only call when select() reported the event readable, or it blocks
+void streamClear() {
+  uint64_t cnt;
+  if ( streamEvent >= 0 ) read(streamEvent, &cnt, sizeof(cnt));
+}
+
+
+// ==== Multipart part header of a frame ===============================================
+//  Built once per frame when it is captured, so senders only push precomputed bytes.
+//  X-Timestamp (capture time, seconds) and X-Frame-Number are added with the
+//  PART_TIMESTAMP and PART_FRAME_NUMBER build flags. aBuf holds PART_HEADER_MAX bytes
+size_t partHeader(char* aBuf, size_t aSize, uint32_t aFnm, const struct timeval* aTms) {
+  int n = snprintf(aBuf, PART_HEADER_MAX, "%s%u\r\n", CTNTTYPE, (unsigned) aSize);
+#if defined(PART_TIMESTAMP)
+  n += snprintf(aBuf + n, PART_HEADER_MAX - n, "X-Timestamp: %lu.%06lu\r\n",
+                (unsigned long) aTms->tv_sec, (unsigned long) aTms->tv_usec);
+#endif
+#if defined(PART_FRAME_NUMBER)
+  n += snprintf(aBuf + n, PART_HEADER_MAX - n, "X-Frame-Number: %u\r\n", (unsigned) aFnm);
+#endif
+  n += snprintf(aBuf + n, PART_HEADER_MAX - n, "\r\n");
+  return n;
+}
+
+
+// ==== Send one multipart part: part header, frame and boundary in a single gather write =====
+size_t streamPart(ClientSink* aClient, const char* aHeader, size_t aHeaderLen, const uint8_t* aData, size_t aSize) {
+  struct iovec iov[3];
+
+  iov[0].iov_base = (void*) aHeader;
+  iov[0].iov_len = aHeaderLen;
+  iov[1].iov_base = (void*) aData;
+  iov[1].iov_len = aSize;
+  iov[2].iov_base = (void*) BOUNDARY;
+  iov[2].iov_len = bdrLen;
+  return aClient->writev(iov, 3);
 }
 
 
@@ -97,18 +271,3 @@ char* allocateMemory(char* aPtr, size_t aSize, bool fail, bool psramOnly) {
   }
   return ptr;
 }
-
-
-// ==== Handle invalid URL requests ============================================
-void handleNotFound() {
-  String message = "Server is running!\n\n";
-  message += "URI: ";
-  message += server.uri();
-  message += "\nMethod: ";
-  message += (server.method() == HTTP_GET) ? "GET" : "POST";
-  message += "\nArguments: ";
-  message += server.args();
-  message += "\n";
-  server.send(200, "text / plain", message);
-}
-
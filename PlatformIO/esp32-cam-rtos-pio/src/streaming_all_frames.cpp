@@ -1,106 +1,225 @@
 #include "streaming.h"
+#include "scheduler.h"
+#include "framearena.h"
+#include "metrics.h"
 
 #if defined (CAMERA_ALL_FRAMES)
 
 #if defined(BENCHMARK)
-#include <AverageFilter.h>
 #define BENCHMARK_PRINT_INT 1000
 #endif
 
+// ==== Read cursors of the streaming clients ==================================
+//  Every client publishes the number of the oldest frame it may still read: the one it is sending,
+//  or the one it waits on for camCB to link the next. Clients move along the chain without taking
+//  frameSync; camCB frees whatever is before the lowest cursor in one go before it stores a frame.
+//  A slot is taken and given back under frameSync.
+//  Backpressure (frameRoom()) moves a slow client on through skipTo and latest, see nextFrame()
+static std::atomic<uint32_t> cursors[MAX_CLIENTS];
+static std::atomic<uint32_t> skipTo[MAX_CLIENTS];   // frame the client is to skip ahead to, if past its cursor
+static std::atomic<bool>     latest[MAX_CLIENTS];   // the client only gets the latest frame
+static bool                  cursorUsed[MAX_CLIENTS];
+
+static int8_t cursorTake(uint32_t aFnm) {
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if ( cursorUsed[i] ) continue;
+    cursors[i].store(aFnm, std::memory_order_release);
+    skipTo[i].store(aFnm, std::memory_order_relaxed);
+    latest[i].store(false, std::memory_order_relaxed);
+    cursorUsed[i] = true;
+    return i;
+  }
+  return -1;
+}
+
+static void cursorGive(int8_t aSlot) {
+  if ( aSlot >= 0 ) cursorUsed[aSlot] = false;
+}
+
+
+// ==== Free the frames at the head of the chain every client has read ===========
+//  Must be called holding frameSync. The last frame of the chain is never freed: camCB links
+//  the next frame to it. Neither is a frame pinned by a snapshot request.
+//  The chain is stored in the frame arena in capture order, so its head is always the oldest frame there
+static void reclaimFrames() {
+  if ( fstFrame == NULL ) return;
+
+  uint32_t first = curFrame->fnm;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if ( !cursorUsed[i] ) continue;
+    uint32_t c = cursors[i].load(std::memory_order_acquire);
+    if ( (int32_t) (c - first) < 0 ) first = c;
+  }
+  while ( fstFrame != curFrame && fstFrame->pin == 0 && (int32_t) (fstFrame->fnm - first) < 0 ) {
+    frameChunck_t* f = (frameChunck_t*) fstFrame->nxt.load(std::memory_order_relaxed);
+    arenaFree( &frameArena, fstFrame );
+    fstFrame = f;
+  }
+}
+
+
+// ==== Backpressure: whether there is room for a frame of aSize bytes ============
+//  Must be called holding frameSync, after reclaimFrames(). There is unless the frames the clients
+//  hold and the new one take more than frameMemoryLimit and capture is to wait for the slowest client
+//  (BACKPRESSURE_PAUSE). With the other policies the clients holding the frames in the way are told
+//  to skip them or demoted to the latest frame, and the frame goes to the rest of the arena until
+//  they have sent the frame they are at and let go of the others
+static bool frameRoom(size_t aSize) {
+  size_t need = arenaEntry(aSize);
+  if ( fstFrame == NULL || frameArena.used + need <= frameMemoryLimit ) return true;
+  if ( frameBackpressure == BACKPRESSURE_PAUSE ) return false;
+
+  //  The first frame to keep: the ones before it are what has to go
+  frameChunck_t* keep = fstFrame;
+  size_t used = frameArena.used;
+  while ( keep != curFrame && used + need > frameMemoryLimit ) {
+    used -= keep->len;
+    keep = (frameChunck_t*) keep->nxt.load(std::memory_order_relaxed);
+  }
+
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if ( !cursorUsed[i] ) continue;
+    uint32_t c = cursors[i].load(std::memory_order_acquire);
+    if ( (int32_t) (c - keep->fnm) >= 0 ) continue;
+    if ( frameBackpressure == BACKPRESSURE_DEMOTE ) {
+      if ( !latest[i].load(std::memory_order_relaxed) ) {
+        latest[i].store(true, std::memory_order_relaxed);
+        backpressureStats.demoted++;
+      }
+    }
+    else {
+      //  Counted once per client falling behind, not for every frame it takes to catch up
+      if ( (int32_t) (skipTo[i].load(std::memory_order_relaxed) - c) <= 0 ) backpressureStats.laggards++;
+      skipTo[i].store(keep->fnm, std::memory_order_relaxed);
+    }
+  }
+  return true;
+}
+
+
+// ==== The frame a client moves on to from aFrame ================================
+//  The next one, or a later one if backpressure wants the client to skip ahead.
+//  NULL if camCB has not linked the next frame yet. The frames walked past are safe to look at:
+//  none of them is freed before the client moves its cursor
+static frameChunck_t* nextFrame(int8_t aSlot, frameChunck_t* aFrame) {
+  frameChunck_t* f = (frameChunck_t*) aFrame->nxt.load(std::memory_order_acquire);
+  if ( f == NULL ) return NULL;
+
+  bool     newest = latest[aSlot].load(std::memory_order_relaxed);
+  uint32_t to = skipTo[aSlot].load(std::memory_order_relaxed);
+  for (;;) {
+    if ( !newest && (int32_t) (f->fnm - to) >= 0 ) break;
+    frameChunck_t* n = (frameChunck_t*) f->nxt.load(std::memory_order_acquire);
+    if ( n == NULL ) break;
+    f = n;
+    backpressureStats.skipped++;
+  }
+  return f;
+}
+
+
 // ==== RTOS task to grab frames from the camera =========================
 void camCB(void* pvParameters) {
 
   TickType_t xLastWakeTime;
 
-  //  A running interval associated with currently desired frame rate
-  const TickType_t xFrequency = pdMS_TO_TICKS(1000 / FPS);
+  //  Frames are captured at the currently desired frame rate
+  //  (the highest rate a client asked for), see schedCaptureDelay()
 
   frameNumber = 0;
   xLastWakeTime = xTaskGetTickCount();
 
+  //  All frames are stored in one PSRAM buffer allocated once, instead of two allocations per frame
+  if ( !arenaInit(&frameArena, FRAME_ARENA_SIZE) ) {
+    Log.fatal("camCB: cannot allocate the frame arena - OOM\n");
+    delay(5000);
+    ESP.restart();
+  }
+  if ( frameMemoryLimit > frameArena.size ) frameMemoryLimit = frameArena.size / 4 * 3;
+  Log.verbose("camCB: frame arena of %d bytes, %d for frames (%s)\n", frameArena.size, frameMemoryLimit, backpressureName(frameBackpressure));
+
 #if defined(BENCHMARK)
-    averageFilter<uint32_t> captureAvg(10);
-    averageFilter<uint32_t> tickAvg(10);
-    captureAvg.initialize();
-    tickAvg.initialize();
     uint32_t lastPrintCam = millis();
-    uint32_t benchmarkStart;
-    uint32_t lastTick = millis();
 #endif
 
   camera_fb_t* fb = NULL;
 
   for (;;) {
+    uint32_t captureStart = micros();
 
-#if defined(BENCHMARK)
-    benchmarkStart = micros();
-#endif
-
-    //  Grab a frame from the camera and allocate frame chunk for it
-    fb = esp_camera_fb_get();
+    //  Grab a frame from the camera and store it at the tail of the frame arena, after freeing
+    //  what every client has read. Only camCB takes frames from the arena and gives them back,
+    //  so the frame is stored without holding frameSync
+    fb = frameSource->get();
     if ( fb ) {
-      frameChunck_t* f = (frameChunck_t*) allocateMemory(NULL, sizeof(frameChunck_t), OK_IF_OOM, PSRAM_ONLY);
+      xSemaphoreTake( frameSync, portMAX_DELAY );
+      reclaimFrames();
+      bool room = frameRoom(fb->len);
+      xSemaphoreGive( frameSync );
+      frameChunck_t* f = room ? arenaAlloc(&frameArena, fb->len) : NULL;
       if ( f ) {
-        // char* d = (char*) ps_malloc( fb->len );
-        char* d = (char*) allocateMemory(NULL, fb->len, OK_IF_OOM, PSRAM_ONLY); 
-        if ( d == NULL ) {
-          free (f);
+        f->nxt.store(NULL, std::memory_order_relaxed);
+        f->pin = 0;
+        memcpy(f->dat, (char *)fb->buf, fb->len);
+        f->fnm = frameNumber;
+        f->tms = fb->timestamp;
+        f->hln = partHeader(f->hdr, f->siz, f->fnm, &f->tms);
+        uint32_t captureTime = micros() - captureStart;
+
+        //  Link the frame to the chain. Clients follow nxt without a lock, so it is only set once
+        //  the frame is complete. New clients and snapshots start from the ends of the chain,
+        //  which are changed under frameSync
+        xSemaphoreTake( frameSync, portMAX_DELAY );
+        if ( fstFrame == NULL ) {
+          fstFrame = f;
         }
-        else {
-          if ( fstFrame == NULL ) {
-            fstFrame = f;
-          }
-          f->dat = (uint8_t*) d;
-          f->nxt = NULL;
-          f->siz = fb->len;
-          f->cnt = 0;
-          memcpy(f->dat, (char *)fb->buf, fb->len);
-          f->fnm = frameNumber;
-          if ( curFrame ) {
-            curFrame->nxt = (uint32_t*) f;
-          }
-          curFrame = f;
-          // Log.verbose("Captured frame# %d\n", frameNumber);
-          frameNumber++;
+        if ( curFrame ) {
+          curFrame->nxt.store(f, std::memory_order_release);
         }
+        curFrame = f;
+        xSemaphoreGive( frameSync );
+        captureDone(f->siz, captureTime);
+        schedPublish(f->fnm);
+        // Log.verbose("Captured frame# %d\n", frameNumber);
+        frameNumber++;
+      }
+      else if ( !room ) {
+        //  Capture waits for the slowest client: the frame is not stored, and the next one is
+        //  taken at the usual time
+        backpressureStats.paused++;
       }
       else {
-        Log.error("camCB: error allocating memory for frame %d - OOM\n", frameNumber);
-        vTaskDelay(1000);
+        //  The slow clients have not let go of the oldest frames yet
+        backpressureStats.full++;
+        Log.trace("camCB: no room in the frame arena for frame %d (%d bytes, %d frames stored)\n", frameNumber, fb->len, frameArena.count);
       }
-      esp_camera_fb_return(fb);
+      frameSource->release(fb);
     }
     else {
       Log.error("camCB: error capturing image for frame %d\n", frameNumber);
+      captureStats.errors++;
       vTaskDelay(1000);
     }
 
-#if defined(BENCHMARK)
-    captureAvg.value(micros()-benchmarkStart);
-#endif
-
-    if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
+    schedCaptureDelay(&xLastWakeTime);
 
-#if defined(BENCHMARK)
-    tickAvg.value(millis()-lastTick);
-    lastTick = millis();
-#endif
-
-    if ( noActiveClients == 0 ) {
+    if ( noActiveClients == 0 && !snapshotActive() ) {
       // we need to drain the cache if there are no more clients connected
       Log.trace("mjpegCB: All clients disconneted\n");
-      while ( fstFrame !=NULL && fstFrame->nxt ) {
-        frameChunck_t* f = (frameChunck_t*) fstFrame->nxt;
-        free ( fstFrame->dat );
-        free ( fstFrame );
+      xSemaphoreTake( frameSync, portMAX_DELAY );
+      //  A client may have connected in the meantime
+      while ( noActiveClients == 0 && fstFrame != NULL && fstFrame->pin == 0 ) {
+        frameChunck_t* f = (frameChunck_t*) fstFrame->nxt.load(std::memory_order_relaxed);
+        arenaFree( &frameArena, fstFrame );
         fstFrame = f;
       }
-      fstFrame = NULL;
-      curFrame = NULL;
+      if ( fstFrame == NULL ) curFrame = NULL;
+      xSemaphoreGive( frameSync );
       Log.verbose("mjpegCB: free heap           : %d\n", ESP.getFreeHeap());
       Log.verbose("mjpegCB: min free heap       : %d\n", ESP.getMinFreeHeap());
       Log.verbose("mjpegCB: max alloc free heap : %d\n", ESP.getMaxAllocHeap());
       Log.verbose("mjpegCB: free psram          : %d\n", ESP.getFreePsram());
+      Log.verbose("mjpegCB: frame arena         : %d frames, high water %d of %d bytes\n", frameArena.count, frameArena.highWater, frameArena.size);
       Log.verbose("mjpegCB: tCam stack wtrmark  : %d\n", uxTaskGetStackHighWaterMark(tCam));
       vTaskSuspend(NULL);  // passing NULL means "suspend yourself"
     }
@@ -108,7 +227,7 @@ void camCB(void* pvParameters) {
 #if defined(BENCHMARK)
     if ( millis() - lastPrintCam > BENCHMARK_PRINT_INT ) {
       lastPrintCam = millis();
-      Log.verbose("mjpegCB: average frame capture time: %d us (tick avg=%d)\n", captureAvg.currentValue(), tickAvg.currentValue() );
+      Log.verbose("camCB: frame capture time avg=%d us, max=%d us\n", captureStats.timeAvg, captureStats.timeMax);
     }
 #endif
 
@@ -116,31 +235,74 @@ void camCB(void* pvParameters) {
 }
 
 
+// ==== Clients being served: every one has its own streaming task ===========
+int clientCount() {
+  return noActiveClients;
+}
+
+
+// ==== The latest frame for snapshots (/jpg) ==================================
+//  The frame is pinned in the chain while it is sent
+bool snapshotAcquire(snapshot_t* aSnap) {
+  xSemaphoreTake( frameSync, portMAX_DELAY );
+  frameChunck_t* f = curFrame;
+  if ( f ) {
+    f->pin++;
+    aSnap->hdr = f->hdr;
+    aSnap->hln = f->hln;
+    aSnap->dat = f->dat;
+    aSnap->siz = f->siz;
+    aSnap->fnm = f->fnm;
+    aSnap->tms = f->tms;
+    aSnap->ref = f;
+  }
+  xSemaphoreGive( frameSync );
+  return f != NULL;
+}
+
+void snapshotRelease(snapshot_t* aSnap) {
+  frameChunck_t* f = (frameChunck_t*) aSnap->ref;
+  xSemaphoreTake( frameSync, portMAX_DELAY );
+  f->pin--;
+  xSemaphoreGive( frameSync );
+  aSnap->ref = NULL;
+}
+
+
 // ==== Handle connection request from clients ===============================
-void handleJPGSstream(void)
+bool handleJPGSstream(ClientSink* client, uint8_t aFps)
 {
-  if ( noActiveClients >= MAX_CLIENTS ) return;
   Log.verbose("handleJPGSstream start: free heap  : %d\n", ESP.getFreeHeap());
 
   streamInfo_t* info = (streamInfo_t*) malloc( sizeof(streamInfo_t) );
   if ( info == NULL ) {
     Log.error("handleJPGSstream: cannot allocate stream info - OOM\n");
-    return;
+    return false;
   }
-  info->client = new WiFiClient;
-  if ( info->client == NULL ) {
-    Log.error("handleJPGSstream: cannot allocate WiFi client for streaming - OOM\n");
+  info->client = client;
+  info->fps = clientFps(aFps);
+  info->due = 0;
+
+  //  The new client's cursor has to be in place before its task can touch the frame chain,
+  //  otherwise camCB may free the frame it is about to serve: the head of the chain, or the next
+  //  frame captured if there is none. The client count and the cursor slots change together
+  //  under frameSync, so two clients connecting at once cannot both take the last slot
+  xSemaphoreTake( frameSync, portMAX_DELAY );
+  info->cursor = noActiveClients < MAX_CLIENTS ? cursorTake( fstFrame ? fstFrame->fnm : frameNumber ) : -1;
+  if ( info->cursor >= 0 ) noActiveClients++;
+  xSemaphoreGive( frameSync );
+  if ( info->cursor < 0 ) {
+    Log.warning("handleJPGSstream: no cursor slot left for the client\n");
     free(info);
-    return;
+    return false;
   }
-
-  *(info->client) = server.client();
+  fpsJoin(info->fps);
 
   //  Creating task to push the stream to all connected clients
   int rc = xTaskCreatePinnedToCore(
              streamCB,
              "streamCB",
-             3 * KILOBYTE,
+             CLIENT_TASK_STACK,
              (void*) info,
              tskIDLE_PRIORITY + 2,
              &info->task,
@@ -148,102 +310,89 @@ void handleJPGSstream(void)
   if ( rc != pdPASS ) {
     Log.error("handleJPGSstream: error creating RTOS task. rc = %d\n", rc);
     Log.error("handleJPGSstream: free heap  : %d\n", ESP.getFreeHeap());
-    delete info;
+    xSemaphoreTake( frameSync, portMAX_DELAY );
+    cursorGive(info->cursor);
+    noActiveClients--;
+    xSemaphoreGive( frameSync );
+    fpsLeave(info->fps);
+    free(info);
+    return false;
   }
 
-  xSemaphoreTake( frameSync, portMAX_DELAY );
-  noActiveClients++;
-  xSemaphoreGive( frameSync );
-
   // Wake up streaming tasks, if they were previously suspended:
   if ( eTaskGetState( tCam ) == eSuspended ) vTaskResume( tCam );
+  return true;
 }
 
 
 // ==== Actually stream content to all connected clients ========================
 void streamCB(void * pvParameters) {
-  char buf[16];
-  TickType_t xLastWakeTime;
-  TickType_t xFrequency;
-
-  frameChunck_t* myFrame = fstFrame;
+  frameChunck_t* myFrame = NULL;
+  bool           served = false;   // myFrame has been sent, waiting for the next one to be linked
 
   streamInfo_t* info = (streamInfo_t*) pvParameters;
 
+  //  The task sleeps until camCB links a frame due at the rate its client asked for, then walks
+  //  every frame up to it. Frames passed over in between stay in the chain until then
+  schedJoin(info);
+  int8_t metrics = metricsJoin(METRICS_MJPEG, info->fps);
+
   //  Immediately send this client a header
   info->client->write(HEADER, hdrLen);
   info->client->write(BOUNDARY, bdrLen);
 
-  xLastWakeTime = xTaskGetTickCount();
-  xFrequency = pdMS_TO_TICKS(1000 / FPS);
-
   Log.trace("streamCB: Client connected\n");
 
 #if defined(BENCHMARK)
-  averageFilter<int32_t> streamAvg(10);
-  averageFilter<int32_t> waitAvg(10);
-  averageFilter<uint32_t> frameAvg(10);
-  averageFilter<float> fpsAvg(10);
-  uint32_t streamStart = 0;
-  streamAvg.initialize();
-  waitAvg.initialize();
-  frameAvg.initialize();
-  fpsAvg.initialize();
   uint32_t lastPrint = millis();
-  uint32_t lastFrame = millis();
 #endif
 
   for (;;) {
-    if ( myFrame ) {
-
-#if defined (BENCHMARK)
-        frameAvg.value( myFrame->siz );
-        streamStart = micros();
-#endif        
-
-      if ( info->client->connected() ) {
-        sprintf(buf, "%d\r\n\r\n", myFrame->siz);
-        info->client->write(CTNTTYPE, cntLen);
-        info->client->write(buf, strlen(buf));
-        info->client->write((char*) myFrame->dat, (size_t)myFrame->siz);
-        info->client->write(BOUNDARY, bdrLen);
-        // Log.verbose("streamCB: Served frame# %d\n", fstFrame->fnm);
-      }
-
-#if defined (BENCHMARK)
-        streamAvg.value(micros()-streamStart);
-        streamStart = micros();
-#endif
-
+    if ( myFrame == NULL ) {
       xSemaphoreTake( frameSync, portMAX_DELAY );
+      myFrame = fstFrame;
+      if ( myFrame ) cursors[info->cursor].store(myFrame->fnm, std::memory_order_release);
+      served = false;
+      xSemaphoreGive( frameSync );
+    }
 
-#if defined (BENCHMARK)
-        waitAvg.value(micros()-streamStart);
-#endif
+    while ( myFrame ) {
 
-      myFrame->cnt++;
-      frameChunck_t* myNextFrame = (frameChunck_t*) myFrame->nxt; // this maybe NULL - that's ok
+      if ( !served ) {
+        //  Frames in between the ones due at the client's frame rate are passed over
+        if ( info->client->connected() && (int32_t) (myFrame->fnm - info->due) >= 0 ) {
+          uint32_t sendStart = micros();
+          size_t sent = streamPart(info->client, myFrame->hdr, myFrame->hln, myFrame->dat, myFrame->siz);
+          if ( sent ) metricsSent(metrics, myFrame->fnm, sent, micros() - sendStart, &myFrame->tms);
+          info->due = myFrame->fnm + frameStep(info->fps);
+          // Log.verbose("streamCB: Served frame# %d\n", fstFrame->fnm);
+        }
+        served = true;
+      }
 
-      // if serving first frame in the chain, check if we are the last serving task and it needs to be deleted
-      if ( myFrame == fstFrame && fstFrame->cnt >= noActiveClients ) {
-        free ( fstFrame->dat );
-        fstFrame->dat = NULL;
-        free ( fstFrame );
-        fstFrame = myNextFrame;
+      //  Only move on once camCB has linked the next frame: the last frame in the chain is the one
+      //  camCB is appending to. Moving the cursor past this frame lets camCB free it
+      frameChunck_t* myNextFrame = nextFrame(info->cursor, myFrame);
+      if ( myNextFrame ) {
+        cursors[info->cursor].store(myNextFrame->fnm, std::memory_order_release);
+        myFrame = myNextFrame;
+        served = false;
       }
-      xSemaphoreGive( frameSync );
 
-      myFrame = myNextFrame;
-    }
-    else {
-      myFrame = fstFrame;
+      //  Caught up with camCB: wait for the next frame
+      if ( myNextFrame == NULL ) break;
     }
 
     if ( !info->client->connected() ) {
       //  client disconnected - clean up.
+      //  Without its cursor, camCB frees the frames only this client held the next time it stores one
+      schedLeave(info);
       xSemaphoreTake( frameSync, portMAX_DELAY );
+      cursorGive(info->cursor);
       noActiveClients--;
       xSemaphoreGive( frameSync );
+      fpsLeave(info->fps);
+      metricsLeave(metrics);
 
       Log.verbose("streamCB: Stream Task stack wtrmark  : %d\n", uxTaskGetStackHighWaterMark(info->task));
       info->client->stop();
@@ -255,21 +404,18 @@ void streamCB(void * pvParameters) {
       vTaskDelay(100);
       vTaskDelete(NULL);
     }
-    //  Let other tasks run after serving every client
-    if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
-
 
 #if defined (BENCHMARK)
-        fpsAvg.value(1000.0 / (float) (millis()-lastFrame) );
-        lastFrame = millis();
-
     if ( millis() - lastPrint > BENCHMARK_PRINT_INT ) {
       lastPrint = millis();
-      Log.verbose("streamCB: wait avg=%d, stream avg=%d us, frame avg size=%d bytes, fps=%S\n", waitAvg.currentValue(), streamAvg.currentValue(), frameAvg.currentValue(), String(fpsAvg.currentValue()));
+      metricsLogClient(metrics);
       if ( fstFrame ) Log.verbose("streamCB: current frame: %d, first frame:%d\n", curFrame->fnm, fstFrame->fnm);
     }
 #endif
+
+    //  Let other tasks run until the next frame due for this client is linked
+    schedWait(info, myFrame == NULL);
   }
 }
 
-#endif
\ No newline at end of file
+#endif
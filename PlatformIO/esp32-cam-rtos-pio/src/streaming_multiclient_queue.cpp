@@ -1,29 +1,30 @@
 #include "streaming.h"
-#include "lwip/sockets.h"
+#include "frame.h"
+#include "metrics.h"
 
 #if defined(CAMERA_MULTICLIENT_QUEUE)
 
 #if defined(BENCHMARK)
-#include <AverageFilter.h>
 #define BENCHMARK_PRINT_INT 1000
-averageFilter<uint32_t> captureAvg(10);
 uint32_t lastPrintCam = millis();
 #endif
 
 QueueHandle_t streamingClients;
+framePub_t    camPub;         // the latest frame, published by camCB without locking
 
-volatile size_t camSize;    // size of the current frame, byte
-volatile char* camBuf;      // pointer to the current frame
+//  Clients admitted: counted when handed over, so a client still in the queue is never missed
+static std::atomic<int> queueClients(0);
 
 // ==== RTOS task to grab frames from the camera =========================
 void camCB(void* pvParameters) {
   TickType_t xLastWakeTime;
 
   //  A running interval associated with currently desired frame rate
-  const TickType_t xFrequency = pdMS_TO_TICKS(1000 / FPS);
+  //  (the highest rate a client asked for)
+  TickType_t xFrequency = pdMS_TO_TICKS(1000 / captureFps);
 
-  // Creating a queue to track all connected clients
-  streamingClients = xQueueCreate( 10, sizeof(WiFiClient*) );
+  // Creating a queue to hand newly connected clients over to the streaming task
+  streamingClients = xQueueCreate( MAX_CLIENTS, sizeof(streamInfo_t) );
 
 
   //  Creating task to push the stream to all connected clients
@@ -37,79 +38,63 @@ void camCB(void* pvParameters) {
     APP_CPU);
     // PRO_CPU);
 
-  //  Pointers to the 2 frames, their respective sizes and index of the current frame
-  char* fbs[2] = { NULL, NULL };
-  size_t fSize[2] = { 0, 0 };
-  int ifb = 0;
-
   //=== loop() section  ===================
   xLastWakeTime = xTaskGetTickCount();
 
-#if defined(BENCHMARK)
-  captureAvg.initialize();
-#endif
-
   camera_fb_t* fb = NULL;
 
   for (;;) {
     //  Grab a frame from the camera and query its size
-
-#if defined(BENCHMARK)
     uint32_t captureStart = micros();
-#endif
-
-    fb = esp_camera_fb_get();
-    size_t s = fb->len;
-
-    //  If frame size is more that we have previously allocated - request  125% of the current frame space
-    if (s > fSize[ifb]) {
-      fSize[ifb] = s * 4 / 3;
-      fbs[ifb] = allocateMemory(fbs[ifb], fSize[ifb], FAIL_IF_OOM, ANY_MEMORY);
+    uint32_t captureTime = 0;
+
+    fb = frameSource->get();
+    frame_t* f = NULL;
+    if ( fb ) {
+      //  Wrap the camera buffer into a shared frame (copied only if the camera needs it back)
+      f = frameCapture(fb);
+      captureTime = micros() - captureStart;
+      if ( f == NULL ) {
+        Log.error("camCB: error allocating memory for frame %d - OOM\n", frameNumber);
+        captureStats.errors++;
+      }
+    }
+    else {
+      Log.error("camCB: error capturing image for frame %d\n", frameNumber);
+      captureStats.errors++;
+      vTaskDelay(1000);
     }
 
-    //  Copy current frame into local buffer
-    char* b = (char *)fb->buf;
-    memcpy(fbs[ifb], b, s);
-    esp_camera_fb_return(fb);
-  
-#if defined(BENCHMARK)
-    captureAvg.value(micros()-captureStart);
-#endif
-
-    //  Only switch frames around if no frame is currently being streamed to a client
-    //  Wait on a semaphore until client operation completes
-    xSemaphoreTake( frameSync, portMAX_DELAY );
-
-    //  Do not allow interrupts while switching the current frame
-    // taskENTER_CRITICAL(&xSemaphore);
-    camBuf = fbs[ifb];
-    camSize = s;
-    ++ifb;
-    ifb = ifb & 1;  // this should produce 1, 0, 1, 0, 1 ... sequence
-    // taskEXIT_CRITICAL(&xSemaphore);
-
-    //  Let anyone waiting for a frame know that the frame is ready
-    xSemaphoreGive( frameSync );
+    //  Publish the frame. This never waits for the streaming task: a frame that is still
+    //  being sent stays alive until the streaming task lets go of it
+    if ( f ) {
+      f->fnm = ++frameNumber;
+      f->hln = partHeader(f->hdr, f->siz, f->fnm, &f->tms);
+      framePublish(&camPub, f);
+      captureDone(f->siz, captureTime);
+    }
 
-    //  Technically only needed once: let the streaming task know that we have at least one frame
-    //  and it could start sending frames to the clients, if any
-    xTaskNotifyGive( tStream );
+    //  Let the streaming task know there is a new frame for the clients that are done
+    //  with the previous one
+    streamSignal();
 
 
     //  Let other tasks run and wait until the end of the current frame rate interval (if any time left)
     if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
+    xFrequency = pdMS_TO_TICKS(1000 / captureFps);
 
     //  If streaming task has suspended itself (no active clients to stream to)
     //  there is no need to grab frames from the camera. We can save some juice
     //  by suspedning the tasks
-    if ( eTaskGetState( tStream ) == eSuspended ) {
+    if ( eTaskGetState( tStream ) == eSuspended && !snapshotActive() ) {
+      framePublish(&camPub, NULL);  // do not hold on to the last frame while suspended
       vTaskSuspend(NULL);  // passing NULL means "suspend yourself"
     }
 
 #if defined(BENCHMARK)
     if ( millis() - lastPrintCam > BENCHMARK_PRINT_INT ) {
       lastPrintCam = millis();
-      Log.verbose("mjpegCB: average frame capture time: %d microseconds\n", captureAvg.currentValue() );
+      Log.verbose("camCB: frame capture time avg=%d us, max=%d us\n", captureStats.timeAvg, captureStats.timeMax);
     }
 #endif
 
@@ -117,141 +102,258 @@ void camCB(void* pvParameters) {
 }
 
 
+// ==== Clients being served plus the ones waiting to be picked up by the streaming task ====
+int clientCount() {
+  return queueClients.load();
+}
+
+
+// ==== The latest frame for snapshots (/jpg) ==================================
+bool snapshotAcquire(snapshot_t* aSnap) {
+  frame_t* f = frameAcquire( &camPub );
+  if ( f == NULL ) return false;
+  aSnap->hdr = f->hdr;
+  aSnap->hln = f->hln;
+  aSnap->dat = f->dat;
+  aSnap->siz = f->siz;
+  aSnap->fnm = f->fnm;
+  aSnap->tms = f->tms;
+  aSnap->ref = f;
+  return true;
+}
+
+void snapshotRelease(snapshot_t* aSnap) {
+  frameUnref( (frame_t*) aSnap->ref );
+  aSnap->ref = NULL;
+}
+
+
 // ==== Handle connection request from clients ===============================
-void handleJPGSstream(void)
+bool handleJPGSstream(ClientSink* client, uint8_t aFps)
 {
-  //  Can only acommodate 10 clients. The limit is a default for WiFi connections
-  if ( !uxQueueSpacesAvailable(streamingClients) ) {
+  if ( queueClients.fetch_add(1) >= MAX_CLIENTS ) {
+    queueClients--;
     Log.error("handleJPGSstream: Max number of WiFi clients reached\n");
-    return;
+    return false;
   }
 
-  //  Create a new WiFi Client object to keep track of this one
-  WiFiClient* client = new WiFiClient();
-  if ( client == NULL ) {
-    Log.error("handleJPGSstream: Can not create new WiFi client - OOM\n");
-    return;
+  // Push the client to the streaming queue. The streaming task sends the header
+  streamInfo_t info;
+  memset(&info, 0, sizeof(info));
+  info.client = client;
+  info.fps = clientFps(aFps);
+  fpsJoin(info.fps);
+  if ( xQueueSend(streamingClients, (void *) &info, 0) != pdTRUE ) {
+    Log.error("handleJPGSstream: cannot hand the client over to the streaming task\n");
+    fpsLeave(info.fps);
+    queueClients--;
+    return false;
   }
-  *client = server.client();
-
-  //  Immediately send this client a header
-  client->setTimeout(1);
-  client->write(HEADER, hdrLen);
-  client->write(BOUNDARY, bdrLen);
-
-  // Push the client to the streaming queue
-  xQueueSend(streamingClients, (void *) &client, 0);
+  streamSignal();
 
   // Wake up streaming tasks, if they were previously suspended:
   if ( eTaskGetState( tCam ) == eSuspended ) vTaskResume( tCam );
   if ( eTaskGetState( tStream ) == eSuspended ) vTaskResume( tStream );
 
   Log.trace("handleJPGSstream: Client connected\n");
+  return true;
 }
 
 
-// ==== Actually stream content to all connected clients ========================
-void streamCB(void * pvParameters) {
-  char buf[16];
-  TickType_t xLastWakeTime;
-  TickType_t xFrequency = pdMS_TO_TICKS(1000 / FPS);
-
-  //  Wait until the first frame is captured and there is something to send
-  //  to clients
-  ulTaskNotifyTake( pdTRUE,          /* Clear the notification value before exiting. */
-                    portMAX_DELAY ); /* Block indefinitely. */
-
-#if defined(BENCHMARK)
-  averageFilter<int32_t> streamAvg(10);
-  averageFilter<int32_t> waitAvg(10);
-  averageFilter<uint32_t> frameAvg(10);
-  averageFilter<float> fpsAvg(10);
-  uint32_t streamStart = 0;
-  streamAvg.initialize();
-  waitAvg.initialize();
-  frameAvg.initialize();
-  uint32_t lastPrint = millis();
-  uint32_t lastFrame = millis();
-#endif
+// ==== Per-client send cursor =====================================================
+//  Every client progresses through its own list of segments (multipart header, or part
+//  header + frame + boundary) at the pace its socket accepts them
+#define STREAM_SEGMENTS   3
+#define STREAM_WAIT_MS    1000  // select() timeout, in case an event was missed
+
+typedef struct {
+  ClientSink*   client;
+  frame_t*      frame;                      // frame being sent, holds a reference
+  uint32_t      fnm;                        // number of the last frame sent
+  uint32_t      due;                        // first frame number to send next
+  uint8_t       fps;                        // frame rate the client asked for
+  const char*   seg[STREAM_SEGMENTS];       // pending segments
+  size_t        len[STREAM_SEGMENTS];
+  uint8_t       nseg;                       // number of segments
+  uint8_t       cur;                        // segment being sent
+  size_t        off;                        // bytes of the current segment already sent
+  uint32_t      start;                      // micros() when it started on the frame
+  int8_t        metrics;                    // metrics registry slot
+} streamCursor_t;
+
+static streamCursor_t cursors[MAX_CLIENTS];
+
+static bool cursorPending(streamCursor_t* c) {
+  return c->cur < c->nseg;
+}
 
-  xLastWakeTime = xTaskGetTickCount();
-  for (;;) {
-    // Default assumption we are running according to the FPS
+static void cursorStart(streamCursor_t* c, const streamInfo_t* aInfo) {
+  memset(c, 0, sizeof(streamCursor_t));
+  c->client = aInfo->client;
+  c->fps = aInfo->fps;
+  c->metrics = metricsJoin(METRICS_MJPEG, c->fps);
+  c->seg[0] = HEADER;
+  c->len[0] = hdrLen;
+  c->seg[1] = BOUNDARY;
+  c->len[1] = bdrLen;
+  c->nseg = 2;
+}
 
+static void cursorFrame(streamCursor_t* c, frame_t* aFrame) {
+  c->frame = frameRef(aFrame);
+  c->fnm = aFrame->fnm;
+  c->due = aFrame->fnm + frameStep(c->fps);
+  c->seg[0] = aFrame->hdr;
+  c->len[0] = aFrame->hln;
+  c->seg[1] = (const char*) aFrame->dat;
+  c->len[1] = aFrame->siz;
+  c->seg[2] = BOUNDARY;
+  c->len[2] = bdrLen;
+  c->nseg = 3;
+  c->cur = 0;
+  c->off = 0;
+  c->start = micros();
+}
 
-    //  Only bother to send anything if there is someone watching
-    UBaseType_t activeClients = uxQueueMessagesWaiting(streamingClients);
-    if ( activeClients ) {
-      WiFiClient *client;
+//  Push as much of the pending segments as the socket takes without blocking, all of them
+//  in one gather write. Returns false if the client is gone
+static bool cursorSend(streamCursor_t* c) {
+  while ( cursorPending(c) ) {
+    struct iovec iov[STREAM_SEGMENTS];
+    int cnt = 0;
+    for (int i = c->cur; i < c->nseg; i++, cnt++) {
+      iov[cnt].iov_base = (void*) c->seg[i];
+      iov[cnt].iov_len = c->len[i];
+    }
+    iov[0].iov_base = (void*) (c->seg[c->cur] + c->off);
+    iov[0].iov_len -= c->off;
+
+    int n = c->client->sendv(iov, cnt, false);
+    if ( n < 0 ) return false;
+    if ( n == 0 ) return true;  // socket buffer is full - wait until it is writable again
+
+    //  Advance the cursor past what was sent
+    size_t sent = n;
+    while ( sent > 0 ) {
+      size_t left = c->len[c->cur] - c->off;
+      if ( sent < left ) {
+        c->off += sent;
+        break;
+      }
+      sent -= left;
+      c->cur++;
+      c->off = 0;
+    }
+  }
+  //  All sent: let go of the frame
+  if ( c->frame ) metricsSent(c->metrics, c->fnm, c->len[0] + c->len[1] + c->len[2], micros() - c->start, &c->frame->tms);
+  frameUnref(c->frame);
+  c->frame = NULL;
+  return true;
+}
 
-      for (int i = 0; i<activeClients; i++) {
-        //  Since we are sending the same frame to everyone,
-        //  pop a client from the the front of the queue
+static void cursorStop(streamCursor_t* c) {
+  fpsLeave(c->fps);
+  queueClients--;
+  metricsLeave(c->metrics);
+  frameUnref(c->frame);
+  delete c->client;
+  memset(c, 0, sizeof(streamCursor_t));
+}
 
-        xQueueReceive (streamingClients, (void*) &client, 0);
 
-      //  Check if this client is still connected.
-        if (!client->connected()) {
-          //  delete this client reference if s/he has disconnected
-          //  and don't put it back on the queue anymore. Bye!
-          Log.trace("streamCB: Client disconnected\n");
-          delete client;
-        }
-        else {
+// ==== Actually stream content to all connected clients ========================
+//  One task serves all clients: every socket is non-blocking, select() tells which ones
+//  can take more data, and each client advances through its current frame at its own pace.
+//  A client that finishes a frame moves on to the latest one, so a slow client skips frames
+//  instead of slowing everyone else down.
+void streamCB(void * pvParameters) {
+  int       active = 0;
+  frame_t*  latest = NULL;      // the newest published frame, referenced
+  uint32_t  generation = 0;
 
-          //  Ok. This is an actively connected client.
-          //  Let's grab a semaphore to prevent frame changes while we
-          //  are serving this frame
-#if defined (BENCHMARK)
-          streamStart = micros();
+#if defined(BENCHMARK)
+  uint32_t lastPrint = millis();
 #endif
 
-          xSemaphoreTake( frameSync, portMAX_DELAY );
-
-#if defined (BENCHMARK)
-          waitAvg.value(micros()-streamStart);
-          frameAvg.value(camSize);
-          streamStart = micros();
-#endif
+  for (;;) {
+    //  Pick up newly connected clients
+    streamInfo_t info;
+    while ( active < MAX_CLIENTS && xQueueReceive(streamingClients, (void*) &info, 0) == pdTRUE ) {
+      cursorStart(&cursors[active++], &info);
+      noActiveClients = active;
+    }
 
-          sprintf(buf, "%d\r\n\r\n", camSize);
-          client->flush();
-          client->write(CTNTTYPE, cntLen);
-          client->write(buf, strlen(buf));
-          client->write((char*) camBuf, (size_t)camSize);
-          client->write(BOUNDARY, bdrLen);
+    if ( active == 0 ) {
+      //  Since there are no connected clients, there is no reason to waste battery running
+      frameUnref(latest);
+      latest = NULL;
+      vTaskSuspend(NULL);
+      continue;
+    }
 
-#if defined (BENCHMARK)
-          streamAvg.value(micros()-streamStart);
-#endif
+    //  Only take a new reference when camCB has published something new
+    if ( frameGeneration(&camPub) != generation ) {
+      generation = frameGeneration(&camPub);
+      frameUnref(latest);
+      latest = frameAcquire(&camPub);
+    }
 
-          //  The frame has been served. Release the semaphore and let other tasks run.
-          //  If there is a frame switch ready, it will happen now in between frames
-          xSemaphoreGive( frameSync );
+    //  Clients that are done with their previous frame start on the latest one,
+    //  if they are due for one at their frame rate
+    int maxFd = streamEvent;
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    if ( streamEvent >= 0 ) FD_SET(streamEvent, &rfds);
+    for (int i = 0; i < active; i++) {
+      streamCursor_t* c = &cursors[i];
+      if ( !cursorPending(c) && latest && latest->fnm != c->fnm && latest->fnm >= c->due ) cursorFrame(c, latest);
+
+      int fd = c->client->fd();
+      if ( fd < 0 ) continue;
+      FD_SET(fd, &rfds);
+      if ( cursorPending(c) ) FD_SET(fd, &wfds);
+      if ( fd > maxFd ) maxFd = fd;
+    }
 
-          // Since this client is still connected, push it to the end
-          // of the queue for further processing
-          xQueueSend(streamingClients, (void *) &client, 0);
+    //  Sleep until some socket can take more data, a client sent something (or left),
+    //  camCB published a new frame or a new client was handed over
+    struct timeval tv = { STREAM_WAIT_MS / 1000, (STREAM_WAIT_MS % 1000) * 1000 };
+    int n = select(maxFd + 1, &rfds, &wfds, NULL, &tv);
+    if ( n <= 0 ) continue;
+    if ( streamEvent >= 0 && FD_ISSET(streamEvent, &rfds) ) streamClear();
+
+    for (int i = 0; i < active; i++) {
+      streamCursor_t* c = &cursors[i];
+      int fd = c->client->fd();
+      bool ok = fd >= 0;
+
+      //  Anything readable is either a disconnect or data we do not care about
+      if ( ok && FD_ISSET(fd, &rfds) ) {
+        ok = c->client->connected();
+        if ( ok ) c->client->flush();
+      }
+      if ( ok && FD_ISSET(fd, &wfds) ) {
+        ok = cursorSend(c);
+      }
 
-        }
+      if ( !ok ) {
+        //  delete this client if s/he has disconnected. Bye!
+        Log.trace("streamCB: Client disconnected\n");
+        cursorStop(c);
+        cursors[i] = cursors[--active];
+        memset(&cursors[active], 0, sizeof(streamCursor_t));
+        noActiveClients = active;
+        i--;
       }
     }
-    else {
-      //  Since there are no connected clients, there is no reason to waste battery running
-      vTaskSuspend(NULL);
-    }
-    //  Let other tasks run after serving every client
-    if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
-
-#if defined (BENCHMARK)
-    fpsAvg.value(1000.0 / (float) (millis()-lastFrame) );
-    lastFrame = millis();
-#endif
 
 #if defined (BENCHMARK)
     if ( millis() - lastPrint > BENCHMARK_PRINT_INT ) {
       lastPrint = millis();
-      Log.verbose("streamCB: wait avg=%d, stream avg=%d us, frame avg size=%d bytes, fps=%S\n", waitAvg.currentValue(), streamAvg.currentValue(), frameAvg.currentValue(), String(fpsAvg.currentValue()));
+      Log.verbose("streamCB: clients=%d\n", active);
+      metricsLog();
     }
 #endif
 
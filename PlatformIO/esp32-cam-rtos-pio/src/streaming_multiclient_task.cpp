@@ -1,14 +1,14 @@
 #include "streaming.h"
+#include "frame.h"
+#include "scheduler.h"
+#include "metrics.h"
 
 #if defined(CAMERA_MULTICLIENT_TASK)
 
-volatile size_t   camSize;    // size of the current frame, byte
-volatile char*    camBuf;      // pointer to the current frame
+framePub_t  camPub;          // the latest frame, published by camCB without locking
 
 #if defined(BENCHMARK)
-#include <AverageFilter.h>
 #define BENCHMARK_PRINT_INT 1000
-averageFilter<uint32_t> captureAvg(10);
 uint32_t lastPrintCam = millis();
 #endif
 
@@ -16,75 +16,59 @@ void camCB(void* pvParameters) {
 
   TickType_t xLastWakeTime;
 
-  //  A running interval associated with currently desired frame rate
-  const TickType_t xFrequency = pdMS_TO_TICKS(1000 / FPS);
+  //  Frames are captured at the currently desired frame rate
+  //  (the highest rate a client asked for), see schedCaptureDelay()
 
-  //  Pointers to the 2 frames, their respective sizes and index of the current frame
-  char* fbs[2] = { NULL, NULL };
-  size_t fSize[2] = { 0, 0 };
-  int ifb = 0;
   frameNumber = 0;
 
   //=== loop() section  ===================
   xLastWakeTime = xTaskGetTickCount();
 
   for (;;) {
-    size_t s = 0;
     //  Grab a frame from the camera and query its size
     camera_fb_t* fb = NULL;
+    frame_t* f = NULL;
+    uint32_t captureStart = micros();
+    uint32_t captureTime = 0;
 
-#if defined(BENCHMARK)
-    uint32_t benchmarkStart = micros();
-#endif
-
-    s = 0;
-    fb = esp_camera_fb_get();
+    fb = frameSource->get();
     if ( fb ) {
-      s = fb->len;
-
-      //  If frame size is more that we have previously allocated - request  125% of the current frame space
-      if (s > fSize[ifb]) {
-        fSize[ifb] = s + s/4;
-        fbs[ifb] = allocateMemory(fbs[ifb], fSize[ifb], FAIL_IF_OOM, ANY_MEMORY);
+      //  One shared frame object for all streaming tasks. It uses the camera buffer itself
+      //  while the driver has another one to capture into, otherwise a copy
+      f = frameCapture(fb);
+      captureTime = micros() - captureStart;
+      if ( f == NULL ) {
+        Log.error("camCB: error allocating memory for frame %d - OOM\n", frameNumber);
+        captureStats.errors++;
       }
-
-      //  Copy current frame into local buffer
-      char* b = (char *)fb->buf;
-      memcpy(fbs[ifb], b, s);
-      esp_camera_fb_return(fb);
     }
     else {
       Log.error("camCB: error capturing image for frame %d\n", frameNumber);
+      captureStats.errors++;
       vTaskDelay(1000);
     }
 
-#if defined(BENCHMARK)
-    captureAvg.value(micros()-benchmarkStart);
-#endif
-
-    //  Only switch frames around if no frame is currently being streamed to a client
-    //  Wait on a semaphore until client operation completes
-    //    xSemaphoreTake( frameSync, portMAX_DELAY );
-
-    //  Do not allow frame copying while switching the current frame
-    // if ( xSemaphoreTake( frameSync, xFrequency ) ) {
-    if ( xSemaphoreTake( frameSync, portMAX_DELAY ) ) {
-      camBuf = fbs[ifb];
-      camSize = s;
-      ifb++;
-      ifb &= 1;  // this should produce 1, 0, 1, 0, 1 ... sequence
-      frameNumber++;
-      //  Let anyone waiting for a frame know that the frame is ready
-      xSemaphoreGive( frameSync );
+    //  Publish the new frame. Nobody is waited for: streaming tasks hold their own
+    //  reference to the frame they are sending, and the previous frame is freed here
+    //  or by the last streaming task still sending it
+    if ( f ) {
+      f->fnm = ++frameNumber;
+      f->hln = partHeader(f->hdr, f->siz, f->fnm, &f->tms);
+      framePublish(&camPub, f);
+      captureDone(f->siz, captureTime);
+      schedPublish(f->fnm);
     }
 
     //  Let other (streaming) tasks run
-    if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
+    schedCaptureDelay(&xLastWakeTime);
 
     //  If streaming task has suspended itself (no active clients to stream to)
     //  there is no need to grab frames from the camera. We can save some juice
     //  by suspedning the tasks
-    if ( noActiveClients == 0 ) {
+    if ( noActiveClients == 0 && !snapshotActive() ) {
+      //  Nobody to serve - do not hold on to the last frame while suspended
+      framePublish(&camPub, NULL);
+
       Log.verbose("mjpegCB: free heap           : %d\n", ESP.getFreeHeap());
       Log.verbose("mjpegCB: min free heap)      : %d\n", ESP.getMinFreeHeap());
       Log.verbose("mjpegCB: max alloc free heap : %d\n", ESP.getMaxAllocHeap());
@@ -95,7 +79,7 @@ void camCB(void* pvParameters) {
 #if defined(BENCHMARK)
     if ( millis() - lastPrintCam > BENCHMARK_PRINT_INT ) {
       lastPrintCam = millis();
-      Log.verbose("mjpegCB: average frame capture time: %d microseconds\n", captureAvg.currentValue() );
+      Log.verbose("camCB: frame capture time avg=%d us, max=%d us\n", captureStats.timeAvg, captureStats.timeMax);
     }
 #endif
 
@@ -104,37 +88,55 @@ void camCB(void* pvParameters) {
 }
 
 
+// ==== Clients being served: every one has its own streaming task ===========
+int clientCount() {
+  return noActiveClients;
+}
+
+
+// ==== The latest frame for snapshots (/jpg) ==================================
+bool snapshotAcquire(snapshot_t* aSnap) {
+  frame_t* f = frameAcquire( &camPub );
+  if ( f == NULL ) return false;
+  aSnap->hdr = f->hdr;
+  aSnap->hln = f->hln;
+  aSnap->dat = f->dat;
+  aSnap->siz = f->siz;
+  aSnap->fnm = f->fnm;
+  aSnap->tms = f->tms;
+  aSnap->ref = f;
+  return true;
+}
+
+void snapshotRelease(snapshot_t* aSnap) {
+  frameUnref( (frame_t*) aSnap->ref );
+  aSnap->ref = NULL;
+}
+
+
 // ==== Handle connection request from clients ===============================
-void handleJPGSstream(void)
+bool handleJPGSstream(ClientSink* client, uint8_t aFps)
 {
-  if ( noActiveClients >= MAX_CLIENTS ) return;
+  if ( noActiveClients >= MAX_CLIENTS ) return false;
   Log.verbose("handleJPGSstream start: free heap  : %d\n", ESP.getFreeHeap());
 
   streamInfo_t* info = new streamInfo_t;
   if ( info == NULL ) {
     Log.error("handleJPGSstream: cannot allocate stream info - OOM\n");
-    return;
-  }
-
-  WiFiClient* client = new WiFiClient();
-  if ( client == NULL ) {
-    Log.error("handleJPGSstream: cannot allocate WiFi client for streaming - OOM\n");
-    free(info);
-    return;
+    return false;
   }
 
-  *client = server.client();
-
   info->frame = frameNumber - 1;
   info->client = client;
-  info->buffer = NULL;
-  info->len = 0;
+  info->fps = clientFps(aFps);
+  info->due = 0;
+  fpsJoin(info->fps);
 
   //  Creating task to push the stream to all connected clients
   int rc = xTaskCreatePinnedToCore(
              streamCB,
              "streamCB",
-             3 * KILOBYTE,
+             CLIENT_TASK_STACK,
              (void*) info,
              tskIDLE_PRIORITY + 2,
              &info->task,
@@ -143,22 +145,21 @@ void handleJPGSstream(void)
     Log.error("handleJPGSstream: error creating RTOS task. rc = %d\n", rc);
     Log.error("handleJPGSstream: free heap  : %d\n", ESP.getFreeHeap());
     //    Log.error("stk high wm: %d\n", uxTaskGetStackHighWaterMark(tSend));
+    fpsLeave(info->fps);
     delete info;
+    return false;
   }
 
   noActiveClients++;
 
   // Wake up streaming tasks, if they were previously suspended:
   if ( eTaskGetState( tCam ) == eSuspended ) vTaskResume( tCam );
+  return true;
 }
 
 
 // ==== Actually stream content to all connected clients ========================
 void streamCB(void * pvParameters) {
-  char buf[16];
-  TickType_t xLastWakeTime;
-  TickType_t xFrequency;
-
   streamInfo_t* info = (streamInfo_t*) pvParameters;
 
   if ( info == NULL ) {
@@ -167,9 +168,9 @@ void streamCB(void * pvParameters) {
     ESP.restart();
   }
 
-  
-  xLastWakeTime = xTaskGetTickCount();
-  xFrequency = pdMS_TO_TICKS(1000 / FPS);
+  //  The task sleeps until camCB publishes a frame due at the rate its client asked for
+  schedJoin(info);
+  int8_t metrics = metricsJoin(METRICS_MJPEG, info->fps);
   Log.trace("streamCB: Client Connected\n");
 
   //  Immediately send this client a header
@@ -177,94 +178,40 @@ void streamCB(void * pvParameters) {
   info->client->write(BOUNDARY, bdrLen);
 
 #if defined(BENCHMARK)
-  averageFilter<int32_t> streamAvg(10);
-  averageFilter<int32_t> waitAvg(10);
-  averageFilter<uint32_t> frameAvg(10);
-  averageFilter<float> fpsAvg(10);
-  uint32_t streamStart = 0;
-  streamAvg.initialize();
-  waitAvg.initialize();
-  frameAvg.initialize();
-  fpsAvg.initialize();
   uint32_t lastPrint = millis();
-  uint32_t lastFrame = millis();
 #endif
 
   for (;;) {
+    bool noFrame = false;
+
     //  Only send anything if there is someone watching
     if ( info->client->connected() ) {
 
-      if ( info->frame != frameNumber) { // do not send same frame twice
-
-#if defined (BENCHMARK)
-        streamStart = micros();
-#endif        
-
-        xSemaphoreTake( frameSync, portMAX_DELAY );
-        size_t currentSize = camSize;
+      //  Take a reference to the current frame without locking,
+      //  so a slow client never holds up camCB or the other clients.
+      //  The first frame is sent right away, the next ones when they are due
+      frame_t* f = frameAcquire( &camPub );
+      noFrame = f == NULL;
 
-#if defined (BENCHMARK)
-        waitAvg.value(micros()-streamStart);
-        frameAvg.value(currentSize);
-        streamStart = micros();
-#endif
-
-
-//  ======================== OPTION1 ==================================
-//  server a copy of the buffer - overhead: have to allocate and copy a buffer for all frames
-
-// /*
-        if ( info->buffer == NULL ) {
-          info->buffer = allocateMemory (info->buffer, camSize, FAIL_IF_OOM, ANY_MEMORY);
-          info->len = camSize;
-        }
-        else {
-          if ( camSize > info->len ) {
-            info->buffer = allocateMemory (info->buffer, camSize, FAIL_IF_OOM, ANY_MEMORY);
-            info->len = camSize;
-          }
-        }
-        memcpy(info->buffer, (const void*) camBuf, camSize);
-        
-        xSemaphoreGive( frameSync );
-
-        sprintf(buf, "%d\r\n\r\n", currentSize);
+      if ( f && (int32_t) (f->fnm - info->due) >= 0 ) {
         info->client->flush();
-        info->client->write(CTNTTYPE, cntLen);
-        info->client->write(buf, strlen(buf));
-        info->client->write((char*) info->buffer, currentSize);
-        info->client->write(BOUNDARY, bdrLen);
-// */
-
-//  ======================== OPTION2 ==================================
-//  just server the comman buffer protected by mutex
-/*
-        sprintf(buf, "%d\r\n\r\n", camSize);
-        info->client->write(CTNTTYPE, cntLen);
-        info->client->write(buf, strlen(buf));
-        info->client->write((char*) camBuf, (size_t)camSize);
-
-        xSemaphoreGive( frameSync );
-
-        info->client->write(BOUNDARY, bdrLen);
-*/
-
-//  ====================================================================
-        info->frame = frameNumber;
-#if defined (BENCHMARK)
-          streamAvg.value(micros()-streamStart);
-#endif        
+        uint32_t sendStart = micros();
+        size_t sent = streamPart(info->client, f->hdr, f->hln, f->dat, f->siz);
+        if ( sent ) metricsSent(metrics, f->fnm, sent, micros() - sendStart, &f->tms);
+
+        info->frame = f->fnm;
+        info->due = f->fnm + frameStep(info->fps);
       }
+      if ( f ) frameUnref( f );
     }
     else {
       //  client disconnected - clean up.
+      schedLeave(info);
+      fpsLeave(info->fps);
+      metricsLeave(metrics);
       noActiveClients--;
       Log.verbose("streamCB: Stream Task stack wtrmark  : %d\n", uxTaskGetStackHighWaterMark(info->task));
       info->client->stop();
-      if ( info->buffer ) {
-        free( info->buffer );
-        info->buffer = NULL;
-      }
       delete info->client;
       delete info;
       info = NULL;
@@ -272,18 +219,16 @@ void streamCB(void * pvParameters) {
       vTaskDelay(100);
       vTaskDelete(NULL);
     }
-    //  Let other tasks run after serving every client
-    if ( xTaskDelayUntil(&xLastWakeTime, xFrequency) != pdTRUE ) taskYIELD();
 
 #if defined (BENCHMARK)
-    fpsAvg.value(1000.0 / (float) (millis()-lastFrame) );
-    lastFrame = millis();
-
     if ( millis() - lastPrint > BENCHMARK_PRINT_INT ) {
       lastPrint = millis();
-      Log.verbose("streamCB: wait avg=%d, stream avg=%d us, frame avg size=%d bytes, fps=%S\n", waitAvg.currentValue(), streamAvg.currentValue(), frameAvg.currentValue(), String(fpsAvg.currentValue()));
+      metricsLogClient(metrics);
     }
 #endif
+
+    //  Let other tasks run until the next frame due for this client is published
+    schedWait(info, noFrame);
   }
 }
 
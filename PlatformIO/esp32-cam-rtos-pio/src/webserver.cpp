@@ -0,0 +1,736 @@
+#include "streaming.h"
+#include "socketsink.h"
+#include "httpparser.h"
+#include "admission.h"
+#include "websocket.h"
+#include "metrics.h"
+
+#if !defined(ARDUINO_ARCH_ESP32)
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+
+#ifndef SERVER_PENDING
+#define SERVER_PENDING      8       // connections the server handles itself (requests, snapshots, long polls)
+#endif
+#define REQUEST_MAX         512     // longest request head we look at
+#define RESPONSE_MAX        192     // longest response head the server builds itself
+#define REQUEST_TIMEOUT_MS  1000    // the request has to arrive within a second, like WebServer's HTTP_MAX_DATA_WAIT
+#define KEEPALIVE_MS        5000    // an idle keep-alive connection is closed after this long
+#define SNAPSHOT_WAIT_MS    2000    // longest a snapshot waits for the camera to deliver a frame
+#define LONGPOLL_MS         10000   // longest /jpg?after=N waits for a newer frame
+#define SEND_TIMEOUT_MS     5000    // a response the client does not take for this long is dropped
+#define WS_IDLE_MS          30000   // a websocket viewer that neither takes frames nor sends anything is dropped
+
+volatile int serverPort = 0;        // port the webserver listens on, 0 until it is up
+
+typedef enum {
+  CONN_READING = 0,                 // the request is coming in
+  CONN_WAITING,                     // a snapshot waiting for a (newer) frame
+  CONN_SENDING,                     // a response being sent
+  CONN_WEBSOCKET,                   // a websocket viewer (/ws)
+} connState_t;
+
+//  A connection accepted but not handed over: its request is being read, or the server
+//  answers it itself without blocking (snapshots, long polls, websocket viewers)
+typedef struct {
+  int         fd;
+  uint8_t     state;
+  bool        head;                 // HEAD request, no body
+  bool        keepAlive;            // read the next request once the response is sent
+  bool        after;                // long poll: only a frame newer than afterFnm will do
+  uint32_t    afterFnm;
+  uint32_t    since;                // millis() when accepted, or of the last progress
+  uint32_t    served;               // responses sent on this connection
+  size_t      len;
+  size_t      parsed;               // length of the request head being answered
+  char        buf[REQUEST_MAX];     // the request
+  uint16_t    rln;
+  char        rsp[RESPONSE_MAX];    // the response head
+  size_t      sent;                 // response bytes sent
+  snapshot_t  snap;                 // frame a snapshot is sent from
+  metricsOut_t body;                // /stats or /metrics response
+  bool        wsBusy;               // websocket: a message is being sent
+  bool        wsAcking;             // the viewer acks frames, so it gets no more than WS_WINDOW unacked
+  uint8_t     wsFlight;             // frames sent and not acked yet
+  uint32_t    wsSent[WS_WINDOW];    // their numbers, oldest first
+  uint32_t    wsLast;               // number of the last frame sent
+  uint32_t    wsStart;              // micros() when it started going out
+  int8_t      wsMetrics;            // metrics registry slot
+  uint8_t     ctlLen;
+  uint8_t     ctl[2 + 125];         // pong to send before the next frame
+} pendingRequest_t;
+
+static pendingRequest_t pending[SERVER_PENDING];
+static pendingRequest_t* routing = NULL;    // connection whose request is being handled
+
+static const char* NOTFOUND = "HTTP/1.1 200 OK\r\n" \
+                              "Content-Type: text/plain\r\n" \
+                              "Connection: close\r\n\r\n" \
+                              "Server is running!\n\n";
+static const char* BADREQUEST = "HTTP/1.1 400 Bad Request\r\n" \
+                                "Connection: close\r\n\r\n";
+static const char* TOOLARGE   = "HTTP/1.1 431 Request Header Fields Too Large\r\n" \
+                                "Connection: close\r\n\r\n";
+static const char* UNAVAILABLE = "HTTP/1.1 503 Service Unavailable\r\n" \
+                                 "Retry-After: %d\r\n" \
+                                 "Content-Type: text/plain\r\n" \
+                                 "Connection: close\r\n\r\n" \
+                                 "Too many viewers (%s), try again later\n";
+static const char* NOFRAME    = "HTTP/1.1 503 Service Unavailable\r\n" \
+                                "Retry-After: 1\r\n" \
+                                "Content-Type: text/plain\r\n" \
+                                "Connection: close\r\n\r\n" \
+                                "No frame from the camera\n";
+//  Followed by the part header of the frame: Content-Type, Content-Length, empty line
+static const char* SNAPSHOT   = "HTTP/1.1 200 OK\r\n" \
+                                "ETag: \"%u\"\r\n" \
+                                "Cache-Control: no-cache\r\n" \
+                                "Access-Control-Allow-Origin: *\r\n" \
+                                "Connection: %s\r\n";
+static const char* NOTMODIFIED = "HTTP/1.1 304 Not Modified\r\n" \
+                                 "ETag: \"%u\"\r\n" \
+                                 "Cache-Control: no-cache\r\n" \
+                                 "Connection: %s\r\n\r\n";
+static const char* WSACCEPT   = "HTTP/1.1 101 Switching Protocols\r\n" \
+                                "Upgrade: websocket\r\n" \
+                                "Connection: Upgrade\r\n" \
+                                "Sec-WebSocket-Accept: %s\r\n\r\n";
+static const char* WSVERSION  = "HTTP/1.1 426 Upgrade Required\r\n" \
+                                "Sec-WebSocket-Version: 13\r\n" \
+                                "Connection: close\r\n\r\n";
+static const char* STATS      = "HTTP/1.1 200 OK\r\n" \
+                                "Content-Type: %s\r\n" \
+                                "Cache-Control: no-cache\r\n" \
+                                "Access-Control-Allow-Origin: *\r\n" \
+                                "Connection: close\r\n\r\n";
+
+
+// ==== Request handlers ========================================================
+static void serviceUnavailable(int aFd, admitReason_t aReason) {
+  char msg[192];
+  int n = snprintf(msg, sizeof(msg), UNAVAILABLE, ADMIT_RETRY_AFTER, admitReasonName(aReason));
+  send(aFd, msg, n < (int) sizeof(msg) ? n : sizeof(msg) - 1, MSG_NOSIGNAL);
+}
+
+//  Streaming requests are handed over to the streaming mode, if the board can afford another client.
+//  ?fps=N asks for fewer frames per second than FPS
+static bool handleStream(int aFd, const httpRequest_t* aReq) {
+  uint16_t len = 0;
+  const char* arg = httpArg(aReq, "fps", &len);
+  int fps = 0;
+  for (uint16_t i = 0; arg && i < len && i < 3 && arg[i] >= '0' && arg[i] <= '9'; i++) fps = fps * 10 + arg[i] - '0';
+  fps = clientFps(fps);
+
+  admitReason_t admit = admitClient(fps);
+  if ( admit != ADMIT_OK ) {
+    serviceUnavailable(aFd, admit);
+    return false;
+  }
+
+  //  Streaming sends block (with a timeout) in task and all-frames modes
+  fcntl(aFd, F_SETFL, fcntl(aFd, F_GETFL, 0) & ~O_NONBLOCK);
+  ClientSink* client = new SocketSink(aFd);
+  if ( client == NULL ) {
+    Log.error("handleStream: Can not create new client - OOM\n");
+    serviceUnavailable(aFd, ADMIT_HEAP);
+    return false;
+  }
+  //  The sink owns the socket from here on, deleting it closes the connection
+  if ( !handleJPGSstream(client, fps) ) {
+    serviceUnavailable(aFd, ADMIT_CLIENTS);
+    delete client;
+  }
+  return true;
+}
+
+// ==== Snapshot: the latest published frame, sent without blocking the server ====
+static void parseRequest(pendingRequest_t* aReq);
+static void wsSent(pendingRequest_t* aConn);
+
+static void closeConnection(pendingRequest_t* aConn) {
+  if ( aConn->snap.ref ) snapshotRelease(&aConn->snap);
+  if ( aConn->body.buf ) metricsFree(&aConn->body);
+  if ( aConn->state == CONN_WAITING || aConn->state == CONN_WEBSOCKET ) frameWaiters--;
+  if ( aConn->state == CONN_WEBSOCKET ) {
+    wsStats.clients--;
+    metricsLeave(aConn->wsMetrics);
+  }
+  close(aConn->fd);
+  aConn->fd = -1;
+}
+
+//  The response is out: on a keep-alive connection whatever the client sent after
+//  the request is the start of the next one
+static void responseDone(pendingRequest_t* aConn) {
+  if ( aConn->snap.ref ) snapshotRelease(&aConn->snap);
+  if ( aConn->body.buf ) metricsFree(&aConn->body);
+  aConn->served++;
+  if ( !aConn->keepAlive ) {
+    closeConnection(aConn);
+    return;
+  }
+  size_t rest = aConn->len > aConn->parsed ? aConn->len - aConn->parsed : 0;
+  memmove(aConn->buf, aConn->buf + aConn->parsed, rest);
+  aConn->len = rest;
+  aConn->parsed = 0;
+  aConn->state = CONN_READING;
+  aConn->since = millis();
+  if ( rest ) parseRequest(aConn);
+}
+
+//  Send as much of the response (or websocket message) as the socket takes
+static void sendResponse(pendingRequest_t* aConn) {
+  struct iovec iov[3];
+  int count = 1;
+  iov[0].iov_base = aConn->rsp;
+  iov[0].iov_len = aConn->rln;
+  if ( aConn->state == CONN_WEBSOCKET ) {
+    //  Frame header and meta data are in rsp, the frame goes out without its part header
+    if ( aConn->snap.ref ) {
+      iov[1].iov_base = (void*) aConn->snap.dat;
+      iov[1].iov_len = aConn->snap.siz;
+      count = 2;
+    }
+  }
+  else if ( aConn->snap.ref ) {
+    iov[1].iov_base = (void*) aConn->snap.hdr;
+    iov[1].iov_len = aConn->snap.hln;
+    iov[2].iov_base = (void*) aConn->snap.dat;
+    iov[2].iov_len = aConn->head ? 0 : aConn->snap.siz;
+    count = 3;
+  }
+  else if ( aConn->body.buf ) {
+    iov[1].iov_base = aConn->body.buf;
+    iov[1].iov_len = aConn->body.len;
+    count = 2;
+  }
+  size_t total = 0;
+  for (int i = 0; i < count; i++) total += iov[i].iov_len;
+  ClientSink::iovConsume(iov, count, aConn->sent);
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = count;
+  sinkSendCalls++;
+  ssize_t n = sendmsg(aConn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+  if ( n < 0 ) {
+    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR ) closeConnection(aConn);
+    return;
+  }
+  sinkSendBytes += n;
+  aConn->sent += n;
+  aConn->since = millis();
+  if ( aConn->sent >= total ) {
+    if ( aConn->state == CONN_WEBSOCKET ) wsSent(aConn);
+    else responseDone(aConn);
+  }
+}
+
+//  Queue a response: the head built from aFmt, followed by the snapshot frame if one is held.
+//  It goes out when select() finds the socket writable
+static void startResponse(pendingRequest_t* aConn, const char* aFmt, uint32_t aFnm) {
+  if ( aConn->state == CONN_WAITING ) frameWaiters--;
+  int n = snprintf(aConn->rsp, RESPONSE_MAX, aFmt, (unsigned) aFnm, aConn->keepAlive ? "keep-alive" : "close");
+  aConn->rln = n < RESPONSE_MAX ? n : RESPONSE_MAX - 1;
+  aConn->sent = 0;
+  aConn->state = CONN_SENDING;
+  aConn->since = millis();
+}
+
+//  A waiting snapshot takes the latest frame if it will do: any frame for a plain /jpg,
+//  a newer one than it has for a long poll
+static bool takeFrame(pendingRequest_t* aConn) {
+  if ( !snapshotAcquire(&aConn->snap) ) return false;
+  if ( aConn->after && (int32_t) (aConn->snap.fnm - aConn->afterFnm) <= 0 ) {
+    snapshotRelease(&aConn->snap);
+    return false;
+  }
+  startResponse(aConn, SNAPSHOT, aConn->snap.fnm);
+  return true;
+}
+
+//  Snapshot requests waiting for the camera or for a newer frame: a frame has been published
+static void wsNext(pendingRequest_t* aConn);
+
+//  Snapshot requests waiting for the camera or for a newer frame, and websocket viewers:
+//  a frame has been published
+static void frameArrived() {
+  uint64_t cnt;
+  read(frameEvent, &cnt, sizeof(cnt));
+  for (int i = 0; i < SERVER_PENDING; i++) {
+    pendingRequest_t* c = &pending[i];
+    if ( c->fd >= 0 && c->state == CONN_WAITING ) takeFrame(c);
+    else if ( c->fd >= 0 && c->state == CONN_WEBSOCKET ) wsNext(c);
+  }
+}
+
+//  Nothing came in time. A long poll is told its frame is still the latest one
+static void waitExpired(pendingRequest_t* aConn) {
+  if ( aConn->after && snapshotAcquire(&aConn->snap) ) {
+    uint32_t fnm = aConn->snap.fnm;
+    snapshotRelease(&aConn->snap);
+    startResponse(aConn, NOTMODIFIED, fnm);
+    return;
+  }
+  send(aConn->fd, NOFRAME, strlen(NOFRAME), MSG_NOSIGNAL);
+  closeConnection(aConn);
+}
+
+static int freeSlots() {
+  int free = 0;
+  for (int i = 0; i < SERVER_PENDING; i++) {
+    if ( pending[i].fd < 0 ) free++;
+  }
+  return free;
+}
+
+static uint32_t numberArg(const char* aStr, uint16_t aLen) {
+  uint32_t v = 0;
+  for (uint16_t i = 0; i < aLen && i < 10 && aStr[i] >= '0' && aStr[i] <= '9'; i++) v = v * 10 + aStr[i] - '0';
+  return v;
+}
+
+//  /jpg: the latest frame captured for the streaming clients, with the frame number as a strong ETag.
+//  A client that already has it (If-None-Match) gets 304 Not Modified.
+//  /jpg?after=N waits up to LONGPOLL_MS for a frame newer than N, so a pull client gets every new
+//  frame as soon as it is published. Connections are kept alive between snapshots (HTTP/1.1)
+static bool handleSnapshot(int aFd, const httpRequest_t* aReq) {
+  pendingRequest_t* c = routing;
+  uint16_t len;
+
+  snapshotWanted();
+  c->head = aReq->method == HTTP_M_HEAD;
+  c->keepAlive = aReq->minor >= 1;
+  const char* conn = httpHeader(aReq, "connection", &len);
+  if ( conn && len == 5 && strncasecmp(conn, "close", 5) == 0 ) c->keepAlive = false;
+  if ( conn && len == 10 && strncasecmp(conn, "keep-alive", 10) == 0 ) c->keepAlive = true;
+  const char* after = httpArg(aReq, "after", &len);
+  c->after = after != NULL;
+  c->afterFnm = after ? numberArg(after, len) : 0;
+  c->snap.ref = NULL;
+
+  if ( !c->after && snapshotAcquire(&c->snap) ) {
+    const char* inm = httpHeader(aReq, "if-none-match", &len);
+    char tag[12];
+    snprintf(tag, sizeof(tag), "%u", (unsigned) c->snap.fnm);
+    if ( inm && httpEtagMatch(inm, len, tag) ) {
+      snapshotRelease(&c->snap);
+      startResponse(c, NOTMODIFIED, c->snap.fnm);
+    }
+    else {
+      startResponse(c, SNAPSHOT, c->snap.fnm);
+    }
+    return true;
+  }
+
+  c->state = CONN_WAITING;
+  c->since = millis();
+  frameWaiters++;
+  if ( takeFrame(c) ) return true;
+
+  //  Waiting holds a connection slot: keep one free for new requests
+  if ( freeSlots() == 0 ) {
+    frameWaiters--;
+    c->state = CONN_READING;
+    send(aFd, NOFRAME, strlen(NOFRAME), MSG_NOSIGNAL);
+    return false;
+  }
+  return true;
+}
+
+// ==== WebSocket viewers (/ws): every frame as a binary message, see websocket.h ====
+//  Start sending the latest frame, unless the viewer has it already or has too many unacked.
+//  Frames published while a viewer is busy or behind are skipped for it
+static void wsNext(pendingRequest_t* aConn) {
+  if ( aConn->wsBusy ) return;
+  uint8_t* m = (uint8_t*) aConn->rsp;
+  size_t n = aConn->ctlLen;
+  memcpy(m, aConn->ctl, n);
+  aConn->ctlLen = 0;
+
+  if ( (!aConn->wsAcking || aConn->wsFlight < WS_WINDOW) && snapshotAcquire(&aConn->snap) ) {
+    uint32_t fnm = aConn->snap.fnm;
+    if ( aConn->served == 0 || (int32_t) (fnm - aConn->wsLast) > 0 ) {
+      if ( aConn->served ) wsStats.skipped += fnm - aConn->wsLast - 1;
+      n += wsHeader(m + n, WS_OP_BINARY, WS_META_SIZE + aConn->snap.siz);
+      wsMeta(m + n, fnm, &aConn->snap.tms);
+      n += WS_META_SIZE;
+      //  A viewer that does not ack only remembers the last WS_WINDOW frames
+      if ( aConn->wsFlight == WS_WINDOW ) {
+        memmove(aConn->wsSent, aConn->wsSent + 1, (WS_WINDOW - 1) * sizeof(uint32_t));
+        aConn->wsFlight--;
+      }
+      aConn->wsSent[aConn->wsFlight++] = fnm;
+      aConn->wsLast = fnm;
+      aConn->served++;
+      aConn->wsStart = micros();
+      wsStats.frames++;
+    }
+    else {
+      snapshotRelease(&aConn->snap);
+    }
+  }
+  if ( n == 0 ) return;
+  aConn->rln = n;
+  aConn->sent = 0;
+  aConn->wsBusy = true;
+  aConn->since = millis();
+}
+
+//  The message is out: a newer frame may be waiting already
+static void wsSent(pendingRequest_t* aConn) {
+  if ( aConn->snap.ref ) {
+    metricsSent(aConn->wsMetrics, aConn->snap.fnm, aConn->rln + aConn->snap.siz, micros() - aConn->wsStart, &aConn->snap.tms);
+    snapshotRelease(&aConn->snap);
+  }
+  aConn->wsBusy = false;
+  wsNext(aConn);
+}
+
+//  Acks, pings and close from the viewer
+static void wsRead(pendingRequest_t* aConn) {
+  ssize_t n = recv(aConn->fd, aConn->buf + aConn->len, REQUEST_MAX - aConn->len, MSG_DONTWAIT);
+  if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+    closeConnection(aConn);
+    return;
+  }
+  if ( n < 0 ) return;
+  aConn->len += n;
+  aConn->since = millis();
+
+  wsFrame_t f;
+  int len;
+  size_t pos = 0;
+  while ( (len = wsParse((uint8_t*) aConn->buf + pos, aConn->len - pos, REQUEST_MAX - 14, &f)) > 0 ) {
+    pos += len;
+    uint32_t fnm;
+    if ( f.opcode == WS_OP_CLOSE ) {
+      //  Echo the close, unless a message is halfway out
+      if ( !aConn->wsBusy ) {
+        uint8_t c[4];
+        size_t h = wsHeader(c, WS_OP_CLOSE, f.pln >= 2 ? 2 : 0);
+        memcpy(c + h, f.payload, f.pln >= 2 ? 2 : 0);
+        send(aConn->fd, c, h + (f.pln >= 2 ? 2 : 0), MSG_NOSIGNAL | MSG_DONTWAIT);
+      }
+      closeConnection(aConn);
+      return;
+    }
+    else if ( f.opcode == WS_OP_PING ) {
+      aConn->ctlLen = wsHeader(aConn->ctl, WS_OP_PONG, f.pln);
+      memcpy(aConn->ctl + aConn->ctlLen, f.payload, f.pln);
+      aConn->ctlLen += f.pln;
+    }
+    else if ( f.fin && wsAck(f.opcode, f.payload, f.pln, &fnm) ) {
+      //  Acks are cumulative
+      aConn->wsAcking = true;
+      wsStats.acks++;
+      int keep = 0;
+      for (int i = 0; i < aConn->wsFlight; i++) {
+        if ( (int32_t) (aConn->wsSent[i] - fnm) > 0 ) aConn->wsSent[keep++] = aConn->wsSent[i];
+      }
+      aConn->wsFlight = keep;
+    }
+  }
+  if ( len == WS_BAD_FRAME || (len == WS_INCOMPLETE && pos == 0 && aConn->len == REQUEST_MAX) ) {
+    closeConnection(aConn);
+    return;
+  }
+  memmove(aConn->buf, aConn->buf + pos, aConn->len - pos);
+  aConn->len -= pos;
+  wsNext(aConn);
+}
+
+//  /ws: upgrade to a websocket and stream frames from the same frame store as /jpg and MJPEG
+static bool handleWebSocket(int aFd, const httpRequest_t* aReq) {
+  pendingRequest_t* c = routing;
+  uint16_t len, klen;
+  const char* upgrade = httpHeader(aReq, "upgrade", &len);
+  const char* key = httpHeader(aReq, "sec-websocket-key", &klen);
+  if ( upgrade == NULL || len != 9 || strncasecmp(upgrade, "websocket", 9) != 0 || key == NULL || klen != WS_KEY_LENGTH ) {
+    send(aFd, BADREQUEST, strlen(BADREQUEST), MSG_NOSIGNAL);
+    return false;
+  }
+  const char* version = httpHeader(aReq, "sec-websocket-version", &len);
+  if ( version == NULL || !httpEquals(version, len, "13") ) {
+    send(aFd, WSVERSION, strlen(WSVERSION), MSG_NOSIGNAL);
+    return false;
+  }
+  //  A viewer holds its slot for as long as it watches: keep one free for new requests
+  if ( freeSlots() == 0 ) {
+    serviceUnavailable(aFd, ADMIT_CLIENTS);
+    return false;
+  }
+  //  Same admission as an MJPEG viewer at the full frame rate
+  admitReason_t admit = admitClient(FPS);
+  if ( admit != ADMIT_OK ) {
+    serviceUnavailable(aFd, admit);
+    return false;
+  }
+
+  char accept[WS_ACCEPT_SIZE];
+  wsAcceptKey(key, klen, accept);
+  int n = snprintf(c->rsp, RESPONSE_MAX, WSACCEPT, accept);
+  send(aFd, c->rsp, n, MSG_NOSIGNAL);
+
+  //  Whatever followed the request is the first websocket data
+  memmove(c->buf, c->buf + c->parsed, c->len - c->parsed);
+  c->len -= c->parsed;
+  c->parsed = 0;
+  c->state = CONN_WEBSOCKET;
+  c->since = millis();
+  c->served = 0;
+  c->wsBusy = false;
+  c->wsAcking = false;
+  c->wsFlight = 0;
+  c->ctlLen = 0;
+  c->snap.ref = NULL;
+  c->wsMetrics = metricsJoin(METRICS_WEBSOCKET, FPS);
+  frameWaiters++;
+  wsStats.clients++;
+  snapshotWanted();
+  wsNext(c);
+  return true;
+}
+
+//  /stats: the metrics registry as JSON, /metrics: in the Prometheus text format.
+//  The response, head included, is rendered into the connection's body and sent as the
+//  socket takes it
+static bool sendMetrics(int aFd, const char* aType, void (*aRender)(metricsOut_t*)) {
+  pendingRequest_t* c = routing;
+  metricsBegin(&c->body);
+  metricsPrint(&c->body, STATS, aType);
+  aRender(&c->body);
+  if ( !metricsEnd(&c->body) ) {
+    Log.error("sendMetrics: cannot render the response - OOM\n");
+    metricsFree(&c->body);
+    serviceUnavailable(aFd, ADMIT_HEAP);
+    return false;
+  }
+  c->head = false;
+  c->keepAlive = false;
+  c->snap.ref = NULL;
+  c->rln = 0;
+  c->sent = 0;
+  c->state = CONN_SENDING;
+  c->since = millis();
+  return true;
+}
+
+static bool handleStats(int aFd, const httpRequest_t* aReq) {
+  return sendMetrics(aFd, "application/json", statsJson);
+}
+
+static bool handleMetrics(int aFd, const httpRequest_t* aReq) {
+  return sendMetrics(aFd, METRICS_CONTENT_TYPE, metricsText);
+}
+
+//  Anything else: let them know the server is alive
+static bool handleNotFound(int aFd, const httpRequest_t* aReq) {
+  char msg[REQUEST_MAX / 2];
+  int n = snprintf(msg, sizeof(msg), "URI: %.*s\nMethod: %s\n", (int) aReq->pln, aReq->path, httpMethodName(aReq->method));
+  send(aFd, NOTFOUND, strlen(NOTFOUND), MSG_NOSIGNAL);
+  if ( aReq->method != HTTP_M_HEAD ) send(aFd, msg, n < (int) sizeof(msg) ? n : sizeof(msg) - 1, MSG_NOSIGNAL);
+  return false;
+}
+
+static const httpRoute_t routes[] = {
+  { HTTP_M_GET, STREAMING_URL, handleStream },
+  { HTTP_M_GET, "/jpg", handleSnapshot },
+  { HTTP_M_HEAD, "/jpg", handleSnapshot },
+  { HTTP_M_GET, "/ws", handleWebSocket },
+  { HTTP_M_GET, "/stats", handleStats },
+  { HTTP_M_GET, "/metrics", handleMetrics },
+};
+#define ROUTES  (sizeof(routes) / sizeof(routes[0]))
+
+//  Route a complete request. The connection is closed unless a handler took it over:
+//  handed it to a streaming client, or kept it in its slot to answer it (snapshots)
+static void handleRequest(pendingRequest_t* aReq, int aParsed, const httpRequest_t* aHttp) {
+  int fd = aReq->fd;
+
+  if ( aParsed == HTTP_BAD_REQUEST || (aParsed > 0 && aHttp->rtsp) ) {
+    send(fd, BADREQUEST, strlen(BADREQUEST), MSG_NOSIGNAL);
+  }
+  else if ( aParsed == HTTP_INCOMPLETE ) {
+    send(fd, TOOLARGE, strlen(TOOLARGE), MSG_NOSIGNAL);
+  }
+  else {
+    const httpRoute_t* r = httpRoute(routes, ROUTES, aHttp);
+    aReq->parsed = aParsed;
+    routing = aReq;
+    bool taken = (r ? r->handler : handleNotFound)(fd, aHttp);
+    routing = NULL;
+    if ( taken ) {
+      if ( aReq->state == CONN_READING ) aReq->fd = -1;
+      return;
+    }
+  }
+  aReq->fd = -1;
+  close(fd);
+}
+
+//  Handle the request once its head is complete
+static void parseRequest(pendingRequest_t* aReq) {
+  httpRequest_t http;
+  int parsed = httpParse(aReq->buf, aReq->len, &http);
+  if ( parsed != HTTP_INCOMPLETE || aReq->len == REQUEST_MAX ) handleRequest(aReq, parsed, &http);
+}
+
+//  Read whatever the client has sent so far
+static void readRequest(pendingRequest_t* aReq) {
+  ssize_t n = recv(aReq->fd, aReq->buf + aReq->len, REQUEST_MAX - aReq->len, MSG_DONTWAIT);
+  if ( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+    close(aReq->fd);
+    aReq->fd = -1;
+    return;
+  }
+  if ( n > 0 ) {
+    aReq->len += n;
+    parseRequest(aReq);
+  }
+}
+
+//  How long a connection may stay in its current state
+static uint32_t stateLimit(const pendingRequest_t* aConn) {
+  switch ( aConn->state ) {
+    case CONN_READING: return ( aConn->served && aConn->len == 0 ) ? KEEPALIVE_MS : REQUEST_TIMEOUT_MS;
+    case CONN_WAITING: return aConn->after ? LONGPOLL_MS : SNAPSHOT_WAIT_MS;
+    case CONN_WEBSOCKET: return aConn->wsBusy ? SEND_TIMEOUT_MS : WS_IDLE_MS;
+    default:           return SEND_TIMEOUT_MS;
+  }
+}
+
+
+// ==== Webserver task ==========================================================
+//  Sleeps in select() on the listening socket and on the connections whose request
+//  is still coming in, so a new viewer is served as soon as it connects and an idle
+//  server costs nothing.
+void mjpegCB(void* pvParameters) {
+  int port = (int) (intptr_t) pvParameters;
+
+  //  Start capturing frames
+  startStreaming();
+
+  for (int i = 0; i < SERVER_PENDING; i++) {
+    pending[i].fd = -1;
+    pending[i].snap.ref = NULL;
+    pending[i].body.buf = NULL;
+  }
+
+  int srv = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#if defined(SERVER_MSS)
+  int mss = SERVER_MSS;
+  setsockopt(srv, IPPROTO_TCP, TCP_MAXSEG, &mss, sizeof(mss));
+#endif
+#if defined(SERVER_SNDBUF)
+  //  Accepted sockets inherit the send buffer size
+  int sndbuf = SERVER_SNDBUF;
+  setsockopt(srv, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+#endif
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+#if defined(SERVER_LOOPBACK)
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+#else
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+#endif
+  addr.sin_port = htons((uint16_t) port);
+  if ( bind(srv, (struct sockaddr*) &addr, sizeof(addr)) != 0 || listen(srv, MAX_CLIENTS) != 0 ) {
+    Log.fatal("mjpegCB: cannot listen on port %d\n", port);
+    delay(5000);
+    ESP.restart();
+  }
+  socklen_t alen = sizeof(addr);
+  getsockname(srv, (struct sockaddr*) &addr, &alen);
+  fcntl(srv, F_SETFL, fcntl(srv, F_GETFL, 0) | O_NONBLOCK);
+  serverPort = ntohs(addr.sin_port);
+
+  Log.trace("mjpegCB: Starting streaming service on port %d\n", serverPort);
+  Log.verbose ("mjpegCB: free heap (start)  : %d\n", ESP.getFreeHeap());
+
+  //=== loop() section  ===================
+  for (;;) {
+    fd_set rfds, wfds;
+    FD_ZERO(&rfds);
+    FD_ZERO(&wfds);
+    int maxFd = -1;
+    int freeSlot = -1;
+    int timed = 0;
+    uint32_t now = millis();
+    uint32_t wait = LONGPOLL_MS;
+
+    for (int i = 0; i < SERVER_PENDING; i++) {
+      pendingRequest_t* r = &pending[i];
+      if ( r->fd >= 0 && (int32_t) (now - r->since) >= (int32_t) stateLimit(r) ) {
+        //  Too slow to send a request, idle, no frame in time, or not taking the response
+        if ( r->state == CONN_WAITING ) waitExpired(r);
+        else closeConnection(r);
+      }
+      if ( r->fd < 0 ) {
+        freeSlot = i;
+        continue;
+      }
+      int32_t left = (int32_t) stateLimit(r) - (int32_t) (now - r->since);
+      if ( left < 0 ) left = 0;
+      if ( (uint32_t) left < wait ) wait = left;
+      timed++;
+      if ( r->state == CONN_WAITING || r->state == CONN_WEBSOCKET ) {
+        //  Keep the camera from going idle while the request waits for it, or a viewer watches
+        snapshotWanted();
+      }
+      if ( r->state == CONN_WAITING ) continue;
+      if ( r->state == CONN_READING || r->state == CONN_WEBSOCKET ) FD_SET(r->fd, &rfds);
+      if ( r->state == CONN_SENDING || (r->state == CONN_WEBSOCKET && r->wsBusy) ) FD_SET(r->fd, &wfds);
+      if ( r->fd > maxFd ) maxFd = r->fd;
+    }
+    if ( frameWaiters && frameEvent >= 0 ) {
+      FD_SET(frameEvent, &rfds);
+      if ( frameEvent > maxFd ) maxFd = frameEvent;
+    }
+    //  Only accept new connections if there is room to read their request
+    if ( freeSlot >= 0 ) {
+      FD_SET(srv, &rfds);
+      if ( srv > maxFd ) maxFd = srv;
+    }
+
+    //  Block until something happens. A timeout is only needed to expire slow connections
+    struct timeval tv = { (time_t) (wait / 1000), (long) (wait % 1000) * 1000 };
+    int n = select(maxFd + 1, &rfds, &wfds, NULL, timed ? &tv : NULL);
+    if ( n <= 0 ) continue;
+
+    for (int i = 0; i < SERVER_PENDING; i++) {
+      pendingRequest_t* r = &pending[i];
+      if ( r->fd < 0 ) continue;
+      if ( r->state == CONN_READING && FD_ISSET(r->fd, &rfds) ) readRequest(r);
+      else if ( r->state == CONN_SENDING && FD_ISSET(r->fd, &wfds) ) sendResponse(r);
+      else if ( r->state == CONN_WEBSOCKET ) {
+        if ( FD_ISSET(r->fd, &rfds) ) wsRead(r);
+        if ( r->fd >= 0 && r->wsBusy && FD_ISSET(r->fd, &wfds) ) sendResponse(r);
+      }
+    }
+    if ( frameEvent >= 0 && FD_ISSET(frameEvent, &rfds) ) frameArrived();
+
+    //  A request handled above may have taken the free slot
+    if ( freeSlot >= 0 && pending[freeSlot].fd < 0 && FD_ISSET(srv, &rfds) ) {
+      int fd = accept(srv, NULL, NULL);
+      if ( fd >= 0 ) {
+        pendingRequest_t* r = &pending[freeSlot];
+        r->fd = fd;
+        r->state = CONN_READING;
+        r->since = millis();
+        r->served = 0;
+        r->len = 0;
+        r->parsed = 0;
+        //  Most clients send the request right with the connection
+        readRequest(r);
+      }
+    }
+  }
+}
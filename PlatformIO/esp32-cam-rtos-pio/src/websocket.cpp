@@ -0,0 +1,158 @@
+#include "websocket.h"
+
+wsStats_t wsStats;
+
+static const char* WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// ==== SHA-1, only for the handshake (a few hundred bytes per connection) ====
+static uint32_t rol(uint32_t aV, int aBits) {
+  return (aV << aBits) | (aV >> (32 - aBits));
+}
+
+static void sha1Block(uint32_t aH[5], const uint8_t* aBlock) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; i++) {
+    w[i] = (uint32_t) aBlock[4 * i] << 24 | (uint32_t) aBlock[4 * i + 1] << 16 |
+           (uint32_t) aBlock[4 * i + 2] << 8 | aBlock[4 * i + 3];
+  }
+  for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = aH[0], b = aH[1], c = aH[2], d = aH[3], e = aH[4];
+  for (int i = 0; i < 80; i++) {
+    uint32_t f, k;
+    if ( i < 20 )      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+    else if ( i < 40 ) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+    else if ( i < 60 ) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+    else               { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+    uint32_t t = rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rol(b, 30);
+    b = a;
+    a = t;
+  }
+  aH[0] += a;
+  aH[1] += b;
+  aH[2] += c;
+  aH[3] += d;
+  aH[4] += e;
+}
+
+//  SHA-1 of aLen bytes, aLen < 120 so that the message fits two blocks
+static void sha1(const uint8_t* aMsg, size_t aLen, uint8_t aDigest[20]) {
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  uint8_t blocks[128];
+  size_t n = aLen + 9 <= 64 ? 64 : 128;
+  memset(blocks, 0, n);
+  memcpy(blocks, aMsg, aLen);
+  blocks[aLen] = 0x80;
+  uint64_t bits = (uint64_t) aLen * 8;
+  for (int i = 0; i < 8; i++) blocks[n - 1 - i] = (uint8_t) (bits >> (8 * i));
+  for (size_t i = 0; i < n; i += 64) sha1Block(h, blocks + i);
+  for (int i = 0; i < 20; i++) aDigest[i] = (uint8_t) (h[i / 4] >> (24 - 8 * (i % 4)));
+}
+
+static void base64(const uint8_t* aIn, size_t aLen, char* aOut) {
+  static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t o = 0;
+  for (size_t i = 0; i < aLen; i += 3) {
+    uint32_t v = (uint32_t) aIn[i] << 16;
+    if ( i + 1 < aLen ) v |= (uint32_t) aIn[i + 1] << 8;
+    if ( i + 2 < aLen ) v |= aIn[i + 2];
+    aOut[o++] = alphabet[(v >> 18) & 0x3F];
+    aOut[o++] = alphabet[(v >> 12) & 0x3F];
+    aOut[o++] = i + 1 < aLen ? alphabet[(v >> 6) & 0x3F] : '=';
+    aOut[o++] = i + 2 < aLen ? alphabet[v & 0x3F] : '=';
+  }
+  aOut[o] = 0;
+}
+
+void wsAcceptKey(const char* aKey, uint16_t aLen, char aAccept[WS_ACCEPT_SIZE]) {
+  uint8_t msg[WS_KEY_LENGTH + 36];
+  uint8_t digest[20];
+  if ( aLen > WS_KEY_LENGTH ) aLen = WS_KEY_LENGTH;
+  memcpy(msg, aKey, aLen);
+  memcpy(msg + aLen, WS_GUID, 36);
+  sha1(msg, aLen + 36, digest);
+  base64(digest, 20, aAccept);
+}
+
+
+// ==== Frames ====
+int wsParse(uint8_t* aBuf, size_t aLen, size_t aMax, wsFrame_t* aFrame) {
+  if ( aLen < 2 ) return WS_INCOMPLETE;
+  //  Extensions are never negotiated, so the reserved bits must be clear.
+  //  Clients always mask their frames
+  if ( (aBuf[0] & 0x70) || !(aBuf[1] & 0x80) ) return WS_BAD_FRAME;
+  aFrame->fin = aBuf[0] & 0x80;
+  aFrame->opcode = aBuf[0] & 0x0F;
+
+  size_t pos = 2;
+  uint64_t pln = aBuf[1] & 0x7F;
+  if ( pln == 126 ) {
+    if ( aLen < 4 ) return WS_INCOMPLETE;
+    pln = (uint64_t) aBuf[2] << 8 | aBuf[3];
+    pos = 4;
+  }
+  else if ( pln == 127 ) {
+    if ( aLen < 10 ) return WS_INCOMPLETE;
+    pln = 0;
+    for (int i = 0; i < 8; i++) pln = pln << 8 | aBuf[2 + i];
+    pos = 10;
+  }
+  //  Control frames are short and never fragmented
+  if ( (aFrame->opcode & 0x08) && (pln > 125 || !aFrame->fin) ) return WS_BAD_FRAME;
+  if ( pln > aMax ) return WS_BAD_FRAME;
+  if ( aLen < pos + 4 + pln ) return WS_INCOMPLETE;
+
+  const uint8_t* mask = aBuf + pos;
+  uint8_t* payload = aBuf + pos + 4;
+  for (size_t i = 0; i < pln; i++) payload[i] ^= mask[i & 3];
+  aFrame->payload = payload;
+  aFrame->pln = pln;
+  aFrame->length = pos + 4 + pln;
+  return (int) aFrame->length;
+}
+
+size_t wsHeader(uint8_t* aBuf, uint8_t aOpcode, uint64_t aLen) {
+  aBuf[0] = 0x80 | aOpcode;
+  if ( aLen < 126 ) {
+    aBuf[1] = (uint8_t) aLen;
+    return 2;
+  }
+  if ( aLen <= 0xFFFF ) {
+    aBuf[1] = 126;
+    aBuf[2] = (uint8_t) (aLen >> 8);
+    aBuf[3] = (uint8_t) aLen;
+    return 4;
+  }
+  aBuf[1] = 127;
+  for (int i = 0; i < 8; i++) aBuf[2 + i] = (uint8_t) (aLen >> (56 - 8 * i));
+  return 10;
+}
+
+void wsMeta(uint8_t* aBuf, uint32_t aFnm, const struct timeval* aTms) {
+  uint64_t us = (uint64_t) aTms->tv_sec * 1000000 + aTms->tv_usec;
+  for (int i = 0; i < 4; i++) aBuf[i] = (uint8_t) (aFnm >> (8 * i));
+  for (int i = 0; i < 8; i++) aBuf[4 + i] = (uint8_t) (us >> (8 * i));
+}
+
+bool wsAck(uint8_t aOpcode, const uint8_t* aPayload, size_t aLen, uint32_t* aFnm) {
+  uint32_t v = 0;
+  if ( aOpcode == WS_OP_BINARY ) {
+    if ( aLen != 4 ) return false;
+    for (int i = 0; i < 4; i++) v |= (uint32_t) aPayload[i] << (8 * i);
+  }
+  else if ( aOpcode == WS_OP_TEXT ) {
+    if ( aLen == 0 || aLen > 10 ) return false;
+    for (size_t i = 0; i < aLen; i++) {
+      if ( aPayload[i] < '0' || aPayload[i] > '9' ) return false;
+      v = v * 10 + aPayload[i] - '0';
+    }
+  }
+  else {
+    return false;
+  }
+  *aFnm = v;
+  return true;
+}